@@ -0,0 +1,137 @@
+// Lookup time of http_router::match() in a table of 5000 parameterized routes: 250 resources of a versioned
+// REST API, each with a collection, an item and four sub-collections with their items.
+//
+//   hit:   paths of routed items and sub-items, with generated ids
+//   miss:  the same paths under an unknown resource or with a trailing segment too many
+//
+// Build with "make bench"; usage: bench/http_router [seconds per run]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "detail/http_router.h"
+
+using namespace x10;
+using namespace x10::detail;
+
+namespace
+{
+    const int versions = 2;
+    const int resources = 250;
+    const int subresources = 4;
+
+    std::string resource(int v, int r)
+    {
+        return "/api/v" + std::to_string(v + 1) + "/resource" + std::to_string(r);
+    }
+
+    std::string sub(int k)
+    {
+        return "/sub" + std::to_string(k);
+    }
+
+    // Runs match() over paths until seconds have passed, and prints the time of one lookup.
+    void run(const http_router& router, const char* what, const std::vector<std::string>& paths, bool found,
+        double seconds)
+    {
+        typedef std::chrono::steady_clock clock;
+
+        util::slice get("GET");
+        http_route_params params;
+
+        auto pass = [&]() {
+            for(auto& p : paths)
+            {
+                bool matched = router.match(get, util::slice(p.data(), p.size()), params) != nullptr;
+                if(matched != found)
+                {
+                    std::fprintf(stderr, "%s: %s\n", what, p.c_str());
+                    std::exit(1);
+                }
+            }
+        };
+
+        // warm the caches and the branch predictors
+        pass();
+
+        std::size_t lookups = 0;
+        auto start = clock::now();
+        std::chrono::duration<double> elapsed;
+        do
+        {
+            pass();
+            lookups += paths.size();
+            elapsed = clock::now() - start;
+        }
+        while(elapsed.count() < seconds);
+
+        auto s = elapsed.count();
+        std::printf("%-6s %8.1f ns/match %8.3f M matches/s\n", what, s * 1e9 / lookups, lookups / s / 1e6);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? std::atof(argv[1]) : 1.0;
+    if(seconds <= 0) seconds = 1.0;
+
+    http_router router;
+    auto handler = [](http_responder*, std::size_t, const http_parse_result*, const http_route_params&) {};
+
+    std::size_t routes = 0;
+    auto add = [&](const std::string& pattern) {
+        if(!router.add("GET", util::slice(pattern.data(), pattern.size()), handler))
+        {
+            std::fprintf(stderr, "add: %s\n", pattern.c_str());
+            std::exit(1);
+        }
+        ++routes;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for(int v = 0; v < versions; ++v)
+    {
+        for(int r = 0; r < resources; ++r)
+        {
+            auto base = resource(v, r);
+            add(base);
+            add(base + "/:id");
+            for(int k = 0; k < subresources; ++k)
+            {
+                add(base + "/:id" + sub(k));
+                add(base + "/:id" + sub(k) + "/:sub_id");
+            }
+        }
+    }
+    std::chrono::duration<double> built = std::chrono::steady_clock::now() - start;
+    std::printf("%zu routes added in %.1f ms\n\n", routes, built.count() * 1e3);
+
+    // the same pseudo-random walk over the table on every run
+    std::vector<std::string> hits;
+    std::vector<std::string> misses;
+    unsigned seed = 1;
+    auto next = [&]() {
+        seed = seed * 1103515245 + 12345;
+        return static_cast<int>((seed >> 16) & 0x7fff);
+    };
+    for(int i = 0; i < 10000; ++i)
+    {
+        int v = next() % versions;
+        int r = next() % resources;
+        int k = next() % subresources;
+        auto id = "/" + std::to_string(next());
+        auto item = resource(v, r) + id;
+
+        if(i % 2) hits.push_back(item);
+        else hits.push_back(item + sub(k) + "/" + std::to_string(next()));
+
+        if(i % 2) misses.push_back(resource(v, resources + r) + id);
+        else misses.push_back(item + sub(k) + "/" + std::to_string(next()) + "/extra");
+    }
+
+    run(router, "hit", hits, true, seconds);
+    run(router, "miss", misses, false, seconds);
+    return 0;
+}
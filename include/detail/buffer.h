@@ -0,0 +1,153 @@
+#ifndef __DETAIL_BUFFER_H__
+#define __DETAIL_BUFFER_H__
+
+#include "base.h"
+#include <new>
+
+namespace x10
+{
+    namespace detail
+    {
+        class buffer_pool;
+
+        // Reference-counted memory block. The header sits right in front of the data,
+        // so a buffer can be recovered from the data pointer handed to libuv.
+        class buffer
+        {
+            friend class buffer_pool;
+
+        public:
+            char* data() { return reinterpret_cast<char*>(this + 1); }
+            const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+            std::size_t capacity() const { return capacity_; }
+
+            void retain() { ++refs_; }
+
+            // the last release returns the block to its pool (or frees it).
+            inline void release();
+
+            static buffer* from_data(char* data)
+            {
+                assert(data);
+                return reinterpret_cast<buffer*>(data) - 1;
+            }
+
+        private:
+            buffer(std::size_t capacity, buffer_pool* pool)
+                : capacity_(capacity)
+                , refs_(1)
+                , pool_(pool)
+                , next_free_(nullptr)
+            {}
+
+            ~buffer()
+            {}
+
+            static buffer* allocate_(std::size_t capacity, buffer_pool* pool)
+            {
+                auto mem = new char[sizeof(buffer) + capacity];
+                assert(mem);
+                return new (mem) buffer(capacity, pool);
+            }
+
+            static void free_(buffer* b)
+            {
+                b->~buffer();
+                delete[] reinterpret_cast<char*>(b);
+            }
+
+        private:
+            std::size_t capacity_;
+            std::size_t refs_;
+            buffer_pool* pool_;
+            buffer* next_free_;
+        };
+
+        // Free list of buffers of one size: get() is the pool of read buffers shared by all streams of the loop.
+        // Buffers of any other size bypass the pool.
+        class buffer_pool
+        {
+        public:
+            static const std::size_t default_buffer_size = 64 * 1024 - sizeof(buffer);
+            static const std::size_t default_max_free = 64;
+
+            buffer_pool(std::size_t buffer_size=default_buffer_size, std::size_t max_free=default_max_free)
+                : buffer_size_(buffer_size)
+                , max_free_(max_free)
+                , free_(nullptr)
+                , free_count_(0)
+            {}
+
+            ~buffer_pool()
+            {
+                while(free_)
+                {
+                    auto b = free_;
+                    free_ = b->next_free_;
+                    buffer::free_(b);
+                }
+            }
+
+            // no copy allowed
+            buffer_pool(const buffer_pool&) = delete;
+            void operator=(const buffer_pool&) = delete;
+
+            // x10 runs on the default loop: one pool per process.
+            static buffer_pool& get()
+            {
+                static buffer_pool pool;
+                return pool;
+            }
+
+            // returns a buffer with a reference count of 1.
+            buffer* acquire(std::size_t min_capacity=0)
+            {
+                if(min_capacity > buffer_size_) return buffer::allocate_(min_capacity, this);
+
+                if(free_)
+                {
+                    auto b = free_;
+                    free_ = b->next_free_;
+                    --free_count_;
+
+                    b->next_free_ = nullptr;
+                    b->refs_ = 1;
+                    return b;
+                }
+                return buffer::allocate_(buffer_size_, this);
+            }
+
+            void recycle(buffer* b)
+            {
+                assert(b && b->refs_ == 0);
+
+                if(b->capacity_ != buffer_size_ || free_count_ >= max_free_)
+                {
+                    buffer::free_(b);
+                    return;
+                }
+
+                b->next_free_ = free_;
+                free_ = b;
+                ++free_count_;
+            }
+
+            std::size_t buffer_size() const { return buffer_size_; }
+            std::size_t free_count() const { return free_count_; }
+
+        private:
+            std::size_t buffer_size_;
+            std::size_t max_free_;
+            buffer* free_;
+            std::size_t free_count_;
+        };
+
+        inline void buffer::release()
+        {
+            assert(refs_ > 0);
+            if(--refs_ == 0) pool_->recycle(this);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,395 @@
+#ifndef __DETAIL_FILE_CACHE_H__
+#define __DETAIL_FILE_CACHE_H__
+
+#include "base.h"
+#include <ctime>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+#include "handle.h"
+#include "timer.h"
+#include "utility.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        class file_cache;
+
+        // An open file and its stat() results. Entries are reference counted: an entry evicted from the cache
+        // (or replaced after the file changed) keeps its descriptor until the last transfer using it releases it.
+        class file_entry
+        {
+            friend class file_cache;
+
+        public:
+            const std::string& path() const { return path_; }
+            int fd() const { return fd_; }
+            int64_t size() const { return size_; }
+            std::time_t mtime() const { return mtime_; }
+
+            // strong validator, quoted: "<inode>-<size>-<mtime>" in hex.
+            util::slice etag() const { return util::slice(etag_, etag_length_); }
+
+            void retain() { ++refs_; }
+
+            void release()
+            {
+                assert(refs_ > 0);
+                if(--refs_ == 0) delete this;
+            }
+
+        private:
+            file_entry(const std::string& path, int fd, const struct stat& st)
+                : path_(path)
+                , fd_(fd)
+                , ino_(st.st_ino)
+                , size_(st.st_size)
+                , mtime_(st.st_mtime)
+                , checked_(0)
+                , refs_(1)
+                , etag_length_(0)
+                , lru_link_()
+            {
+                int n = std::snprintf(etag_, sizeof(etag_), "\"%llx-%llx-%llx\"", static_cast<unsigned long long>(ino_),
+                    static_cast<unsigned long long>(size_), static_cast<unsigned long long>(mtime_));
+                etag_length_ = n > 0 ? static_cast<std::size_t>(n) : 0;
+            }
+
+            ~file_entry()
+            {
+                if(fd_ != -1) ::close(fd_);
+            }
+
+            // no copy allowed
+            file_entry(const file_entry&) = delete;
+            void operator=(const file_entry&) = delete;
+
+            bool same_file_(const struct stat& st) const
+            {
+                return st.st_ino == ino_ && st.st_size == size_ && st.st_mtime == mtime_;
+            }
+
+        private:
+            std::string path_;
+            int fd_;
+            ino_t ino_;
+            int64_t size_;
+            std::time_t mtime_;
+            int64_t checked_;       // loop time of the last stat()
+            std::size_t refs_;
+            char etag_[64];
+            std::size_t etag_length_;
+            util::list_hook<file_entry> lru_link_;
+        };
+
+        // LRU cache of open regular files keyed by path, so that serving a hot file costs no open() or stat().
+        // An entry is trusted for revalidate_ms after its last stat(); past that the next lookup stat()s the path
+        // again and reopens the file if it was replaced or modified.
+        class file_cache
+        {
+            typedef util::intrusive_list<file_entry, &file_entry::lru_link_> list_type;
+
+        public:
+            static const std::size_t default_max_entries = 1024;
+            static const int64_t default_revalidate_ms = 1000;
+
+            file_cache(std::size_t max_entries=default_max_entries, int64_t revalidate_ms=default_revalidate_ms)
+                : max_entries_(max_entries)
+                , revalidate_ms_(revalidate_ms)
+                , entries_()
+                , lru_()
+            {
+                assert(max_entries_ > 0);
+            }
+
+            ~file_cache()
+            {
+                clear();
+            }
+
+            // no copy allowed
+            file_cache(const file_cache&) = delete;
+            void operator=(const file_cache&) = delete;
+
+            // x10 runs on the default loop: one cache per process.
+            static file_cache& get()
+            {
+                static file_cache cache;
+                return cache;
+            }
+
+            // Returns the entry of a regular file with a reference for the caller (release() it), or nullptr and
+            // the error in rv.
+            file_entry* open(const std::string& path, resval& rv)
+            {
+                auto now = timer::now();
+
+                auto it = entries_.find(path);
+                if(it != entries_.end())
+                {
+                    auto e = it->second;
+                    if(now - e->checked_ >= revalidate_ms_)
+                    {
+                        struct stat st;
+                        if(::stat(path.c_str(), &st) == 0 && e->same_file_(st)) e->checked_ = now;
+                        else
+                        {
+                            remove_(e);
+                            e = nullptr;
+                        }
+                    }
+
+                    if(e)
+                    {
+                        // most recently used at the back
+                        lru_.remove(e);
+                        lru_.push_back(e);
+
+                        e->retain();
+                        return e;
+                    }
+                }
+
+                int fd;
+                do fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                while(fd == -1 && errno == EINTR);
+                if(fd == -1)
+                {
+                    rv = get_sys_error(errno);
+                    return nullptr;
+                }
+
+                struct stat st;
+                if(::fstat(fd, &st) != 0) rv = get_sys_error(errno);
+                else if(!S_ISREG(st.st_mode)) rv = S_ISDIR(st.st_mode) ? resval(error::eisdir) : resval(error::einval);
+                else rv = resval();
+                if(!rv)
+                {
+                    ::close(fd);
+                    return nullptr;
+                }
+
+                auto e = new file_entry(path, fd, st);
+                assert(e);
+                e->checked_ = now;
+
+                entries_[path] = e;
+                lru_.push_back(e);
+                while(lru_.size() > max_entries_) remove_(lru_.front());
+
+                e->retain();
+                return e;
+            }
+
+            // drops the entry of a path (a transfer in progress keeps the file open).
+            void invalidate(const std::string& path)
+            {
+                auto it = entries_.find(path);
+                if(it != entries_.end()) remove_(it->second);
+            }
+
+            void clear()
+            {
+                while(!lru_.empty()) remove_(lru_.front());
+            }
+
+            std::size_t size() const { return lru_.size(); }
+            std::size_t max_entries() const { return max_entries_; }
+
+        private:
+            void remove_(file_entry* e)
+            {
+                entries_.erase(e->path_);
+                lru_.remove(e);
+                e->release();
+            }
+
+        private:
+            std::size_t max_entries_;
+            int64_t revalidate_ms_;
+            std::unordered_map<std::string, file_entry*> entries_;
+            list_type lru_;
+        };
+
+        // Copies ranges of files to a non-blocking socket with sendfile(2), so the data never passes through
+        // user space (other platforms pread() and send() in chunks). When the send buffer fills up, it waits for
+        // writability on a uv_poll_t watcher of its own, set on a dup() of the socket: the descriptor itself is
+        // watched by the stream. One transfer at a time; close it along with the connection.
+        class file_sender : public handle
+        {
+            typedef std::function<void(resval)> on_complete_callback_type;
+
+            // caps the bytes moved per readiness event so that one large file can't starve the loop.
+            static const int64_t max_bytes_per_event = 1024 * 1024;
+
+        public:
+            file_sender(int socket)
+                : handle(reinterpret_cast<uv_handle_t*>(&poll_))
+                , poll_()
+                , socket_(socket)
+                , fd_(-1)
+                , file_(nullptr)
+                , offset_(0)
+                , remaining_(0)
+                , on_complete_()
+            {
+                fd_ = ::fcntl(socket, F_DUPFD_CLOEXEC, 0);
+                assert(fd_ != -1);
+
+                int r = uv_poll_init_socket(uv_default_loop(), &poll_, fd_);
+                assert(r == 0);
+
+                poll_.data = this;
+            }
+
+        private:
+            virtual ~file_sender()
+            {}
+
+        public:
+            virtual void close()
+            {
+                if(fd_ == -1) return;
+
+                if(file_) file_->release();
+                file_ = nullptr;
+                on_complete_ = nullptr;
+
+#ifdef __linux__
+                // libuv drops a stopped descriptor from epoll lazily, and closing the duplicate alone does not
+                // remove it either (the socket is still open).
+                struct epoll_event ev;
+                epoll_ctl(uv_backend_fd(uv_default_loop()), EPOLL_CTL_DEL, fd_, &ev);
+#endif
+
+                // uv_close() stops the watcher synchronously, so the descriptor can go right after.
+                int fd = fd_;
+                fd_ = -1;
+                handle::close();
+                ::close(fd);
+            }
+
+            // Sends length bytes of the file from offset. The callback may be invoked before send() returns.
+            resval send(file_entry* file, int64_t offset, int64_t length, on_complete_callback_type callback)
+            {
+                if(fd_ == -1) return resval(error::ebadf);
+                if(file_ || !file || offset < 0 || length < 0) return resval(error::einval);
+
+                file->retain();
+                file_ = file;
+                offset_ = offset;
+                remaining_ = length;
+                on_complete_ = callback;
+
+                pump_();
+                return resval();
+            }
+
+            bool is_sending() const { return file_ != nullptr; }
+
+        private:
+            void pump_()
+            {
+                int64_t budget = max_bytes_per_event;
+                while(remaining_ > 0)
+                {
+                    if(budget <= 0)
+                    {
+                        wait_();
+                        return;
+                    }
+
+                    auto n = transfer_(static_cast<std::size_t>(std::min(remaining_, budget)));
+                    if(n > 0)
+                    {
+                        offset_ += n;
+                        remaining_ -= n;
+                        budget -= n;
+                    }
+                    else if(n == 0)
+                    {
+                        // the file was truncated under us
+                        finish_(resval(error::eof));
+                        return;
+                    }
+                    else if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        wait_();
+                        return;
+                    }
+                    else if(errno != EINTR)
+                    {
+                        finish_(get_sys_error(errno));
+                        return;
+                    }
+                }
+
+                finish_(resval());
+            }
+
+            ssize_t transfer_(std::size_t length)
+            {
+#ifdef __linux__
+                off_t offset = offset_;
+                return ::sendfile(socket_, file_->fd(), &offset, length);
+#else
+                char chunk[16 * 1024];
+                auto n = ::pread(file_->fd(), chunk, std::min(length, sizeof(chunk)), offset_);
+                if(n <= 0) return n;
+
+                // whatever the socket doesn't take is read again next time.
+#ifdef MSG_NOSIGNAL
+                return ::send(socket_, chunk, n, MSG_NOSIGNAL);
+#else
+                return ::send(socket_, chunk, n, 0);
+#endif
+#endif
+            }
+
+            void wait_()
+            {
+                int r = uv_poll_start(&poll_, UV_WRITABLE, [](uv_poll_t* handle, int status, int) {
+                    auto self = reinterpret_cast<file_sender*>(handle->data);
+                    assert(self);
+
+                    if(!self->file_) return;
+                    if(status) self->finish_(get_last_error());
+                    else self->pump_();
+                });
+                if(r) finish_(get_last_error());
+            }
+
+            void finish_(resval rv)
+            {
+                uv_poll_stop(&poll_);
+
+                auto file = file_;
+                file_ = nullptr;
+                if(file) file->release();
+
+                // the callback may start the next transfer.
+                auto callback = std::move(on_complete_);
+                on_complete_ = nullptr;
+                if(callback) callback(rv);
+            }
+
+        private:
+            uv_poll_t poll_;
+            int socket_;
+            int fd_;
+            file_entry* file_;
+            int64_t offset_;
+            int64_t remaining_;
+            on_complete_callback_type on_complete_;
+        };
+    }
+}
+
+#endif
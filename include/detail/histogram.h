@@ -0,0 +1,130 @@
+#ifndef __DETAIL_HISTOGRAM_H__
+#define __DETAIL_HISTOGRAM_H__
+
+#include "base.h"
+#include <cstdint>
+#include <limits>
+
+namespace x10
+{
+    namespace detail
+    {
+        /**
+         *  Log-linear histogram of unsigned 64-bit values.
+         *  Every power-of-two range is split into 2^sub_bucket_bits linear buckets,
+         *  so the relative error of any reported value is at most 1/2^sub_bucket_bits (12.5%).
+         *  Recording is a couple of shifts and one increment: no allocation, no search.
+         */
+        class histogram
+        {
+        public:
+            static const unsigned sub_bucket_bits = 3;
+            static const std::size_t sub_bucket_count = std::size_t(1) << sub_bucket_bits;
+            static const std::size_t bucket_count = (64 - sub_bucket_bits + 1) * sub_bucket_count;
+
+            histogram()
+                : counts_()
+                , count_(0)
+                , sum_(0)
+                , min_(std::numeric_limits<uint64_t>::max())
+                , max_(0)
+            {}
+
+            void record(uint64_t value, uint64_t n=1)
+            {
+                counts_[index_of(value)] += n;
+                count_ += n;
+                sum_ += value * n;
+                if(value < min_) min_ = value;
+                if(value > max_) max_ = value;
+            }
+
+            void merge(const histogram& other)
+            {
+                for(std::size_t i=0;i<bucket_count;++i) counts_[i] += other.counts_[i];
+                count_ += other.count_;
+                sum_ += other.sum_;
+                if(other.min_ < min_) min_ = other.min_;
+                if(other.max_ > max_) max_ = other.max_;
+            }
+
+            void reset()
+            {
+                *this = histogram();
+            }
+
+            uint64_t count() const { return count_; }
+            uint64_t sum() const { return sum_; }
+            uint64_t min() const { return count_ ? min_ : 0; }
+            uint64_t max() const { return max_; }
+            double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0.0; }
+
+            // upper bound of the bucket holding the p-th percentile (p in [0, 100]), clamped to max().
+            uint64_t percentile(double p) const
+            {
+                if(count_ == 0) return 0;
+
+                uint64_t rank = static_cast<uint64_t>(p / 100.0 * count_ + 0.5);
+                if(rank == 0) rank = 1;
+                if(rank > count_) rank = count_;
+
+                uint64_t seen = 0;
+                for(std::size_t i=0;i<bucket_count;++i)
+                {
+                    seen += counts_[i];
+                    if(seen >= rank) return std::min(bucket_upper_bound(i), max_);
+                }
+                return max_;
+            }
+
+            uint64_t bucket_value(std::size_t index) const { return counts_[index]; }
+
+            static std::size_t index_of(uint64_t value)
+            {
+                if(value < sub_bucket_count) return static_cast<std::size_t>(value);
+
+                unsigned shift = msb_(value) - sub_bucket_bits;
+                return (static_cast<std::size_t>(shift + 1) << sub_bucket_bits) |
+                    static_cast<std::size_t>((value >> shift) & (sub_bucket_count - 1));
+            }
+
+            static uint64_t bucket_lower_bound(std::size_t index)
+            {
+                if(index < sub_bucket_count) return index;
+
+                unsigned shift = static_cast<unsigned>(index >> sub_bucket_bits) - 1;
+                return (static_cast<uint64_t>((index & (sub_bucket_count - 1)) | sub_bucket_count)) << shift;
+            }
+
+            static uint64_t bucket_upper_bound(std::size_t index)
+            {
+                if(index < sub_bucket_count) return index;
+
+                unsigned shift = static_cast<unsigned>(index >> sub_bucket_bits) - 1;
+                return bucket_lower_bound(index) + ((uint64_t(1) << shift) - 1);
+            }
+
+        private:
+            static unsigned msb_(uint64_t value)
+            {
+                assert(value);
+#if defined(__GNUC__) || defined(__clang__)
+                return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#else
+                unsigned r = 0;
+                while(value >>= 1) ++r;
+                return r;
+#endif
+            }
+
+        private:
+            uint64_t counts_[bucket_count];
+            uint64_t count_;
+            uint64_t sum_;
+            uint64_t min_;
+            uint64_t max_;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,587 @@
+#ifndef __DETAIL_HPACK_H__
+#define __DETAIL_HPACK_H__
+
+#include "base.h"
+#include <deque>
+#include "utility.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // HPACK (RFC 7541): header compression of HTTP/2.
+        namespace hpack
+        {
+            struct static_entry
+            {
+                const char* name;
+                const char* value;
+            };
+
+            // index 1 to 61
+            inline const static_entry* static_table()
+            {
+                static const static_entry table[] = {
+                    { ":authority", "" },
+                    { ":method", "GET" },
+                    { ":method", "POST" },
+                    { ":path", "/" },
+                    { ":path", "/index.html" },
+                    { ":scheme", "http" },
+                    { ":scheme", "https" },
+                    { ":status", "200" },
+                    { ":status", "204" },
+                    { ":status", "206" },
+                    { ":status", "304" },
+                    { ":status", "400" },
+                    { ":status", "404" },
+                    { ":status", "500" },
+                    { "accept-charset", "" },
+                    { "accept-encoding", "gzip, deflate" },
+                    { "accept-language", "" },
+                    { "accept-ranges", "" },
+                    { "accept", "" },
+                    { "access-control-allow-origin", "" },
+                    { "age", "" },
+                    { "allow", "" },
+                    { "authorization", "" },
+                    { "cache-control", "" },
+                    { "content-disposition", "" },
+                    { "content-encoding", "" },
+                    { "content-language", "" },
+                    { "content-length", "" },
+                    { "content-location", "" },
+                    { "content-range", "" },
+                    { "content-type", "" },
+                    { "cookie", "" },
+                    { "date", "" },
+                    { "etag", "" },
+                    { "expect", "" },
+                    { "expires", "" },
+                    { "from", "" },
+                    { "host", "" },
+                    { "if-match", "" },
+                    { "if-modified-since", "" },
+                    { "if-none-match", "" },
+                    { "if-range", "" },
+                    { "if-unmodified-since", "" },
+                    { "last-modified", "" },
+                    { "link", "" },
+                    { "location", "" },
+                    { "max-forwards", "" },
+                    { "proxy-authenticate", "" },
+                    { "proxy-authorization", "" },
+                    { "range", "" },
+                    { "referer", "" },
+                    { "refresh", "" },
+                    { "retry-after", "" },
+                    { "server", "" },
+                    { "set-cookie", "" },
+                    { "strict-transport-security", "" },
+                    { "transfer-encoding", "" },
+                    { "user-agent", "" },
+                    { "vary", "" },
+                    { "via", "" },
+                    { "www-authenticate", "" },
+                };
+                return table;
+            }
+
+            static const std::size_t static_table_size = 61;
+
+            // per entry overhead counted in the table size
+            static const std::size_t entry_overhead = 32;
+
+            // Huffman code of each octet (RFC 7541, appendix B), most significant bit first.
+            struct huffman_code
+            {
+                uint32_t code;
+                uint8_t length;
+            };
+
+            inline const huffman_code* huffman_codes()
+            {
+                static const huffman_code codes[256] = {
+                    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 }, { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+                    { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 }, { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+                    { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 }, { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+                    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 }, { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+                    { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 }, { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+                    { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+                    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 }, { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+                    { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 }, { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+                    { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 }, { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+                    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 }, { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+                    { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 }, { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+                    { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 }, { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+                    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 }, { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+                    { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 }, { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+                    { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 }, { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+                    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+                    { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 }, { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+                    { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 }, { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+                    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 }, { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+                    { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 }, { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+                    { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 }, { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+                    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 }, { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+                    { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 }, { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+                    { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 }, { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+                    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 }, { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+                    { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 }, { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+                    { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 }, { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+                    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 }, { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+                    { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 }, { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+                    { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 }, { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+                    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 }, { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+                    { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 }, { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+                };
+                return codes;
+            }
+
+            // Decodes the code 8 bits at a time: each table maps the next octet of input either to a symbol
+            // (and the length of its code, which may be shorter than 8) or to the table of the codes that go on.
+            class huffman_decoder
+            {
+                struct entry
+                {
+                    uint8_t symbol;
+                    uint8_t length;         // 0: no code (EOS or a path into another table)
+                    uint16_t next;          // table of the codes starting with these 8 bits, or 0
+                };
+
+                typedef std::vector<entry> table_type;
+
+            public:
+                static const huffman_decoder& get()
+                {
+                    static huffman_decoder decoder;
+                    return decoder;
+                }
+
+                // Appends the decoded string to out; false if the input is not a valid code (EOS, or padding
+                // that is longer than 7 bits or not made of ones).
+                bool decode(const util::slice& in, std::string& out) const
+                {
+                    uint64_t cur = 0;
+                    unsigned bits = 0;          // bits of cur not decoded yet
+                    unsigned symbol_bits = 0;   // of which belong to the symbol being decoded
+                    std::size_t t = 0;
+
+                    for(auto c : in)
+                    {
+                        cur = (cur << 8) | static_cast<unsigned char>(c);
+                        bits += 8;
+                        symbol_bits += 8;
+
+                        while(bits >= 8)
+                        {
+                            auto& e = tables_[t * 256 + ((cur >> (bits - 8)) & 0xff)];
+                            if(e.next)
+                            {
+                                t = e.next;
+                                bits -= 8;
+                            }
+                            else if(e.length)
+                            {
+                                out += static_cast<char>(e.symbol);
+                                bits -= e.length;
+                                symbol_bits = bits;
+                                t = 0;
+                            }
+                            else return false;
+                        }
+                    }
+
+                    while(bits > 0)
+                    {
+                        auto& e = tables_[t * 256 + ((cur << (8 - bits)) & 0xff)];
+                        if(e.next || !e.length || e.length > bits) break;
+
+                        out += static_cast<char>(e.symbol);
+                        bits -= e.length;
+                        symbol_bits = bits;
+                        t = 0;
+                    }
+
+                    auto mask = (uint64_t(1) << bits) - 1;
+                    return symbol_bits <= 7 && (cur & mask) == mask;
+                }
+
+            private:
+                huffman_decoder()
+                    : tables_(256)
+                {
+                    auto codes = huffman_codes();
+                    for(unsigned s=0;s<256;++s)
+                    {
+                        auto code = codes[s].code;
+                        unsigned length = codes[s].length;
+
+                        std::size_t t = 0;
+                        while(length > 8)
+                        {
+                            length -= 8;
+                            auto i = t * 256 + ((code >> length) & 0xff);
+                            if(!tables_[i].next)
+                            {
+                                auto next = tables_.size() / 256;
+                                tables_.resize(tables_.size() + 256);
+                                tables_[i].next = static_cast<uint16_t>(next);
+                            }
+                            t = tables_[i].next;
+                        }
+
+                        // every octet starting with the code maps to the symbol
+                        auto shift = 8 - length;
+                        auto first = (code << shift) & 0xff;
+                        for(unsigned j=0;j<(1u << shift);++j)
+                        {
+                            auto& e = tables_[t * 256 + (first | j)];
+                            e.symbol = static_cast<uint8_t>(s);
+                            e.length = static_cast<uint8_t>(length);
+                            e.next = 0;
+                        }
+                    }
+                }
+
+                // no copy allowed
+                huffman_decoder(const huffman_decoder&) = delete;
+                void operator=(const huffman_decoder&) = delete;
+
+            private:
+                table_type tables_;         // 256 entries per table, the first one is the root
+            };
+
+            // integer with an N-bit prefix (5.1); false if truncated or too large.
+            inline bool read_int(const char*& p, const char* end, unsigned prefix, uint64_t& v)
+            {
+                if(p == end) return false;
+
+                uint64_t max = (uint64_t(1) << prefix) - 1;
+                v = static_cast<unsigned char>(*p++) & max;
+                if(v < max) return true;
+
+                for(unsigned m=0;;m += 7)
+                {
+                    if(p == end || m > 28) return false;
+
+                    auto b = static_cast<unsigned char>(*p++);
+                    v += uint64_t(b & 0x7f) << m;
+                    if(!(b & 0x80)) return true;
+                }
+            }
+
+            // flags: the bits above the prefix in the first octet
+            inline void write_int(std::string& out, unsigned prefix, unsigned char flags, uint64_t v)
+            {
+                uint64_t max = (uint64_t(1) << prefix) - 1;
+                if(v < max)
+                {
+                    out += static_cast<char>(flags | v);
+                    return;
+                }
+
+                out += static_cast<char>(flags | max);
+                v -= max;
+                for(;v >= 0x80;v >>= 7) out += static_cast<char>(0x80 | (v & 0x7f));
+                out += static_cast<char>(v);
+            }
+
+            // The table of header fields shared by the encoder and the decoder of one direction, newest first.
+            class dynamic_table
+            {
+            public:
+                struct entry
+                {
+                    std::string name;
+                    std::string value;
+                };
+
+                dynamic_table(std::size_t max_size)
+                    : entries_()
+                    , size_(0)
+                    , max_size_(max_size)
+                {}
+
+                // 1-based (62 and up in the address space of a header block)
+                const entry* at(std::size_t i) const { return i >= 1 && i <= entries_.size() ? &entries_[i - 1] : nullptr; }
+
+                void add(const util::slice& name, const util::slice& value)
+                {
+                    // copy first: name or value may come from an entry about to be evicted
+                    entry e { name.to_string(), value.to_string() };
+                    auto size = e.name.size() + e.value.size() + entry_overhead;
+
+                    evict_(size > max_size_ ? max_size_ : max_size_ - size);
+
+                    // an entry larger than the table empties it and is not added (4.4)
+                    if(size > max_size_) return;
+
+                    entries_.push_front(std::move(e));
+                    size_ += size;
+                }
+
+                void set_max_size(std::size_t size)
+                {
+                    max_size_ = size;
+                    evict_(max_size_);
+                }
+
+                std::size_t size() const { return size_; }
+                std::size_t max_size() const { return max_size_; }
+                std::size_t count() const { return entries_.size(); }
+
+            private:
+                void evict_(std::size_t to)
+                {
+                    while(size_ > to && !entries_.empty())
+                    {
+                        auto& e = entries_.back();
+                        size_ -= e.name.size() + e.value.size() + entry_overhead;
+                        entries_.pop_back();
+                    }
+                }
+
+            private:
+                std::deque<entry> entries_;
+                std::size_t size_;
+                std::size_t max_size_;
+            };
+        }
+
+        // Decodes the header blocks of one connection (the dynamic table carries over from block to block).
+        // Literal strings are passed as views into the block unless Huffman coded.
+        class hpack_decoder
+        {
+        public:
+            hpack_decoder(std::size_t max_table_size=4096)
+                : table_(max_table_size)
+                , limit_(max_table_size)
+                , name_()
+                , value_()
+            {}
+
+            // no copy allowed
+            hpack_decoder(const hpack_decoder&) = delete;
+            void operator=(const hpack_decoder&) = delete;
+
+            // SETTINGS_HEADER_TABLE_SIZE we announced: the encoder may not ask for more.
+            void set_max_table_size(std::size_t size)
+            {
+                limit_ = size;
+                if(table_.max_size() > size) table_.set_max_size(size);
+            }
+
+            // Calls f(name, value) for each field of a complete header block (the slices are valid during the
+            // call). Returns false on a decoding error: the connection must be closed (COMPRESSION_ERROR).
+            template<typename F>
+            bool decode(const util::slice& block, F f)
+            {
+                auto p = block.data();
+                auto end = p + block.size();
+                bool first = true;
+
+                while(p < end)
+                {
+                    auto c = static_cast<unsigned char>(*p);
+                    uint64_t index;
+
+                    if(c & 0x80)
+                    {
+                        // indexed field
+                        if(!hpack::read_int(p, end, 7, index)) return false;
+
+                        util::slice name, value;
+                        if(!lookup_(index, name, value)) return false;
+                        f(name, value);
+                    }
+                    else if((c & 0xe0) == 0x20)
+                    {
+                        // dynamic table size update, at the start of a block only
+                        if(!first || !hpack::read_int(p, end, 5, index) || index > limit_) return false;
+                        table_.set_max_size(static_cast<std::size_t>(index));
+                        continue;
+                    }
+                    else
+                    {
+                        // literal: with incremental indexing (01), without indexing (0000) or never indexed (0001)
+                        bool indexing = (c & 0xc0) == 0x40;
+                        if(!hpack::read_int(p, end, indexing ? 6 : 4, index)) return false;
+
+                        util::slice name, value;
+                        if(index)
+                        {
+                            if(!lookup_(index, name, value)) return false;
+                        }
+                        else if(!read_string_(p, end, name_, name)) return false;
+                        if(!read_string_(p, end, value_, value)) return false;
+
+                        f(name, value);
+                        if(indexing) table_.add(name, value);
+                    }
+                    first = false;
+                }
+                return true;
+            }
+
+            const hpack::dynamic_table& table() const { return table_; }
+
+        private:
+            bool lookup_(uint64_t index, util::slice& name, util::slice& value) const
+            {
+                if(index == 0) return false;
+                if(index <= hpack::static_table_size)
+                {
+                    auto& e = hpack::static_table()[index - 1];
+                    name = e.name;
+                    value = e.value;
+                    return true;
+                }
+
+                auto e = table_.at(static_cast<std::size_t>(index - hpack::static_table_size));
+                if(!e) return false;
+
+                name = e->name;
+                value = e->value;
+                return true;
+            }
+
+            // a string literal (5.2): a view into the block, or decoded into scratch
+            static bool read_string_(const char*& p, const char* end, std::string& scratch, util::slice& s)
+            {
+                if(p == end) return false;
+
+                bool huffman = (static_cast<unsigned char>(*p) & 0x80) != 0;
+                uint64_t length;
+                if(!hpack::read_int(p, end, 7, length) || length > static_cast<uint64_t>(end - p)) return false;
+
+                util::slice raw(p, static_cast<std::size_t>(length));
+                p += length;
+
+                if(!huffman)
+                {
+                    s = raw;
+                    return true;
+                }
+
+                scratch.clear();
+                if(!hpack::huffman_decoder::get().decode(raw, scratch)) return false;
+                s = scratch;
+                return true;
+            }
+
+        private:
+            hpack::dynamic_table table_;
+            std::size_t limit_;
+            std::string name_;
+            std::string value_;
+        };
+
+        // Encodes the header blocks of one connection. Fields found in the static or dynamic table are sent as
+        // an index; others as literals (not Huffman coded), added to the dynamic table unless their value
+        // changes all the time (date, content-length, validators) or is sensitive (never indexed).
+        class hpack_encoder
+        {
+        public:
+            hpack_encoder(std::size_t max_table_size=4096)
+                : table_(max_table_size)
+                , pending_update_(false)
+            {}
+
+            // no copy allowed
+            hpack_encoder(const hpack_encoder&) = delete;
+            void operator=(const hpack_encoder&) = delete;
+
+            // SETTINGS_HEADER_TABLE_SIZE of the peer: the next block starts with a size update.
+            void set_max_table_size(std::size_t size)
+            {
+                table_.set_max_size(std::min<std::size_t>(size, 4096));
+                pending_update_ = true;
+            }
+
+            // call first for each block
+            void begin_block(std::string& out)
+            {
+                if(!pending_update_) return;
+
+                pending_update_ = false;
+                hpack::write_int(out, 5, 0x20, table_.max_size());
+            }
+
+            // name in lower case
+            void encode(std::string& out, const util::slice& name, const util::slice& value)
+            {
+                std::size_t name_index = 0;
+                auto index = find_(name, value, name_index);
+                if(index)
+                {
+                    hpack::write_int(out, 7, 0x80, index);
+                    return;
+                }
+
+                auto policy = policy_(name);
+                if(policy == indexing) hpack::write_int(out, 6, 0x40, name_index);
+                else hpack::write_int(out, 4, policy == never_indexed ? 0x10 : 0x00, name_index);
+
+                if(!name_index) write_string_(out, name);
+                write_string_(out, value);
+
+                if(policy == indexing) table_.add(name, value);
+            }
+
+            const hpack::dynamic_table& table() const { return table_; }
+
+        private:
+            enum policy_type
+            {
+                indexing,
+                not_indexed,
+                never_indexed
+            };
+
+            static policy_type policy_(const util::slice& name)
+            {
+                static const char* volatile_names[] = { "date", "content-length", "etag", "last-modified", "content-range", "location", "age", "expires" };
+
+                if(name == "set-cookie" || name == "authorization" || name == "www-authenticate") return never_indexed;
+                for(auto n : volatile_names) if(name == n) return not_indexed;
+                return indexing;
+            }
+
+            // index of the field in the tables (0 if absent), and of its name in name_index
+            std::size_t find_(const util::slice& name, const util::slice& value, std::size_t& name_index) const
+            {
+                auto st = hpack::static_table();
+                for(std::size_t i=0;i<hpack::static_table_size;++i)
+                {
+                    if(name != st[i].name) continue;
+
+                    if(!name_index) name_index = i + 1;
+                    if(value == st[i].value) return i + 1;
+                }
+
+                for(std::size_t i=1;i<=table_.count();++i)
+                {
+                    auto e = table_.at(i);
+                    if(e->name != name) continue;
+
+                    if(!name_index) name_index = hpack::static_table_size + i;
+                    if(e->value == value) return hpack::static_table_size + i;
+                }
+                return 0;
+            }
+
+            static void write_string_(std::string& out, const util::slice& s)
+            {
+                hpack::write_int(out, 7, 0x00, s.size());
+                out.append(s.data(), s.size());
+            }
+
+        private:
+            hpack::dynamic_table table_;
+            bool pending_update_;
+        };
+    }
+}
+
+#endif
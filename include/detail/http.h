@@ -1,9 +1,13 @@
 #ifndef __DETAIL_HTTP_H__
 #define __DETAIL_HTTP_H__
 
-#include <sstream>
+#include <deque>
 #include "base.h"
+#include "buffer.h"
+#include "http_headers.h"
+#include "http_scanner.h"
 #include "stream.h"
+#include "timer.h"
 #include "utility.h"
 
 namespace x10
@@ -14,8 +18,39 @@ namespace x10
         class http_parse_result;
         typedef std::function<void(const http_parse_result*, resval)> http_parse_callback_type;
 
+        // body data (valid during the call), then an empty slice with error::eof at the end of the body, or an error.
+        typedef std::function<void(const util::slice&, resval)> http_body_callback_type;
+
         class http_parser_context;
 
+        // http_parser_context backends: http_parser's byte-at-a-time state machine, or the vectorized
+        // http_request_scanner (requests only).
+        enum class http_parser_backend
+        {
+            state_machine,
+            simd
+        };
+
+        // Whether a comma-separated header value (Connection, Upgrade...) lists token, case-insensitively.
+        inline bool http_header_has_token(const util::slice& value, const util::slice& token)
+        {
+            std::size_t i = 0;
+            while(i <= value.size())
+            {
+                auto end = value.find(',', i);
+                if(end == util::slice::npos) end = value.size();
+
+                auto b = i;
+                auto e = end;
+                while(b < e && (value[b] == ' ' || value[b] == '\t')) ++b;
+                while(e > b && (value[e-1] == ' ' || value[e-1] == '\t')) --e;
+                if(value.substr(b, e - b).equals_no_case(token)) return true;
+
+                i = end + 1;
+            }
+            return false;
+        }
+
         class url_obj
         {
         public:
@@ -27,49 +62,27 @@ namespace x10
             ~url_obj()
             {}
 
+            // the URL is not copied: buffer must outlive this object (or the next parse()).
             bool parse(const char* buffer, std::size_t length, bool is_connect=false)
             {
-                buf_ = std::string(buffer, length);
+                buf_ = util::slice(buffer, length);
                 return http_parser_parse_url(buffer, length, is_connect, &handle_) == 0;
             }
 
         public:
-            std::string schema() const
-            {
-                if(has_schema()) return buf_.substr(handle_.field_data[UF_SCHEMA].off, handle_.field_data[UF_SCHEMA].len);
-                return std::string();
-            }
-
-            std::string host() const
-            {
-                // TODO: if not specified, use host name
-                if(has_schema()) return buf_.substr(handle_.field_data[UF_HOST].off, handle_.field_data[UF_HOST].len);
-                return std::string();
-            }
+            // views into the parsed buffer (empty if not present)
+            util::slice schema() const { return field_(UF_SCHEMA); }
+            util::slice host() const { return field_(UF_HOST); }
 
             int port() const
             {
-                if(has_path()) return static_cast<int>(handle_.port);
+                if(has_port()) return static_cast<int>(handle_.port);
                 return 0;
             }
 
-            std::string path() const
-            {
-                if(has_path()) return buf_.substr(handle_.field_data[UF_PATH].off, handle_.field_data[UF_PATH].len);
-                return std::string();
-            }
-
-            std::string query() const
-            {
-                if(has_query()) return buf_.substr(handle_.field_data[UF_QUERY].off, handle_.field_data[UF_QUERY].len);
-                return std::string();
-            }
-
-            std::string fragment() const
-            {
-                if(has_query()) return buf_.substr(handle_.field_data[UF_FRAGMENT].off, handle_.field_data[UF_FRAGMENT].len);
-                return std::string();
-            }
+            util::slice path() const { return field_(UF_PATH); }
+            util::slice query() const { return field_(UF_QUERY); }
+            util::slice fragment() const { return field_(UF_FRAGMENT); }
 
             bool has_schema() const { return handle_.field_set & (1<<UF_SCHEMA); }
             bool has_host() const { return handle_.field_set & (1<<UF_HOST); }
@@ -78,278 +91,1006 @@ namespace x10
             bool has_query() const { return handle_.field_set & (1<<UF_QUERY); }
             bool has_fragment() const { return handle_.field_set & (1<<UF_FRAGMENT); }
 
+        private:
+            // view of a URL component inside the parsed buffer (empty if not present).
+            util::slice field_(http_parser_url_fields f) const
+            {
+                if(!(handle_.field_set & (1<<f))) return util::slice();
+                return buf_.substr(handle_.field_data[f].off, handle_.field_data[f].len);
+            }
+
         private:
             http_parser_url handle_;
-            std::string buf_;
+            util::slice buf_;
         };
 
+        // Parsed HTTP request. Every field is a view into the connection's read buffers (or a small
+        // per-context copy for the rare header split across two reads); see http_parser_context.
         class http_parse_result
         {
             friend class http_parser_context;
-
-            typedef std::map<std::string, std::string, util::text::ci_less> headers_type;
+            friend class http2_session;
 
         public:
+            typedef std::pair<util::slice, util::slice> header_type;
+            typedef std::vector<header_type> headers_type;
+
             http_parse_result()
-                : headers_()
-                , schema_()
+                : schema_()
                 , host_()
                 , port_(0)
                 , path_()
                 , query_()
                 , fragment_()
                 , method_()
-                , http_version_()
+                , status_code_(0)
+                , http_major_(0)
+                , http_minor_(0)
                 , upgrade_(false)
+                , keep_alive_(false)
+                , chunked_(false)
+                , content_length_(-1)
+                , headers_()
+                , others_()
+                , known_mask_(0)
             {}
 
             http_parse_result(const http_parse_result& c)
-                : headers_(c.headers_)
-                , schema_(c.schema_)
+                : schema_(c.schema_)
                 , host_(c.host_)
                 , port_(c.port_)
                 , path_(c.path_)
                 , query_(c.query_)
                 , fragment_(c.fragment_)
                 , method_(c.method_)
-                , http_version_(c.http_version_)
+                , status_code_(c.status_code_)
+                , http_major_(c.http_major_)
+                , http_minor_(c.http_minor_)
                 , upgrade_(c.upgrade_)
-            {}
+                , keep_alive_(c.keep_alive_)
+                , chunked_(c.chunked_)
+                , content_length_(c.content_length_)
+                , headers_(c.headers_)
+                , others_(c.others_)
+                , known_mask_(c.known_mask_)
+            {
+                copy_known_(c);
+            }
 
             http_parse_result(http_parse_result&& c)
-                : headers_(std::move(c.headers_))
-                , schema_(std::move(c.schema_))
-                , host_(std::move(c.host_))
+                : schema_(c.schema_)
+                , host_(c.host_)
                 , port_(c.port_)
-                , path_(std::move(c.path_))
-                , query_(std::move(c.query_))
-                , fragment_(std::move(c.fragment_))
-                , method_(std::move(c.method_))
-                , http_version_(std::move(c.http_version_))
+                , path_(c.path_)
+                , query_(c.query_)
+                , fragment_(c.fragment_)
+                , method_(c.method_)
+                , status_code_(c.status_code_)
+                , http_major_(c.http_major_)
+                , http_minor_(c.http_minor_)
                 , upgrade_(c.upgrade_)
-            {}
+                , keep_alive_(c.keep_alive_)
+                , chunked_(c.chunked_)
+                , content_length_(c.content_length_)
+                , headers_(std::move(c.headers_))
+                , others_(std::move(c.others_))
+                , known_mask_(c.known_mask_)
+            {
+                copy_known_(c);
+            }
 
             ~http_parse_result()
             {}
 
         public:
-            const std::string& schema() const { return schema_; }
-            const std::string& host() const { return host_; }
+            const util::slice& schema() const { return schema_; }
+            const util::slice& host() const { return host_; }
             int port() const { return port_; }
-            const std::string& path() const { return path_; }
-            const std::string& query() const { return query_; }
-            const std::string& fragment() const { return fragment_; }
+            const util::slice& path() const { return path_; }
+            const util::slice& query() const { return query_; }
+            const util::slice& fragment() const { return fragment_; }
             const headers_type& headers() const { return headers_; }
-            const std::string& method() const { return method_; }
-            const std::string& http_version() const { return http_version_; }
+            const util::slice& method() const { return method_; }
+
+            // status code of a response (0 for a request)
+            int status_code() const { return status_code_; }
+            unsigned short http_major() const { return http_major_; }
+            unsigned short http_minor() const { return http_minor_; }
             bool upgrade() const { return upgrade_; }
 
+            // HTTP/1.1 without "Connection: close", or HTTP/1.0 with "Connection: keep-alive".
+            bool keep_alive() const { return keep_alive_; }
+
+            // "Transfer-Encoding: chunked": the body is decoded before delivery.
+            bool chunked() const { return chunked_; }
+
+            // value of Content-Length, or -1 if there is none.
+            int64_t content_length() const { return content_length_; }
+
+            util::slice http_version() const
+            {
+                static const char* versions[] = { "0.9", "1.0", "1.1" };
+                if(http_major_ == 0 && http_minor_ == 9) return versions[0];
+                if(http_major_ == 1 && http_minor_ <= 1) return versions[1 + http_minor_];
+                if(http_major_ == 2 && http_minor_ == 0) return "2.0";
+                return util::slice();
+            }
+
+            // value of the first header with this (well-known) name: one array access.
+            util::slice header(http_header_id id) const
+            {
+                if(!has_header(id)) return util::slice();
+                return known_[static_cast<std::size_t>(id)];
+            }
+
+            bool has_header(http_header_id id) const
+            {
+                return id != http_header_id::unknown && (known_mask_ & bit_(id)) != 0;
+            }
+
+            // case-insensitive lookup of the first header with this name (empty if absent).
+            util::slice header(const util::slice& name) const
+            {
+                auto id = http_header_lookup(name);
+                if(id != http_header_id::unknown) return header(id);
+
+                for(auto& h : others_) if(h.first.equals_no_case(name)) return h.second;
+                return util::slice();
+            }
+
+            bool has_header(const util::slice& name) const
+            {
+                auto id = http_header_lookup(name);
+                if(id != http_header_id::unknown) return has_header(id);
+
+                for(auto& h : others_) if(h.first.equals_no_case(name)) return true;
+                return false;
+            }
+
+            // forgets all fields but keeps the header storage for the next message.
+            void clear()
+            {
+                schema_ = host_ = path_ = query_ = fragment_ = method_ = util::slice();
+                port_ = 0;
+                status_code_ = 0;
+                http_major_ = http_minor_ = 0;
+                upgrade_ = false;
+                keep_alive_ = false;
+                chunked_ = false;
+                content_length_ = -1;
+                headers_.clear();
+                others_.clear();
+                known_mask_ = 0;
+            }
+
+        private:
+            static_assert(http_known_header_count <= 64, "known_mask_ has one bit per well-known header");
+
+            static uint64_t bit_(http_header_id id) { return uint64_t(1) << static_cast<unsigned>(id); }
+
+            // headers_ keeps every header in arrival order; lookups go to known_ (well-known names, first
+            // occurrence) or to the small flat list others_ (any other name).
+            void add_header_(const util::slice& name, const util::slice& value, http_header_id id)
+            {
+                headers_.push_back(std::make_pair(name, value));
+
+                if(id == http_header_id::unknown) others_.push_back(std::make_pair(name, value));
+                else if(!has_header(id))
+                {
+                    known_[static_cast<std::size_t>(id)] = value;
+                    known_mask_ |= bit_(id);
+                }
+            }
+
+            void copy_known_(const http_parse_result& c)
+            {
+                for(std::size_t i=0;i<http_known_header_count;++i) known_[i] = c.known_[i];
+            }
+
         private:
-            std::string schema_;
-            std::string host_;
+            util::slice schema_;
+            util::slice host_;
             int port_;
-            std::string path_;
-            std::string query_;
-            std::string fragment_;
-            std::string method_;
-            std::string http_version_;
+            util::slice path_;
+            util::slice query_;
+            util::slice fragment_;
+            util::slice method_;
+            int status_code_;
+            unsigned short http_major_;
+            unsigned short http_minor_;
             bool upgrade_;
+            bool keep_alive_;
+            bool chunked_;
+            int64_t content_length_;
             headers_type headers_;
+            headers_type others_;
+            uint64_t known_mask_;
+            util::slice known_[http_known_header_count];
+        };
+
+        // What one peer can make a parser context hold, and for how long (0: no limit). A message over a size limit
+        // fails with emsgsize and a phase over its time limit with etimedout (see http_parser_context::set_limits()).
+        struct http_limits
+        {
+            http_limits()
+                : max_header_bytes(64 * 1024)
+                , max_headers(100)
+                , max_url_length(16 * 1024)
+                , max_body_size(0)
+                , header_timeout_ms(30 * 1000)
+                , body_timeout_ms(60 * 1000)
+                , idle_timeout_ms(75 * 1000)
+            {}
+
+            // nothing is checked (a parser context until set_limits())
+            static http_limits none()
+            {
+                http_limits l;
+                l.max_header_bytes = l.max_headers = l.max_url_length = 0;
+                l.header_timeout_ms = l.body_timeout_ms = l.idle_timeout_ms = 0;
+                return l;
+            }
+
+            std::size_t max_header_bytes;   // start line and headers of a message
+            std::size_t max_headers;
+            std::size_t max_url_length;
+            uint64_t max_body_size;         // Content-Length, or the decoded size of a chunked body
+            int64_t header_timeout_ms;      // from the first byte of a message to the end of its head
+            int64_t body_timeout_ms;        // without body data while reading a body (not while paused)
+            int64_t idle_timeout_ms;        // between messages, while the owner is not busy (see set_busy())
         };
 
+        // Feeds read buffers to http_parser without copying them: the buffers are retained while a message head is
+        // being parsed and handled, and the result holds views into them. Only a token that http_parser reports
+        // in two pieces (because it straddles two reads) is copied, into spill_.
+        // The message is dispatched once its head is complete; the body (decoded if chunked) then streams to the
+        // on_body() callback, and its buffers are released as soon as they have been delivered.
+        // A persistent context keeps parsing after a keep-alive message: pipelined messages already in the
+        // buffer are parsed right away, each one resetting the per-message state in place.
+        // Requests are parsed by http_request_scanner unless the state_machine backend is asked for.
+        // Limits (see set_limits()) bound the memory a message can pin: the scanner copies a head split across reads,
+        // and http_parser gets the reads that continue a head gathered into one buffer of max_header_bytes.
         class http_parser_context
         {
+            // headers of a typical request fit without growing the vector.
+            static const std::size_t reserved_headers = 32;
+
         public:
-            http_parser_context(http_parser_type parser_type)
+            // callback is invoked with the head of every message, or once with the error that ended parsing.
+            // The result and its slices are valid until the callback returns.
+            http_parser_context(http_parser_type parser_type, http_parse_callback_type callback, bool persistent=false,
+                http_parser_backend backend=http_parser_backend::simd)
                 : parser_()
-                , was_header_value_(true)
-                , last_header_field_()
-                , last_header_value_()
                 , settings_()
-                , error_()
-                , parse_completed_(false)
+                , scanner_(nullptr)
+                , was_header_value_(true)
+                , header_field_()
+                , header_value_()
                 , url_()
+                , url_slice_()
+                , buffers_()
+                , spill_()
+                , backlog_()
+                , current_(nullptr)
+                , callback_(callback)
+                , body_callback_()
+                , persistent_(persistent)
+                , error_()
+                , in_message_(false)
+                , in_body_(false)
+                , skip_body_(false)
+                , body_received_(0)
+                , bad_length_(false)
+                , executing_(false)
+                , paused_(false)
+                , finished_(false)
+                , messages_(0)
                 , result_()
+                , limits_(http_limits::none())
+                , timer_(nullptr)
+                , armed_(-1)
+                , since_(timer::now())
+                , busy_(false)
+                , head_bytes_(0)
+                , gather_(nullptr)
+                , gathered_(0)
             {
                 http_parser_init(&parser_, parser_type);
                 parser_.data = this;
 
-                settings_.on_url = [](http_parser* parser, const char *at, size_t len) {
+                buffers_.reserve(4);
+                result_.headers_.reserve(reserved_headers);
+
+                if(backend == http_parser_backend::simd && parser_type == HTTP_REQUEST)
+                {
+                    scanner_ = new http_request_scanner(&parser_, &settings_);
+                    assert(scanner_);
+                }
+
+                settings_.on_message_begin = [](http_parser* parser) {
                     auto self = reinterpret_cast<http_parser_context*>(parser->data);
                     assert(self);
 
-                    assert(at && len);
+                    self->begin_message_();
+                    return 0;
+                };
+                settings_.on_url = [](http_parser* parser, const char *at, size_t len) {
+                    auto self = reinterpret_cast<http_parser_context*>(parser->data);
+                    assert(self);
 
-                    if(!self->url_.parse(at, len))
-                    {
-                        self->error_ = resval(error::http_parser_url_fail);
-                        return 1;
-                    }
+                    self->append_(self->url_slice_, at, len);
 
+                    auto max = self->limits_.max_url_length;
+                    if((max && self->url_slice_.size() > max) || !self->count_head_(len)) return self->fail_limit_();
                     return 0;
                 };
                 settings_.on_header_field = [](http_parser* parser, const char* at, size_t len) {
                     auto self = reinterpret_cast<http_parser_context*>(parser->data);
                     assert(self);
 
+                    // trailers of a chunked body are not reported.
+                    if(self->in_body_) return 0;
+
                     if(self->was_header_value_)
                     {
                         // new field started
-                        if(!self->last_header_field_.empty())
-                        {
-                            // add new entry
-                            self->result_.headers_[self->last_header_field_] = self->last_header_value_;
-                            self->last_header_value_.clear();
-                        }
-
-                        self->last_header_field_ = std::string(at, len);
+                        self->add_header_();
+
+                        auto max = self->limits_.max_headers;
+                        if(max && self->result_.headers_.size() >= max) return self->fail_limit_();
+
+                        self->header_field_ = util::slice(at, len);
                         self->was_header_value_ = false;
                     }
                     else
                     {
                         // appending
-                        self->last_header_field_ += std::string(at, len);
+                        self->append_(self->header_field_, at, len);
                     }
 
-                    return 0;
+                    // ": " and CRLF included
+                    return self->count_head_(len + 4) ? 0 : self->fail_limit_();
                 };
                 settings_.on_header_value = [](http_parser* parser, const char* at, size_t len) {
                     auto self = reinterpret_cast<http_parser_context*>(parser->data);
                     assert(self);
 
+                    if(self->in_body_) return 0;
+
                     if(!self->was_header_value_)
                     {
-                        self->last_header_value_ = std::string(at, len);
+                        self->header_value_ = util::slice(at, len);
                         self->was_header_value_ = true;
                     }
                     else
                     {
                         // appending
-                        self->last_header_value_ += std::string(at, len);
+                        self->append_(self->header_value_, at, len);
                     }
 
-                    return 0;
+                    return self->count_head_(len) ? 0 : self->fail_limit_();
                 };
                 settings_.on_headers_complete = [](http_parser* parser) {
                     auto self = reinterpret_cast<http_parser_context*>(parser->data);
                     assert(self);
 
                     // add last entry if any
-                    if(!self->last_header_field_.empty())
+                    self->add_header_();
+
+                    // the URL is complete only now: it may have come in several pieces.
+                    if(!self->url_slice_.empty() &&
+                        !self->url_.parse(self->url_slice_.data(), self->url_slice_.size(), parser->method == HTTP_CONNECT))
                     {
-                        // add new entry
-                        self->result_.headers_[self->last_header_field_] = self->last_header_value_;
+                        self->error_ = resval(error::http_parser_url_fail);
+                        return -1;
                     }
 
+                    resval rv = self->complete_head_(parser);
+                    if(!rv)
+                    {
+                        self->error_ = rv;
+                        return -1;
+                    }
+
+                    auto max = self->limits_.max_body_size;
+                    if(max && self->result_.content_length_ > 0 && static_cast<uint64_t>(self->result_.content_length_) > max)
+                        return self->fail_limit_();
+
+                    self->in_body_ = true;
+                    self->body_received_ = 0;
+                    self->enter_phase_();
+
+                    ++self->messages_;
+                    self->callback_(&self->result_, resval());
+
+                    // 1: the message has no body whatever its headers say (see skip_body())
+                    return self->skip_body_ ? 1 : 0;
+                };
+                settings_.on_body = [](http_parser* parser, const char* at, size_t len) {
+                    auto self = reinterpret_cast<http_parser_context*>(parser->data);
+                    assert(self);
+
+                    self->body_received_ += len;
+
+                    auto max = self->limits_.max_body_size;
+                    if(max && self->body_received_ > max) return self->fail_limit_();
+
+                    if(self->timer_) self->since_ = timer::now();
+                    if(self->body_callback_) self->body_callback_(util::slice(at, len), resval());
                     return 0;
                 };
                 settings_.on_message_complete = [](http_parser* parser) {
                     auto self = reinterpret_cast<http_parser_context*>(parser->data);
                     assert(self);
 
-                    // get host and port info from header entry "Host"
-                    std::string host("");
-                    int port = 0;
-                    auto x = self->result_.headers_.find("host");
-                    if(x != self->result_.headers_.end())
-                    {
-                        auto s = x->second;
-                        auto colon = s.find_last_of(':');
-                        if(colon == s.npos)
-                        {
-                            host = s;
-                        }
-                        else
-                        {
-                            host = s.substr(0, colon);
-                            port = std::stoi(s.substr(colon+1));
-                        }
-                    }
+                    auto& r = self->result_;
 
-                    // url info
-                    self->result_.schema_ = self->url_.has_schema()?self->url_.schema():"HTTP";
-                    self->result_.path_ = self->url_.has_path()?self->url_.path():"/";
-                    self->result_.query_ = self->url_.has_query()?self->url_.query():"";
-                    self->result_.fragment_ = self->url_.has_fragment()?self->url_.fragment():"";
-                    self->result_.host_ = self->url_.has_host()?self->url_.host():host;
-
-                    // determine port number
-                    if(self->url_.has_port()) { self->result_.port_ = self->url_.port(); }
-                    else if(port != 0) { self->result_.port_ = port; }
-                    else
+                    // http_parser frames the body by Content-Length already: this only guards against a mismatch.
+                    if(r.content_length_ >= 0 && !self->skip_body_ && self->body_received_ != static_cast<uint64_t>(r.content_length_))
                     {
-                        if(util::text::compare_no_case(self->result_.schema_, "HTTPS")) self->result_.port_ = 443;
-                        else self->result_.port_ = 80;
+                        self->error_ = resval(error::eproto);
+                        return -1;
                     }
 
-                    // HTTP method
-                    self->result_.method_ = http_method_str(static_cast<http_method>(parser->method));
+                    self->in_message_ = false;
+                    self->in_body_ = false;
+                    self->enter_phase_();
 
-                    // HTTP version
-                    std::stringstream version;
-                    version << parser->http_major << "." << parser->http_minor;
-                    self->result_.http_version_ = version.str();
+                    auto body_callback = std::move(self->body_callback_);
+                    self->body_callback_ = nullptr;
+                    if(body_callback) body_callback(util::slice(), resval(error::eof));
 
-                    self->parse_completed_ = true;
+                    // stop here: the rest of the input is not HTTP any more, or must not be parsed.
+                    if(r.upgrade_ || !r.keep_alive_ || !self->persistent_)
+                    {
+                        self->finished_ = true;
+                        return -1;
+                    }
                     return 0;
                 };
             }
 
             ~http_parser_context()
-            {}
+            {
+                backlog_.clear();
+                release_buffers_(nullptr);
+                if(gather_) gather_->release();
+                if(scanner_) delete scanner_;
+
+                // possibly from its own callback: the timer goes once closed.
+                if(timer_) timer_->close();
+            }
+
+            // no copy allowed
+            http_parser_context(const http_parser_context&) = delete;
+            void operator=(const http_parser_context&) = delete;
 
         public:
-            bool is_finished() const
+            // no more input expected: parsing failed, or the last message ended the exchange (see on_message_complete).
+            bool is_finished() const { return finished_; }
+
+            // some but not all of a message has been parsed.
+            bool in_message() const { return in_message_; }
+
+            // the head of the current message has been dispatched; its body is being parsed.
+            bool in_body() const { return in_body_; }
+
+            // size of the current (or last) request head, as counted against max_header_bytes
+            std::size_t head_bytes() const { return head_bytes_; }
+
+            bool is_paused() const { return paused_; }
+
+            std::size_t messages() const { return messages_; }
+
+            // Sizes are checked as the message is parsed; the timeouts need a timer of the default loop. A timeout
+            // fires between reads and fails the context with etimedout: the owner may delete it from the callback.
+            void set_limits(const http_limits& limits)
+            {
+                limits_ = limits;
+                if(scanner_) scanner_->set_max_head_size(limits.max_header_bytes ? limits.max_header_bytes : http_request_scanner::max_head_size);
+
+                if(!timer_ && (limits.header_timeout_ms > 0 || limits.body_timeout_ms > 0 || limits.idle_timeout_ms > 0))
+                {
+                    timer_ = new timer;
+                    assert(timer_);
+
+                    timer_->on_timeout([this](timer*) { after_timeout_(); });
+
+                    // connections keep the loop alive, not their deadlines
+                    timer_->unref();
+                }
+                enter_phase_();
+            }
+
+            const http_limits& limits() const { return limits_; }
+
+            // The owner is answering a message: no idle timeout until it is done (set_busy(false)). Without it, the
+            // idle time starts at the end of each message.
+            void set_busy(bool busy)
+            {
+                if(busy == busy_) return;
+
+                busy_ = busy;
+                enter_phase_();
+            }
+
+            // receives the body of the current message (set it from the parse callback); without one,
+            // the body is discarded.
+            void on_body(http_body_callback_type callback)
+            {
+                body_callback_ = callback;
+            }
+
+            // owner is the pooled buffer holding data (see stream::read_buffer()). It is retained for as long as
+            // the data is needed; without an owner, the data is copied into a pooled buffer first.
+            // Returns true once is_finished().
+            bool feed_data(const char* data, std::size_t offset, std::size_t length, buffer* owner=nullptr)
+            {
+                if(finished_) return true;
+
+                data += offset;
+                bool gathered = true;
+                auto retained = retain_(data, length, owner, gathered);
+
+                if(paused_ || !backlog_.empty())
+                {
+                    // keep it for resume()
+                    backlog_.push_back(std::make_pair(retained, util::slice(data, length)));
+                    return false;
+                }
+
+                execute_(retained, data, length);
+
+                // A read too large to be gathered is parsed where it is (tokens split across reads are joined in
+                // spill_): it may well end the head and start a pipelined one. What is bounded is the head itself.
+                if(!gathered && !finished_ && in_message_ && !in_body_ && head_bytes_ > limits_.max_header_bytes)
+                    fail_(resval(error::emsgsize));
+                return finished_;
+            }
+
+            // Call it from the parse callback when the message has no body although its headers may announce one:
+            // a response to HEAD, or a 1xx, 204 or 304 response (http_parser frames responses by their headers only).
+            void skip_body()
             {
-                // there was an error or parse completed.
-                return !error_ || parse_completed_;
+                skip_body_ = true;
             }
 
-            bool feed_data(const char* data, std::size_t offset, std::size_t length, http_parse_callback_type callback)
+            // The peer closed the connection: completes a response whose body is delimited by the end of the
+            // connection, and otherwise fails a message still incomplete. Returns true if no message was cut.
+            bool feed_eof()
             {
-                ::http_parser_execute(&parser_, &settings_, &data[offset], length);
+                if(finished_) return !in_message_;
 
-                if(!error_)
+                if(in_message_ && in_body_ && !scanner_ && !paused_ && backlog_.empty()) execute_(nullptr, nullptr, 0);
+
+                if(in_message_)
+                {
+                    if(!finished_) fail_(resval(error::http_parser_incomplete));
+                    return false;
+                }
+
+                finished_ = true;
+                return true;
+            }
+
+            // Stops parsing right after the current callback (use it for backpressure): the input not parsed
+            // yet is kept, and parsed by resume().
+            void pause()
+            {
+                if(paused_ || finished_) return;
+
+                paused_ = true;
+                http_parser_pause(&parser_, 1);
+            }
+
+            // Returns true once is_finished().
+            bool resume()
+            {
+                if(!paused_) return finished_;
+
+                paused_ = false;
+                http_parser_pause(&parser_, 0);
+                enter_phase_();
+
+                // called from a callback: http_parser just goes on.
+                if(executing_) return finished_;
+
+                while(!paused_ && !finished_ && !backlog_.empty())
+                {
+                    auto next = backlog_.front();
+                    backlog_.pop_front();
+                    execute_(next.first, next.second.data(), next.second.size());
+                }
+
+                // the scanner may hold back the end of a message without input left (see http_request_scanner).
+                if(scanner_ && !paused_ && !finished_ && backlog_.empty()) execute_(nullptr, nullptr, 0);
+                return finished_;
+            }
+
+            // ends parsing with an error (e.g. the connection was lost in the middle of a message).
+            void abort(resval rv)
+            {
+                if(!finished_) fail_(rv);
+            }
+
+            // back to the initial state, as for a new connection.
+            void reset()
+            {
+                http_parser_init(&parser_, static_cast<http_parser_type>(parser_.type));
+                parser_.data = this;
+                if(scanner_) scanner_->reset();
+
+                backlog_.clear();
+                release_buffers_(nullptr);
+                begin_message_();
+                body_callback_ = nullptr;
+                error_ = resval();
+                in_message_ = false;
+                in_body_ = false;
+                paused_ = false;
+                finished_ = false;
+                messages_ = 0;
+                busy_ = false;
+                enter_phase_();
+            }
+
+        private:
+            // Keeps the input alive while it is needed, and points data at where it is kept. Reads that continue a
+            // head for http_parser are copied into gather_ (unless too large: gathered is then false).
+            buffer* retain_(const char*& data, std::size_t length, buffer* owner, bool& gathered)
+            {
+                if(!scanner_ && limits_.max_header_bytes && in_message_ && !in_body_ && !finished_)
                 {
-                    // there was an error
-                    callback(nullptr, error_);
-                    return true;
+                    if(!gather_)
+                    {
+                        gather_ = buffer_pool::get().acquire(limits_.max_header_bytes);
+                        assert(gather_);
+                        gathered_ = 0;
+                    }
+
+                    if(gathered_ + length <= gather_->capacity())
+                    {
+                        auto p = gather_->data() + gathered_;
+                        std::memcpy(p, data, length);
+                        gathered_ += length;
+                        data = p;
+
+                        gather_->retain();
+                        buffers_.push_back(gather_);
+                        return gather_;
+                    }
+                    gathered = false;
                 }
-                else if(parse_completed_)
+
+                if(!owner)
                 {
-                    // finished
-                    callback(&result_, resval());
-                    return true;
+                    owner = buffer_pool::get().acquire(length);
+                    assert(owner);
+                    std::memcpy(owner->data(), data, length);
+                    data = owner->data();
                 }
                 else
                 {
-                    // need more data
-                    return false;
+                    owner->retain();
+                }
+
+                buffers_.push_back(owner);
+                return owner;
+            }
+
+            void execute_(buffer* owner, const char* data, std::size_t length)
+            {
+                current_ = owner;
+                executing_ = true;
+                auto parsed = scanner_ ? scanner_->execute(data, length) : ::http_parser_execute(&parser_, &settings_, data, length);
+                executing_ = false;
+
+                if(finished_)
+                {
+                    // done: see on_message_complete
+                }
+                else if(HTTP_PARSER_ERRNO(&parser_) == HPE_PAUSED)
+                {
+                    if(parsed < length) backlog_.push_front(std::make_pair(owner, util::slice(data + parsed, length - parsed)));
+                }
+                else if(parsed != length || HTTP_PARSER_ERRNO(&parser_) != HPE_OK)
+                {
+                    // malformed message (or the URL could not be parsed, or a limit was hit)
+                    if(error_ && HTTP_PARSER_ERRNO(&parser_) == HPE_HEADER_OVERFLOW) error_ = resval(error::emsgsize);
+                    fail_(error_ ? resval(error::eproto) : error_);
+                }
+
+                // Between messages nothing refers to the buffers any more; within a body, the data has been delivered.
+                // The scanner keeps its own copy of a head split across reads.
+                if(!in_message_ || in_body_ || scanner_) release_buffers_(nullptr);
+                current_ = nullptr;
+            }
+
+            void fail_(resval rv)
+            {
+                finished_ = true;
+
+                auto body_callback = std::move(body_callback_);
+                body_callback_ = nullptr;
+                if(body_callback && in_body_) body_callback(util::slice(), rv);
+
+                callback_(nullptr, rv);
+            }
+
+            // a new message starts within the buffer being parsed: the ones before it can go.
+            void begin_message_()
+            {
+                release_buffers_(current_);
+
+                was_header_value_ = true;
+                header_field_ = util::slice();
+                header_value_ = util::slice();
+                url_slice_ = util::slice();
+                bad_length_ = false;
+                result_.clear();
+                in_message_ = true;
+                in_body_ = false;
+                skip_body_ = false;
+
+                // the next head is gathered anew (the data already in gather_ stays retained as needed).
+                if(gather_) gather_->release();
+                gather_ = nullptr;
+                head_bytes_ = 0;
+                enter_phase_();
+            }
+
+            // adds len bytes to the head of the message; false once over max_header_bytes.
+            bool count_head_(std::size_t len)
+            {
+                if(in_body_) return true;
+
+                head_bytes_ += len;
+                return !limits_.max_header_bytes || head_bytes_ <= limits_.max_header_bytes;
+            }
+
+            int fail_limit_()
+            {
+                error_ = resval(error::emsgsize);
+                return -1;
+            }
+
+            // A new phase (header, body, idle, or none while busy) starts now. The timer is restarted only if
+            // the new deadline comes before the one it is armed for: otherwise it re-arms itself when it fires.
+            void enter_phase_()
+            {
+                if(!timer_) return;
+
+                since_ = timer::now();
+
+                auto deadline = deadline_();
+                if(deadline < 0 || (armed_ >= 0 && armed_ <= deadline)) return;
+
+                armed_ = deadline;
+                timer_->start(std::max<int64_t>(deadline - since_, 0));
+            }
+
+            // deadline of the current phase in loop time, or -1
+            int64_t deadline_() const
+            {
+                int64_t timeout = 0;
+                if(finished_) timeout = 0;
+                else if(in_body_) timeout = paused_ ? 0 : limits_.body_timeout_ms;
+                else if(in_message_) timeout = limits_.header_timeout_ms;
+                else timeout = busy_ ? 0 : limits_.idle_timeout_ms;
+
+                return timeout > 0 ? since_ + timeout : -1;
+            }
+
+            void after_timeout_()
+            {
+                armed_ = -1;
+
+                auto deadline = deadline_();
+                if(deadline < 0) return;
+
+                auto now = timer::now();
+                if(now < deadline)
+                {
+                    armed_ = deadline;
+                    timer_->start(deadline - now);
+                    return;
+                }
+
+                // the owner may delete this from the callback.
+                fail_(resval(error::etimedout));
+            }
+
+            // releases the buffers except 'keep' and the ones still holding input to parse.
+            void release_buffers_(buffer* keep)
+            {
+                std::size_t kept = 0;
+                for(auto b : buffers_)
+                {
+                    bool needed = b == keep;
+                    for(auto& pending : backlog_) if(pending.first == b) needed = true;
+
+                    if(needed) buffers_[kept++] = b;
+                    else b->release();
+                }
+                buffers_.resize(kept);
+                spill_.clear();
+            }
+
+            // http_parser reports a token in two pieces only when it straddles two reads: join them in spill_.
+            void append_(util::slice& s, const char* at, std::size_t len)
+            {
+                if(s.empty())
+                {
+                    s = util::slice(at, len);
+                    return;
+                }
+
+                spill_.push_back(std::string());
+                auto& joined = spill_.back();
+                joined.reserve(s.size() + len);
+                joined.append(s.data(), s.size());
+                joined.append(at, len);
+                s = util::slice(joined);
+            }
+
+            void add_header_()
+            {
+                if(header_field_.empty()) return;
+
+                auto id = http_header_lookup(header_field_);
+                if(id == http_header_id::content_length)
+                {
+                    // a single decimal number (repeating the same value is tolerated)
+                    int64_t length = parse_length_(header_value_);
+                    if(length < 0 || (result_.content_length_ >= 0 && result_.content_length_ != length)) bad_length_ = true;
+                    result_.content_length_ = length;
+                }
+
+                result_.add_header_(header_field_, header_value_, id);
+                header_field_ = util::slice();
+                header_value_ = util::slice();
+            }
+
+            // fills the result once the headers are complete: eproto if the message framing is invalid, einval if
+            // the Host port is.
+            resval complete_head_(http_parser* parser)
+            {
+                auto& r = result_;
+
+                // get host and port info from header entry "Host"
+                util::slice host;
+                int port = 0;
+                util::slice s = r.header(http_header_id::host);
+                if(!s.empty())
+                {
+                    auto colon = s.rfind(':');
+                    if(colon == util::slice::npos || s.find(']', colon) != util::slice::npos)
+                    {
+                        host = s;
+                    }
+                    else
+                    {
+                        host = s.substr(0, colon);
+                        port = parse_port_(s.substr(colon+1));
+                        if(port < 0) return resval(error::einval);
+                    }
                 }
+
+                // url info
+                r.schema_ = url_.has_schema()?url_.schema():util::slice("HTTP");
+                r.path_ = url_.has_path()?url_.path():util::slice("/");
+                r.query_ = url_.query();
+                r.fragment_ = url_.fragment();
+                r.host_ = url_.has_host()?url_.host():host;
+
+                // determine port number
+                if(url_.has_port()) { r.port_ = url_.port(); }
+                else if(port != 0) { r.port_ = port; }
+                else
+                {
+                    if(r.schema_.equals_no_case("HTTPS")) r.port_ = 443;
+                    else r.port_ = 80;
+                }
+
+                // HTTP method (http_method_str() returns static strings), or status code
+                if(parser->type == HTTP_REQUEST) r.method_ = http_method_str(static_cast<http_method>(parser->method));
+                else r.status_code_ = parser->status_code;
+
+                // HTTP version
+                r.http_major_ = parser->http_major;
+                r.http_minor_ = parser->http_minor;
+                r.upgrade_ = parser->upgrade != 0;
+                r.keep_alive_ = http_should_keep_alive(parser) != 0;
+                r.chunked_ = (parser->flags & F_CHUNKED) != 0;
+
+                // Content-Length (checked in add_header_()) never goes together with chunked encoding:
+                // a request with both could be framed differently by a proxy in front of us.
+                if(bad_length_ || (r.content_length_ >= 0 && r.chunked_)) return resval(error::eproto);
+                return resval();
+            }
+
+            // 0 if empty, -1 if not a number or above 65535
+            static int parse_port_(const util::slice& s)
+            {
+                int port = 0;
+                for(auto c : s)
+                {
+                    if(c < '0' || c > '9') return -1;
+                    port = port * 10 + (c - '0');
+                    if(port > 65535) return -1;
+                }
+                return port;
+            }
+
+            // -1 if not a plain decimal number
+            static int64_t parse_length_(const util::slice& s)
+            {
+                if(s.empty() || s.size() > 18) return -1;
+
+                int64_t length = 0;
+                for(auto c : s)
+                {
+                    if(c < '0' || c > '9') return -1;
+                    length = length * 10 + (c - '0');
+                }
+                return length;
             }
 
         private:
             http_parser parser_;
             http_parser_settings settings_;
+            http_request_scanner* scanner_;
             bool was_header_value_;
-            std::string last_header_field_;
-            std::string last_header_value_;
+            util::slice header_field_;
+            util::slice header_value_;
+            url_obj url_;
+            util::slice url_slice_;
+
+            std::vector<buffer*> buffers_;
+            std::deque<std::string> spill_;
+            std::deque<std::pair<buffer*, util::slice>> backlog_;
+            buffer* current_;
 
+            http_parse_callback_type callback_;
+            http_body_callback_type body_callback_;
+            bool persistent_;
             resval error_;
-            bool parse_completed_;
-            url_obj url_;
+            bool in_message_;
+            bool in_body_;
+            bool skip_body_;
+            uint64_t body_received_;
+            bool bad_length_;
+            bool executing_;
+            bool paused_;
+            bool finished_;
+            std::size_t messages_;
             http_parse_result result_;
+
+            http_limits limits_;
+            timer* timer_;              // created by set_limits() if there is a timeout
+            int64_t armed_;             // deadline the timer is armed for, or -1
+            int64_t since_;             // start of the current phase (last body data within a body)
+            bool busy_;
+            std::size_t head_bytes_;
+            buffer* gather_;            // reads continuing a head, for http_parser
+            std::size_t gathered_;
         };
 
-        resval parse_http_request(stream* input, http_parse_callback_type callback)
+        // Parses a single request from input (see http_session for keep-alive connections). The sizes of limits are
+        // enforced; its timeouts are left to the owner of the stream.
+        resval parse_http_request(stream* input, http_parse_callback_type callback, const http_limits& limits=http_limits())
         {
-            auto ctx = new http_parser_context(HTTP_REQUEST);
+            auto ctx = new http_parser_context(HTTP_REQUEST, callback);
             assert(ctx);
 
+            auto sizes = limits;
+            sizes.header_timeout_ms = sizes.body_timeout_ms = sizes.idle_timeout_ms = 0;
+            ctx->set_limits(sizes);
+
             input->on_read([=](const char* data, std::size_t offset, std::size_t length, stream*, resval rv) {
                 if(rv)
                 {
-                    if(ctx->feed_data(data, offset, length, callback))
+                    if(ctx->feed_data(data, offset, length, input->read_buffer()))
                     {
                         // parse end
                         input->read_stop();
@@ -364,17 +1105,13 @@ namespace x10
                 {
                     if(rv.code() == error::eof)
                     {
-                        // EOF
-                        if(!ctx->is_finished())
-                        {
-                            // HTTP request was not properly parsed.
-                            callback(nullptr, resval(error::http_parser_incomplete));
-                        }
+                        // EOF: HTTP request was not properly parsed.
+                        ctx->abort(resval(error::http_parser_incomplete));
                     }
                     else
                     {
                         // error
-                        callback(nullptr, rv);
+                        ctx->abort(rv);
                     }
                     delete ctx;
                 }
@@ -383,64 +1120,121 @@ namespace x10
             return input->read_start();
         }
 
-        std::string http_status_text(int status_code)
+        struct http_status
+        {
+            int code;
+            const char* text;
+        };
+
+        // known status codes
+        static const http_status http_statuses[] =
         {
-            switch(status_code)
-            {
-                case 100: return "Continue";
-                case 101: return "Switching Protocols";
-                case 102: return "Processing";                 // RFC 2518; obsoleted by RFC 4918
-                case 200: return "OK";
-                case 201: return "Created";
-                case 202: return "Accepted";
-                case 203: return "Non-Authoritative Information";
-                case 204: return "No Content";
-                case 205: return "Reset Content";
-                case 206: return "Partial Content";
-                case 207: return "Multi-Status";               // RFC 4918
-                case 300: return "Multiple Choices";
-                case 301: return "Moved Permanently";
-                case 302: return "Moved Temporarily";
-                case 303: return "See Other";
-                case 304: return "Not Modified";
-                case 305: return "Use Proxy";
-                case 307: return "Temporary Redirect";
-                case 400: return "Bad Request";
-                case 401: return "Unauthorized";
-                case 402: return "Payment Required";
-                case 403: return "Forbidden";
-                case 404: return "Not Found";
-                case 405: return "Method Not Allowed";
-                case 406: return "Not Acceptable";
-                case 407: return "Proxy Authentication Required";
-                case 408: return "Request Time-out";
-                case 409: return "Conflict";
-                case 410: return "Gone";
-                case 411: return "Length Required";
-                case 412: return "Precondition Failed";
-                case 413: return "Request Entity Too Large";
-                case 414: return "Request-URI Too Large";
-                case 415: return "Unsupported Media Type";
-                case 416: return "Requested Range Not Satisfiable";
-                case 417: return "Expectation Failed";
-                case 418: return "I\"m a teapot";              // RFC 2324
-                case 422: return "Unprocessable Entity";       // RFC 4918
-                case 423: return "Locked";                     // RFC 4918
-                case 424: return "Failed Dependency";          // RFC 4918
-                case 425: return "Unordered Collection";       // RFC 4918
-                case 426: return "Upgrade Required";           // RFC 2817
-                case 500: return "Internal Server Error";
-                case 501: return "Not Implemented";
-                case 502: return "Bad Gateway";
-                case 503: return "Service Unavailable";
-                case 504: return "Gateway Time-out";
-                case 505: return "HTTP Version not supported";
-                case 506: return "Variant Also Negotiates";    // RFC 2295
-                case 507: return "Insufficient Storage";       // RFC 4918
-                case 509: return "Bandwidth Limit Exceeded";
-                case 510: return "Not Extended";                // RFC 2774
-                default: assert(false); return std::string();
+            { 100, "Continue" },
+            { 101, "Switching Protocols" },
+            { 102, "Processing" },                          // RFC 2518; obsoleted by RFC 4918
+            { 200, "OK" },
+            { 201, "Created" },
+            { 202, "Accepted" },
+            { 203, "Non-Authoritative Information" },
+            { 204, "No Content" },
+            { 205, "Reset Content" },
+            { 206, "Partial Content" },
+            { 207, "Multi-Status" },                        // RFC 4918
+            { 300, "Multiple Choices" },
+            { 301, "Moved Permanently" },
+            { 302, "Moved Temporarily" },
+            { 303, "See Other" },
+            { 304, "Not Modified" },
+            { 305, "Use Proxy" },
+            { 307, "Temporary Redirect" },
+            { 400, "Bad Request" },
+            { 401, "Unauthorized" },
+            { 402, "Payment Required" },
+            { 403, "Forbidden" },
+            { 404, "Not Found" },
+            { 405, "Method Not Allowed" },
+            { 406, "Not Acceptable" },
+            { 407, "Proxy Authentication Required" },
+            { 408, "Request Time-out" },
+            { 409, "Conflict" },
+            { 410, "Gone" },
+            { 411, "Length Required" },
+            { 412, "Precondition Failed" },
+            { 413, "Request Entity Too Large" },
+            { 414, "Request-URI Too Large" },
+            { 415, "Unsupported Media Type" },
+            { 416, "Requested Range Not Satisfiable" },
+            { 417, "Expectation Failed" },
+            { 418, "I'm a teapot" },                        // RFC 2324
+            { 422, "Unprocessable Entity" },                // RFC 4918
+            { 423, "Locked" },                              // RFC 4918
+            { 424, "Failed Dependency" },                   // RFC 4918
+            { 425, "Unordered Collection" },                // RFC 4918
+            { 426, "Upgrade Required" },                    // RFC 2817
+            { 500, "Internal Server Error" },
+            { 501, "Not Implemented" },
+            { 502, "Bad Gateway" },
+            { 503, "Service Unavailable" },
+            { 504, "Gateway Time-out" },
+            { 505, "HTTP Version not supported" },
+            { 506, "Variant Also Negotiates" },             // RFC 2295
+            { 507, "Insufficient Storage" },                // RFC 4918
+            { 509, "Bandwidth Limit Exceeded" },
+            { 510, "Not Extended" },                        // RFC 2774
+        };
+
+        // Status lines of every code from 100 to 599, formatted once ("Unknown" for the codes not listed above).
+        class http_status_lines
+        {
+        public:
+            static const int first_code = 100;
+            static const int last_code = 599;
+
+            static const http_status_lines& get()
+            {
+                static http_status_lines lines;
+                return lines;
+            }
+
+            // "HTTP/1.1 200 OK\r\n"; empty for a code out of range.
+            util::slice line(int status_code) const
+            {
+                if(status_code < first_code || status_code > last_code) return util::slice();
+                return lines_[status_code - first_code];
+            }
+
+            util::slice text(int status_code) const
+            {
+                if(status_code < first_code || status_code > last_code) return util::slice();
+                return texts_[status_code - first_code];
+            }
+
+        private:
+            http_status_lines()
+            {
+                for(int code=first_code;code<=last_code;++code) texts_[code - first_code] = "Unknown";
+                for(auto& s : http_statuses) texts_[s.code - first_code] = s.text;
+
+                for(int code=first_code;code<=last_code;++code)
+                {
+                    auto& line = lines_[code - first_code];
+                    line = "HTTP/1.1 " + std::to_string(code) + " ";
+                    line.append(texts_[code - first_code].data(), texts_[code - first_code].size());
+                    line += "\r\n";
+                }
             }
+
+        private:
+            util::slice texts_[last_code - first_code + 1];
+            std::string lines_[last_code - first_code + 1];
+        };
+
+        // reason phrase of a status code (a static string: no allocation)
+        util::slice http_status_text(int status_code)
+        {
+            auto text = http_status_lines::get().text(status_code);
+            assert(!text.empty());
+            return text;
         }
     }
 }
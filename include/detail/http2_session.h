@@ -0,0 +1,1414 @@
+#ifndef __DETAIL_HTTP2_SESSION_H__
+#define __DETAIL_HTTP2_SESSION_H__
+
+#include "base.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include "hpack.h"
+#include "http.h"
+#include "http_responder.h"
+#include "http_response.h"
+#include "http_session.h"
+#include "server.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // error codes of RST_STREAM and GOAWAY frames
+        enum class http2_error : uint32_t
+        {
+            no_error = 0x0,
+            protocol_error = 0x1,
+            internal_error = 0x2,
+            flow_control_error = 0x3,
+            settings_timeout = 0x4,
+            stream_closed = 0x5,
+            frame_size_error = 0x6,
+            refused_stream = 0x7,
+            cancel = 0x8,
+            compression_error = 0x9,
+            connect_error = 0xa,
+            enhance_your_calm = 0xb,
+            inadequate_security = 0xc,
+            http_1_1_required = 0xd
+        };
+
+        enum class http2_frame_type : uint8_t
+        {
+            data = 0x0,
+            headers = 0x1,
+            priority = 0x2,
+            rst_stream = 0x3,
+            settings = 0x4,
+            push_promise = 0x5,
+            ping = 0x6,
+            goaway = 0x7,
+            window_update = 0x8,
+            continuation = 0x9
+        };
+
+        // One cleartext HTTP/2 connection (h2c): any number of requests multiplexed as streams. Requests are
+        // dispatched the way http_session does it (a http_parse_result once the header block is complete, the
+        // body through read_body()) and answered with the same http_response, in any order: each response goes
+        // out as soon as it is given, interleaved with the others under flow control.
+        //
+        // The connection either starts with the client preface ("prior knowledge", start()), or is upgraded
+        // from an HTTP/1.1 request (upgrade()). The session owns the connection and deletes itself after
+        // closing it. As an http_responder it serves the request helpers (http_router, http_static, http_cache)
+        // like http_session does; a file range is read into memory, since its DATA frames are interleaved.
+        class http2_session : public http_responder
+        {
+            typedef std::function<void(http2_session*, std::size_t, const http_parse_result*)> on_request_callback_type;
+            typedef std::function<void(http2_session*, resval)> on_error_callback_type;
+            typedef std::function<void(http2_session*)> on_open_callback_type;
+
+        public:
+            static const std::size_t max_concurrent_streams = 100;
+
+            // receive windows we grant: per stream, and to the connection
+            static const int64_t stream_window = 1024 * 1024;
+            static const int64_t connection_window = 16 * 1024 * 1024;
+
+            // a header block (HEADERS and its CONTINUATIONs) larger than this ends the connection
+            static const std::size_t max_header_block = 64 * 1024;
+
+            // SETTINGS_MAX_HEADER_LIST_SIZE we advertise: the decoded size of a request's fields (name, value and
+            // 32 each, RFC 7540 6.5.2), which a small block of indexed references can multiply. Past it the
+            // stream is reset.
+            static const std::size_t max_header_list = 64 * 1024;
+
+            // no DATA frame is queued while this much is waiting to be written: slow readers don't pile up memory.
+            static const std::size_t write_watermark = 1024 * 1024;
+
+        private:
+            static const std::size_t frame_header_size = 9;
+            static const std::size_t default_max_frame_size = 16384;
+            static const int64_t default_window = 65535;
+            static const int64_t max_window = 0x7fffffff;
+
+            // frame flags
+            static const uint8_t flag_end_stream = 0x1;
+            static const uint8_t flag_ack = 0x1;
+            static const uint8_t flag_end_headers = 0x4;
+            static const uint8_t flag_padded = 0x8;
+            static const uint8_t flag_priority = 0x20;
+
+            // SETTINGS identifiers
+            static const uint16_t settings_header_table_size = 0x1;
+            static const uint16_t settings_enable_push = 0x2;
+            static const uint16_t settings_max_concurrent_streams = 0x3;
+            static const uint16_t settings_initial_window_size = 0x4;
+            static const uint16_t settings_max_frame_size = 0x5;
+            static const uint16_t settings_max_header_list_size = 0x6;
+
+            struct field_ref
+            {
+                std::size_t name;
+                std::size_t name_size;
+                std::size_t value;
+                std::size_t value_size;
+            };
+
+            struct h2_stream
+            {
+                h2_stream(uint32_t id, int64_t send_window)
+                    : id(id)
+                    , request()
+                    , fields()
+                    , field_refs()
+                    , on_body()
+                    , recv_window(stream_window)
+                    , recv_consumed(0)
+                    , send_window(send_window)
+                    , body()
+                    , body_ref()
+                    , body_owner(nullptr)
+                    , body_sent(0)
+                    , refs(0)
+                    , remote_closed(false)
+                    , responded(false)
+                    , local_closed(false)
+                    , queued(false)
+                    , closed(false)
+                {}
+
+                ~h2_stream()
+                {
+                    if(body_owner) body_owner->release();
+                }
+
+                util::slice response_body() const { return body.empty() ? body_ref : util::slice(body); }
+
+                uint32_t id;
+                http_parse_result request;
+                std::string fields;                 // decoded names and values the request points into
+                std::vector<field_ref> field_refs;
+                http_body_callback_type on_body;
+
+                int64_t recv_window;                // what the peer may still send
+                int64_t recv_consumed;              // delivered since the last WINDOW_UPDATE
+                int64_t send_window;
+
+                std::string body;
+                util::slice body_ref;
+                buffer* body_owner;                 // holds body_ref for a response serialized beforehand
+                std::size_t body_sent;
+
+                std::size_t refs;                   // write batches referencing the body, and dispatches
+                bool remote_closed;                 // END_STREAM received
+                bool responded;
+                bool local_closed;                  // END_STREAM queued
+                bool queued;                        // in sending_
+                bool closed;                        // out of streams_: deleted once unreferenced
+            };
+
+            // frames waiting for one vectored write: headers and control frames are copied into bytes, DATA
+            // payloads point to the response bodies of their streams.
+            struct write_batch
+            {
+                struct segment
+                {
+                    const char* external;           // or nullptr: bytes from offset
+                    std::size_t offset;
+                    std::size_t size;
+                };
+
+                write_batch()
+                    : bytes()
+                    , segments()
+                    , streams()
+                {}
+
+                std::string bytes;
+                std::vector<segment> segments;
+                std::vector<h2_stream*> streams;
+            };
+
+            // iovecs per write
+            static const std::size_t max_segments = 256;
+
+        public:
+            // tracker (optional): the connection is marked busy while it has open streams.
+            http2_session(stream* conn, server* tracker=nullptr)
+                : conn_(conn)
+                , tracker_(tracker)
+                , on_request_()
+                , on_error_()
+                , streams_()
+                , sending_()
+                , out_()
+                , in_flight_()
+                , input_()
+                , decoder_()
+                , encoder_()
+                , header_block_()
+                , continuing_(0)
+                , continuing_flags_(0)
+                , current_(nullptr)
+                , last_stream_id_(0)
+                , max_frame_size_(default_max_frame_size)
+                , initial_send_window_(default_window)
+                , send_window_(default_window)
+                , recv_window_(connection_window)
+                , recv_consumed_(0)
+                , preface_received_(false)
+                , settings_received_(false)
+                , goaway_received_(false)
+                , failed_(false)
+                , dispatching_(false)
+                , closing_(false)
+                , closed_(false)
+                , refs_(0)
+            {
+                assert(conn_);
+            }
+
+            // no copy allowed
+            http2_session(const http2_session&) = delete;
+            void operator=(const http2_session&) = delete;
+
+            // Invoked once the header block of a request is complete. The result (and its slices) is valid until
+            // the callback returns; answer with respond(id, ...).
+            void on_request(on_request_callback_type callback)
+            {
+                on_request_ = callback;
+            }
+
+            // protocol or I/O error: the connection is closed afterwards.
+            void on_error(on_error_callback_type callback)
+            {
+                on_error_ = callback;
+            }
+
+            // Prior knowledge: the client starts with the connection preface.
+            resval start()
+            {
+                send_settings_();
+
+                conn_->on_read([this](const char* data, std::size_t offset, std::size_t length, stream*, resval rv) {
+                    after_read_(data, offset, length, rv);
+                });
+                conn_->on_complete([this](resval rv) { after_write_(rv); });
+
+                resval rv = conn_->read_start();
+                if(!rv) return rv;
+                return flush_();
+            }
+
+            // Upgrades the connection of an HTTP/1.1 request with "Upgrade: h2c" and "HTTP2-Settings": answers
+            // 101, and once it is written the request is dispatched again as stream 1 of a new http2_session
+            // (on_open receives it first, to set its callbacks). Returns false, without answering, if the request
+            // does not ask for h2c or has a body: answer it over HTTP/1.1.
+            static bool upgrade(http_session* session, std::size_t id, const http_parse_result* r, on_open_callback_type on_open, server* tracker=nullptr)
+            {
+                if(!r->upgrade() || !http_header_has_token(r->header(http_header_id::upgrade), "h2c")) return false;
+                if(r->content_length() > 0 || r->chunked()) return false;
+
+                auto settings = std::make_shared<std::string>();
+                if(!base64url_decode_(r->header("HTTP2-Settings"), *settings) || settings->size() % 6) return false;
+
+                // the request outlives the callback: copy it as header fields
+                auto fields = std::make_shared<std::vector<std::pair<std::string, std::string>>>();
+                auto target = r->path().to_string();
+                if(!r->query().empty()) target += "?" + r->query().to_string();
+
+                fields->push_back(std::make_pair(":method", r->method().to_string()));
+                fields->push_back(std::make_pair(":scheme", "http"));
+                fields->push_back(std::make_pair(":authority", r->header(http_header_id::host).to_string()));
+                fields->push_back(std::make_pair(":path", target));
+                for(auto& h : r->headers())
+                {
+                    if(h.first.equals_no_case("host") || h.first.equals_no_case("HTTP2-Settings") || h.first.equals_no_case("te")
+                        || connection_specific_(h.first)) continue;
+
+                    auto name = h.first.to_string();
+                    for(auto& c : name) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+                    fields->push_back(std::make_pair(name, h.second.to_string()));
+                }
+
+                http_response res(101);
+                res.add_header("Connection", "Upgrade");
+                res.add_header("Upgrade", "h2c");
+
+                resval rv = session->upgrade(id, std::move(res), [on_open, tracker, settings, fields](stream* conn) {
+                    auto h2 = new http2_session(conn, tracker);
+                    assert(h2);
+
+                    h2->apply_settings_(*settings);
+                    if(on_open) on_open(h2);
+                    h2->start_upgraded_(*fields);
+                });
+                return !!rv;
+            }
+
+            // Streams the body of the request being dispatched (call it from on_request): slices are valid during
+            // the callback only, and the end is signaled with error::eof (error::ecanceled if the client resets
+            // the stream). Without it, the body is discarded.
+            virtual void read_body(http_body_callback_type callback)
+            {
+                if(current_) current_->on_body = callback;
+            }
+
+            // Answers request 'id' (its stream). Returns einval if the stream is gone (reset by the client) or
+            // already answered, ebadf once the session is closed.
+            virtual resval respond(std::size_t id, http_response&& response)
+            {
+                if(closed_) return resval(error::ebadf);
+                auto s = find_(id);
+                if(!s || s->responded) return resval(error::einval);
+
+                util::slice head;
+                auto head_buffer = response.take_head(head);
+
+                s->body = std::move(response.body_string());
+                if(s->body.empty()) s->body_ref = response.body();
+
+                resval rv = respond_(s, head);
+                head_buffer->release();
+                return rv;
+            }
+
+            // Answers request 'id' with length bytes of a file from offset, read into the body here: there is no
+            // sendfile under HTTP/2 framing. Meant for the small files of a static site.
+            virtual resval respond(std::size_t id, http_response&& response, file_entry* file, int64_t offset, int64_t length)
+            {
+                if(closed_) return resval(error::ebadf);
+                auto s = find_(id);
+                if(!s || s->responded) return resval(error::einval);
+                if(!file || offset < 0 || length < 0 || offset + length > file->size()) return resval(error::einval);
+
+                response.set_content_length(length);
+                if(s->request.method() == "HEAD") return respond(id, std::move(response));
+
+                std::string body(static_cast<std::size_t>(length), '\0');
+                std::size_t done = 0;
+                while(done < body.size())
+                {
+                    auto n = ::pread(file->fd(), &body[done], body.size() - done, static_cast<off_t>(offset + done));
+                    if(n < 0 && errno == EINTR) continue;
+                    if(n <= 0)
+                    {
+                        respond(id, http_response(500));
+                        return resval(error::eio);
+                    }
+                    done += static_cast<std::size_t>(n);
+                }
+
+                response.set_body(std::move(body));
+                return respond(id, std::move(response));
+            }
+
+            // Answers request 'id' with a response serialized for HTTP/1.1 (see http_cache): its head is encoded
+            // again as a header block, and the body is sent from data, which the stream retains meanwhile. An
+            // HTTP/2 stream ends on its own: last does not close the connection.
+            virtual resval respond(std::size_t id, buffer* data, const util::slice& response, bool)
+            {
+                if(closed_) return resval(error::ebadf);
+                auto s = find_(id);
+                if(!s || s->responded) return resval(error::einval);
+                if(!data || response.empty()) return resval(error::einval);
+
+                auto head_size = head_size_(response);
+                if(!head_size) return resval(error::einval);
+
+                data->retain();
+                s->body_owner = data;
+                s->body_ref = response.substr(head_size);
+                return respond_(s, response.substr(0, head_size));
+            }
+
+            // requests over HTTP/2 are not labeled in http_metrics (it counts HTTP/1.x sessions).
+            virtual void set_route(std::size_t, std::size_t) {}
+
+            // A party answering requests later (see http_cache) holds a reference: a session closed meanwhile is
+            // deleted by the last release() instead, and answers respond() with ebadf until then.
+            virtual void retain() { ++refs_; }
+
+            virtual void release()
+            {
+                assert(refs_ > 0);
+                if(--refs_ == 0 && closed_) delete this;
+            }
+
+            // closes the connection right away: unanswered requests and unsent responses are dropped.
+            void close()
+            {
+                if(closed_) return;
+
+                if(dispatching_)
+                {
+                    // inside a callback: close once it returns.
+                    closing_ = true;
+                    return;
+                }
+
+                // the body handlers still waiting learn that the request is gone
+                std::vector<h2_stream*> open;
+                for(auto& it : streams_) open.push_back(it.second);
+                for(auto s : open) cancel_body_(s);
+
+                conn_->on_read(nullptr);
+                conn_->on_complete(nullptr);
+                conn_->close();
+
+                closed_ = true;
+                if(refs_ == 0) delete this;
+            }
+
+            stream* connection() const { return conn_; }
+
+            // open streams
+            std::size_t streams() const { return streams_.size(); }
+
+            // highest stream id started by the client
+            uint32_t last_stream_id() const { return last_stream_id_; }
+
+        private:
+            ~http2_session()
+            {
+                // writes won't complete any more (the connection is closed)
+                for(auto& b : in_flight_) for(auto s : b.streams) release_(s);
+                for(auto s : out_.streams) release_(s);
+
+                for(auto& it : streams_) delete it.second;
+            }
+
+            // headers of HTTP/1.x connection management, not allowed in HTTP/2 (8.2.2)
+            static bool connection_specific_(const util::slice& name)
+            {
+                return name.equals_no_case("connection") || name.equals_no_case("keep-alive") || name.equals_no_case("proxy-connection")
+                    || name.equals_no_case("transfer-encoding") || name.equals_no_case("upgrade");
+            }
+
+            // HTTP2-Settings: base64url without padding
+            static bool base64url_decode_(const util::slice& in, std::string& out)
+            {
+                uint32_t acc = 0;
+                int bits = 0;
+                for(auto c : in)
+                {
+                    int v;
+                    if(c >= 'A' && c <= 'Z') v = c - 'A';
+                    else if(c >= 'a' && c <= 'z') v = c - 'a' + 26;
+                    else if(c >= '0' && c <= '9') v = c - '0' + 52;
+                    else if(c == '-' || c == '+') v = 62;
+                    else if(c == '_' || c == '/') v = 63;
+                    else if(c == '=') break;
+                    else return false;
+
+                    acc = (acc << 6) | static_cast<uint32_t>(v);
+                    bits += 6;
+                    if(bits >= 8)
+                    {
+                        bits -= 8;
+                        out += static_cast<char>((acc >> bits) & 0xff);
+                    }
+                }
+                return true;
+            }
+
+            void start_upgraded_(const std::vector<std::pair<std::string, std::string>>& fields)
+            {
+                if(!start())
+                {
+                    close();
+                    return;
+                }
+
+                // the upgraded request is stream 1, half-closed: its response goes out over HTTP/2.
+                auto s = new h2_stream(1, initial_send_window_);
+                assert(s);
+                for(auto& f : fields) add_field_(s, f.first, f.second);
+
+                last_stream_id_ = 1;
+                s->remote_closed = true;
+
+                dispatching_ = true;
+                if(build_request_(s)) open_stream_(s, true);
+                else
+                {
+                    delete s;
+                    reset_stream_(1, http2_error::protocol_error);
+                }
+                dispatching_ = false;
+
+                after_dispatch_();
+            }
+
+            void after_read_(const char* data, std::size_t offset, std::size_t length, resval rv)
+            {
+                if(!rv)
+                {
+                    if(rv.code() != error::eof) report_(rv);
+                    close();
+                    return;
+                }
+
+                // frames split across reads are put together in input_
+                util::slice in(data + offset, length);
+                if(!input_.empty())
+                {
+                    input_.append(in.data(), in.size());
+                    in = input_;
+                }
+
+                dispatching_ = true;
+                auto used = process_(in);
+                dispatching_ = false;
+
+                if(input_.empty()) input_.assign(in.data() + used, in.size() - used);
+                else input_.erase(0, used);
+
+                after_dispatch_();
+            }
+
+            void after_dispatch_()
+            {
+                if(closing_)
+                {
+                    close();
+                    return;
+                }
+
+                pump_();
+                flush_();
+                close_if_done_();
+            }
+
+            // parses the complete frames of in; returns the bytes used.
+            std::size_t process_(const util::slice& in)
+            {
+                static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+                std::size_t p = 0;
+                if(!preface_received_)
+                {
+                    auto n = std::min(in.size(), sizeof(preface) - 1);
+                    if(std::memcmp(in.data(), preface, n) != 0)
+                    {
+                        connection_error_(http2_error::protocol_error);
+                        return in.size();
+                    }
+                    if(n < sizeof(preface) - 1) return 0;
+
+                    preface_received_ = true;
+                    p = n;
+                }
+
+                while(!failed_ && !closing_ && in.size() - p >= frame_header_size)
+                {
+                    auto h = reinterpret_cast<const unsigned char*>(in.data() + p);
+                    std::size_t length = (std::size_t(h[0]) << 16) | (std::size_t(h[1]) << 8) | h[2];
+                    auto type = static_cast<http2_frame_type>(h[3]);
+                    uint8_t flags = h[4];
+                    uint32_t id = ((uint32_t(h[5]) << 24) | (uint32_t(h[6]) << 16) | (uint32_t(h[7]) << 8) | h[8]) & 0x7fffffff;
+
+                    // we never raise SETTINGS_MAX_FRAME_SIZE
+                    if(length > default_max_frame_size)
+                    {
+                        connection_error_(http2_error::frame_size_error);
+                        return in.size();
+                    }
+                    if(in.size() - p < frame_header_size + length) break;
+
+                    frame_(type, flags, id, in.substr(p + frame_header_size, length));
+                    p += frame_header_size + length;
+                }
+
+                return failed_ ? in.size() : p;
+            }
+
+            void frame_(http2_frame_type type, uint8_t flags, uint32_t id, util::slice payload)
+            {
+                // the first frame is SETTINGS, and nothing comes between the frames of a header block
+                if(!settings_received_ && type != http2_frame_type::settings) return connection_error_(http2_error::protocol_error);
+                if(continuing_ && (type != http2_frame_type::continuation || id != continuing_)) return connection_error_(http2_error::protocol_error);
+
+                switch(type)
+                {
+                case http2_frame_type::data: return data_frame_(flags, id, payload);
+                case http2_frame_type::headers: return headers_frame_(flags, id, payload);
+                case http2_frame_type::priority:
+                    if(!id) return connection_error_(http2_error::protocol_error);
+                    if(payload.size() != 5) reset_stream_(id, http2_error::frame_size_error);
+                    return;
+                case http2_frame_type::rst_stream: return rst_stream_frame_(id, payload);
+                case http2_frame_type::settings: return settings_frame_(flags, id, payload);
+                case http2_frame_type::push_promise: return connection_error_(http2_error::protocol_error);
+                case http2_frame_type::ping: return ping_frame_(flags, id, payload);
+                case http2_frame_type::goaway:
+                    if(id || payload.size() < 8) return connection_error_(http2_error::protocol_error);
+                    goaway_received_ = true;
+                    return;
+                case http2_frame_type::window_update: return window_update_frame_(id, payload);
+                case http2_frame_type::continuation: return continuation_frame_(flags, id, payload);
+                default:
+                    // unknown frame types are ignored
+                    return;
+                }
+            }
+
+            // strips the padding of a DATA or HEADERS frame; false if malformed.
+            static bool unpad_(uint8_t flags, util::slice& payload)
+            {
+                if(!(flags & flag_padded)) return true;
+                if(payload.empty()) return false;
+
+                std::size_t pad = static_cast<unsigned char>(payload[0]);
+                if(pad >= payload.size()) return false;
+
+                payload = payload.substr(1, payload.size() - 1 - pad);
+                return true;
+            }
+
+            void data_frame_(uint8_t flags, uint32_t id, util::slice payload)
+            {
+                if(!id) return connection_error_(http2_error::protocol_error);
+
+                // flow control counts the whole payload, padding included
+                auto size = static_cast<int64_t>(payload.size());
+                recv_window_ -= size;
+                if(recv_window_ < 0) return connection_error_(http2_error::flow_control_error);
+                if(!unpad_(flags, payload)) return connection_error_(http2_error::protocol_error);
+
+                recv_consumed_ += size;
+                if(recv_consumed_ >= connection_window / 2)
+                {
+                    window_update_(0, recv_consumed_);
+                    recv_window_ += recv_consumed_;
+                    recv_consumed_ = 0;
+                }
+
+                auto s = find_(id);
+                if(!s)
+                {
+                    // a stream we reset may still have frames in flight
+                    if(id > last_stream_id_) connection_error_(http2_error::protocol_error);
+                    return;
+                }
+                if(s->remote_closed) return reset_stream_(id, http2_error::stream_closed);
+
+                s->recv_window -= size;
+                if(s->recv_window < 0) return reset_stream_(id, http2_error::flow_control_error);
+
+                ++s->refs;
+                if(!payload.empty() && s->on_body) s->on_body(payload, resval());
+
+                if(flags & flag_end_stream) end_body_(s);
+                else if(!s->closed)
+                {
+                    s->recv_consumed += size;
+                    if(s->recv_consumed >= stream_window / 2)
+                    {
+                        window_update_(id, s->recv_consumed);
+                        s->recv_window += s->recv_consumed;
+                        s->recv_consumed = 0;
+                    }
+                }
+                release_(s);
+            }
+
+            void headers_frame_(uint8_t flags, uint32_t id, util::slice payload)
+            {
+                if(!id || !(id & 1)) return connection_error_(http2_error::protocol_error);
+                if(!unpad_(flags, payload)) return connection_error_(http2_error::protocol_error);
+
+                if(flags & flag_priority)
+                {
+                    if(payload.size() < 5) return connection_error_(http2_error::protocol_error);
+                    payload = payload.substr(5);
+                }
+
+                header_block_.assign(payload.data(), payload.size());
+                if(flags & flag_end_headers) header_block_complete_(flags, id);
+                else
+                {
+                    continuing_ = id;
+                    continuing_flags_ = flags;
+                }
+            }
+
+            void continuation_frame_(uint8_t flags, uint32_t id, const util::slice& payload)
+            {
+                if(!continuing_) return connection_error_(http2_error::protocol_error);
+
+                header_block_.append(payload.data(), payload.size());
+                if(header_block_.size() > max_header_block) return connection_error_(http2_error::enhance_your_calm);
+
+                if(flags & flag_end_headers)
+                {
+                    continuing_ = 0;
+                    header_block_complete_(continuing_flags_, id);
+                }
+            }
+
+            void header_block_complete_(uint8_t flags, uint32_t id)
+            {
+                auto discard = [](const util::slice&, const util::slice&) {};
+
+                auto s = find_(id);
+                if(s || id <= last_stream_id_)
+                {
+                    // trailers: the decoder state must follow even when the fields are dropped
+                    if(!decoder_.decode(header_block_, discard)) return connection_error_(http2_error::compression_error);
+
+                    if(!s) return connection_error_(http2_error::stream_closed);
+                    if(s->remote_closed) return reset_stream_(id, http2_error::stream_closed);
+                    if(!(flags & flag_end_stream)) return reset_stream_(id, http2_error::protocol_error);
+
+                    ++s->refs;
+                    end_body_(s);
+                    release_(s);
+                    return;
+                }
+
+                last_stream_id_ = id;
+
+                s = new h2_stream(id, initial_send_window_);
+                assert(s);
+
+                // past max_header_list the fields are dropped, but the whole block is decoded: the dynamic table
+                // must stay in step with the peer's.
+                std::size_t list_size = 0;
+                bool decoded = decoder_.decode(header_block_, [s, &list_size](const util::slice& name, const util::slice& value) {
+                    list_size += name.size() + value.size() + 32;
+                    if(list_size <= max_header_list) add_field_(s, name, value);
+                });
+                if(!decoded)
+                {
+                    delete s;
+                    return connection_error_(http2_error::compression_error);
+                }
+                if(list_size > max_header_list)
+                {
+                    delete s;
+                    return reset_stream_(id, http2_error::enhance_your_calm);
+                }
+
+                if(goaway_received_ || streams_.size() >= max_concurrent_streams)
+                {
+                    delete s;
+                    return reset_stream_(id, http2_error::refused_stream);
+                }
+                if(!build_request_(s))
+                {
+                    delete s;
+                    return reset_stream_(id, http2_error::protocol_error);
+                }
+
+                s->remote_closed = (flags & flag_end_stream) != 0;
+                open_stream_(s, s->remote_closed);
+            }
+
+            static void add_field_(h2_stream* s, const util::slice& name, const util::slice& value)
+            {
+                field_ref f { s->fields.size(), name.size(), s->fields.size() + name.size(), value.size() };
+                s->fields.append(name.data(), name.size());
+                s->fields.append(value.data(), value.size());
+                s->field_refs.push_back(f);
+            }
+
+            // fills the request from the decoded fields (8.3.1); false if malformed.
+            static bool build_request_(h2_stream* s)
+            {
+                auto& r = s->request;
+                util::slice authority;
+                bool regular = false;
+
+                for(auto& f : s->field_refs)
+                {
+                    util::slice name(s->fields.data() + f.name, f.name_size);
+                    util::slice value(s->fields.data() + f.value, f.value_size);
+                    if(name.empty()) return false;
+
+                    if(name[0] == ':')
+                    {
+                        // pseudo-headers come first
+                        if(regular) return false;
+
+                        if(name == ":method") r.method_ = value;
+                        else if(name == ":scheme") r.schema_ = value;
+                        else if(name == ":authority") authority = value;
+                        else if(name == ":path")
+                        {
+                            auto q = value.find('?');
+                            r.path_ = value.substr(0, q);
+                            if(q != util::slice::npos) r.query_ = value.substr(q + 1);
+                        }
+                        else return false;
+                        continue;
+                    }
+
+                    regular = true;
+                    for(auto c : name) if(c >= 'A' && c <= 'Z') return false;
+                    if(connection_specific_(name)) return false;
+
+                    r.add_header_(name, value, http_header_lookup(name));
+                }
+
+                if(r.method_.empty() || (r.path_.empty() && r.method_ != "CONNECT")) return false;
+
+                // handlers written for HTTP/1.1 look for Host
+                if(!authority.empty())
+                {
+                    if(!r.has_header(http_header_id::host)) r.add_header_("host", authority, http_header_id::host);
+
+                    auto colon = authority.rfind(':');
+                    if(colon != util::slice::npos && authority.find(']', colon) == util::slice::npos)
+                    {
+                        r.host_ = authority.substr(0, colon);
+                        r.port_ = std::atoi(authority.substr(colon + 1).to_string().c_str());
+                    }
+                    else r.host_ = authority;
+                }
+
+                auto length = r.header(http_header_id::content_length);
+                if(!length.empty())
+                {
+                    int64_t n = 0;
+                    for(auto c : length)
+                    {
+                        if(c < '0' || c > '9' || n > (INT64_MAX - 9) / 10) return false;
+                        n = n * 10 + (c - '0');
+                    }
+                    r.content_length_ = n;
+                }
+
+                r.http_major_ = 2;
+                r.http_minor_ = 0;
+                r.keep_alive_ = true;
+                return true;
+            }
+
+            void open_stream_(h2_stream* s, bool end_stream)
+            {
+                streams_[s->id] = s;
+                if(tracker_) tracker_->set_busy(conn_, true);
+
+                ++s->refs;
+                current_ = s;
+                if(on_request_) on_request_(this, s->id, &s->request);
+                current_ = nullptr;
+
+                if(end_stream) end_body_(s);
+                release_(s);
+            }
+
+            // END_STREAM from the client
+            void end_body_(h2_stream* s)
+            {
+                s->remote_closed = true;
+
+                auto callback = std::move(s->on_body);
+                s->on_body = nullptr;
+                if(callback) callback(util::slice(), resval(error::eof));
+
+                finish_if_done_(s);
+            }
+
+            void cancel_body_(h2_stream* s)
+            {
+                auto callback = std::move(s->on_body);
+                s->on_body = nullptr;
+                if(callback && !s->remote_closed) callback(util::slice(), resval(error::ecanceled));
+            }
+
+            void rst_stream_frame_(uint32_t id, const util::slice& payload)
+            {
+                if(!id || id > last_stream_id_) return connection_error_(http2_error::protocol_error);
+                if(payload.size() != 4) return connection_error_(http2_error::frame_size_error);
+
+                auto s = find_(id);
+                if(!s) return;
+
+                ++s->refs;
+                cancel_body_(s);
+                close_stream_(s);
+                release_(s);
+            }
+
+            void settings_frame_(uint8_t flags, uint32_t id, const util::slice& payload)
+            {
+                if(id) return connection_error_(http2_error::protocol_error);
+
+                if(flags & flag_ack)
+                {
+                    if(!payload.empty()) connection_error_(http2_error::frame_size_error);
+                    return;
+                }
+                if(payload.size() % 6) return connection_error_(http2_error::frame_size_error);
+
+                settings_received_ = true;
+                if(!apply_settings_(payload)) return;
+
+                append_frame_(http2_frame_type::settings, flag_ack, 0, util::slice());
+            }
+
+            bool apply_settings_(const util::slice& payload)
+            {
+                auto p = reinterpret_cast<const unsigned char*>(payload.data());
+                for(std::size_t i=0;i + 6 <= payload.size();i += 6)
+                {
+                    uint16_t key = static_cast<uint16_t>((p[i] << 8) | p[i+1]);
+                    uint32_t value = (uint32_t(p[i+2]) << 24) | (uint32_t(p[i+3]) << 16) | (uint32_t(p[i+4]) << 8) | p[i+5];
+
+                    switch(key)
+                    {
+                    case settings_header_table_size:
+                        encoder_.set_max_table_size(value);
+                        break;
+
+                    case settings_enable_push:
+                        if(value > 1)
+                        {
+                            connection_error_(http2_error::protocol_error);
+                            return false;
+                        }
+                        break;
+
+                    case settings_initial_window_size:
+                    {
+                        if(value > max_window)
+                        {
+                            connection_error_(http2_error::flow_control_error);
+                            return false;
+                        }
+
+                        // applies to the open streams too (6.9.2)
+                        auto delta = static_cast<int64_t>(value) - initial_send_window_;
+                        initial_send_window_ = value;
+                        for(auto& it : streams_)
+                        {
+                            auto s = it.second;
+                            s->send_window += delta;
+                            if(s->send_window > max_window)
+                            {
+                                connection_error_(http2_error::flow_control_error);
+                                return false;
+                            }
+                            if(s->responded && !s->local_closed) queue_(s);
+                        }
+                        break;
+                    }
+
+                    case settings_max_frame_size:
+                        if(value < default_max_frame_size || value > 0xffffff)
+                        {
+                            connection_error_(http2_error::protocol_error);
+                            return false;
+                        }
+                        max_frame_size_ = value;
+                        break;
+
+                    default:
+                        // max concurrent streams (we don't push), max header list size, unknown: ignored
+                        break;
+                    }
+                }
+                return true;
+            }
+
+            void ping_frame_(uint8_t flags, uint32_t id, const util::slice& payload)
+            {
+                if(id) return connection_error_(http2_error::protocol_error);
+                if(payload.size() != 8) return connection_error_(http2_error::frame_size_error);
+
+                if(!(flags & flag_ack)) append_frame_(http2_frame_type::ping, flag_ack, 0, payload);
+            }
+
+            void window_update_frame_(uint32_t id, const util::slice& payload)
+            {
+                if(payload.size() != 4) return connection_error_(http2_error::frame_size_error);
+
+                auto p = reinterpret_cast<const unsigned char*>(payload.data());
+                int64_t increment = ((uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3]) & 0x7fffffff;
+
+                if(!id)
+                {
+                    if(!increment) return connection_error_(http2_error::protocol_error);
+
+                    send_window_ += increment;
+                    if(send_window_ > max_window) connection_error_(http2_error::flow_control_error);
+                    return;
+                }
+
+                auto s = find_(id);
+                if(!s)
+                {
+                    if(id > last_stream_id_) connection_error_(http2_error::protocol_error);
+                    return;
+                }
+                if(!increment) return reset_stream_(id, http2_error::protocol_error);
+
+                s->send_window += increment;
+                if(s->send_window > max_window) return reset_stream_(id, http2_error::flow_control_error);
+
+                if(s->responded && !s->local_closed) queue_(s);
+            }
+
+            void queue_(h2_stream* s)
+            {
+                if(s->queued) return;
+
+                s->queued = true;
+                sending_.push_back(s);
+            }
+
+            // Queues DATA frames, one per stream in turn, as long as the windows and the write watermark allow.
+            void pump_()
+            {
+                while(!sending_.empty() && !failed_ && send_window_ > 0)
+                {
+                    // the rest goes once the next write completes
+                    if(conn_->write_queue_size() + out_.bytes.size() >= write_watermark || out_.segments.size() + 2 > max_segments) break;
+
+                    auto s = sending_.front();
+                    sending_.pop_front();
+
+                    auto body = s->response_body();
+                    auto remaining = static_cast<int64_t>(body.size() - s->body_sent);
+                    auto n = std::min(std::min(remaining, static_cast<int64_t>(max_frame_size_)), std::min(send_window_, s->send_window));
+                    if(n <= 0)
+                    {
+                        // blocked by the stream window: WINDOW_UPDATE queues it again
+                        s->queued = false;
+                        continue;
+                    }
+
+                    bool end = n == remaining;
+                    append_data_(s, body.substr(s->body_sent, static_cast<std::size_t>(n)), end);
+                    s->body_sent += static_cast<std::size_t>(n);
+                    s->send_window -= n;
+                    send_window_ -= n;
+
+                    if(end)
+                    {
+                        s->queued = false;
+                        s->local_closed = true;
+                        finish_if_done_(s);
+                    }
+                    else sending_.push_back(s);
+                }
+            }
+
+            // the stream is done both ways: it leaves streams_ (its body stays until written).
+            void finish_if_done_(h2_stream* s)
+            {
+                if(s->remote_closed && s->local_closed) close_stream_(s);
+            }
+
+            void close_stream_(h2_stream* s)
+            {
+                if(s->closed) return;
+
+                s->closed = true;
+                streams_.erase(s->id);
+                if(s->queued)
+                {
+                    for(auto it = sending_.begin(); it != sending_.end(); ++it) if(*it == s)
+                    {
+                        sending_.erase(it);
+                        break;
+                    }
+                    s->queued = false;
+                }
+
+                if(tracker_ && streams_.empty()) tracker_->set_busy(conn_, false);
+
+                ++s->refs;
+                release_(s);
+            }
+
+            void release_(h2_stream* s)
+            {
+                if(s->refs > 0) --s->refs;
+                if(s->closed && s->refs == 0) delete s;
+            }
+
+            h2_stream* find_(std::size_t id) const
+            {
+                auto it = streams_.find(static_cast<uint32_t>(id));
+                return it == streams_.end() ? nullptr : it->second;
+            }
+
+            // Encodes the head serialized by http_response ("HTTP/1.1 200 OK", then "Name: value" lines): the
+            // status, then the headers with lower-case names, without the HTTP/1.x connection headers.
+            // Sends the head (HTTP/1.1, encoded as a header block) and the body set on the stream. The answer to a
+            // HEAD request keeps the body's Content-Length but not the body.
+            resval respond_(h2_stream* s, const util::slice& head)
+            {
+                s->responded = true;
+                if(s->request.method() == "HEAD")
+                {
+                    s->body.clear();
+                    s->body_ref = util::slice();
+                }
+
+                std::string block;
+                encoder_.begin_block(block);
+                encode_head_(head, block);
+
+                bool end = s->response_body().empty();
+                append_headers_(s->id, block, end);
+
+                if(end)
+                {
+                    s->local_closed = true;
+                    finish_if_done_(s);
+                }
+                else queue_(s);
+
+                if(dispatching_) return resval();
+
+                pump_();
+                resval rv = flush_();
+                close_if_done_();
+                return rv;
+            }
+
+            // the size of the head of a serialized response, up to its empty line (0 if there is none)
+            static std::size_t head_size_(const util::slice& response)
+            {
+                std::size_t i = 0;
+                while((i = response.find('\n', i)) != util::slice::npos)
+                {
+                    ++i;
+                    if(i < response.size() && response[i] == '\n') return i + 1;
+                    if(i + 1 < response.size() && response[i] == '\r' && response[i + 1] == '\n') return i + 2;
+                }
+                return 0;
+            }
+
+            void encode_head_(const util::slice& head, std::string& block)
+            {
+                auto eol = head.find('\n');
+                auto line = head.substr(0, eol);
+                auto sp = line.find(' ');
+                encoder_.encode(block, ":status", line.substr(sp + 1, 3));
+
+                char lower[128];
+                std::size_t i = eol + 1;
+                while(i < head.size())
+                {
+                    auto end = head.find('\n', i);
+                    if(end == util::slice::npos) end = head.size();
+                    line = head.substr(i, end - i);
+                    i = end + 1;
+
+                    if(!line.empty() && line[line.size() - 1] == '\r') line = line.substr(0, line.size() - 1);
+                    auto colon = line.find(':');
+                    if(colon == util::slice::npos || colon > sizeof(lower)) continue;
+
+                    auto name = line.substr(0, colon);
+                    if(connection_specific_(name)) continue;
+
+                    for(std::size_t k=0;k<name.size();++k) lower[k] = static_cast<char>(std::tolower(static_cast<unsigned char>(name[k])));
+
+                    auto value = line.substr(colon + 1);
+                    while(!value.empty() && value[0] == ' ') value = value.substr(1);
+                    encoder_.encode(block, util::slice(lower, name.size()), value);
+                }
+            }
+
+            // HEADERS, then CONTINUATION frames if the block is larger than a frame.
+            void append_headers_(uint32_t id, const std::string& block, bool end_stream)
+            {
+                util::slice rest(block);
+                bool first = true;
+                do
+                {
+                    auto chunk = rest.substr(0, max_frame_size_);
+                    rest = rest.substr(chunk.size());
+
+                    uint8_t flags = rest.empty() ? flag_end_headers : 0;
+                    if(first && end_stream) flags |= flag_end_stream;
+
+                    append_frame_(first ? http2_frame_type::headers : http2_frame_type::continuation, flags, id, chunk);
+                    first = false;
+                }
+                while(!rest.empty());
+            }
+
+            static void frame_header_(char* h, std::size_t length, http2_frame_type type, uint8_t flags, uint32_t id)
+            {
+                h[0] = static_cast<char>(length >> 16);
+                h[1] = static_cast<char>(length >> 8);
+                h[2] = static_cast<char>(length);
+                h[3] = static_cast<char>(type);
+                h[4] = static_cast<char>(flags);
+                h[5] = static_cast<char>(id >> 24);
+                h[6] = static_cast<char>(id >> 16);
+                h[7] = static_cast<char>(id >> 8);
+                h[8] = static_cast<char>(id);
+            }
+
+            void append_bytes_(const char* p, std::size_t n)
+            {
+                auto& segments = out_.segments;
+                if(!segments.empty() && !segments.back().external && segments.back().offset + segments.back().size == out_.bytes.size())
+                    segments.back().size += n;
+                else segments.push_back(write_batch::segment { nullptr, out_.bytes.size(), n });
+
+                out_.bytes.append(p, n);
+            }
+
+            void append_frame_(http2_frame_type type, uint8_t flags, uint32_t id, const util::slice& payload)
+            {
+                char h[frame_header_size];
+                frame_header_(h, payload.size(), type, flags, id);
+                append_bytes_(h, sizeof(h));
+                if(!payload.empty()) append_bytes_(payload.data(), payload.size());
+            }
+
+            // the payload is not copied: the stream is kept until the write completes.
+            void append_data_(h2_stream* s, const util::slice& payload, bool end_stream)
+            {
+                char h[frame_header_size];
+                frame_header_(h, payload.size(), http2_frame_type::data, end_stream ? flag_end_stream : 0, s->id);
+                append_bytes_(h, sizeof(h));
+
+                if(payload.empty()) return;
+
+                out_.segments.push_back(write_batch::segment { payload.data(), 0, payload.size() });
+                ++s->refs;
+                out_.streams.push_back(s);
+            }
+
+            void window_update_(uint32_t id, int64_t increment)
+            {
+                char payload[4];
+                payload[0] = static_cast<char>((increment >> 24) & 0x7f);
+                payload[1] = static_cast<char>(increment >> 16);
+                payload[2] = static_cast<char>(increment >> 8);
+                payload[3] = static_cast<char>(increment);
+                append_frame_(http2_frame_type::window_update, 0, id, util::slice(payload, 4));
+            }
+
+            void send_settings_()
+            {
+                char payload[18];
+                auto put = [&payload](int i, uint16_t key, uint32_t value) {
+                    char* p = payload + 6 * i;
+                    p[0] = static_cast<char>(key >> 8);
+                    p[1] = static_cast<char>(key);
+                    p[2] = static_cast<char>(value >> 24);
+                    p[3] = static_cast<char>(value >> 16);
+                    p[4] = static_cast<char>(value >> 8);
+                    p[5] = static_cast<char>(value);
+                };
+                put(0, settings_max_concurrent_streams, max_concurrent_streams);
+                put(1, settings_initial_window_size, stream_window);
+                put(2, settings_max_header_list_size, max_header_list);
+                append_frame_(http2_frame_type::settings, 0, 0, util::slice(payload, sizeof(payload)));
+
+                // the connection window starts at 65535 whatever the settings say
+                window_update_(0, connection_window - default_window);
+            }
+
+            void reset_stream_(uint32_t id, http2_error code)
+            {
+                char payload[4];
+                auto v = static_cast<uint32_t>(code);
+                payload[0] = static_cast<char>(v >> 24);
+                payload[1] = static_cast<char>(v >> 16);
+                payload[2] = static_cast<char>(v >> 8);
+                payload[3] = static_cast<char>(v);
+                append_frame_(http2_frame_type::rst_stream, 0, id, util::slice(payload, 4));
+
+                auto s = find_(id);
+                if(!s) return;
+
+                ++s->refs;
+                cancel_body_(s);
+                close_stream_(s);
+                release_(s);
+            }
+
+            // GOAWAY, then the connection closes once it is written.
+            void connection_error_(http2_error code)
+            {
+                if(failed_) return;
+
+                char payload[8];
+                auto v = static_cast<uint32_t>(code);
+                payload[0] = static_cast<char>(last_stream_id_ >> 24);
+                payload[1] = static_cast<char>(last_stream_id_ >> 16);
+                payload[2] = static_cast<char>(last_stream_id_ >> 8);
+                payload[3] = static_cast<char>(last_stream_id_);
+                payload[4] = static_cast<char>(v >> 24);
+                payload[5] = static_cast<char>(v >> 16);
+                payload[6] = static_cast<char>(v >> 8);
+                payload[7] = static_cast<char>(v);
+                append_frame_(http2_frame_type::goaway, 0, 0, util::slice(payload, 8));
+
+                failed_ = true;
+                conn_->read_stop();
+                report_(resval(error::eproto));
+            }
+
+            resval flush_()
+            {
+                if(out_.segments.empty()) return resval();
+
+                in_flight_.push_back(std::move(out_));
+                out_ = write_batch();
+
+                // offsets resolve against the batch's own bytes, which no longer move
+                auto& b = in_flight_.back();
+                std::vector<uv_buf_t> bufs;
+                bufs.reserve(b.segments.size());
+                for(auto& s : b.segments)
+                {
+                    auto p = s.external ? s.external : b.bytes.data() + s.offset;
+                    bufs.push_back(uv_buf_t { const_cast<char*>(p), s.size });
+                }
+
+                resval rv = conn_->write(bufs.data(), static_cast<int>(bufs.size()));
+                if(!rv)
+                {
+                    // the connection is done for: close_if_done_() closes it
+                    for(auto s : b.streams) release_(s);
+                    in_flight_.pop_back();
+                    if(!failed_) conn_->read_stop();
+                    failed_ = true;
+                    report_(rv);
+                }
+                return rv;
+            }
+
+            // stream writes complete in the order they were issued.
+            void after_write_(resval rv)
+            {
+                assert(!in_flight_.empty());
+                auto done = std::move(in_flight_.front());
+                in_flight_.pop_front();
+                for(auto s : done.streams) release_(s);
+
+                if(!rv)
+                {
+                    report_(rv);
+                    close();
+                    return;
+                }
+
+                pump_();
+                flush_();
+                close_if_done_();
+            }
+
+            // after a connection error, or a GOAWAY from the client once its streams are answered
+            void close_if_done_()
+            {
+                if(!in_flight_.empty() || !out_.segments.empty()) return;
+                if(failed_ || (goaway_received_ && streams_.empty())) close();
+            }
+
+            void report_(resval rv)
+            {
+                if(on_error_) on_error_(this, rv);
+            }
+
+        private:
+            stream* conn_;
+            server* tracker_;
+            on_request_callback_type on_request_;
+            on_error_callback_type on_error_;
+
+            std::unordered_map<uint32_t, h2_stream*> streams_;
+            std::deque<h2_stream*> sending_;        // streams with response data to send, in turn
+            write_batch out_;                       // frames of the next write
+            std::deque<write_batch> in_flight_;
+            std::string input_;                     // start of a frame split across reads
+
+            hpack_decoder decoder_;
+            hpack_encoder encoder_;
+            std::string header_block_;
+            uint32_t continuing_;                   // stream of a header block waiting for CONTINUATION
+            uint8_t continuing_flags_;
+            h2_stream* current_;                    // stream being dispatched
+
+            uint32_t last_stream_id_;
+            std::size_t max_frame_size_;            // of the frames we send
+            int64_t initial_send_window_;
+            int64_t send_window_;                   // connection windows
+            int64_t recv_window_;
+            int64_t recv_consumed_;
+
+            bool preface_received_;
+            bool settings_received_;
+            bool goaway_received_;
+            bool failed_;                           // GOAWAY sent: closing once written
+            bool dispatching_;
+            bool closing_;
+            bool closed_;                           // closed, waiting for the last release()
+            std::size_t refs_;                      // see retain()
+        };
+    }
+}
+
+#endif
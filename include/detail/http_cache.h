@@ -0,0 +1,488 @@
+#ifndef __DETAIL_HTTP_CACHE_H__
+#define __DETAIL_HTTP_CACHE_H__
+
+#include "base.h"
+#include <map>
+#include <unordered_map>
+#include "http_responder.h"
+#include "timer.h"
+#include "utility.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // Response cache in front of the handlers of a session (see http_responder), keyed by method, host, path
+        // and query. A stored response is the complete serialized response in one pooled buffer that every hit
+        // writes as is: no formatting and no copy. The cache is bounded by bytes and evicts the least recently used
+        // responses.
+        //
+        //     if(!cache.lookup(session, id, r)) handler(session, id, r);      // answers with cache.respond()
+        //
+        // Concurrent misses of a key are coalesced: the first runs the handler and the others wait for its
+        // response. Freshness comes from the response's Cache-Control (s-maxage, then max-age), or else from the
+        // default TTL; "no-store", "no-cache", "private", Set-Cookie and Vary keep a response out of the cache.
+        // Stored responses keep the Date they were produced with. Waiters whose leader has not answered within the
+        // fill timeout get a 503 (Retry-After: 0) instead of waiting for it any longer.
+        class http_cache
+        {
+            struct entry
+            {
+                std::string key;
+                buffer* data;           // nullptr: a pass marker (private responses: no coalescing for the key)
+                util::slice response;
+                int64_t expires;        // loop time
+                std::size_t bytes;
+                util::list_hook<entry> lru_link;
+            };
+
+            typedef util::intrusive_list<entry, &entry::lru_link> list_type;
+
+            struct waiter
+            {
+                http_responder* session;
+                std::size_t id;
+                bool last;
+            };
+
+            // a miss whose handler is running
+            struct fill
+            {
+                std::string key;
+                std::vector<waiter> waiters;
+                timer* deadline;        // started by the first waiter
+            };
+
+            // how long misses of a key whose response was private skip coalescing
+            static const int64_t pass_ms = 10 * 1000;
+
+        public:
+            static const std::size_t default_max_bytes = 64 * 1024 * 1024;
+            static const int64_t default_fill_timeout_ms = 30 * 1000;
+
+            // default_ttl_ms: freshness of a response without max-age (0: such responses are not stored)
+            http_cache(std::size_t max_bytes=default_max_bytes, int64_t default_ttl_ms=0)
+                : max_bytes_(max_bytes)
+                , max_entry_bytes_(max_bytes / 16)
+                , default_ttl_ms_(default_ttl_ms)
+                , fill_timeout_ms_(default_fill_timeout_ms)
+                , bytes_(0)
+                , entries_()
+                , lru_()
+                , fills_()
+                , leaders_()
+                , hits_(0)
+                , misses_(0)
+            {
+                assert(max_bytes_ > 0);
+            }
+
+            ~http_cache()
+            {
+                clear();
+            }
+
+            // no copy allowed
+            http_cache(const http_cache&) = delete;
+            void operator=(const http_cache&) = delete;
+
+            // x10 runs on the default loop: one cache per process.
+            static http_cache& get()
+            {
+                static http_cache cache;
+                return cache;
+            }
+
+            // larger responses are not stored (they still answer the misses coalesced on them)
+            void set_max_entry_bytes(std::size_t bytes) { max_entry_bytes_ = bytes; }
+
+            // how long coalesced misses wait for the response of the first one (milliseconds)
+            void set_fill_timeout(int64_t ms) { fill_timeout_ms_ = ms; }
+
+            // Answers request 'id' from the cache and returns true, or waits for the response of the same key that
+            // is being produced (also true). Returns false if the caller must produce the response: answer it with
+            // respond() below, even if it turns out not to be cacheable.
+            bool lookup(http_responder* session, std::size_t id, const http_parse_result* r)
+            {
+                if(!cacheable_(r)) return false;
+
+                auto key = key_(r);
+
+                auto it = entries_.find(key);
+                if(it != entries_.end())
+                {
+                    auto e = it->second;
+                    if(timer::now() >= e->expires) remove_(e);
+                    else if(!e->data) return false;
+                    else if(!revalidate_(r))
+                    {
+                        lru_.remove(e);
+                        lru_.push_back(e);
+
+                        ++hits_;
+                        session->respond(id, e->data, e->response, !r->keep_alive());
+                        return true;
+                    }
+                }
+
+                ++misses_;
+
+                // the sessions are held until answered: one may close meanwhile.
+                session->retain();
+
+                auto f = fills_.find(key);
+                if(f != fills_.end())
+                {
+                    f->second->waiters.push_back(waiter { session, id, !r->keep_alive() });
+                    if(!f->second->deadline) start_deadline_(f->second);
+                    return true;
+                }
+
+                auto n = new fill();
+                assert(n);
+                n->key = std::move(key);
+
+                fills_[n->key] = n;
+                leaders_[std::make_pair(session, id)] = n;
+                return false;
+            }
+
+            // Answers request 'id' (after a miss of lookup()) and the requests waiting for it, storing the response
+            // if it is cacheable. Requests that did not go through lookup() are answered as by the session.
+            resval respond(http_responder* session, std::size_t id, http_response&& response)
+            {
+                auto it = leaders_.find(std::make_pair(session, id));
+                if(it == leaders_.end()) return session->respond(id, std::move(response));
+
+                auto f = it->second;
+                leaders_.erase(it);
+                stop_deadline_(f);
+                detach_(f);
+
+                // serialized for keep-alive: each request decides whether its connection closes after it.
+                bool last = !response.keep_alive();
+                response.set_keep_alive(true);
+
+                int64_t ttl = 0;
+                bool shared = true;
+                int status = response.status();
+
+                // a HEAD response is stored without its body, as the session would have sent it
+                util::slice data;
+                auto b = serialize_(response, data, f->key.compare(0, 5, "HEAD ") == 0);
+                bool store = freshness_(status, data, ttl, shared);
+
+                if(!shared)
+                {
+                    // private to the leader: the waiters can't have it and must ask again.
+                    set_pass_(f->key);
+                    for(auto& w : f->waiters) busy_(w);
+                }
+                else
+                {
+                    if(store && data.size() <= max_entry_bytes_) store_(f->key, b, data, ttl);
+                    for(auto& w : f->waiters) w.session->respond(w.id, b, data, w.last);
+                }
+
+                resval rv = session->respond(id, b, data, last);
+
+                b->release();
+                session->release();
+                for(auto& w : f->waiters) w.session->release();
+                delete f;
+                return rv;
+            }
+
+            // drops the stored response of a key (the requests already answered from it are not affected).
+            void invalidate(const util::slice& method, const util::slice& host, const util::slice& path, const util::slice& query)
+            {
+                auto it = entries_.find(key_(method, host, path, query));
+                if(it != entries_.end()) remove_(it->second);
+            }
+
+            void clear()
+            {
+                while(!lru_.empty()) remove_(lru_.front());
+            }
+
+            std::size_t size() const { return lru_.size(); }
+            std::size_t bytes() const { return bytes_; }
+            std::size_t max_bytes() const { return max_bytes_; }
+            uint64_t hits() const { return hits_; }
+            uint64_t misses() const { return misses_; }
+
+        private:
+            void start_deadline_(fill* f)
+            {
+                f->deadline = new timer;
+                assert(f->deadline);
+
+                f->deadline->on_timeout([this, f](timer*) { expire_(f); });
+                f->deadline->start(fill_timeout_ms_);
+            }
+
+            static void stop_deadline_(fill* f)
+            {
+                if(!f->deadline) return;
+
+                f->deadline->stop();
+                f->deadline->close();
+                f->deadline = nullptr;
+            }
+
+            // The leader is late: its waiters get a 503 and the next miss of the key starts a new fill. The leader
+            // still answers through respond(), which finds the fill in leaders_ without waiters.
+            void expire_(fill* f)
+            {
+                stop_deadline_(f);
+                detach_(f);
+
+                auto waiters = std::move(f->waiters);
+                f->waiters.clear();
+                for(auto& w : waiters)
+                {
+                    busy_(w);
+                    w.session->release();
+                }
+            }
+
+            // removes the fill from fills_ unless a newer fill of the key (see expire_()) took its place
+            void detach_(fill* f)
+            {
+                auto it = fills_.find(f->key);
+                if(it != fills_.end() && it->second == f) fills_.erase(it);
+            }
+
+            static void busy_(const waiter& w)
+            {
+                http_response busy(503);
+                busy.add_header("Retry-After", "0");
+                busy.set_keep_alive(!w.last);
+                w.session->respond(w.id, std::move(busy));
+            }
+
+            // GET and HEAD without credentials, unless the client forbids storing.
+            static bool cacheable_(const http_parse_result* r)
+            {
+                if(r->method() != "GET" && r->method() != "HEAD") return false;
+                if(r->has_header(http_header_id::authorization)) return false;
+                return !directive_(r->header(http_header_id::cache_control), "no-store");
+            }
+
+            // the client wants a response from the handler (which then refreshes the stored one).
+            static bool revalidate_(const http_parse_result* r)
+            {
+                auto cc = r->header(http_header_id::cache_control);
+                int64_t age = -1;
+                return directive_(cc, "no-cache") || (number_(cc, "max-age", age) && age == 0)
+                    || directive_(r->header(http_header_id::pragma), "no-cache");
+            }
+
+            static std::string key_(const http_parse_result* r)
+            {
+                auto host = r->header(http_header_id::host);
+                return key_(r->method(), host.empty() ? r->host() : host, r->path(), r->query());
+            }
+
+            static std::string key_(const util::slice& method, const util::slice& host, const util::slice& path, const util::slice& query)
+            {
+                std::string key;
+                key.reserve(method.size() + host.size() + path.size() + query.size() + 2);
+                key.append(method.data(), method.size());
+                key += ' ';
+                for(auto c : host) key += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+                key.append(path.data(), path.size());
+                if(!query.empty())
+                {
+                    key += '?';
+                    key.append(query.data(), query.size());
+                }
+                return key;
+            }
+
+            // The whole response in one buffer, with a reference for the caller: the body goes behind the head in
+            // the head's buffer when there is room, or both into a buffer of their size. A head_only response
+            // keeps the Content-Length of its body and leaves the body out.
+            static buffer* serialize_(http_response& response, util::slice& data, bool head_only)
+            {
+                util::slice head;
+                auto b = response.take_head(head);
+                auto body = response.body();
+                if(body.empty() || head_only)
+                {
+                    data = head;
+                    return b;
+                }
+
+                auto offset = static_cast<std::size_t>(head.data() - b->data());
+                if(offset + head.size() + body.size() <= b->capacity())
+                {
+                    std::memcpy(b->data() + offset + head.size(), body.data(), body.size());
+                    data = util::slice(head.data(), head.size() + body.size());
+                    return b;
+                }
+
+                auto whole = http_response::head_pool().acquire(head.size() + body.size());
+                assert(whole);
+                std::memcpy(whole->data(), head.data(), head.size());
+                std::memcpy(whole->data() + head.size(), body.data(), body.size());
+                b->release();
+
+                data = util::slice(whole->data(), head.size() + body.size());
+                return whole;
+            }
+
+            // Whether a serialized response may be stored, and for how long; shared is false if it may not even
+            // answer other requests than its own.
+            bool freshness_(int status, const util::slice& data, int64_t& ttl, bool& shared) const
+            {
+                auto cc = field_(data, "Cache-Control");
+                if(directive_(cc, "private") || !field_(data, "Set-Cookie").empty() || !field_(data, "Vary").empty())
+                {
+                    shared = false;
+                    return false;
+                }
+
+                // heuristically cacheable statuses (RFC 7231, 6.1)
+                switch(status)
+                {
+                case 200: case 203: case 204: case 300: case 301: case 404: case 405: case 410: case 414: case 501:
+                    break;
+                default:
+                    return false;
+                }
+
+                if(directive_(cc, "no-store") || directive_(cc, "no-cache")) return false;
+
+                int64_t age = -1;
+                if(number_(cc, "s-maxage", age) || number_(cc, "max-age", age)) ttl = age * 1000;
+                else ttl = default_ttl_ms_;
+                return ttl > 0;
+            }
+
+            void store_(const std::string& key, buffer* b, const util::slice& data, int64_t ttl)
+            {
+                auto bytes = data.size() + key.size() + sizeof(entry);
+                if(bytes > max_bytes_) return;
+
+                b->retain();
+                insert_(key, b, data, ttl, bytes);
+            }
+
+            void set_pass_(const std::string& key)
+            {
+                insert_(key, nullptr, util::slice(), pass_ms, key.size() + sizeof(entry));
+            }
+
+            void insert_(const std::string& key, buffer* b, const util::slice& data, int64_t ttl, std::size_t bytes)
+            {
+                auto it = entries_.find(key);
+                if(it != entries_.end()) remove_(it->second);
+
+                auto e = new entry { key, b, data, timer::now() + ttl, bytes, util::list_hook<entry>() };
+                assert(e);
+
+                entries_[key] = e;
+                lru_.push_back(e);
+                bytes_ += bytes;
+
+                while(bytes_ > max_bytes_) remove_(lru_.front());
+            }
+
+            void remove_(entry* e)
+            {
+                entries_.erase(e->key);
+                lru_.remove(e);
+                bytes_ -= e->bytes;
+
+                // responses being written hold their own reference.
+                if(e->data) e->data->release();
+                delete e;
+            }
+
+            // value of the first header with this name in a serialized head (empty if absent).
+            static util::slice field_(const util::slice& data, const util::slice& name)
+            {
+                // lines end with CRLF; the status line first, an empty line last
+                auto p = data.find('\n');
+                while(p != util::slice::npos)
+                {
+                    auto begin = p + 1;
+                    p = data.find('\n', begin);
+                    if(p == util::slice::npos || p - begin < 2) break;
+
+                    auto line = data.substr(begin, p - begin - 1);
+                    if(line.size() > name.size() && line[name.size()] == ':' && line.substr(0, name.size()).equals_no_case(name))
+                    {
+                        auto value = line.substr(name.size() + 1);
+                        while(!value.empty() && value[0] == ' ') value = value.substr(1);
+                        return value;
+                    }
+                }
+                return util::slice();
+            }
+
+            // Cache-Control (or Pragma) has this directive, with or without an argument.
+            static bool directive_(const util::slice& value, const util::slice& name)
+            {
+                util::slice arg;
+                return find_directive_(value, name, arg);
+            }
+
+            // the delta-seconds argument of a directive
+            static bool number_(const util::slice& value, const util::slice& name, int64_t& n)
+            {
+                util::slice arg;
+                if(!find_directive_(value, name, arg) || arg.empty()) return false;
+
+                n = 0;
+                for(auto c : arg)
+                {
+                    if(c < '0' || c > '9') return false;
+                    if(n < INT64_MAX / 10000) n = n * 10 + (c - '0');
+                }
+                return true;
+            }
+
+            static bool find_directive_(const util::slice& value, const util::slice& name, util::slice& arg)
+            {
+                std::size_t i = 0;
+                while(i < value.size())
+                {
+                    auto comma = value.find(',', i);
+                    if(comma == util::slice::npos) comma = value.size();
+
+                    auto d = value.substr(i, comma - i);
+                    while(!d.empty() && (d[0] == ' ' || d[0] == '\t')) d = d.substr(1);
+                    while(!d.empty() && (d[d.size()-1] == ' ' || d[d.size()-1] == '\t')) d = d.substr(0, d.size() - 1);
+
+                    auto eq = d.find('=');
+                    auto token = eq == util::slice::npos ? d : d.substr(0, eq);
+                    if(token.equals_no_case(name))
+                    {
+                        arg = eq == util::slice::npos ? util::slice() : d.substr(eq + 1);
+                        if(!arg.empty() && arg[0] == '"' && arg.size() >= 2) arg = arg.substr(1, arg.size() - 2);
+                        return true;
+                    }
+                    i = comma + 1;
+                }
+                return false;
+            }
+
+        private:
+            std::size_t max_bytes_;
+            std::size_t max_entry_bytes_;
+            int64_t default_ttl_ms_;
+            int64_t fill_timeout_ms_;
+            std::size_t bytes_;
+            std::unordered_map<std::string, entry*> entries_;
+            list_type lru_;                 // most recently used at the back
+            std::unordered_map<std::string, fill*> fills_;
+            std::map<std::pair<const http_responder*, std::size_t>, fill*> leaders_;
+            uint64_t hits_;
+            uint64_t misses_;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,726 @@
+#ifndef __DETAIL_HTTP_CLIENT_H__
+#define __DETAIL_HTTP_CLIENT_H__
+
+#include "base.h"
+#include <algorithm>
+#include <unordered_map>
+#include "histogram.h"
+#include "http.h"
+#include "http_response.h"
+#include "tcp.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // Request builder of http_client. The request line and the headers are serialized straight into one pooled
+        // buffer (see http_response); the head and the body then go out with one vectored write.
+        class http_client_request
+        {
+        public:
+            http_client_request(const util::slice& method, const util::slice& target)
+                : head_(nullptr)
+                , head_end_(0)
+                , method_(method.to_string())
+                , has_host_(false)
+                , body_()
+            {
+                auto p = reserve_(method.size() + target.size() + 12);
+
+                std::memcpy(p, method.data(), method.size());
+                p += method.size();
+                *p++ = ' ';
+                std::memcpy(p, target.data(), target.size());
+                p += target.size();
+
+                static const char version[] = " HTTP/1.1\r\n";
+                std::memcpy(p, version, sizeof(version) - 1);
+                p += sizeof(version) - 1;
+
+                head_end_ = p - head_->data();
+            }
+
+            http_client_request(http_client_request&& c)
+                : head_(c.head_)
+                , head_end_(c.head_end_)
+                , method_(std::move(c.method_))
+                , has_host_(c.has_host_)
+                , body_(std::move(c.body_))
+            {
+                c.head_ = nullptr;
+            }
+
+            ~http_client_request()
+            {
+                if(head_) head_->release();
+            }
+
+            // no copy allowed
+            http_client_request(const http_client_request&) = delete;
+            void operator=(const http_client_request&) = delete;
+
+            const std::string& method() const { return method_; }
+
+            // name and value are copied into the head buffer. Without a Host header, the client adds one.
+            void add_header(const util::slice& name, const util::slice& value)
+            {
+                if(name.equals_no_case("Host")) has_host_ = true;
+
+                auto p = reserve_(name.size() + value.size() + 4);
+
+                std::memcpy(p, name.data(), name.size());
+                p += name.size();
+                *p++ = ':';
+                *p++ = ' ';
+                std::memcpy(p, value.data(), value.size());
+                p += value.size();
+                *p++ = '\r';
+                *p++ = '\n';
+
+                head_end_ = p - head_->data();
+            }
+
+            void set_body(std::string body) { body_ = std::move(body); }
+            std::string& body() { return body_; }
+
+            // GET and HEAD without a body may be pipelined, and sent again if the connection is lost before
+            // their response arrives (they are safe and idempotent).
+            bool is_pipelinable() const
+            {
+                return body_.empty() && (method_ == "GET" || method_ == "HEAD");
+            }
+
+            // Completes the head (Host, Content-Length, empty line) and hands its buffer over to the caller (who
+            // releases it). Call it once.
+            buffer* take_head(const util::slice& host, util::slice& head)
+            {
+                if(!has_host_) add_header("Host", host);
+
+                auto p = reserve_(32);
+                if(!body_.empty() || method_ == "POST" || method_ == "PUT")
+                {
+                    p += std::sprintf(p, "Content-Length: %llu\r\n", static_cast<unsigned long long>(body_.size()));
+                }
+                *p++ = '\r';
+                *p++ = '\n';
+                head_end_ = p - head_->data();
+
+                head = util::slice(head_->data(), head_end_);
+
+                auto b = head_;
+                head_ = nullptr;
+                head_end_ = 0;
+                return b;
+            }
+
+        private:
+            // returns room for 'size' more bytes at the end of the head
+            char* reserve_(std::size_t size)
+            {
+                if(!head_)
+                {
+                    head_ = http_response::head_pool().acquire(size);
+                    assert(head_);
+                }
+                else if(head_end_ + size > head_->capacity())
+                {
+                    auto b = http_response::head_pool().acquire(std::max(head_->capacity() * 2, head_end_ + size));
+                    assert(b);
+
+                    std::memcpy(b->data(), head_->data(), head_end_);
+                    head_->release();
+                    head_ = b;
+                }
+                return head_->data() + head_end_;
+            }
+
+        private:
+            buffer* head_;
+            std::size_t head_end_;
+            std::string method_;
+            bool has_host_;
+            std::string body_;
+        };
+
+        // A complete response received by http_client. Unlike http_parse_result it owns its data: the headers are
+        // copied into one string when the head arrives, and the body is accumulated.
+        class http_client_response
+        {
+            friend class http_client;
+
+        public:
+            typedef http_parse_result::header_type header_type;
+            typedef http_parse_result::headers_type headers_type;
+
+            http_client_response()
+                : status_(0)
+                , http_major_(0)
+                , http_minor_(0)
+                , keep_alive_(false)
+                , storage_()
+                , headers_()
+                , body_()
+            {}
+
+            // no copy allowed
+            http_client_response(const http_client_response&) = delete;
+            void operator=(const http_client_response&) = delete;
+
+            int status() const { return status_; }
+            unsigned short http_major() const { return http_major_; }
+            unsigned short http_minor() const { return http_minor_; }
+            bool keep_alive() const { return keep_alive_; }
+
+            const headers_type& headers() const { return headers_; }
+
+            // case-insensitive lookup of the first header with this name (empty if absent).
+            util::slice header(const util::slice& name) const
+            {
+                for(auto& h : headers_) if(h.first.equals_no_case(name)) return h.second;
+                return util::slice();
+            }
+
+            const std::string& body() const { return body_; }
+            std::string& body() { return body_; }
+
+        private:
+            void assign_head_(const http_parse_result* r)
+            {
+                status_ = r->status_code();
+                http_major_ = r->http_major();
+                http_minor_ = r->http_minor();
+                keep_alive_ = r->keep_alive() && !r->upgrade();
+
+                // one allocation: the slices stay valid since storage_ never grows past the reserved size.
+                std::size_t size = 0;
+                for(auto& h : r->headers()) size += h.first.size() + h.second.size();
+                storage_.clear();
+                storage_.reserve(size);
+                headers_.clear();
+                headers_.reserve(r->headers().size());
+
+                for(auto& h : r->headers())
+                {
+                    auto name = storage_.size();
+                    storage_.append(h.first.data(), h.first.size());
+                    auto value = storage_.size();
+                    storage_.append(h.second.data(), h.second.size());
+
+                    headers_.push_back(std::make_pair(util::slice(storage_.data() + name, h.first.size()),
+                        util::slice(storage_.data() + value, h.second.size())));
+                }
+
+                body_.clear();
+                if(r->content_length() > 0) body_.reserve(static_cast<std::size_t>(r->content_length()));
+            }
+
+        private:
+            int status_;
+            unsigned short http_major_;
+            unsigned short http_minor_;
+            bool keep_alive_;
+            std::string storage_;
+            headers_type headers_;
+            std::string body_;
+        };
+
+        struct http_client_options
+        {
+            http_client_options()
+                : max_connections_per_host(8)
+                , max_pipeline(4)
+                , connect_timeout(5000)
+            {}
+
+            std::size_t max_connections_per_host;
+            std::size_t max_pipeline;   // requests in flight on one connection (1: no pipelining)
+            int64_t connect_timeout;    // milliseconds (0: the kernel's own timeout)
+        };
+
+        // Counters of one host ("ip:port") of http_client.
+        struct http_client_host_stats
+        {
+            http_client_host_stats()
+                : requests(0)
+                , failures(0)
+                , retries(0)
+                , connections(0)
+                , latency()
+            {}
+
+            uint64_t requests;
+            uint64_t failures;
+            uint64_t retries;           // requests sent again after their connection was lost
+            uint64_t connections;       // connections opened
+            histogram latency;          // microseconds from the write of a request to its complete response
+        };
+
+        // Asynchronous HTTP/1.1 client. Each host has a pool of keep-alive connections: a request goes to an idle
+        // connection, else to a new one (up to max_connections_per_host), else is pipelined behind the requests of
+        // a connection known to stay open (GET and HEAD only, up to max_pipeline), else waits for a connection.
+        // Responses are parsed by http_parser (HTTP_RESPONSE) over the read buffers, and copied only into the
+        // http_client_response handed to the callback.
+        // Hosts are addressed by IP: name resolution is left to the caller.
+        class http_client
+        {
+        public:
+            typedef std::function<void(const http_client_response*, resval)> response_callback_type;
+
+        private:
+            struct connection;
+            struct host_pool;
+
+            // a request from its submission to its response
+            struct exchange
+            {
+                exchange(bool pipelinable, bool head_method, response_callback_type callback)
+                    : head(nullptr)
+                    , head_data()
+                    , body()
+                    , pipelinable(pipelinable)
+                    , head_method(head_method)
+                    , written(false)
+                    , done(false)
+                    , retries(0)
+                    , sent_at(0)
+                    , callback(callback)
+                    , response()
+                {}
+
+                buffer* head;
+                util::slice head_data;
+                std::string body;
+                bool pipelinable;
+                bool head_method;
+                bool written;           // the write completed (or can't complete any more)
+                bool done;              // the callback has been invoked
+                unsigned retries;
+                uint64_t sent_at;       // 0 until sent
+                response_callback_type callback;
+                http_client_response response;
+            };
+
+            struct connection
+            {
+                connection(http_client* client, host_pool* pool)
+                    : client(client)
+                    , pool(pool)
+                    , conn(nullptr)
+                    , parser(HTTP_RESPONSE, [this](const http_parse_result* r, resval rv) { this->client->after_parse_(this, r, rv); },
+                        true, http_parser_backend::state_machine)
+                    , in_flight()
+                    , writes()
+                    , connected(false)
+                    , reusable(true)
+                    , parsing(false)
+                    , closed(false)
+                    , error()
+                {}
+
+                http_client* client;
+                host_pool* pool;
+                tcp* conn;
+                http_parser_context parser;
+                std::deque<exchange*> in_flight;    // written, waiting for their response
+                std::deque<exchange*> writes;       // waiting for their write to complete
+                bool connected;
+                bool reusable;                      // every response so far kept the connection open
+                bool parsing;                       // inside feed_data(): deleted once it returns
+                bool closed;
+                resval error;                       // why the connection ends
+            };
+
+            struct host_pool
+            {
+                std::string ip;
+                int port;
+                std::string host;                   // Host header
+                std::vector<connection*> connections;
+                std::size_t connecting;
+                std::deque<exchange*> waiting;
+                http_client_host_stats stats;
+            };
+
+        public:
+            http_client(const http_client_options& options=http_client_options())
+                : options_(options)
+                , pools_()
+            {
+                assert(options_.max_connections_per_host > 0 && options_.max_pipeline > 0);
+            }
+
+            ~http_client()
+            {
+                close();
+                for(auto& p : pools_) delete p.second;
+            }
+
+            // no copy allowed
+            http_client(const http_client&) = delete;
+            void operator=(const http_client&) = delete;
+
+            // Sends the request to ip:port. The callback receives the response, or nullptr and the error; it may
+            // be invoked before request() returns if no connection can be opened.
+            resval request(const std::string& ip, int port, http_client_request&& request, response_callback_type callback)
+            {
+                if(!callback || get_ip_version(ip) == 0) return resval(error::einval);
+
+                auto p = pool_(ip, port);
+
+                auto x = new exchange(request.is_pipelinable(), request.method() == "HEAD", callback);
+                assert(x);
+
+                x->head = request.take_head(p->host, x->head_data);
+                x->body = std::move(request.body());
+
+                ++p->stats.requests;
+                p->waiting.push_back(x);
+                dispatch_(p);
+                return resval();
+            }
+
+            // closes every connection: requests waiting or in flight fail with error::ecanceled.
+            void close()
+            {
+                for(auto& it : pools_)
+                {
+                    auto p = it.second;
+                    while(!p->connections.empty()) close_connection_(p->connections.back(), resval(error::ecanceled), false);
+
+                    while(!p->waiting.empty())
+                    {
+                        auto x = p->waiting.front();
+                        p->waiting.pop_front();
+                        fail_(p, x, resval(error::ecanceled));
+                    }
+                }
+            }
+
+            // stats of ip:port (nullptr if no request was made to it)
+            const http_client_host_stats* stats(const std::string& ip, int port) const
+            {
+                auto it = pools_.find(key_(ip, port));
+                return it == pools_.end() ? nullptr : &it->second->stats;
+            }
+
+            // f(host, stats) for every host
+            template<typename F>
+            void for_each_host(F f) const
+            {
+                for(auto& p : pools_) f(p.first, p.second->stats);
+            }
+
+            const http_client_options& options() const { return options_; }
+
+        private:
+            static std::string key_(const std::string& ip, int port)
+            {
+                return (get_ip_version(ip) == 6 ? "[" + ip + "]" : ip) + ":" + std::to_string(port);
+            }
+
+            host_pool* pool_(const std::string& ip, int port)
+            {
+                auto key = key_(ip, port);
+
+                auto it = pools_.find(key);
+                if(it != pools_.end()) return it->second;
+
+                auto p = new host_pool { ip, port, port == 80 ? key.substr(0, key.rfind(':')) : key,
+                    std::vector<connection*>(), 0, std::deque<exchange*>(), http_client_host_stats() };
+                assert(p);
+
+                pools_[key] = p;
+                return p;
+            }
+
+            // sends the waiting requests: to an idle connection, a new one, or behind pipelined ones.
+            void dispatch_(host_pool* p)
+            {
+                while(!p->waiting.empty())
+                {
+                    auto x = p->waiting.front();
+
+                    auto c = pick_(p, x, false);
+                    if(!c && p->connecting < p->waiting.size() && p->connections.size() < options_.max_connections_per_host)
+                    {
+                        // a failure to connect fails the waiting requests, if no other connection is left
+                        if(open_(p)) continue;
+                        break;
+                    }
+                    if(!c) c = pick_(p, x, true);
+                    if(!c) break;
+
+                    p->waiting.pop_front();
+                    send_(c, x);
+                }
+            }
+
+            connection* pick_(host_pool* p, exchange* x, bool pipeline)
+            {
+                connection* best = nullptr;
+                for(auto c : p->connections)
+                {
+                    if(!c->connected || !c->reusable || c->parser.is_finished()) continue;
+
+                    if(c->in_flight.empty()) return c;
+                    if(!pipeline || !x->pipelinable || c->in_flight.size() >= options_.max_pipeline) continue;
+
+                    // nothing may be queued behind a request that isn't pipelinable.
+                    if(!c->in_flight.back()->pipelinable) continue;
+
+                    // a connection that has answered already is known to stay open.
+                    if(c->parser.messages() == 0) continue;
+
+                    if(!best || c->in_flight.size() < best->in_flight.size()) best = c;
+                }
+                return best;
+            }
+
+            // fails if the connection failed right away
+            resval open_(host_pool* p)
+            {
+                auto c = new connection(this, p);
+                assert(c);
+
+                c->conn = new tcp;
+                assert(c->conn);
+
+                c->conn->on_complete([this, c](resval rv) {
+                    if(!c->connected) after_connect_(c, rv);
+                    else after_write_(c, rv);
+                });
+
+                p->connections.push_back(c);
+                ++p->connecting;
+                ++p->stats.connections;
+
+                resval rv = c->conn->connect(p->ip, p->port, options_.connect_timeout);
+                if(!rv) after_connect_(c, rv);
+                return rv;
+            }
+
+            void after_connect_(connection* c, resval rv)
+            {
+                auto p = c->pool;
+
+                if(rv)
+                {
+                    c->conn->set_no_delay(true);
+
+                    c->conn->on_read([this, c](const char* data, std::size_t offset, std::size_t length, stream*, resval rv) {
+                        after_read_(c, data, offset, length, rv);
+                    });
+                    rv = c->conn->read_start();
+                }
+
+                if(!rv)
+                {
+                    close_connection_(c, rv, false);
+
+                    // nothing can be sent to this host for now
+                    if(p->connections.empty())
+                    {
+                        while(!p->waiting.empty())
+                        {
+                            auto x = p->waiting.front();
+                            p->waiting.pop_front();
+                            fail_(p, x, rv);
+                        }
+                    }
+                    return;
+                }
+
+                c->connected = true;
+                --p->connecting;
+                dispatch_(p);
+            }
+
+            void send_(connection* c, exchange* x)
+            {
+                x->written = false;
+                x->sent_at = uv_hrtime();
+                c->in_flight.push_back(x);
+                c->writes.push_back(x);
+
+                uv_buf_t bufs[2];
+                int count = 0;
+                bufs[count++] = uv_buf_t { const_cast<char*>(x->head_data.data()), x->head_data.size() };
+                if(!x->body.empty()) bufs[count++] = uv_buf_t { const_cast<char*>(x->body.data()), x->body.size() };
+
+                resval rv = c->conn->write(bufs, count);
+                if(!rv)
+                {
+                    c->writes.pop_back();
+                    x->written = true;
+                    close_connection_(c, rv, true);
+                }
+            }
+
+            // stream writes complete in the order they were issued.
+            void after_write_(connection* c, resval rv)
+            {
+                assert(!c->writes.empty());
+                auto x = c->writes.front();
+                c->writes.pop_front();
+
+                x->written = true;
+                if(x->done) delete_(x);
+
+                if(!rv) close_connection_(c, rv, true);
+            }
+
+            void after_read_(connection* c, const char* data, std::size_t offset, std::size_t length, resval rv)
+            {
+                // callbacks may close the connection (or the client) from within the parser.
+                c->parsing = true;
+
+                bool finished = true;
+                if(rv) finished = c->parser.feed_data(data, offset, length, c->conn->read_buffer());
+                else
+                {
+                    if(rv.code() != error::eof) c->error = rv;
+
+                    // the end of the connection may end a response (no Content-Length and not chunked).
+                    c->reusable = false;
+                    c->parser.feed_eof();
+                }
+
+                c->parsing = false;
+                if(c->closed)
+                {
+                    delete c;
+                    return;
+                }
+
+                if(finished || !c->error) close_connection_(c, c->error ? resval(error::econnreset) : c->error, true);
+            }
+
+            // invoked by the parser, with the head of a response or the error that ended the connection.
+            void after_parse_(connection* c, const http_parse_result* r, resval rv)
+            {
+                if(c->closed) return;
+
+                if(!r)
+                {
+                    c->error = rv;
+                    return;
+                }
+
+                auto status = r->status_code();
+                if(c->in_flight.empty())
+                {
+                    // unsolicited response: the connection is out of sync
+                    c->error = resval(error::eproto);
+                    c->reusable = false;
+                    c->parser.abort(c->error);
+                    return;
+                }
+
+                // interim response (100 Continue, 103 Early Hints): the final one follows.
+                if(status >= 100 && status < 200 && status != 101)
+                {
+                    c->parser.skip_body();
+                    return;
+                }
+
+                auto x = c->in_flight.front();
+                x->response.assign_head_(r);
+                if(!x->response.keep_alive()) c->reusable = false;
+
+                if(x->head_method || status == 204 || status == 304) c->parser.skip_body();
+
+                c->parser.on_body([this, c, x](const util::slice& data, resval rv) {
+                    if(c->closed) return;
+
+                    if(rv) x->response.body_.append(data.data(), data.size());
+                    else if(rv.code() == error::eof) complete_(c, x);
+
+                    // other errors: the connection fails (see after_read_())
+                });
+            }
+
+            void complete_(connection* c, exchange* x)
+            {
+                auto p = c->pool;
+
+                assert(!c->in_flight.empty() && c->in_flight.front() == x);
+                c->in_flight.pop_front();
+
+                p->stats.latency.record((uv_hrtime() - x->sent_at) / 1000);
+
+                // the callback may close the client, which deletes x if its write is still pending.
+                bool written = x->written;
+                x->done = true;
+                x->callback(&x->response, resval());
+                if(written) delete_(x);
+
+                // more requests may go to this connection now (unless it is about to close, see after_read_()).
+                dispatch_(p);
+            }
+
+            // Closes a connection. Requests in flight are sent again on another connection when that is safe
+            // (once per request), and fail otherwise.
+            void close_connection_(connection* c, resval rv, bool redispatch)
+            {
+                if(c->closed) return;
+                c->closed = true;
+
+                auto p = c->pool;
+                if(!c->connected) --p->connecting;
+                p->connections.erase(std::find(p->connections.begin(), p->connections.end(), c));
+
+                c->conn->on_read(nullptr);
+                c->conn->on_complete(nullptr);
+                c->conn->close();
+
+                // libuv won't touch the data of pending writes once the socket is closed.
+                for(auto x : c->writes)
+                {
+                    x->written = true;
+                    if(x->done) delete_(x);
+                }
+                c->writes.clear();
+
+                // back to the front of the queue, in their order
+                for(auto i=c->in_flight.rbegin();i!=c->in_flight.rend();++i)
+                {
+                    auto x = *i;
+                    if(redispatch && x->pipelinable && x->retries == 0)
+                    {
+                        ++x->retries;
+                        ++p->stats.retries;
+                        p->waiting.push_front(x);
+                    }
+                    else fail_(p, x, rv);
+                }
+                c->in_flight.clear();
+
+                // within the parser: deleted by after_read_()
+                if(!c->parsing) delete c;
+
+                if(redispatch) dispatch_(p);
+            }
+
+            void fail_(host_pool* p, exchange* x, resval rv)
+            {
+                ++p->stats.failures;
+
+                x->done = true;
+                x->callback(nullptr, rv);
+                if(x->written || !x->sent_at) delete_(x);
+            }
+
+            static void delete_(exchange* x)
+            {
+                if(x->head) x->head->release();
+                delete x;
+            }
+
+        private:
+            http_client_options options_;
+            std::unordered_map<std::string, host_pool*> pools_;
+        };
+    }
+}
+
+#endif
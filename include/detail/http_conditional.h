@@ -0,0 +1,290 @@
+#ifndef __DETAIL_HTTP_CONDITIONAL_H__
+#define __DETAIL_HTTP_CONDITIONAL_H__
+
+#include "base.h"
+#include <ctime>
+#include <unordered_map>
+#include <sys/stat.h>
+#include "http_responder.h"
+#include "timer.h"
+#include "utility.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // Validators (ETag, Last-Modified) of resources by key, and the conditional GET/HEAD they answer with a
+        // 304 before the handler runs: a revalidation costs one lookup and the write of a pre-serialized 304,
+        // without opening or even stat()ing a file.
+        //
+        //     if(!validators.serve(session, id, r, key)) handler(session, id, r);     // which calls set()
+        //
+        // Validators are trusted for revalidate_ms after they were set; past that serve() leaves the request to
+        // the handler, which sets them again (those of set_file() are refreshed by one stat() instead).
+        class http_conditional
+        {
+            struct entry
+            {
+                std::string key;
+                std::string path;           // set_file(): refreshed from stat()
+                std::string etag;           // quoted (W/ if weak), or empty
+                std::time_t last_modified;  // 0: none
+                int64_t checked;            // loop time of the last set
+                buffer* response;           // the 304, serialized on first use
+                util::slice response_data;
+                util::list_hook<entry> lru_link;
+            };
+
+            typedef util::intrusive_list<entry, &entry::lru_link> list_type;
+
+        public:
+            static const std::size_t default_max_entries = 4096;
+            static const int64_t default_revalidate_ms = 1000;
+
+            http_conditional(std::size_t max_entries=default_max_entries, int64_t revalidate_ms=default_revalidate_ms)
+                : max_entries_(max_entries)
+                , revalidate_ms_(revalidate_ms)
+                , entries_()
+                , lru_()
+                , hits_(0)
+            {
+                assert(max_entries_ > 0);
+            }
+
+            ~http_conditional()
+            {
+                clear();
+            }
+
+            // no copy allowed
+            http_conditional(const http_conditional&) = delete;
+            void operator=(const http_conditional&) = delete;
+
+            // x10 runs on the default loop: one set of validators per process.
+            static http_conditional& get()
+            {
+                static http_conditional validators;
+                return validators;
+            }
+
+            // strong validator of a representation: a 64-bit FNV-1a of its bytes, quoted.
+            static std::string strong_etag(const util::slice& content)
+            {
+                uint64_t h = 14695981039346656037ULL;
+                for(auto c : content)
+                {
+                    h ^= static_cast<unsigned char>(c);
+                    h *= 1099511628211ULL;
+                }
+
+                char etag[24];
+                int n = std::snprintf(etag, sizeof(etag), "\"%016llx\"", static_cast<unsigned long long>(h));
+                return std::string(etag, n);
+            }
+
+            // weak validator from file metadata: W/"<size>-<mtime>" in hex.
+            static std::string weak_etag(int64_t size, std::time_t mtime)
+            {
+                char etag[48];
+                int n = std::snprintf(etag, sizeof(etag), "W/\"%llx-%llx\"", static_cast<unsigned long long>(size), static_cast<unsigned long long>(mtime));
+                return std::string(etag, n);
+            }
+
+            // Sets the validators of a resource: etag quoted (empty: none), last_modified (0: none).
+            void set(const util::slice& key, const util::slice& etag, std::time_t last_modified)
+            {
+                auto e = find_or_add_(key);
+                update_(e, etag, last_modified);
+            }
+
+            // validators of a representation held in memory
+            void set_content(const util::slice& key, const util::slice& content, std::time_t last_modified=0)
+            {
+                set(key, strong_etag(content), last_modified);
+            }
+
+            // Weak validators of a file from its size and mtime; stat() again when they are due for revalidation.
+            resval set_file(const util::slice& key, const std::string& path)
+            {
+                struct stat st;
+                if(::stat(path.c_str(), &st) != 0)
+                {
+                    invalidate(key);
+                    return get_sys_error(errno);
+                }
+
+                auto e = find_or_add_(key);
+                e->path = path;
+                update_(e, weak_etag(st.st_size, st.st_mtime), st.st_mtime);
+                return resval();
+            }
+
+            void invalidate(const util::slice& key)
+            {
+                auto it = entries_.find(key.to_string());
+                if(it != entries_.end()) remove_(it->second);
+            }
+
+            void clear()
+            {
+                while(!lru_.empty()) remove_(lru_.front());
+            }
+
+            // Answers request 'id' with a 304 and returns true if it is a GET or a HEAD whose preconditions show that
+            // the client's copy is current; false leaves it to the caller.
+            bool serve(http_responder* session, std::size_t id, const http_parse_result* r, const util::slice& key)
+            {
+                if(!r->has_header(http_header_id::if_none_match) && !r->has_header(http_header_id::if_modified_since)) return false;
+                if(r->method() != "GET" && r->method() != "HEAD") return false;
+
+                auto it = entries_.find(key.to_string());
+                if(it == entries_.end()) return false;
+
+                auto e = it->second;
+                if(timer::now() - e->checked >= revalidate_ms_ && !refresh_(e)) return false;
+                if(!not_modified(r, e->etag, e->last_modified)) return false;
+
+                lru_.remove(e);
+                lru_.push_back(e);
+
+                ++hits_;
+                session->respond(id, response_(e), e->response_data, !r->keep_alive());
+                return true;
+            }
+
+            // Evaluates If-None-Match (weak comparison, RFC 7232 3.2), or else If-Modified-Since, against validators.
+            static bool not_modified(const http_parse_result* r, const util::slice& etag, std::time_t last_modified)
+            {
+                auto inm = r->header(http_header_id::if_none_match);
+                if(!inm.empty())
+                {
+                    if(inm == "*") return true;
+                    return !etag.empty() && list_contains_(inm, opaque_(etag));
+                }
+
+                auto ims = r->header(http_header_id::if_modified_since);
+                std::time_t since;
+                return last_modified && !ims.empty() && http_date::parse(ims, since) && last_modified <= since;
+            }
+
+            std::size_t size() const { return lru_.size(); }
+            uint64_t hits() const { return hits_; }
+
+        private:
+            entry* find_or_add_(const util::slice& key)
+            {
+                auto k = key.to_string();
+                auto it = entries_.find(k);
+                if(it != entries_.end())
+                {
+                    lru_.remove(it->second);
+                    lru_.push_back(it->second);
+                    return it->second;
+                }
+
+                if(lru_.size() >= max_entries_) remove_(lru_.front());
+
+                auto e = new entry { std::move(k), std::string(), std::string(), 0, 0, nullptr, util::slice(), util::list_hook<entry>() };
+                assert(e);
+                entries_[e->key] = e;
+                lru_.push_back(e);
+                return e;
+            }
+
+            void update_(entry* e, const util::slice& etag, std::time_t last_modified)
+            {
+                e->checked = timer::now();
+                if(etag == e->etag && last_modified == e->last_modified) return;
+
+                e->etag = etag.to_string();
+                e->last_modified = last_modified;
+                drop_response_(e);
+            }
+
+            // validators of set_file() past their time: one stat()
+            bool refresh_(entry* e)
+            {
+                if(e->path.empty()) return false;
+
+                struct stat st;
+                if(::stat(e->path.c_str(), &st) != 0)
+                {
+                    remove_(e);
+                    return false;
+                }
+                update_(e, weak_etag(st.st_size, st.st_mtime), st.st_mtime);
+                return true;
+            }
+
+            // The 304 of an entry. It carries the validators (RFC 7232 4.1) and a Date: it is serialized again once
+            // that Date is not the current one.
+            buffer* response_(entry* e)
+            {
+                auto line = http_status_lines::get().line(304);
+                auto date = http_date::get().header();
+                if(e->response && e->response_data.substr(line.size(), date.size()) == date) return e->response;
+
+                drop_response_(e);
+
+                char last_modified[32];
+                http_response res(304);
+                if(!e->etag.empty()) res.add_header("ETag", e->etag);
+                if(e->last_modified) res.add_header("Last-Modified", util::slice(last_modified, http_date::format(e->last_modified, last_modified, sizeof(last_modified))));
+
+                e->response = res.take_head(e->response_data);
+                return e->response;
+            }
+
+            static void drop_response_(entry* e)
+            {
+                if(e->response) e->response->release();
+                e->response = nullptr;
+                e->response_data = util::slice();
+            }
+
+            void remove_(entry* e)
+            {
+                lru_.remove(e);
+                entries_.erase(e->key);
+                drop_response_(e);
+                delete e;
+            }
+
+            // the quoted part of an entity tag (without W/)
+            static util::slice opaque_(const util::slice& etag)
+            {
+                return etag.size() > 2 && etag[0] == 'W' && etag[1] == '/' ? etag.substr(2) : etag;
+            }
+
+            // whether a comma-separated list of entity tags holds tag (weakly)
+            static bool list_contains_(const util::slice& list, const util::slice& tag)
+            {
+                std::size_t i = 0;
+                while(i < list.size())
+                {
+                    while(i < list.size() && (list[i] == ' ' || list[i] == '\t' || list[i] == ',')) ++i;
+
+                    auto start = i;
+                    if(i + 1 < list.size() && list[i] == 'W' && list[i+1] == '/') i += 2;
+                    if(i >= list.size() || list[i] != '"') return false;
+
+                    auto end = list.find('"', i + 1);
+                    if(end == util::slice::npos) return false;
+
+                    if(opaque_(list.substr(start, end + 1 - start)) == tag) return true;
+                    i = end + 1;
+                }
+                return false;
+            }
+
+        private:
+            std::size_t max_entries_;
+            int64_t revalidate_ms_;
+            std::unordered_map<std::string, entry*> entries_;
+            list_type lru_;
+            uint64_t hits_;
+        };
+    }
+}
+
+#endif
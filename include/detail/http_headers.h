@@ -0,0 +1,220 @@
+#ifndef __DETAIL_HTTP_HEADERS_H__
+#define __DETAIL_HTTP_HEADERS_H__
+
+#include "base.h"
+#include "utility.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // Well-known header names: the parser interns them, and keeps their values in a fixed array.
+        enum class http_header_id
+        {
+            accept,
+            accept_charset,
+            accept_encoding,
+            accept_language,
+            accept_ranges,
+            age,
+            allow,
+            authorization,
+            cache_control,
+            connection,
+            content_disposition,
+            content_encoding,
+            content_language,
+            content_length,
+            content_location,
+            content_range,
+            content_type,
+            cookie,
+            date,
+            etag,
+            expect,
+            expires,
+            forwarded,
+            from,
+            host,
+            http2_settings,
+            if_match,
+            if_modified_since,
+            if_none_match,
+            if_range,
+            if_unmodified_since,
+            keep_alive,
+            last_modified,
+            location,
+            origin,
+            pragma,
+            proxy_authorization,
+            range,
+            referer,
+            retry_after,
+            sec_websocket_accept,
+            sec_websocket_extensions,
+            sec_websocket_key,
+            sec_websocket_protocol,
+            sec_websocket_version,
+            server,
+            set_cookie,
+            te,
+            trailer,
+            transfer_encoding,
+            upgrade,
+            user_agent,
+            vary,
+            via,
+            www_authenticate,
+            x_forwarded_for,
+            x_forwarded_host,
+            x_forwarded_proto,
+            x_real_ip,
+            x_request_id,
+            x_requested_with,
+
+            unknown     // also the number of well-known headers
+        };
+
+        static const std::size_t http_known_header_count = static_cast<std::size_t>(http_header_id::unknown);
+
+        /**
+         *  Maps a header name (any case) to its http_header_id with one hash and one comparison.
+         *  The hash below is perfect over the well-known names (the constants were searched for offline,
+         *  the constructor asserts there is no collision), so a name only needs to be compared with the one
+         *  candidate in its slot.
+         */
+        class http_header_table
+        {
+            static const std::size_t table_size = 256;
+
+        public:
+            static const http_header_table& get()
+            {
+                static http_header_table table;
+                return table;
+            }
+
+            http_header_id lookup(const util::slice& name) const
+            {
+                if(name.size() < 2) return http_header_id::unknown;
+
+                auto slot = slots_[hash_(name)];
+                if(slot == 0 || !name.equals_no_case(names_[slot - 1])) return http_header_id::unknown;
+                return static_cast<http_header_id>(slot - 1);
+            }
+
+            // canonical spelling of a well-known header name
+            static util::slice name(http_header_id id)
+            {
+                if(id == http_header_id::unknown) return util::slice();
+                return get().names_[static_cast<std::size_t>(id)];
+            }
+
+        private:
+            http_header_table()
+                : slots_()
+            {
+                for(std::size_t i=0;i<http_known_header_count;++i)
+                {
+                    names_[i] = names()[i];
+
+                    auto h = hash_(names_[i]);
+                    assert(slots_[h] == 0);
+                    slots_[h] = static_cast<unsigned char>(i + 1);
+                }
+            }
+
+            static std::size_t hash_(const util::slice& name)
+            {
+                auto n = name.size();
+                return (n * 55 + fold_(name[0]) * 99 + fold_(name[n - 1]) + fold_(name[n - 2]) * 3) & (table_size - 1);
+            }
+
+            // ASCII case folding: good enough to hash (the comparison is exact)
+            static std::size_t fold_(char c) { return static_cast<unsigned char>(c) | 0x20; }
+
+            static const char* const* names()
+            {
+                // same order as http_header_id
+                static const char* const names[] =
+                {
+                    "Accept",
+                    "Accept-Charset",
+                    "Accept-Encoding",
+                    "Accept-Language",
+                    "Accept-Ranges",
+                    "Age",
+                    "Allow",
+                    "Authorization",
+                    "Cache-Control",
+                    "Connection",
+                    "Content-Disposition",
+                    "Content-Encoding",
+                    "Content-Language",
+                    "Content-Length",
+                    "Content-Location",
+                    "Content-Range",
+                    "Content-Type",
+                    "Cookie",
+                    "Date",
+                    "ETag",
+                    "Expect",
+                    "Expires",
+                    "Forwarded",
+                    "From",
+                    "Host",
+                    "HTTP2-Settings",
+                    "If-Match",
+                    "If-Modified-Since",
+                    "If-None-Match",
+                    "If-Range",
+                    "If-Unmodified-Since",
+                    "Keep-Alive",
+                    "Last-Modified",
+                    "Location",
+                    "Origin",
+                    "Pragma",
+                    "Proxy-Authorization",
+                    "Range",
+                    "Referer",
+                    "Retry-After",
+                    "Sec-WebSocket-Accept",
+                    "Sec-WebSocket-Extensions",
+                    "Sec-WebSocket-Key",
+                    "Sec-WebSocket-Protocol",
+                    "Sec-WebSocket-Version",
+                    "Server",
+                    "Set-Cookie",
+                    "TE",
+                    "Trailer",
+                    "Transfer-Encoding",
+                    "Upgrade",
+                    "User-Agent",
+                    "Vary",
+                    "Via",
+                    "WWW-Authenticate",
+                    "X-Forwarded-For",
+                    "X-Forwarded-Host",
+                    "X-Forwarded-Proto",
+                    "X-Real-IP",
+                    "X-Request-ID",
+                    "X-Requested-With",
+                };
+                static_assert(sizeof(names) / sizeof(names[0]) == http_known_header_count, "http_header_id and names differ");
+                return names;
+            }
+
+        private:
+            unsigned char slots_[table_size];     // index + 1 in names_; 0 = empty
+            util::slice names_[http_known_header_count];
+        };
+
+        inline http_header_id http_header_lookup(const util::slice& name)
+        {
+            return http_header_table::get().lookup(name);
+        }
+    }
+}
+
+#endif
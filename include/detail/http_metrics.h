@@ -0,0 +1,275 @@
+#ifndef __DETAIL_HTTP_METRICS_H__
+#define __DETAIL_HTTP_METRICS_H__
+
+#include "base.h"
+#include "histogram.h"
+#include "http_response.h"
+#include "utility.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // What http_session measures of a request (uv_hrtime() times, in nanoseconds).
+        struct http_request_sample
+        {
+            std::size_t route;          // see http_metrics::route(); 0: not routed
+            uint64_t started;           // the read holding the first byte of the request
+            uint64_t parsed;            // head complete: the handler is invoked (0: nothing to record)
+            uint64_t answered;          // the response is handed to the session
+            uint64_t bytes_in;          // head, and the body declared by Content-Length
+            uint64_t bytes_out;
+        };
+
+        // Request metrics by route and status class (2xx, 4xx...): counts, bytes in and out, and log-linear
+        // histograms of the parse (first byte to complete head), handler (head to response) and write (response to
+        // written) latencies. x10 runs on the default loop, so recording is a few plain increments: no lock and no
+        // atomic. render() exports them in the Prometheus text format:
+        //
+        //     router.add("GET", "/metrics", [](http_responder* s, std::size_t id, const http_parse_result*, const http_route_params&) {
+        //         s->respond(id, http_metrics::get().render());
+        //     });
+        class http_metrics
+        {
+            struct route_label
+            {
+                std::string method;
+                std::string pattern;
+            };
+
+            struct series
+            {
+                uint64_t requests;
+                uint64_t bytes_in;
+                uint64_t bytes_out;
+                histogram parse;        // microseconds
+                histogram handler;
+                histogram write;
+            };
+
+            // status classes 1xx to 5xx, and anything else
+            static const std::size_t status_classes = 6;
+
+            // histogram buckets exported: values below 2^k microseconds
+            static const unsigned first_bucket_bits = 4;
+            static const unsigned last_bucket_bits = 27;
+
+            // the route labels that http_router hands out index this registry: there is no other.
+            http_metrics()
+                : routes_()
+                , series_()
+            {
+                routes_.push_back(route_label { std::string(), std::string() });
+            }
+
+            ~http_metrics()
+            {
+                for(auto s : series_) delete s;
+            }
+
+        public:
+            // no copy allowed
+            http_metrics(const http_metrics&) = delete;
+            void operator=(const http_metrics&) = delete;
+
+            // x10 runs on the default loop: one registry per process.
+            static http_metrics& get()
+            {
+                static http_metrics metrics;
+                return metrics;
+            }
+
+            // The label of a route (see http_router, which asks once per route): its index for
+            // http_responder::set_route().
+            std::size_t route(const util::slice& method, const util::slice& pattern)
+            {
+                for(std::size_t i=1;i<routes_.size();++i)
+                {
+                    if(method == routes_[i].method && pattern == routes_[i].pattern) return i;
+                }
+                routes_.push_back(route_label { method.to_string(), pattern.to_string() });
+                return routes_.size() - 1;
+            }
+
+            // a request whose response was written at 'written' (see http_session::set_metrics())
+            void record(const http_request_sample& sample, int status, uint64_t written)
+            {
+                // a label route() did not hand out counts as unrouted
+                std::size_t route = sample.route < routes_.size() ? sample.route : 0;
+                std::size_t c = status >= 100 && status < 600 ? static_cast<std::size_t>(status / 100) : 0;
+                auto i = route * status_classes + c;
+                if(i >= series_.size()) series_.resize(routes_.size() * status_classes, nullptr);
+
+                auto s = series_[i];
+                if(!s)
+                {
+                    s = new series();
+                    assert(s);
+                    series_[i] = s;
+                }
+
+                ++s->requests;
+                s->bytes_in += sample.bytes_in;
+                s->bytes_out += sample.bytes_out;
+                s->parse.record(micros_(sample.started, sample.parsed));
+                s->handler.record(micros_(sample.parsed, sample.answered));
+                s->write.record(micros_(sample.answered, written));
+            }
+
+            void reset()
+            {
+                for(auto& s : series_)
+                {
+                    delete s;
+                    s = nullptr;
+                }
+            }
+
+            // Prometheus text exposition format (version 0.0.4)
+            std::string text() const
+            {
+                std::string out;
+                out.reserve(4096);
+
+                counter_(out, "x10_http_requests_total", "HTTP requests answered.", &series::requests);
+                counter_(out, "x10_http_request_bytes_total", "HTTP request bytes (head and declared body).", &series::bytes_in);
+                counter_(out, "x10_http_response_bytes_total", "HTTP response bytes written.", &series::bytes_out);
+                histogram_(out, "x10_http_parse_seconds", "From the first byte of a request to its complete head.", &series::parse);
+                histogram_(out, "x10_http_handler_seconds", "From the complete head of a request to its response.", &series::handler);
+                histogram_(out, "x10_http_write_seconds", "From a response to the end of its write.", &series::write);
+                return out;
+            }
+
+            // the response of a scrape
+            http_response render() const
+            {
+                http_response res(200);
+                res.add_header("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+                res.set_body(text());
+                return res;
+            }
+
+        private:
+            static uint64_t micros_(uint64_t from, uint64_t to)
+            {
+                return to > from ? (to - from) / 1000 : 0;
+            }
+
+            // {method="GET",route="/users/:id",code="2xx"}
+            void labels_(std::string& out, std::size_t i, const char* le=nullptr) const
+            {
+                auto& r = routes_[i / status_classes];
+                auto c = i % status_classes;
+
+                out += "{method=\"";
+                escape_(out, r.method);
+                out += "\",route=\"";
+                escape_(out, r.pattern);
+                out += "\",code=\"";
+                if(c)
+                {
+                    out += static_cast<char>('0' + c);
+                    out += "xx";
+                }
+                else out += "other";
+                out += '"';
+                if(le)
+                {
+                    out += ",le=\"";
+                    out += le;
+                    out += '"';
+                }
+                out += '}';
+            }
+
+            static void escape_(std::string& out, const std::string& value)
+            {
+                for(auto c : value)
+                {
+                    if(c == '\\' || c == '"') out += '\\';
+                    if(c == '\n') out += "\\n";
+                    else out += c;
+                }
+            }
+
+            static void number_(std::string& out, uint64_t n)
+            {
+                char buf[24];
+                out.append(buf, std::snprintf(buf, sizeof(buf), " %llu\n", static_cast<unsigned long long>(n)));
+            }
+
+            void counter_(std::string& out, const char* name, const char* help, uint64_t series::*field) const
+            {
+                header_(out, name, help, "counter");
+                for(std::size_t i=0;i<series_.size();++i)
+                {
+                    if(!series_[i]) continue;
+                    out += name;
+                    labels_(out, i);
+                    number_(out, series_[i]->*field);
+                }
+            }
+
+            // Cumulative buckets at powers of two: the counts below 2^k microseconds are exact, since the buckets
+            // of the log-linear histogram do not straddle them.
+            void histogram_(std::string& out, const char* name, const char* help, histogram series::*field) const
+            {
+                header_(out, name, help, "histogram");
+
+                std::string bucket = std::string(name) + "_bucket";
+                for(std::size_t i=0;i<series_.size();++i)
+                {
+                    if(!series_[i]) continue;
+                    auto& h = series_[i]->*field;
+
+                    uint64_t cumulative = 0;
+                    std::size_t b = 0;
+                    for(auto k=first_bucket_bits;k<=last_bucket_bits;++k)
+                    {
+                        auto end = histogram::index_of(uint64_t(1) << k);
+                        for(;b<end;++b) cumulative += h.bucket_value(b);
+
+                        char le[32];
+                        std::snprintf(le, sizeof(le), "%.6f", static_cast<double>((uint64_t(1) << k) - 1) / 1e6);
+                        out += bucket;
+                        labels_(out, i, le);
+                        number_(out, cumulative);
+                    }
+                    out += bucket;
+                    labels_(out, i, "+Inf");
+                    number_(out, h.count());
+
+                    char sum[32];
+                    out += name;
+                    out += "_sum";
+                    labels_(out, i);
+                    out.append(sum, std::snprintf(sum, sizeof(sum), " %.6f\n", static_cast<double>(h.sum()) / 1e6));
+
+                    out += name;
+                    out += "_count";
+                    labels_(out, i);
+                    number_(out, h.count());
+                }
+            }
+
+            static void header_(std::string& out, const char* name, const char* help, const char* type)
+            {
+                out += "# HELP ";
+                out += name;
+                out += ' ';
+                out += help;
+                out += "\n# TYPE ";
+                out += name;
+                out += ' ';
+                out += type;
+                out += '\n';
+            }
+
+        private:
+            std::vector<route_label> routes_;   // 0: requests no route was set for
+            std::vector<series*> series_;       // by route and status class, created on first use
+        };
+    }
+}
+
+#endif
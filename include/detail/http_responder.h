@@ -0,0 +1,47 @@
+#ifndef __DETAIL_HTTP_RESPONDER_H__
+#define __DETAIL_HTTP_RESPONDER_H__
+
+#include "base.h"
+#include "buffer.h"
+#include "file_cache.h"
+#include "http.h"
+#include "http_response.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // What the request helpers (http_router, http_static, http_conditional, http_cache) need of the session
+        // a request came in on: http_session for HTTP/1.x, http2_session for a stream of an HTTP/2 connection.
+        // Requests are identified by the id given to the session's on_request callback.
+        class http_responder
+        {
+        public:
+            virtual ~http_responder() {}
+
+            // Streams the body of the request being dispatched (call it from on_request).
+            virtual void read_body(http_body_callback_type callback) = 0;
+
+            // Answers request 'id'; einval if it is unknown or already answered.
+            virtual resval respond(std::size_t id, http_response&& response) = 0;
+
+            // Answers request 'id' with a head and length bytes of a file from offset (the responder keeps its
+            // own reference to file).
+            virtual resval respond(std::size_t id, http_response&& response, file_entry* file, int64_t offset, int64_t length) = 0;
+
+            // Answers request 'id' with a response serialized beforehand (HTTP/1.1 head and body), shared with
+            // other requests: data is retained until it is written. last: the connection closes after it.
+            virtual resval respond(std::size_t id, buffer* data, const util::slice& response, bool last) = 0;
+
+            // the route of request 'id' in the metrics (see http_router)
+            virtual void set_route(std::size_t id, std::size_t route) = 0;
+
+            // A party answering requests later holds a reference: a responder closed meanwhile is deleted by the
+            // last release() instead, and answers respond() with ebadf until then.
+            virtual void retain() = 0;
+            virtual void release() = 0;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,313 @@
+#ifndef __DETAIL_HTTP_RESPONSE_H__
+#define __DETAIL_HTTP_RESPONSE_H__
+
+#include <ctime>
+#include "base.h"
+#include "buffer.h"
+#include "http.h"
+#include "timer.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // "Date:" header of the responses, formatted once per second by a loop timer instead of once per response.
+        class http_date
+        {
+        public:
+            static http_date& get()
+            {
+                static http_date date;
+                return date;
+            }
+
+            // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+            util::slice header()
+            {
+                if(!timer_) start_();
+                return util::slice(buf_, length_);
+            }
+
+            // Writes the IMF-fixdate of t ("Sun, 06 Nov 1994 08:49:37 GMT", 29 characters) and returns its length.
+            static std::size_t format(std::time_t t, char* buf, std::size_t size)
+            {
+                static const char* days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+                static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+                std::tm tm;
+#ifdef _WIN32
+                gmtime_s(&tm, &t);
+#else
+                gmtime_r(&t, &tm);
+#endif
+                int n = std::snprintf(buf, size, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                    days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+                return n > 0 ? std::min(static_cast<std::size_t>(n), size - 1) : 0;
+            }
+
+            // Parses an IMF-fixdate (the obsolete RFC 850 and asctime formats are not accepted): false if s is not one.
+            static bool parse(const util::slice& s, std::time_t& t)
+            {
+                static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+                // "Sun, 06 Nov 1994 08:49:37 GMT"
+                if(s.size() != 29 || s[3] != ',' || s[4] != ' ' || s[7] != ' ' || s[11] != ' ' || s[16] != ' '
+                    || s[19] != ':' || s[22] != ':' || s.substr(25) != " GMT") return false;
+
+                auto number = [&s](std::size_t pos, std::size_t len, int& n) -> bool {
+                    n = 0;
+                    for(std::size_t i=pos;i<pos+len;++i)
+                    {
+                        if(s[i] < '0' || s[i] > '9') return false;
+                        n = n * 10 + (s[i] - '0');
+                    }
+                    return true;
+                };
+
+                std::tm tm = std::tm();
+                int mon = 0;
+                while(mon < 12 && std::memcmp(months + 3 * mon, s.data() + 8, 3) != 0) ++mon;
+
+                if(mon == 12 || !number(5, 2, tm.tm_mday) || !number(12, 4, tm.tm_year) || !number(17, 2, tm.tm_hour)
+                    || !number(20, 2, tm.tm_min) || !number(23, 2, tm.tm_sec)) return false;
+                if(tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60) return false;
+
+                tm.tm_mon = mon;
+                tm.tm_year -= 1900;
+#ifdef _WIN32
+                t = _mkgmtime(&tm);
+#else
+                t = timegm(&tm);
+#endif
+                return t != static_cast<std::time_t>(-1);
+            }
+
+        private:
+            http_date()
+                : timer_(nullptr)
+                , length_(0)
+            {}
+
+            // no copy allowed
+            http_date(const http_date&) = delete;
+            void operator=(const http_date&) = delete;
+
+            void start_()
+            {
+                refresh_();
+
+                timer_ = new timer;
+                assert(timer_);
+
+                timer_->on_timeout([this](timer*) { refresh_(); });
+                timer_->start(1000, 1000);
+
+                // must not keep the loop alive
+                timer_->unref();
+            }
+
+            void refresh_()
+            {
+                static const char prefix[] = "Date: ";
+
+                std::memcpy(buf_, prefix, sizeof(prefix) - 1);
+                auto n = format(std::time(nullptr), buf_ + sizeof(prefix) - 1, sizeof(buf_) - sizeof(prefix) - 1);
+                std::memcpy(buf_ + sizeof(prefix) - 1 + n, "\r\n", 2);
+                length_ = sizeof(prefix) - 1 + n + 2;
+            }
+
+        private:
+            timer* timer_;
+            char buf_[64];
+            std::size_t length_;
+        };
+
+        // Response builder. Headers are serialized straight into one pooled buffer as they are added; the status
+        // line (precomputed, see http_status_lines) and the cached Date header are put in front of them at the end,
+        // in room reserved for that. The head and the body then go out with one vectored write (see http_session).
+        class http_response
+        {
+        public:
+            // room for the status line and the Date header in front of the headers
+            static const std::size_t head_reserve = 128;
+
+            // a typical response head fits in one buffer of this pool.
+            static buffer_pool& head_pool()
+            {
+                static buffer_pool pool(4 * 1024 - sizeof(buffer));
+                return pool;
+            }
+
+            http_response(int status_code=200)
+                : status_code_(status_code)
+                , keep_alive_(true)
+                , content_length_(-1)
+                , streamed_(false)
+                , chunked_(false)
+                , head_(nullptr)
+                , head_end_(head_reserve)
+                , body_()
+                , body_ref_()
+            {}
+
+            http_response(http_response&& c)
+                : status_code_(c.status_code_)
+                , keep_alive_(c.keep_alive_)
+                , content_length_(c.content_length_)
+                , streamed_(c.streamed_)
+                , chunked_(c.chunked_)
+                , head_(c.head_)
+                , head_end_(c.head_end_)
+                , body_(std::move(c.body_))
+                , body_ref_(c.body_ref_)
+            {
+                c.head_ = nullptr;
+            }
+
+            ~http_response()
+            {
+                if(head_) head_->release();
+            }
+
+            // no copy allowed
+            http_response(const http_response&) = delete;
+            void operator=(const http_response&) = delete;
+
+            void set_status(int status_code) { status_code_ = status_code; }
+            int status() const { return status_code_; }
+
+            // false adds "Connection: close" (the connection closes after the response anyway, see http_session).
+            void set_keep_alive(bool keep_alive) { keep_alive_ = keep_alive; }
+            bool keep_alive() const { return keep_alive_; }
+
+            // Content-Length of a body sent separately (or of a HEAD response); by default the size of body().
+            void set_content_length(int64_t length) { content_length_ = length; }
+
+            // The body follows separately and its length is unknown: "Transfer-Encoding: chunked", or (for an
+            // HTTP/1.0 peer) delimited by closing the connection. See http_body_writer.
+            void set_streamed(bool chunked)
+            {
+                streamed_ = true;
+                chunked_ = chunked;
+                if(!chunked) keep_alive_ = false;
+            }
+
+            bool has_body() const { return status_code_ >= 200 && status_code_ != 204 && status_code_ != 304; }
+
+            // name and value are copied into the head buffer.
+            void add_header(const util::slice& name, const util::slice& value)
+            {
+                auto p = reserve_(name.size() + value.size() + 4);
+
+                std::memcpy(p, name.data(), name.size());
+                p += name.size();
+                *p++ = ':';
+                *p++ = ' ';
+                std::memcpy(p, value.data(), value.size());
+                p += value.size();
+                *p++ = '\r';
+                *p++ = '\n';
+
+                head_end_ = p - head_->data();
+            }
+
+            void set_body(std::string body)
+            {
+                body_ = std::move(body);
+                body_ref_ = util::slice();
+            }
+
+            // The body is not copied: it must stay alive until the response has been written.
+            void set_body_ref(const util::slice& body)
+            {
+                body_.clear();
+                body_ref_ = body;
+            }
+
+            util::slice body() const { return body_.empty() ? body_ref_ : util::slice(body_); }
+
+            // the body set by set_body() (empty after set_body_ref())
+            std::string& body_string() { return body_; }
+
+            // Completes the head and hands its buffer over to the caller (who releases it). Call it once.
+            buffer* take_head(util::slice& head)
+            {
+                static const char crlf[] = "\r\n";
+
+                int64_t length = content_length_ >= 0 ? content_length_ : static_cast<int64_t>(body().size());
+
+                // tail: Content-Length (or Transfer-Encoding), Connection, empty line
+                auto p = reserve_(64);
+                if(has_body())
+                {
+                    if(!streamed_) p += std::sprintf(p, "Content-Length: %lld\r\n", static_cast<long long>(length));
+                    else if(chunked_)
+                    {
+                        static const char chunked[] = "Transfer-Encoding: chunked\r\n";
+                        std::memcpy(p, chunked, sizeof(chunked) - 1);
+                        p += sizeof(chunked) - 1;
+                    }
+                }
+                if(!keep_alive_)
+                {
+                    static const char close[] = "Connection: close\r\n";
+                    std::memcpy(p, close, sizeof(close) - 1);
+                    p += sizeof(close) - 1;
+                }
+                std::memcpy(p, crlf, 2);
+                p += 2;
+                head_end_ = p - head_->data();
+
+                // front: status line, Date
+                auto line = http_status_lines::get().line(status_code_);
+                auto date = http_date::get().header();
+                assert(!line.empty() && line.size() + date.size() <= head_reserve);
+
+                auto begin = head_reserve - line.size() - date.size();
+                std::memcpy(head_->data() + begin, line.data(), line.size());
+                std::memcpy(head_->data() + begin + line.size(), date.data(), date.size());
+
+                head = util::slice(head_->data() + begin, head_end_ - begin);
+
+                auto b = head_;
+                head_ = nullptr;
+                head_end_ = head_reserve;
+                return b;
+            }
+
+        private:
+            // returns room for 'size' more bytes at the end of the head
+            char* reserve_(std::size_t size)
+            {
+                if(!head_)
+                {
+                    head_ = head_pool().acquire(head_reserve + size);
+                    assert(head_);
+                }
+                else if(head_end_ + size > head_->capacity())
+                {
+                    auto b = head_pool().acquire(std::max(head_->capacity() * 2, head_end_ + size));
+                    assert(b);
+
+                    std::memcpy(b->data() + head_reserve, head_->data() + head_reserve, head_end_ - head_reserve);
+                    head_->release();
+                    head_ = b;
+                }
+                return head_->data() + head_end_;
+            }
+
+        private:
+            int status_code_;
+            bool keep_alive_;
+            int64_t content_length_;
+            bool streamed_;
+            bool chunked_;
+            buffer* head_;
+            std::size_t head_end_;
+            std::string body_;
+            util::slice body_ref_;
+        };
+    }
+}
+
+#endif
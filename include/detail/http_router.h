@@ -0,0 +1,355 @@
+#ifndef __DETAIL_HTTP_ROUTER_H__
+#define __DETAIL_HTTP_ROUTER_H__
+
+#include "base.h"
+#include "http_metrics.h"
+#include "http_responder.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // Parameters captured by a route: views into the request path (still percent-encoded), valid as long as
+        // the request. Names come from the route pattern.
+        class http_route_params
+        {
+            friend class http_router;
+
+        public:
+            static const std::size_t capacity = 16;
+
+            http_route_params()
+                : names_(nullptr)
+                , count_(0)
+            {}
+
+            std::size_t size() const { return count_; }
+            bool empty() const { return count_ == 0; }
+
+            util::slice name(std::size_t i) const { assert(i < count_); return names_[i]; }
+            util::slice value(std::size_t i) const { assert(i < count_); return values_[i]; }
+
+            // value of the named parameter (empty if the route has none)
+            util::slice get(const util::slice& name) const
+            {
+                for(std::size_t i=0;i<count_;++i) if(names_[i] == name) return values_[i];
+                return util::slice();
+            }
+
+            util::slice operator[](const util::slice& name) const { return get(name); }
+
+        private:
+            const std::string* names_;
+            util::slice values_[capacity];
+            std::size_t count_;
+        };
+
+        // Routes requests by method and path. Each method has a radix tree of the route patterns, where a node
+        // holds a run of static text shared by its routes; patterns may capture segments (":name", up to the next
+        // '/') and the rest of the path ("*name", at the end):
+        //
+        //     router.add("GET", "/users/:id/files/*path", handler);
+        //
+        // Lookups walk the tree once along the path, preferring static text to ":" and ":" to "*" at a branch,
+        // and store the captured values into http_route_params without allocating: the names were resolved when
+        // the route was added.
+        class http_router
+        {
+        public:
+            typedef std::function<void(http_responder*, std::size_t, const http_parse_result*, const http_route_params&)> handler_type;
+
+        private:
+            struct node
+            {
+                node()
+                    : label()
+                    , first()
+                    , children()
+                    , param(nullptr)
+                    , wildcard(nullptr)
+                    , route(-1)
+                {}
+
+                ~node()
+                {
+                    for(auto c : children) delete c;
+                    delete param;
+                    delete wildcard;
+                }
+
+                std::string label;              // static text matched by this node (the name, for a capture)
+                std::string first;              // first character of each child's label
+                std::vector<node*> children;
+                node* param;                    // ":name" child
+                node* wildcard;                 // "*name" child
+                int route;                      // route ending here, or -1
+            };
+
+            struct route
+            {
+                std::vector<std::string> names;
+                handler_type handler;
+                std::size_t label;      // in http_metrics
+            };
+
+        public:
+            http_router()
+                : trees_()
+                , routes_()
+            {}
+
+            ~http_router()
+            {
+                for(auto& t : trees_) delete t.second;
+            }
+
+            // no copy allowed
+            http_router(const http_router&) = delete;
+            void operator=(const http_router&) = delete;
+
+            // Returns einval if the pattern is malformed (not starting with '/', an empty name, "*" before the end,
+            // more than http_route_params::capacity captures), already routed, or captures a segment under
+            // another name than an existing route at the same place.
+            resval add(const util::slice& method, const util::slice& pattern, handler_type handler)
+            {
+                if(pattern.empty() || pattern[0] != '/' || !handler) return resval(error::einval);
+
+                // a rejected pattern leaves the tree as it was
+                if(!valid_(find_tree_(method), pattern)) return resval(error::einval);
+
+                auto n = find_tree_(method);
+                if(!n)
+                {
+                    n = new node;
+                    assert(n);
+                    trees_.push_back(std::make_pair(method.to_string(), n));
+                }
+
+                route r { std::vector<std::string>(), handler, 0 };
+
+                std::size_t i = 0;
+                while(i < pattern.size())
+                {
+                    char c = pattern[i];
+                    if(c != ':' && c != '*')
+                    {
+                        auto end = i;
+                        while(end < pattern.size() && pattern[end] != ':' && pattern[end] != '*') ++end;
+                        n = insert_static_(n, pattern.substr(i, end - i));
+                        i = end;
+                        continue;
+                    }
+
+                    auto end = pattern.find('/', i);
+                    if(end == util::slice::npos) end = pattern.size();
+                    auto name = pattern.substr(i + 1, end - i - 1);
+
+                    auto& child = (c == ':') ? n->param : n->wildcard;
+                    if(!child)
+                    {
+                        child = new node;
+                        assert(child);
+                        child->label = name.to_string();
+                    }
+                    assert(name == child->label);
+
+                    r.names.push_back(name.to_string());
+                    n = child;
+                    i = end;
+                }
+
+                assert(n->route < 0);
+                n->route = static_cast<int>(routes_.size());
+                r.label = http_metrics::get().route(method, pattern);
+                routes_.push_back(std::move(r));
+                return resval();
+            }
+
+            // Returns the handler of the route matching method and path (the query excluded), or nullptr.
+            const handler_type* match(const util::slice& method, const util::slice& path, http_route_params& params) const
+            {
+                auto r = match_route_(method, path, params);
+                return r ? &r->handler : nullptr;
+            }
+
+            // Invokes the handler of the route of request 'id'; returns false if none matches (the request is left
+            // to the caller). The route labels the request in the session's metrics (see http_metrics).
+            bool dispatch(http_responder* session, std::size_t id, const http_parse_result* r) const
+            {
+                http_route_params params;
+                auto route = match_route_(r->method(), r->path(), params);
+                if(!route) return false;
+
+                session->set_route(id, route->label);
+                route->handler(session, id, r, params);
+                return true;
+            }
+
+            std::size_t size() const { return routes_.size(); }
+
+        private:
+            const route* match_route_(const util::slice& method, const util::slice& path, http_route_params& params) const
+            {
+                params.count_ = 0;
+
+                auto root = find_tree_(method);
+                if(!root || path.empty()) return nullptr;
+
+                int index = -1;
+                if(!match_(root, path, params.values_, 0, index)) return nullptr;
+
+                auto& r = routes_[index];
+                params.names_ = r.names.data();
+                params.count_ = r.names.size();
+                return &r;
+            }
+
+            node* find_tree_(const util::slice& method) const
+            {
+                for(auto& t : trees_) if(method == t.first) return t.second;
+                return nullptr;
+            }
+
+            // The checks of add(), made before the tree is changed: the syntax of the pattern, and against the
+            // nodes it would go through (n: the method's tree, nullptr once the pattern leaves the tree) the names
+            // of the captures and the route at its end.
+            static bool valid_(const node* n, const util::slice& pattern)
+            {
+                std::size_t captures = 0;
+                std::size_t i = 0;
+                while(i < pattern.size())
+                {
+                    char c = pattern[i];
+                    if(c != ':' && c != '*')
+                    {
+                        auto end = i;
+                        while(end < pattern.size() && pattern[end] != ':' && pattern[end] != '*') ++end;
+                        if(n) n = find_static_(n, pattern.substr(i, end - i));
+                        i = end;
+                        continue;
+                    }
+
+                    auto end = pattern.find('/', i);
+                    if(end == util::slice::npos) end = pattern.size();
+                    auto name = pattern.substr(i + 1, end - i - 1);
+                    if(name.empty() || captures == http_route_params::capacity) return false;
+                    if(c == '*' && end != pattern.size()) return false;
+
+                    // a capture follows a '/' (or starts the pattern after the root)
+                    if(pattern[i - 1] != '/') return false;
+
+                    if(n)
+                    {
+                        auto child = (c == ':') ? n->param : n->wildcard;
+                        if(child && name != child->label) return false;
+                        n = child;
+                    }
+                    ++captures;
+                    i = end;
+                }
+                return !n || n->route < 0;
+            }
+
+            // the node the static text s ends at below n, or nullptr if insert_static_() would have to add one.
+            static const node* find_static_(const node* n, util::slice s)
+            {
+                while(!s.empty())
+                {
+                    auto i = n->first.find(s[0]);
+                    if(i == std::string::npos) return nullptr;
+
+                    auto c = n->children[i];
+                    if(s.size() < c->label.size() || std::memcmp(s.data(), c->label.data(), c->label.size()) != 0) return nullptr;
+
+                    n = c;
+                    s = s.substr(c->label.size());
+                }
+                return n;
+            }
+
+            // adds the static text s below n, splitting labels where it diverges, and returns the node it ends at.
+            static node* insert_static_(node* n, util::slice s)
+            {
+                while(!s.empty())
+                {
+                    auto i = n->first.find(s[0]);
+                    if(i == std::string::npos)
+                    {
+                        auto c = new node;
+                        assert(c);
+                        c->label = s.to_string();
+                        n->first += s[0];
+                        n->children.push_back(c);
+                        return c;
+                    }
+
+                    auto c = n->children[i];
+                    std::size_t k = 0;
+                    while(k < c->label.size() && k < s.size() && c->label[k] == s[k]) ++k;
+
+                    if(k < c->label.size())
+                    {
+                        // split: the common part becomes the parent of the rest of c
+                        auto mid = new node;
+                        assert(mid);
+                        mid->label = c->label.substr(0, k);
+                        c->label.erase(0, k);
+                        mid->first += c->label[0];
+                        mid->children.push_back(c);
+                        n->children[i] = mid;
+                        c = mid;
+                    }
+
+                    n = c;
+                    s = s.substr(k);
+                }
+                return n;
+            }
+
+            // n's label is matched: matches the rest of the path below n.
+            static bool match_(const node* n, const util::slice& path, util::slice* values, std::size_t count, int& route)
+            {
+                if(path.empty() && n->route >= 0)
+                {
+                    route = n->route;
+                    return true;
+                }
+
+                if(!path.empty())
+                {
+                    auto i = n->first.find(path[0]);
+                    if(i != std::string::npos)
+                    {
+                        auto c = n->children[i];
+                        auto& label = c->label;
+                        if(path.size() >= label.size() && std::memcmp(path.data(), label.data(), label.size()) == 0
+                            && match_(c, path.substr(label.size()), values, count, route)) return true;
+                    }
+
+                    if(n->param && path[0] != '/')
+                    {
+                        auto end = path.find('/');
+                        if(end == util::slice::npos) end = path.size();
+
+                        values[count] = path.substr(0, end);
+                        if(match_(n->param, path.substr(end), values, count + 1, route)) return true;
+                    }
+                }
+
+                if(n->wildcard && n->wildcard->route >= 0)
+                {
+                    values[count] = path;
+                    route = n->wildcard->route;
+                    return true;
+                }
+                return false;
+            }
+
+        private:
+            std::vector<std::pair<std::string, node*>> trees_;
+            std::vector<route> routes_;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,640 @@
+#ifndef __DETAIL_HTTP_SCANNER_H__
+#define __DETAIL_HTTP_SCANNER_H__
+
+#include <string>
+#include <vector>
+#include "base.h"
+#include "utility.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace x10
+{
+    namespace detail
+    {
+        // Delimiter search, 32 (AVX2) or 16 (SSE2) bytes per step with a scalar tail (and a scalar fallback
+        // on other targets). The instruction set is chosen at compile time (-mavx2).
+        namespace http_scan
+        {
+            inline unsigned ctz_(unsigned bits)
+            {
+#if defined(__GNUC__) || defined(__clang__)
+                return static_cast<unsigned>(__builtin_ctz(bits));
+#else
+                unsigned r = 0;
+                while(!(bits & 1)) { bits >>= 1; ++r; }
+                return r;
+#endif
+            }
+
+            // first byte below 'limit' or DEL (HTAB excepted when allow_tab): the end of a URL (limit 0x21)
+            // or of a header value (limit 0x20); end if none.
+            inline const char* find_ctl(const char* p, const char* end, unsigned char limit, bool allow_tab)
+            {
+#if defined(__AVX2__)
+                const __m256i lim = _mm256_set1_epi8(static_cast<char>(limit - 1));
+                const __m256i del = _mm256_set1_epi8(0x7f);
+                const __m256i tab = _mm256_set1_epi8(allow_tab ? 0x09 : 0x7f);
+                for(;end - p >= 32;p += 32)
+                {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+
+                    // v <= limit-1 (unsigned) <=> max(v, limit-1) == limit-1
+                    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, lim), lim), _mm256_cmpeq_epi8(v, del));
+                    m = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), m);
+
+                    unsigned bits = static_cast<unsigned>(_mm256_movemask_epi8(m));
+                    if(bits) return p + ctz_(bits);
+                }
+#elif defined(__SSE2__) || defined(_M_X64)
+                const __m128i lim = _mm_set1_epi8(static_cast<char>(limit - 1));
+                const __m128i del = _mm_set1_epi8(0x7f);
+                const __m128i tab = _mm_set1_epi8(allow_tab ? 0x09 : 0x7f);
+                for(;end - p >= 16;p += 16)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+
+                    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, lim), lim), _mm_cmpeq_epi8(v, del));
+                    m = _mm_andnot_si128(_mm_cmpeq_epi8(v, tab), m);
+
+                    unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(m));
+                    if(bits) return p + ctz_(bits);
+                }
+#endif
+                for(;p < end;++p)
+                {
+                    auto c = static_cast<unsigned char>(*p);
+                    if((c < limit || c == 0x7f) && !(allow_tab && c == 0x09)) return p;
+                }
+                return end;
+            }
+
+            // first occurrence of c; end if none.
+            inline const char* find_char(const char* p, const char* end, char c)
+            {
+#if defined(__AVX2__)
+                const __m256i needle = _mm256_set1_epi8(c);
+                for(;end - p >= 32;p += 32)
+                {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+                    unsigned bits = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle)));
+                    if(bits) return p + ctz_(bits);
+                }
+#elif defined(__SSE2__) || defined(_M_X64)
+                const __m128i needle = _mm_set1_epi8(c);
+                for(;end - p >= 16;p += 16)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                    unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+                    if(bits) return p + ctz_(bits);
+                }
+#endif
+                for(;p < end;++p) if(*p == c) return p;
+                return end;
+            }
+
+            // first occurrence of a or b; end if none.
+            inline const char* find_either(const char* p, const char* end, char a, char b)
+            {
+#if defined(__AVX2__)
+                const __m256i na = _mm256_set1_epi8(a);
+                const __m256i nb = _mm256_set1_epi8(b);
+                for(;end - p >= 32;p += 32)
+                {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+                    unsigned bits = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, na), _mm256_cmpeq_epi8(v, nb))));
+                    if(bits) return p + ctz_(bits);
+                }
+#elif defined(__SSE2__) || defined(_M_X64)
+                const __m128i na = _mm_set1_epi8(a);
+                const __m128i nb = _mm_set1_epi8(b);
+                for(;end - p >= 16;p += 16)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                    unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, na), _mm_cmpeq_epi8(v, nb))));
+                    if(bits) return p + ctz_(bits);
+                }
+#endif
+                for(;p < end;++p) if(*p == a || *p == b) return p;
+                return end;
+            }
+
+            // RFC 7230 tchar
+            inline bool is_token(char c)
+            {
+                static const char* const specials = "!#$%&'*+-.^_`|~";
+                return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                    (c != 0 && std::strchr(specials, c) != nullptr);
+            }
+        }
+
+        /**
+         *  HTTP/1.x request parser with the same contract as http_parser_execute(): it drives the same
+         *  http_parser_settings callbacks, fills the same http_parser fields (method, version, flags, upgrade)
+         *  and reports errors and pauses through HTTP_PARSER_ERRNO, so http_parser_context can use either one.
+         *
+         *  The head is only tokenized once it is complete: the search for its end resumes where the previous
+         *  read stopped, and a head split across reads is joined in head_ (the only copy). Tokens are then
+         *  found with the vectorized searches above. The body is framed here (Content-Length, or chunked
+         *  encoding decoded in place) and delivered as slices of the input.
+         */
+        class http_request_scanner
+        {
+        public:
+            // the size of a head is limited like in http_parser (HTTP_MAX_HEADER_SIZE) unless set otherwise.
+            static const std::size_t max_head_size = 80 * 1024;
+
+            http_request_scanner(http_parser* parser, const http_parser_settings* settings)
+                : parser_(parser)
+                , settings_(settings)
+                , max_head_(max_head_size)
+                , state_(state::idle)
+                , head_()
+                , scanned_(0)
+                , remaining_(0)
+                , chunk_digits_(false)
+            {
+                assert(parser_ && settings_);
+            }
+
+            std::size_t execute(const char* data, std::size_t length)
+            {
+                if(HTTP_PARSER_ERRNO(parser_) != HPE_OK) return 0;
+
+                // completion held back by a pause (see message_done): it needs no input.
+                if(state_ == state::message_done && !complete_()) return 0;
+
+                auto p = data;
+                auto end = data + length;
+                while(p < end)
+                {
+                    switch(state_)
+                    {
+                    case state::idle:
+                        // CRLF between messages is tolerated
+                        if(*p == '\r' || *p == '\n')
+                        {
+                            ++p;
+                            break;
+                        }
+
+                        head_.clear();
+                        scanned_ = 0;
+                        state_ = state::head;
+                        if(!notify_(settings_->on_message_begin, HPE_CB_message_begin)) return p - data;
+                        break;
+
+                    case state::head:
+                        if(!scan_head_(p, end)) return p - data;
+                        break;
+
+                    case state::body:
+                    {
+                        auto n = static_cast<std::size_t>(std::min<uint64_t>(remaining_, end - p));
+                        remaining_ -= n;
+                        p += n;
+                        if(remaining_ == 0) state_ = state::message_done;
+                        if(!notify_data_(settings_->on_body, p - n, n, HPE_CB_body)) return p - data;
+                        break;
+                    }
+
+                    case state::message_done:
+                    {
+                        if(!complete_()) return p - data;
+                        break;
+                    }
+
+                    case state::chunk_size:
+                        if(!chunk_size_(*p++)) return p - data;
+                        break;
+
+                    case state::chunk_size_lf:
+                        if(*p++ != '\n') return fail_(HPE_LF_EXPECTED, p - data);
+                        state_ = remaining_ ? state::chunk_data : state::trailer;
+                        break;
+
+                    case state::chunk_ext:
+                        p = http_scan::find_char(p, end, '\n');
+                        if(p == end) break;
+                        ++p;
+                        state_ = remaining_ ? state::chunk_data : state::trailer;
+                        break;
+
+                    case state::chunk_data:
+                    {
+                        auto n = static_cast<std::size_t>(std::min<uint64_t>(remaining_, end - p));
+                        remaining_ -= n;
+                        p += n;
+                        if(remaining_ == 0) state_ = state::chunk_data_cr;
+                        if(!notify_data_(settings_->on_body, p - n, n, HPE_CB_body)) return p - data;
+                        break;
+                    }
+
+                    case state::chunk_data_cr:
+                        // a bare LF is tolerated
+                        if(*p == '\r') { ++p; state_ = state::chunk_data_lf; break; }
+                        // fall through
+                    case state::chunk_data_lf:
+                        if(*p++ != '\n') return fail_(HPE_LF_EXPECTED, p - data);
+                        remaining_ = 0;
+                        state_ = state::chunk_size;
+                        break;
+
+                    case state::trailer:
+                        // trailer fields are skipped; an empty line ends the message.
+                        if(*p == '\r') { ++p; state_ = state::trailer_lf; break; }
+                        if(*p == '\n')
+                        {
+                            ++p;
+                            if(!complete_()) return p - data;
+                            break;
+                        }
+                        state_ = state::trailer_line;
+                        break;
+
+                    case state::trailer_lf:
+                        if(*p++ != '\n') return fail_(HPE_LF_EXPECTED, p - data);
+                        if(!complete_()) return p - data;
+                        break;
+
+                    case state::trailer_line:
+                        p = http_scan::find_char(p, end, '\n');
+                        if(p == end) break;
+                        ++p;
+                        state_ = state::trailer;
+                        break;
+
+                    case state::dead:
+                        return fail_(HPE_CLOSED_CONNECTION, p - data);
+                    }
+                }
+
+                // a body ending with the input completes its message now, not with the next read.
+                if(state_ == state::message_done) complete_();
+                return length;
+            }
+
+            // bytes of a head, line breaks included (a head split across reads is copied into head_ meanwhile)
+            void set_max_head_size(std::size_t size) { max_head_ = size; }
+
+            void reset()
+            {
+                state_ = state::idle;
+                head_.clear();
+                scanned_ = 0;
+                remaining_ = 0;
+            }
+
+        private:
+            enum class state
+            {
+                idle,
+                head,
+                body,
+                message_done,       // the message ends without more input (held back by a pause)
+                chunk_size,
+                chunk_size_lf,
+                chunk_ext,
+                chunk_data,
+                chunk_data_cr,
+                chunk_data_lf,
+                trailer,
+                trailer_lf,
+                trailer_line,
+                dead
+            };
+
+            // Finds the end of the head (an empty line), then parses it. p is advanced past what was consumed;
+            // false to stop (need more input, error, or pause).
+            bool scan_head_(const char*& p, const char* end)
+            {
+                // Parse in place when the whole head is in this read; otherwise gather it in head_.
+                bool joined = !head_.empty();
+                if(joined) head_.append(p, end - p);
+
+                auto begin = joined ? head_.data() : p;
+                auto last = joined ? head_.data() + head_.size() : end;
+
+                auto q = begin + scanned_;
+                const char* head_end = nullptr;
+                while(!head_end)
+                {
+                    q = http_scan::find_char(q, last, '\n');
+                    if(q == last) break;
+
+                    // "\n\n" or "\n\r\n"
+                    if(last - q < 2 || (q[1] == '\r' && last - q < 3)) break;
+                    if(q[1] == '\n') head_end = q + 2;
+                    else if(q[1] == '\r' && q[2] == '\n') head_end = q + 3;
+                    else ++q;
+                }
+
+                if(!head_end)
+                {
+                    if(static_cast<std::size_t>(last - begin) > max_head_)
+                    {
+                        fail_(HPE_HEADER_OVERFLOW, 0);
+                        p = end;
+                        return false;
+                    }
+
+                    // resume from the last '\n' (if any) next time
+                    scanned_ = (q < last ? q : last) - begin;
+                    if(!joined) head_.assign(p, end - p);
+                    p = end;
+                    return false;
+                }
+
+                // bytes of this read that belong to the head
+                std::size_t consumed = joined ? (head_end - begin) - (head_.size() - (end - p)) : (head_end - begin);
+                p += consumed;
+
+                if(static_cast<std::size_t>(head_end - begin) > max_head_)
+                {
+                    fail_(HPE_HEADER_OVERFLOW, 0);
+                    return false;
+                }
+                return parse_head_(begin, head_end);
+            }
+
+            bool parse_head_(const char* p, const char* end)
+            {
+                // request line: method, a token (M-SEARCH...) that http_parser knows
+                auto sp = p;
+                while(sp < end && http_scan::is_token(*sp)) ++sp;
+                if(sp == p || sp == end || *sp != ' ') return fail_(HPE_INVALID_METHOD);
+
+                int method = lookup_method_(util::slice(p, sp - p));
+                if(method < 0) return fail_(HPE_INVALID_METHOD);
+                parser_->method = static_cast<unsigned char>(method);
+
+                // URL: any byte above SP
+                auto url = sp + 1;
+                auto url_end = http_scan::find_ctl(url, end, 0x21, false);
+                if(url_end == url || url_end == end || *url_end != ' ') return fail_(HPE_INVALID_URL);
+
+                // version
+                auto v = url_end + 1;
+                if(end - v < 10 || std::memcmp(v, "HTTP/", 5) != 0 || !is_digit_(v[5]) || v[6] != '.' || !is_digit_(v[7]))
+                    return fail_(HPE_INVALID_VERSION);
+                parser_->http_major = static_cast<unsigned short>(v[5] - '0');
+                parser_->http_minor = static_cast<unsigned short>(v[7] - '0');
+
+                p = v + 8;
+                if(!skip_eol_(p, end)) return fail_(HPE_LF_EXPECTED);
+
+                if(!emit_(settings_->on_url, url, url_end - url, HPE_CB_url)) return false;
+
+                // header fields
+                parser_->flags = 0;
+                parser_->upgrade = 0;
+
+                bool has_upgrade = false;
+                bool connection_upgrade = false;
+                bool bad_encoding = false;
+                int64_t content_length = -1;
+
+                for(;;)
+                {
+                    // an empty line ends the head
+                    if(*p == '\n' || *p == '\r') break;
+
+                    // obs-fold (a line starting with whitespace) is rejected, as RFC 7230 allows.
+                    auto name = p;
+                    while(p < end && http_scan::is_token(*p)) ++p;
+                    if(p == name || p == end || *p != ':') return fail_(HPE_INVALID_HEADER_TOKEN);
+                    util::slice field(name, p - name);
+
+                    // value: up to CR/LF, any other control character is an error
+                    ++p;
+                    auto value_end = http_scan::find_ctl(p, end, 0x20, true);
+                    if(value_end == end || (*value_end != '\r' && *value_end != '\n')) return fail_(HPE_INVALID_HEADER_TOKEN);
+
+                    // trim OWS
+                    auto value = p;
+                    while(value < value_end && (*value == ' ' || *value == '\t')) ++value;
+                    auto trimmed_end = value_end;
+                    while(trimmed_end > value && (trimmed_end[-1] == ' ' || trimmed_end[-1] == '\t')) --trimmed_end;
+                    util::slice val(value, trimmed_end - value);
+
+                    p = value_end;
+                    if(!skip_eol_(p, end)) return fail_(HPE_LF_EXPECTED);
+
+                    // the framing headers: same rules as http_parser
+                    if(field.equals_no_case("connection"))
+                    {
+                        for_each_token_(val, [&](const util::slice& t) {
+                            if(t.equals_no_case("close")) parser_->flags |= F_CONNECTION_CLOSE;
+                            else if(t.equals_no_case("keep-alive")) parser_->flags |= F_CONNECTION_KEEP_ALIVE;
+                            else if(t.equals_no_case("upgrade")) connection_upgrade = true;
+                        });
+                    }
+                    else if(field.equals_no_case("transfer-encoding"))
+                    {
+                        // chunked must be the last coding; any other coding cannot be framed on a request.
+                        util::slice last;
+                        for_each_token_(val, [&](const util::slice& t) { last = t; });
+                        if(last.equals_no_case("chunked")) parser_->flags |= F_CHUNKED;
+                        else bad_encoding = true;
+                    }
+                    else if(field.equals_no_case("content-length"))
+                    {
+                        int64_t length = parse_length_(val);
+                        if(length < 0 || (content_length >= 0 && content_length != length)) return fail_(HPE_INVALID_CONTENT_LENGTH);
+                        content_length = length;
+                    }
+                    else if(field.equals_no_case("upgrade"))
+                    {
+                        has_upgrade = true;
+                    }
+
+                    if(!emit_(settings_->on_header_field, field.data(), field.size(), HPE_CB_header_field)) return false;
+                    if(!emit_(settings_->on_header_value, val.data(), val.size(), HPE_CB_header_value)) return false;
+                }
+
+                if(bad_encoding) return fail_(HPE_UNKNOWN);
+                if(has_upgrade && connection_upgrade) parser_->flags |= F_UPGRADE;
+                parser_->upgrade = ((parser_->flags & F_UPGRADE) || parser_->method == HTTP_CONNECT) ? 1 : 0;
+
+                bool chunked = (parser_->flags & F_CHUNKED) != 0;
+                parser_->content_length = chunked || content_length < 0 ? 0 : static_cast<uint64_t>(content_length);
+
+                int rv = settings_->on_headers_complete ? settings_->on_headers_complete(parser_) : 0;
+                if(rv != 0 && rv != 1) return fail_(HPE_CB_headers_complete);
+                if(HTTP_PARSER_ERRNO(parser_) != HPE_OK && HTTP_PARSER_ERRNO(parser_) != HPE_PAUSED) return false;
+
+                bool skip_body = rv == 1;
+                bool paused = HTTP_PARSER_ERRNO(parser_) == HPE_PAUSED;
+
+                if(parser_->upgrade)
+                {
+                    // the rest of the input belongs to another protocol: http_parser stops here too.
+                    state_ = state::message_done;
+                    if(!paused) complete_();
+                    return false;
+                }
+
+                if(!skip_body && chunked)
+                {
+                    remaining_ = 0;
+                    state_ = state::chunk_size;
+                }
+                else if(!skip_body && content_length > 0)
+                {
+                    remaining_ = static_cast<uint64_t>(content_length);
+                    state_ = state::body;
+                }
+                else
+                {
+                    state_ = state::message_done;
+                    if(paused) return false;
+                    return complete_();
+                }
+                return !paused;
+            }
+
+            bool chunk_size_(char c)
+            {
+                int digit = hex_(c);
+                if(digit >= 0)
+                {
+                    if(remaining_ >> 60) return fail_(HPE_INVALID_CHUNK_SIZE);
+                    remaining_ = remaining_ * 16 + digit;
+                    chunk_digits_ = true;
+                    return true;
+                }
+
+                if(!chunk_digits_) return fail_(HPE_INVALID_CHUNK_SIZE);
+                chunk_digits_ = false;
+
+                if(c == '\r') state_ = state::chunk_size_lf;
+                else if(c == '\n') state_ = remaining_ ? state::chunk_data : state::trailer;
+                else if(c == ';' || c == ' ' || c == '\t') state_ = state::chunk_ext;
+                else return fail_(HPE_INVALID_CHUNK_SIZE);
+                return true;
+            }
+
+            bool complete_()
+            {
+                state_ = state::idle;
+                return notify_(settings_->on_message_complete, HPE_CB_message_complete);
+            }
+
+            // false: stop (the callback failed, or paused the parser)
+            bool notify_(http_cb cb, http_errno err)
+            {
+                if(cb && cb(parser_) != 0) return fail_(err);
+                return HTTP_PARSER_ERRNO(parser_) == HPE_OK;
+            }
+
+            bool notify_data_(http_data_cb cb, const char* at, std::size_t length, http_errno err)
+            {
+                if(cb && cb(parser_, at, length) != 0) return fail_(err);
+                return HTTP_PARSER_ERRNO(parser_) == HPE_OK;
+            }
+
+            // tokens of the head: a pause takes effect once the head is complete (see parse_head_()).
+            bool emit_(http_data_cb cb, const char* at, std::size_t length, http_errno err)
+            {
+                if(cb && cb(parser_, at, length) != 0) return fail_(err);
+                return true;
+            }
+
+            bool fail_(http_errno err)
+            {
+                if(HTTP_PARSER_ERRNO(parser_) == HPE_OK) parser_->http_errno = err;
+                state_ = state::dead;
+                return false;
+            }
+
+            std::size_t fail_(http_errno err, std::size_t parsed)
+            {
+                fail_(err);
+                return parsed;
+            }
+
+            static bool skip_eol_(const char*& p, const char* end)
+            {
+                if(p < end && *p == '\r') ++p;
+                if(p == end || *p != '\n') return false;
+                ++p;
+                return true;
+            }
+
+            template<typename F>
+            static void for_each_token_(const util::slice& list, F f)
+            {
+                std::size_t i = 0;
+                while(i < list.size())
+                {
+                    auto comma = list.find(',', i);
+                    if(comma == util::slice::npos) comma = list.size();
+
+                    auto b = i, e = comma;
+                    while(b < e && (list[b] == ' ' || list[b] == '\t')) ++b;
+                    while(e > b && (list[e - 1] == ' ' || list[e - 1] == '\t')) --e;
+                    if(e > b) f(list.substr(b, e - b));
+
+                    i = comma + 1;
+                }
+            }
+
+            // http_method values differ between http_parser versions: the table is built from http_method_str().
+            static int lookup_method_(const util::slice& token)
+            {
+                static std::vector<util::slice> methods;
+                if(methods.empty())
+                {
+                    for(int m=0;m<64;++m)
+                    {
+                        util::slice name = http_method_str(static_cast<http_method>(m));
+                        if(name.empty() || name[0] == '<') break;
+                        methods.push_back(name);
+                    }
+                }
+
+                for(std::size_t m=0;m<methods.size();++m) if(methods[m] == token) return static_cast<int>(m);
+                return -1;
+            }
+
+            static int64_t parse_length_(const util::slice& s)
+            {
+                if(s.empty() || s.size() > 18) return -1;
+
+                int64_t length = 0;
+                for(auto c : s)
+                {
+                    if(!is_digit_(c)) return -1;
+                    length = length * 10 + (c - '0');
+                }
+                return length;
+            }
+
+            static bool is_digit_(char c) { return c >= '0' && c <= '9'; }
+
+            static int hex_(char c)
+            {
+                if(c >= '0' && c <= '9') return c - '0';
+                c |= 0x20;
+                if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+                return -1;
+            }
+
+        private:
+            http_parser* parser_;
+            const http_parser_settings* settings_;
+            std::size_t max_head_;
+            state state_;
+            std::string head_;          // a head split across reads
+            std::size_t scanned_;       // where the search for the end of the head resumes
+            uint64_t remaining_;        // body or chunk bytes left
+            bool chunk_digits_;
+        };
+    }
+}
+
+#endif
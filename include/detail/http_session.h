@@ -0,0 +1,1077 @@
+#ifndef __DETAIL_HTTP_SESSION_H__
+#define __DETAIL_HTTP_SESSION_H__
+
+#include "base.h"
+#include "file_cache.h"
+#include "http.h"
+#include "http_metrics.h"
+#include "http_responder.h"
+#include "http_response.h"
+#include "server.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        class http_session;
+
+        // The body of a streamed response (see http_session::respond(id, response, writer)), sent as it is
+        // produced: chunked for HTTP/1.1, delimited by the end of the connection for HTTP/1.0. Each chunk goes out
+        // with one vectored write (size line, data, CRLF); small chunks are copied into one pooled buffer instead.
+        // Writes are never refused: a producer checks writable() and waits for on_drain once the data waiting for
+        // the socket reach the high watermark (Server-Sent Events, large generated bodies).
+        // end() finishes the body and deletes the writer; call it in every case, also after on_close.
+        class http_body_writer
+        {
+            friend class http_session;
+
+            typedef std::function<void(http_body_writer*)> on_drain_callback_type;
+            typedef std::function<void(http_body_writer*)> on_close_callback_type;
+
+        public:
+            static const std::size_t default_high_watermark = 256 * 1024;
+            static const std::size_t default_low_watermark = 64 * 1024;
+
+            // no copy allowed
+            http_body_writer(const http_body_writer&) = delete;
+            void operator=(const http_body_writer&) = delete;
+
+            // data is copied (see the other overload to hand a large piece over)
+            resval write(const util::slice& data)
+            {
+                if(closed_) return resval(error::ebadf);
+                if(data.empty() || no_body_) return resval();
+
+                if(!active_) frame_(data, backlog_);
+                else send_(data, nullptr, chunked_);
+                return written_();
+            }
+
+            resval write(std::string data)
+            {
+                if(closed_) return resval(error::ebadf);
+                if(data.empty() || no_body_) return resval();
+
+                if(!active_) frame_(data, backlog_);
+                else send_(data, &data, chunked_);
+                return written_();
+            }
+
+            // sent after the last chunk (chunked only): the client may ignore them unless it asked ("TE: trailers").
+            void add_trailer(const util::slice& name, const util::slice& value)
+            {
+                trailers_.append(name.data(), name.size());
+                trailers_ += ": ";
+                trailers_.append(value.data(), value.size());
+                trailers_ += "\r\n";
+            }
+
+            // Finishes the body (last chunk and trailers) and deletes the writer: ebadf if the connection is gone.
+            inline resval end();
+
+            // bytes waiting for the socket
+            inline std::size_t buffered() const;
+
+            bool writable() const { return buffered() < high_watermark_; }
+
+            // on_drain is invoked once the buffered bytes fall to low, after writes reached high.
+            void set_watermarks(std::size_t low, std::size_t high)
+            {
+                assert(low <= high);
+                low_watermark_ = low;
+                high_watermark_ = high;
+            }
+
+            void on_drain(on_drain_callback_type callback) { on_drain_ = callback; }
+
+            // the connection is gone before end(): writes fail with ebadf from now on.
+            void on_close(on_close_callback_type callback) { on_close_ = callback; }
+
+            bool is_closed() const { return closed_; }
+
+        private:
+            http_body_writer(http_session* session, bool chunked, bool no_body)
+                : session_(session)
+                , chunked_(chunked)
+                , no_body_(no_body)
+                , active_(false)
+                , ended_(false)
+                , closed_(false)
+                , waiting_drain_(false)
+                , sending_(false)
+                , calling_(false)
+                , backlog_()
+                , trailers_()
+                , low_watermark_(default_low_watermark)
+                , high_watermark_(default_high_watermark)
+                , on_drain_()
+                , on_close_()
+                , sample_()
+                , status_(0)
+            {}
+
+            inline ~http_body_writer();
+
+            // "<size in hex>\r\n" into buf, returns its length
+            static std::size_t chunk_head_(std::size_t size, char* buf)
+            {
+                static const char digits[] = "0123456789abcdef";
+
+                char tmp[2 * sizeof(std::size_t)];
+                std::size_t n = 0;
+                do tmp[n++] = digits[size & 0xf];
+                while(size >>= 4);
+
+                for(std::size_t i=0;i<n;++i) buf[i] = tmp[n - 1 - i];
+                buf[n] = '\r';
+                buf[n+1] = '\n';
+                return n + 2;
+            }
+
+            // appends data, framed, to out
+            void frame_(const util::slice& data, std::string& out) const
+            {
+                if(chunked_)
+                {
+                    char head[2 * sizeof(std::size_t) + 2];
+                    out.append(head, chunk_head_(data.size(), head));
+                }
+                out.append(data.data(), data.size());
+                if(chunked_) out += "\r\n";
+            }
+
+            // the last chunk and the trailers
+            void end_frame_(std::string& out) const
+            {
+                if(!chunked_ || no_body_) return;
+                out += "0\r\n";
+                out += trailers_;
+                out += "\r\n";
+            }
+
+            void send_(const util::slice& data, std::string* owned, bool framed)
+            {
+                sending_ = true;
+                send_chunk_(data, owned, framed);
+                sending_ = false;
+            }
+
+            inline void send_chunk_(const util::slice& data, std::string* owned, bool framed);
+
+            // invokes a callback, which may end() the writer
+            void call_(const on_drain_callback_type& callback)
+            {
+                calling_ = true;
+                callback(this);
+                calling_ = false;
+                if(ended_) delete this;
+            }
+
+            resval written_()
+            {
+                if(closed_) return resval(error::ebadf);
+                if(buffered() >= high_watermark_) waiting_drain_ = true;
+                return resval();
+            }
+
+            // a write of the session completed
+            void after_write_()
+            {
+                if(!waiting_drain_ || buffered() > low_watermark_) return;
+
+                waiting_drain_ = false;
+                if(on_drain_) call_(on_drain_);
+            }
+
+            // the connection is gone
+            void close_()
+            {
+                if(closed_) return;
+
+                closed_ = true;
+                active_ = false;
+
+                // ended before its head went out: nobody holds it any more
+                if(ended_ && !calling_)
+                {
+                    delete this;
+                    return;
+                }
+
+                // within write(), its result tells instead
+                if(!sending_ && on_close_) call_(on_close_);
+            }
+
+        private:
+            http_session* session_;
+            bool chunked_;
+            bool no_body_;              // HEAD request, or a status without body
+            bool active_;               // the head has been written: data go straight to the socket
+            bool ended_;                // end() before the head was written, or from a callback
+            bool closed_;
+            bool waiting_drain_;
+            bool sending_;              // in send_()
+            bool calling_;              // in a callback
+            std::string backlog_;       // framed data written before the head
+            std::string trailers_;
+            std::size_t low_watermark_;
+            std::size_t high_watermark_;
+            on_drain_callback_type on_drain_;
+            on_close_callback_type on_close_;
+            http_request_sample sample_;    // see http_session::set_metrics()
+            int status_;
+        };
+
+        // One HTTP/1.x connection serving any number of requests (keep-alive and pipelining).
+        // Requests are numbered in arrival order and responses go out in that same order, whatever order
+        // the handler answers them in. The session owns the connection and deletes itself after closing it:
+        // when the peer is done, when a response ends the exchange ("Connection: close"), or on error.
+        class http_session : public http_responder
+        {
+            typedef std::function<void(http_session*, std::size_t, const http_parse_result*)> on_request_callback_type;
+            typedef std::function<void(http_session*, resval)> on_error_callback_type;
+            typedef std::function<void(stream*)> on_upgraded_callback_type;
+
+            friend class http_body_writer;
+
+        public:
+            // tracker (optional): the connection is marked busy while a request is waiting for its response.
+            http_session(stream* conn, server* tracker=nullptr)
+                : conn_(conn)
+                , tracker_(tracker)
+                , parser_(HTTP_REQUEST, [this](const http_parse_result* r, resval rv) { after_parse_(r, rv); }, true)
+                , on_request_()
+                , on_error_()
+                , on_upgraded_()
+                , pending_()
+                , in_flight_()
+                , sender_(nullptr)
+                , streaming_(nullptr)
+                , metrics_(false)
+                , read_at_(0)
+                , message_at_(0)
+                , file_sample_()
+                , file_status_(0)
+                , first_id_(0)
+                , next_id_(0)
+                , refs_(0)
+                , reading_(false)
+                , paused_(false)
+                , dispatching_(false)
+                , closing_(false)
+                , sending_file_(false)
+                , ending_(false)
+                , closed_(false)
+            {
+                assert(conn_);
+                parser_.set_limits(http_limits());
+            }
+
+            // no copy allowed
+            http_session(const http_session&) = delete;
+            void operator=(const http_session&) = delete;
+
+            // Invoked once the request head is complete (see read_body() for the body). The result (and its slices)
+            // is valid until the callback returns; answer with respond(id, ...).
+            void on_request(on_request_callback_type callback)
+            {
+                on_request_ = callback;
+            }
+
+            // malformed request, incomplete request at EOF, request over a limit (emsgsize), too slow a peer
+            // (etimedout), or I/O error: the connection is closed afterwards.
+            void on_error(on_error_callback_type callback)
+            {
+                on_error_ = callback;
+            }
+
+            // Sizes and timeouts of requests (http_limits() by default). The idle timeout runs once every response
+            // has been written.
+            void set_limits(const http_limits& limits)
+            {
+                parser_.set_limits(limits);
+            }
+
+            // Records every request into http_metrics::get() (off by default); see set_route().
+            void set_metrics(bool enable)
+            {
+                metrics_ = enable;
+            }
+
+            // the route of request 'id' in the metrics (see http_metrics::route(), and http_router which sets it).
+            virtual void set_route(std::size_t id, std::size_t route)
+            {
+                if(id >= first_id_ && id - first_id_ < pending_.size()) pending_[id - first_id_].metrics.route = route;
+            }
+
+            resval start()
+            {
+                conn_->on_read([this](const char* data, std::size_t offset, std::size_t length, stream*, resval rv) {
+                    after_read_(data, offset, length, rv);
+                });
+                conn_->on_complete([this](resval rv) { after_write_(rv); });
+
+                resval rv = conn_->read_start();
+                if(rv) reading_ = true;
+                return rv;
+            }
+
+            // Answers request 'id' with a complete serialized response. It is written once every earlier
+            // request has been answered.
+            resval respond(std::size_t id, std::string response)
+            {
+                if(closed_) return resval(error::ebadf);
+                if(id < first_id_ || id - first_id_ >= pending_.size()) return resval(error::einval);
+
+                auto& p = pending_[id - first_id_];
+                if(p.ready) return resval(error::einval);
+
+                p.ready = true;
+                answered_(p);
+                p.body = std::move(response);
+                return flush_();
+            }
+
+            // Answers request 'id' with a response whose head and body go out in one vectored write. A response
+            // without keep-alive ("Connection: close") is the last one: later requests are dropped unanswered.
+            virtual resval respond(std::size_t id, http_response&& response)
+            {
+                return respond_(id, std::move(response), !response.keep_alive());
+            }
+
+            // Answers request 'id' with the last response (101 Switching Protocols), then hands the connection
+            // over instead of closing it: on_upgraded receives it once the response is written, and the session is
+            // gone by then. Input that followed the request in the same read is not handed over (a client waits
+            // for the response before it speaks the new protocol).
+            resval upgrade(std::size_t id, http_response&& response, on_upgraded_callback_type on_upgraded)
+            {
+                if(closed_) return resval(error::ebadf);
+                if(!on_upgraded || on_upgraded_) return resval(error::einval);
+
+                on_upgraded_ = on_upgraded;
+                resval rv = respond_(id, std::move(response), true);
+                if(!rv) on_upgraded_ = nullptr;
+                return rv;
+            }
+
+            // Answers request 'id' with a head followed by length bytes of a file from offset, copied from the
+            // page cache to the socket by sendfile (see file_sender). The session keeps its own reference to file.
+            virtual resval respond(std::size_t id, http_response&& response, file_entry* file, int64_t offset, int64_t length)
+            {
+                if(closed_) return resval(error::ebadf);
+                if(id < first_id_ || id - first_id_ >= pending_.size()) return resval(error::einval);
+                if(!file || offset < 0 || length < 0 || offset + length > file->size()) return resval(error::einval);
+
+                auto& p = pending_[id - first_id_];
+                if(p.ready) return resval(error::einval);
+
+                response.set_content_length(length);
+
+                p.ready = true;
+                answered_(p);
+                p.last = !response.keep_alive();
+                p.head = response.take_head(p.head_data);
+                if(length > 0 && !p.head_only)
+                {
+                    file->retain();
+                    p.file = file;
+                    p.file_offset = offset;
+                    p.file_length = length;
+                }
+                return flush_();
+            }
+
+            // Answers request 'id' with a head whose body is written later, as it is produced, through writer (see
+            // http_body_writer): later responses wait until its end(). writer is set even if the head cannot be
+            // written (it is closed then): end() deletes it.
+            resval respond(std::size_t id, http_response&& response, http_body_writer*& writer)
+            {
+                writer = nullptr;
+                if(closed_) return resval(error::ebadf);
+                if(id < first_id_ || id - first_id_ >= pending_.size()) return resval(error::einval);
+
+                auto& p = pending_[id - first_id_];
+                if(p.ready) return resval(error::einval);
+
+                response.set_streamed(p.chunked);
+                writer = new http_body_writer(this, p.chunked, p.head_only || !response.has_body());
+                assert(writer);
+                retain();
+
+                p.ready = true;
+                answered_(p);
+                p.last = !response.keep_alive();
+                p.head = response.take_head(p.head_data);
+                p.writer = writer;
+                return flush_();
+            }
+
+            // Answers request 'id' with a complete serialized response held by a pooled buffer (see http_cache): it
+            // is written from there without a copy, and the session keeps its own reference to data meanwhile.
+            // 'last' ends the exchange, as a response without keep-alive does.
+            virtual resval respond(std::size_t id, buffer* data, const util::slice& response, bool last)
+            {
+                if(closed_) return resval(error::ebadf);
+                if(id < first_id_ || id - first_id_ >= pending_.size()) return resval(error::einval);
+                if(!data || response.empty()) return resval(error::einval);
+
+                auto& p = pending_[id - first_id_];
+                if(p.ready) return resval(error::einval);
+
+                data->retain();
+                p.ready = true;
+                answered_(p);
+                p.last = last;
+                p.head = data;
+                p.head_data = response;
+                return flush_();
+            }
+
+            // Streams the body of the request being dispatched (call it from on_request): slices are valid during
+            // the callback only. Without it, the body is discarded.
+            virtual void read_body(http_body_callback_type callback)
+            {
+                parser_.on_body(callback);
+            }
+
+            // Backpressure: stops parsing and reading from the socket until resume_body(), so that a large
+            // upload never piles up in memory while the handler's sink is busy.
+            void pause_body()
+            {
+                if(paused_ || closed_) return;
+
+                paused_ = true;
+                parser_.pause();
+                if(reading_) conn_->read_stop();
+            }
+
+            void resume_body()
+            {
+                if(!paused_ || closed_) return;
+
+                paused_ = false;
+                if(reading_) conn_->read_start();
+
+                // the input kept by the parser is parsed now (unless called from a callback of the parser).
+                bool nested = dispatching_;
+                dispatching_ = true;
+                bool finished = parser_.resume();
+                dispatching_ = nested;
+                if(nested) return;
+
+                if(closing_)
+                {
+                    close();
+                    return;
+                }
+                if(finished) stop_reading_();
+                close_if_done_();
+            }
+
+            // closes the connection right away: unanswered requests and unsent responses are dropped.
+            void close()
+            {
+                if(closed_) return;
+
+                if(dispatching_)
+                {
+                    // inside the parser: close once it returns.
+                    closing_ = true;
+                    return;
+                }
+
+                if(sender_) sender_->close();
+                sender_ = nullptr;
+
+                conn_->on_read(nullptr);
+                conn_->on_complete(nullptr);
+                conn_->close();
+                destroy_();
+            }
+
+            // A party answering requests later (see http_cache) holds a reference: a session closed meanwhile is
+            // deleted by the last release() instead, and answers respond() with ebadf until then.
+            virtual void retain() { ++refs_; }
+
+            virtual void release()
+            {
+                assert(refs_ > 0);
+                if(--refs_ == 0 && closed_) delete this;
+            }
+
+            bool is_closed() const { return closed_; }
+
+            stream* connection() const { return conn_; }
+
+            // requests parsed so far
+            std::size_t requests() const { return next_id_; }
+
+            // requests waiting for their response to be written
+            std::size_t pending_responses() const { return pending_.size(); }
+
+        private:
+            ~http_session()
+            {
+                for(auto& r : pending_) release_(r);
+                for(auto& r : in_flight_) release_(r);
+            }
+
+            // a response: serialized head (pooled) and body (owned, referenced, a range of a file, or streamed); or a
+            // chunk of a streamed body
+            struct pending_response
+            {
+                // chunked and head_only come from the request; a write of the stream's own is neither.
+                pending_response(bool chunked, bool head_only)
+                    : ready(false)
+                    , last(false)
+                    , head(nullptr)
+                    , head_data()
+                    , body()
+                    , body_ref()
+                    , file(nullptr)
+                    , file_offset(0)
+                    , file_length(0)
+                    , writer(nullptr)
+                    , crlf(false)
+                    , chunked(chunked)
+                    , head_only(head_only)
+                    , metrics()
+                {}
+
+                bool ready;
+                bool last;              // the connection closes after it
+                buffer* head;
+                util::slice head_data;
+                std::string body;
+                util::slice body_ref;
+                file_entry* file;
+                int64_t file_offset;
+                int64_t file_length;
+                http_body_writer* writer;
+                bool crlf;              // a chunk: CRLF after the body
+                bool chunked;           // the request accepts a chunked response (HTTP/1.1)
+                bool head_only;         // HEAD request
+                http_request_sample metrics;
+            };
+
+            resval respond_(std::size_t id, http_response&& response, bool last)
+            {
+                if(closed_) return resval(error::ebadf);
+                if(id < first_id_ || id - first_id_ >= pending_.size()) return resval(error::einval);
+
+                auto& p = pending_[id - first_id_];
+                if(p.ready) return resval(error::einval);
+
+                p.ready = true;
+                answered_(p);
+                p.last = last;
+                p.head = response.take_head(p.head_data);
+                if(p.head_only) return flush_();   // the head still carries the body's Content-Length
+
+                p.body = std::move(response.body_string());
+                if(p.body.empty()) p.body_ref = response.body();
+                return flush_();
+            }
+
+            void answered_(pending_response& p)
+            {
+                if(metrics_ && p.metrics.parsed) p.metrics.answered = uv_hrtime();
+            }
+
+            // the status code of a serialized response ("HTTP/1.1 200 ...")
+            static int status_of_(const pending_response& r)
+            {
+                auto head = r.head_data.empty() ? util::slice(r.body) : r.head_data;
+                if(head.size() < 12 || head[8] != ' ') return 0;
+
+                int status = 0;
+                for(std::size_t i=9;i<12;++i)
+                {
+                    if(head[i] < '0' || head[i] > '9') return 0;
+                    status = status * 10 + (head[i] - '0');
+                }
+                return status;
+            }
+
+            // a response is written (a file response once its file is sent as well)
+            void record_(pending_response& r)
+            {
+                if(!metrics_ || !r.metrics.parsed) return;
+
+                auto body = r.body.empty() ? r.body_ref : util::slice(r.body);
+                r.metrics.bytes_out = r.head_data.size() + body.size() + static_cast<uint64_t>(r.file_length);
+                if(r.file)
+                {
+                    file_sample_ = r.metrics;
+                    file_status_ = status_of_(r);
+                    return;
+                }
+                http_metrics::get().record(r.metrics, status_of_(r), uv_hrtime());
+            }
+
+            static void release_(pending_response& r)
+            {
+                if(r.head) r.head->release();
+                if(r.file) r.file->release();
+                r.head = nullptr;
+                r.file = nullptr;
+
+                // a streamed response that will never be written
+                auto writer = r.writer;
+                r.writer = nullptr;
+                if(writer) writer->close_();
+            }
+
+            void after_read_(const char* data, std::size_t offset, std::size_t length, resval rv)
+            {
+                if(rv)
+                {
+                    if(metrics_)
+                    {
+                        read_at_ = uv_hrtime();
+                        if(!parser_.in_message()) message_at_ = read_at_;
+                    }
+
+                    // handlers may answer (or close) from within the parser.
+                    dispatching_ = true;
+                    bool finished = parser_.feed_data(data, offset, length, conn_->read_buffer());
+                    dispatching_ = false;
+
+                    if(closing_)
+                    {
+                        close();
+                        return;
+                    }
+                    if(finished) stop_reading_();
+                }
+                else
+                {
+                    // within a message, the parser tells the body handler first (and reports it, see after_parse_()).
+                    if(parser_.in_message())
+                    {
+                        dispatching_ = true;
+                        parser_.abort(rv.code() == error::eof ? resval(error::http_parser_incomplete) : rv);
+                        dispatching_ = false;
+
+                        if(closing_)
+                        {
+                            close();
+                            return;
+                        }
+                    }
+                    else if(rv.code() != error::eof) report_(rv);
+                    stop_reading_();
+                }
+
+                close_if_done_();
+            }
+
+            void after_parse_(const http_parse_result* r, resval rv)
+            {
+                if(closed_) return;
+
+                if(!r)
+                {
+                    // an idle keep-alive connection timing out is no error.
+                    if(rv.code() != error::etimedout || parser_.in_message()) report_(rv);
+
+                    // the parser is finished: reading stops after feed_data(), unless a timeout fired between reads
+                    // (the peer is too slow: what is pending is dropped).
+                    if(!dispatching_) close();
+                    return;
+                }
+
+                // requests pipelined behind the last response
+                if(ending_) return;
+
+                auto id = next_id_++;
+                bool chunked = r->http_major() > 1 || (r->http_major() == 1 && r->http_minor() >= 1);
+                bool head_only = r->method() == util::slice("HEAD");
+                pending_.push_back(pending_response(chunked, head_only));
+                if(metrics_)
+                {
+                    auto& m = pending_.back().metrics;
+                    m.started = message_at_;
+                    m.parsed = uv_hrtime();
+                    m.bytes_in = parser_.head_bytes() + static_cast<uint64_t>(std::max<int64_t>(r->content_length(), 0));
+
+                    // a pipelined request starts in the same read at the earliest
+                    message_at_ = read_at_;
+                }
+                if(tracker_) tracker_->set_busy(conn_, true);
+                parser_.set_busy(true);
+
+                if(on_request_) on_request_(this, id, r);
+            }
+
+            // writes the answered responses at the head of the queue, in request order. Nothing is written behind
+            // a file: its data go out once its head has been written (see after_write_()).
+            resval flush_()
+            {
+                while(!sending_file_ && !streaming_ && !pending_.empty() && pending_.front().ready)
+                {
+                    auto r = std::move(pending_.front());
+                    pending_.pop_front();
+                    ++first_id_;
+
+                    auto writer = r.writer;
+                    r.writer = nullptr;
+                    if(writer)
+                    {
+                        // recorded once the stream ends
+                        writer->sample_ = r.metrics;
+                        writer->sample_.bytes_out = r.head_data.size() + writer->backlog_.size();
+                        writer->status_ = status_of_(r);
+                        r.metrics.parsed = 0;
+                    }
+                    bool last = r.last;
+                    bool file = r.file != nullptr;
+
+                    resval rv = write_(std::move(r));
+
+                    if(writer)
+                    {
+                        if(!rv)
+                        {
+                            writer->close_();
+                            return rv;
+                        }
+                        if(!start_stream_(writer)) return resval(error::ebadf);
+                    }
+                    if(!rv) return rv;
+
+                    if(file) sending_file_ = true;
+                    if(last)
+                    {
+                        end_();
+                        break;
+                    }
+                }
+
+                if(tracker_ && pending_.empty()) tracker_->set_busy(conn_, false);
+                return resval();
+            }
+
+            // Writes a response (or a chunk): the data must stay alive until the write completes (see after_write_()).
+            resval write_(pending_response&& response)
+            {
+                static const char crlf[] = "\r\n";
+
+                in_flight_.push_back(std::move(response));
+
+                auto& r = in_flight_.back();
+                auto body = r.body.empty() ? r.body_ref : util::slice(r.body);
+
+                uv_buf_t bufs[3];
+                int count = 0;
+                if(!r.head_data.empty()) bufs[count++] = uv_buf_t { const_cast<char*>(r.head_data.data()), r.head_data.size() };
+                if(!body.empty()) bufs[count++] = uv_buf_t { const_cast<char*>(body.data()), body.size() };
+                if(r.crlf) bufs[count++] = uv_buf_t { const_cast<char*>(crlf), 2 };
+
+                resval rv = count ? conn_->write(bufs, count) : resval(error::einval);
+                if(!rv)
+                {
+                    release_(r);
+                    in_flight_.pop_back();
+                    report_(rv);
+                    close();
+                }
+                return rv;
+            }
+
+            // The head of a streamed response is written: what was written to writer before goes out, and it
+            // writes to the socket from now on (or is done, if it ended already). False if the session closed.
+            bool start_stream_(http_body_writer* writer)
+            {
+                if(!writer->backlog_.empty())
+                {
+                    pending_response r(false, false);
+                    r.ready = true;
+                    r.body = std::move(writer->backlog_);
+                    writer->backlog_.clear();
+                    if(!write_(std::move(r)))
+                    {
+                        writer->close_();
+                        return false;
+                    }
+                }
+
+                if(writer->ended_)
+                {
+                    delete writer;
+                    return true;
+                }
+
+                writer->active_ = true;
+                streaming_ = writer;
+                return true;
+            }
+
+            // the streamed response is complete: the responses after it can go.
+            void end_stream_()
+            {
+                // its write time runs to its end() (its data may still be on their way)
+                if(metrics_ && streaming_->sample_.parsed) http_metrics::get().record(streaming_->sample_, streaming_->status_, uv_hrtime());
+                streaming_ = nullptr;
+                if(flush_()) close_if_done_();
+            }
+
+            // stream writes complete in the order they were issued.
+            void after_write_(resval rv)
+            {
+                assert(!in_flight_.empty());
+                auto done = std::move(in_flight_.front());
+                in_flight_.pop_front();
+
+                // the head goes: measure first
+                if(rv) record_(done);
+
+                if(done.head) done.head->release();
+                done.head = nullptr;
+
+                if(!rv)
+                {
+                    release_(done);
+                    report_(rv);
+                    close();
+                    return;
+                }
+
+                if(done.file)
+                {
+                    send_file_(done);
+                    return;
+                }
+
+                // the producer may write more (or end) from there.
+                if(streaming_)
+                {
+                    streaming_->after_write_();
+                    return;
+                }
+
+                close_if_done_();
+            }
+
+            void send_file_(pending_response& r)
+            {
+                if(!sender_)
+                {
+                    sender_ = new file_sender(conn_->uv_stream()->io_watcher.fd);
+                    assert(sender_);
+                }
+
+                resval rv = sender_->send(r.file, r.file_offset, r.file_length, [this](resval rv) { after_send_file_(rv); });
+                release_(r);
+                if(!rv) after_send_file_(rv);
+            }
+
+            void after_send_file_(resval rv)
+            {
+                sending_file_ = false;
+
+                if(!rv)
+                {
+                    report_(rv);
+                    close();
+                    return;
+                }
+
+                if(metrics_ && file_sample_.parsed)
+                {
+                    http_metrics::get().record(file_sample_, file_status_, uv_hrtime());
+                    file_sample_.parsed = 0;
+                }
+
+                if(flush_()) close_if_done_();
+            }
+
+            // no more requests will come and every response has been written.
+            void close_if_done_()
+            {
+                if(sending_file_ || streaming_ || !pending_.empty() || !in_flight_.empty()) return;
+
+                if(reading_)
+                {
+                    // waiting for the next request
+                    parser_.set_busy(false);
+                    return;
+                }
+
+                if(on_upgraded_) hand_over_();
+                else close();
+            }
+
+            // the upgrade response is written: the connection now belongs to the new protocol.
+            void hand_over_()
+            {
+                if(sender_) sender_->close();
+                sender_ = nullptr;
+
+                // long-lived from now on: keep it out of the idle connections of a drain
+                if(tracker_) tracker_->set_busy(conn_, true);
+
+                conn_->on_read(nullptr);
+                conn_->on_complete(nullptr);
+
+                auto conn = conn_;
+                auto on_upgraded = std::move(on_upgraded_);
+                destroy_();
+
+                on_upgraded(conn);
+            }
+
+            // the last response is on its way: stop reading and forget the requests after it.
+            void end_()
+            {
+                ending_ = true;
+                stop_reading_();
+
+                for(auto& r : pending_) release_(r);
+                pending_.clear();
+                first_id_ = next_id_;
+            }
+
+            void stop_reading_()
+            {
+                if(!reading_) return;
+
+                conn_->read_stop();
+                reading_ = false;
+            }
+
+            void report_(resval rv)
+            {
+                if(on_error_) on_error_(this, rv);
+            }
+
+            // the connection is closed (or handed over): the session goes once nobody holds it.
+            void destroy_()
+            {
+                closed_ = true;
+
+                // a body still being read ends with an error for its reader, and streamed responses are closed (both
+                // may hold the last reference).
+                ++refs_;
+                parser_.abort(resval(error::ecanceled));
+
+                auto writer = streaming_;
+                streaming_ = nullptr;
+                if(writer) writer->close_();
+                for(auto& r : pending_)
+                {
+                    writer = r.writer;
+                    r.writer = nullptr;
+                    if(writer) writer->close_();
+                }
+
+                if(--refs_ == 0) delete this;
+            }
+
+        private:
+            stream* conn_;
+            server* tracker_;
+            http_parser_context parser_;
+            on_request_callback_type on_request_;
+            on_error_callback_type on_error_;
+            on_upgraded_callback_type on_upgraded_;
+
+            std::deque<pending_response> pending_;
+            std::deque<pending_response> in_flight_;
+            file_sender* sender_;       // created by the first file response
+            http_body_writer* streaming_;   // the streamed response being written: later responses wait
+            bool metrics_;
+            uint64_t read_at_;          // uv_hrtime() of the last read
+            uint64_t message_at_;       // of the read where the request being parsed started
+            http_request_sample file_sample_;   // of the file being sent
+            int file_status_;
+            std::size_t first_id_;      // id of pending_.front()
+            std::size_t next_id_;
+            std::size_t refs_;          // see retain()
+
+            bool reading_;
+            bool paused_;
+            bool dispatching_;
+            bool closing_;
+            bool sending_file_;         // a file is being sent (or its head written): later responses wait
+            bool ending_;               // the last response has been written
+            bool closed_;
+        };
+
+        http_body_writer::~http_body_writer()
+        {
+            session_->release();
+        }
+
+        resval http_body_writer::end()
+        {
+            resval rv;
+            if(closed_) rv = resval(error::ebadf);
+            else if(!active_)
+            {
+                // the head is not written yet: the session ends it after the backlog.
+                end_frame_(backlog_);
+                ended_ = true;
+                return rv;
+            }
+            else
+            {
+                std::string last;
+                end_frame_(last);
+                if(!last.empty()) send_(last, &last, false);
+
+                if(!closed_) session_->end_stream_();
+                else rv = resval(error::ebadf);
+            }
+
+            // from its own callback: deleted once it returns
+            if(calling_) ended_ = true;
+            else delete this;
+            return rv;
+        }
+
+        std::size_t http_body_writer::buffered() const
+        {
+            if(closed_) return 0;
+            if(!active_) return backlog_.size();
+            return session_->conn_->write_queue_size();
+        }
+
+        // A chunk goes out as a pooled buffer holding the size line (and the data and CRLF, if they fit) and the
+        // data as they are, with one vectored write.
+        void http_body_writer::send_chunk_(const util::slice& data, std::string* owned, bool framed)
+        {
+            auto head = http_response::head_pool().acquire();
+            assert(head);
+
+            std::size_t n = framed ? chunk_head_(data.size(), head->data()) : 0;
+
+            http_session::pending_response r(false, false);
+            r.ready = true;
+            r.head = head;
+            if(n + data.size() + 2 <= head->capacity())
+            {
+                std::memcpy(head->data() + n, data.data(), data.size());
+                n += data.size();
+                if(framed)
+                {
+                    head->data()[n++] = '\r';
+                    head->data()[n++] = '\n';
+                }
+            }
+            else
+            {
+                if(owned) r.body = std::move(*owned);
+                else r.body = data.to_string();
+                r.crlf = framed;
+            }
+            r.head_data = util::slice(head->data(), n);
+            sample_.bytes_out += n + r.body.size() + (r.crlf ? 2 : 0);
+
+            // a failed write closes the session, and this writer with it.
+            session_->write_(std::move(r));
+        }
+    }
+}
+
+#endif
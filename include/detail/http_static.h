@@ -0,0 +1,271 @@
+#ifndef __DETAIL_HTTP_STATIC_H__
+#define __DETAIL_HTTP_STATIC_H__
+
+#include "base.h"
+#include "file_cache.h"
+#include "http_conditional.h"
+#include "http_responder.h"
+#include "http_url.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        enum class http_range_result
+        {
+            ignore,         // no usable range: send the whole representation
+            ok,
+            unsatisfiable
+        };
+
+        // Parses "bytes=first-last", "bytes=first-" or "bytes=-suffix" against a representation of 'size' bytes
+        // and clamps it. Other units, malformed values and multiple ranges are ignored (allowed by RFC 7233).
+        inline http_range_result http_parse_range(const util::slice& value, int64_t size, int64_t& first, int64_t& last)
+        {
+            static const util::slice unit("bytes=");
+
+            if(value.size() <= unit.size() || !value.substr(0, unit.size()).equals_no_case(unit)) return http_range_result::ignore;
+
+            auto spec = value.substr(unit.size());
+            auto dash = spec.find('-');
+            if(dash == util::slice::npos || spec.find(',') != util::slice::npos) return http_range_result::ignore;
+
+            // digits only, without overflow; -1 if empty
+            auto number = [](const util::slice& s, bool& valid) -> int64_t {
+                if(s.empty()) return -1;
+
+                int64_t n = 0;
+                for(auto c : s)
+                {
+                    if(c < '0' || c > '9' || n > (INT64_MAX - 9) / 10)
+                    {
+                        valid = false;
+                        return -1;
+                    }
+                    n = n * 10 + (c - '0');
+                }
+                return n;
+            };
+
+            bool valid = true;
+            auto a = number(spec.substr(0, dash), valid);
+            auto b = number(spec.substr(dash + 1), valid);
+            if(!valid || (a < 0 && b < 0) || (a >= 0 && b >= 0 && b < a)) return http_range_result::ignore;
+
+            if(a < 0)
+            {
+                // suffix: the last b bytes
+                if(b == 0 || size == 0) return http_range_result::unsatisfiable;
+                first = size - std::min(b, size);
+                last = size - 1;
+                return http_range_result::ok;
+            }
+
+            if(a >= size) return http_range_result::unsatisfiable;
+            first = a;
+            last = (b < 0 || b >= size) ? size - 1 : b;
+            return http_range_result::ok;
+        }
+
+        // Content-Type for the extension of a path (application/octet-stream if unknown).
+        inline util::slice http_content_type(const util::slice& path)
+        {
+            static const struct { const char* ext; const char* type; } types[] = {
+                { "html", "text/html; charset=utf-8" },
+                { "htm", "text/html; charset=utf-8" },
+                { "css", "text/css; charset=utf-8" },
+                { "js", "application/javascript; charset=utf-8" },
+                { "mjs", "application/javascript; charset=utf-8" },
+                { "json", "application/json" },
+                { "map", "application/json" },
+                { "txt", "text/plain; charset=utf-8" },
+                { "xml", "application/xml" },
+                { "svg", "image/svg+xml" },
+                { "png", "image/png" },
+                { "jpg", "image/jpeg" },
+                { "jpeg", "image/jpeg" },
+                { "gif", "image/gif" },
+                { "webp", "image/webp" },
+                { "ico", "image/x-icon" },
+                { "woff", "font/woff" },
+                { "woff2", "font/woff2" },
+                { "wasm", "application/wasm" },
+                { "pdf", "application/pdf" },
+                { "mp4", "video/mp4" },
+                { "webm", "video/webm" },
+            };
+
+            auto dot = path.rfind('.');
+            auto slash = path.rfind('/');
+            if(dot != util::slice::npos && (slash == util::slice::npos || dot > slash))
+            {
+                auto ext = path.substr(dot + 1);
+                for(auto& t : types) if(ext.equals_no_case(t.ext)) return t.type;
+            }
+            return "application/octet-stream";
+        }
+
+        // Serves the files under a directory to GET and HEAD requests of a session (see http_responder). Files come
+        // from a file_cache (no open() or stat() for a hot file) and their data are sent with sendfile over HTTP/1.x
+        // (no copy through user space). Supports single byte ranges ("Range", "If-Range"); validators are the ETag and
+        // Last-Modified of the cached entry. They are also kept by request path in an http_conditional, which
+        // answers a revalidation of a file served lately before the path is even decoded.
+        class http_static_files
+        {
+        public:
+            http_static_files(const std::string& root, file_cache& cache=file_cache::get(), http_conditional& validators=http_conditional::get())
+                : root_(root)
+                , index_("index.html")
+                , cache_(cache)
+                , validators_(validators)
+                , key_()
+            {
+                while(!root_.empty() && root_.back() == '/') root_.pop_back();
+            }
+
+            // file served for a path ending with '/'
+            void set_index(const std::string& name) { index_ = name; }
+
+            // Answers request 'id' if it is a GET or a HEAD, and returns false otherwise (the request is left to
+            // the caller).
+            bool serve(http_responder* session, std::size_t id, const http_parse_result* r)
+            {
+                bool head = r->method() == "HEAD";
+                if(!head && r->method() != "GET") return false;
+
+                // keyed by root too: instances share the validators
+                key_.assign(root_);
+                key_.append(r->path().data(), r->path().size());
+                if(validators_.serve(session, id, r, key_)) return true;
+
+                std::string path;
+                if(!map_path_(r->path(), path))
+                {
+                    session->respond(id, http_response(400));
+                    return true;
+                }
+
+                resval rv;
+                auto file = cache_.open(path, rv);
+                if(!file)
+                {
+                    auto code = rv.code();
+                    int status = (code == error::enoent || code == error::enotdir || code == error::eisdir
+                        || code == error::enametoolong || code == error::eloop) ? 404
+                        : (code == error::eacces || code == error::eperm) ? 403 : 500;
+                    session->respond(id, http_response(status));
+                    return true;
+                }
+
+                validators_.set(key_, file->etag(), file->mtime());
+                if(validators_.serve(session, id, r, key_))
+                {
+                    file->release();
+                    return true;
+                }
+
+                char last_modified[32];
+                auto n = http_date::format(file->mtime(), last_modified, sizeof(last_modified));
+
+                http_response res(200);
+                res.add_header("Content-Type", http_content_type(path.c_str()));
+                res.add_header("ETag", file->etag());
+                res.add_header("Last-Modified", util::slice(last_modified, n));
+                res.add_header("Accept-Ranges", "bytes");
+
+                int64_t first = 0;
+                int64_t length = file->size();
+
+                auto range = r->header(http_header_id::range);
+                if(!range.empty() && if_range_(r, file, util::slice(last_modified, n)))
+                {
+                    int64_t last = 0;
+                    char content_range[96];
+
+                    switch(http_parse_range(range, file->size(), first, last))
+                    {
+                    case http_range_result::ok:
+                        length = last - first + 1;
+                        res.set_status(206);
+                        res.add_header("Content-Range", util::slice(content_range, std::snprintf(content_range, sizeof(content_range),
+                            "bytes %lld-%lld/%lld", static_cast<long long>(first), static_cast<long long>(last), static_cast<long long>(file->size()))));
+                        break;
+
+                    case http_range_result::unsatisfiable:
+                        res.set_status(416);
+                        res.add_header("Content-Range", util::slice(content_range, std::snprintf(content_range, sizeof(content_range),
+                            "bytes */%lld", static_cast<long long>(file->size()))));
+                        session->respond(id, std::move(res));
+                        file->release();
+                        return true;
+
+                    case http_range_result::ignore:
+                        first = 0;
+                        break;
+                    }
+                }
+
+                if(head)
+                {
+                    res.set_content_length(length);
+                    session->respond(id, std::move(res));
+                }
+                else session->respond(id, std::move(res), file, first, length);
+
+                file->release();
+                return true;
+            }
+
+        private:
+            // the range applies if If-Range is absent or matches the current validator.
+            static bool if_range_(const http_parse_result* r, const file_entry* file, const util::slice& last_modified)
+            {
+                auto v = r->header(http_header_id::if_range);
+                if(v.empty()) return true;
+                if(v[0] == '"') return v == file->etag();
+                return v == last_modified;
+            }
+
+            // Decodes the request path and maps it under the root. Rejects malformed escapes, NULs and ".." segments.
+            bool map_path_(const util::slice& target, std::string& path) const
+            {
+                if(target.empty() || target[0] != '/') return false;
+
+                path.reserve(root_.size() + target.size() + index_.size());
+                path.assign(root_);
+                path.resize(root_.size() + target.size());
+
+                std::size_t size = 0;
+                if(!http_percent_decode(target, &path[root_.size()], size)) return false;
+                path.resize(root_.size() + size);
+                if(std::memchr(path.data() + root_.size(), '\0', size)) return false;
+
+                // segments, escaped slashes included
+                auto segment = root_.size() + 1;
+                for(auto i=segment;i<=path.size();++i)
+                {
+                    if(i < path.size() && path[i] != '/') continue;
+                    if(dot_dot_(path, segment, i)) return false;
+                    segment = i + 1;
+                }
+
+                if(path.back() == '/') path += index_;
+                return true;
+            }
+
+            static bool dot_dot_(const std::string& path, std::size_t segment, std::size_t end)
+            {
+                return end - segment == 2 && path[segment] == '.' && path[segment+1] == '.';
+            }
+
+        private:
+            std::string root_;
+            std::string index_;
+            file_cache& cache_;
+            http_conditional& validators_;
+            std::string key_;
+        };
+    }
+}
+
+#endif
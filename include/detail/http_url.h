@@ -0,0 +1,116 @@
+#ifndef __DETAIL_HTTP_URL_H__
+#define __DETAIL_HTTP_URL_H__
+
+#include "base.h"
+#include "http_scanner.h"
+#include "utility.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // Decodes the %XX escapes of in (and '+' as a space, in form data) into out: in.data() itself (in place), or
+        // a buffer of in.size() bytes at least. The escapes are found 16 or 32 bytes at a time (see http_scan) and
+        // the runs between them are moved as blocks. Returns false on a malformed escape.
+        inline bool http_percent_decode(const util::slice& in, char* out, std::size_t& size, bool plus_as_space=false)
+        {
+            auto hex = [](char c) -> int {
+                if(c >= '0' && c <= '9') return c - '0';
+                if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+                if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+                return -1;
+            };
+
+            auto p = in.data();
+            auto end = p + in.size();
+            auto o = out;
+            while(p < end)
+            {
+                auto q = plus_as_space ? http_scan::find_either(p, end, '%', '+') : http_scan::find_char(p, end, '%');
+                if(q != p)
+                {
+                    // in place, nothing moves until the first escape
+                    if(o != p) std::memmove(o, p, q - p);
+                    o += q - p;
+                    p = q;
+                }
+                if(p == end) break;
+
+                if(*p == '+')
+                {
+                    *o++ = ' ';
+                    ++p;
+                    continue;
+                }
+
+                int h = end - p >= 3 ? hex(p[1]) : -1;
+                int l = h >= 0 ? hex(p[2]) : -1;
+                if(l < 0) return false;
+
+                *o++ = static_cast<char>(h * 16 + l);
+                p += 3;
+            }
+
+            size = static_cast<std::size_t>(o - out);
+            return true;
+        }
+
+        // in place: size is updated (on failure the data are left partly decoded)
+        inline bool http_percent_decode(char* data, std::size_t& size, bool plus_as_space=false)
+        {
+            return http_percent_decode(util::slice(data, size), data, size, plus_as_space);
+        }
+
+        // Splits a query string ("a=1&b=2") into its pairs: key and value are views into it, still encoded (see
+        // http_percent_decode()), so that nothing is copied or allocated. A pair without '=' has an empty value,
+        // and empty pairs are skipped.
+        //
+        //     http_query q(r->query());
+        //     util::slice key, value;
+        //     while(q.next(key, value)) ...
+        class http_query
+        {
+        public:
+            explicit http_query(const util::slice& query)
+                : query_(query)
+                , pos_(0)
+            {}
+
+            bool next(util::slice& key, util::slice& value)
+            {
+                auto end = query_.data() + query_.size();
+                while(pos_ < query_.size())
+                {
+                    auto p = query_.data() + pos_;
+                    auto amp = http_scan::find_char(p, end, '&');
+                    pos_ = static_cast<std::size_t>(amp - query_.data()) + 1;
+                    if(amp == p) continue;
+
+                    auto pair = util::slice(p, amp - p);
+                    auto eq = pair.find('=');
+                    key = pair.substr(0, eq);
+                    value = eq == util::slice::npos ? util::slice() : pair.substr(eq + 1);
+                    return true;
+                }
+                return false;
+            }
+
+            void rewind() { pos_ = 0; }
+
+            // the value of the first pair whose key is name (as is, still encoded); false if there is none.
+            static bool find(const util::slice& query, const util::slice& name, util::slice& value)
+            {
+                http_query q(query);
+                util::slice key;
+                while(q.next(key, value)) if(key == name) return true;
+                return false;
+            }
+
+        private:
+            util::slice query_;
+            std::size_t pos_;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,879 @@
+#ifndef __DETAIL_MULTIPART_H__
+#define __DETAIL_MULTIPART_H__
+
+#include "base.h"
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "http_session.h"
+#include "utility.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // A part of a multipart body: its headers, and the parameters of its Content-Disposition.
+        class multipart_part
+        {
+            friend class multipart_parser;
+
+        public:
+            typedef std::vector<std::pair<std::string, std::string>> headers_type;
+
+            multipart_part()
+                : index_(0)
+                , headers_()
+                , name_()
+                , filename_()
+                , has_filename_(false)
+            {}
+
+            // position in the body, from 0
+            std::size_t index() const { return index_; }
+
+            const headers_type& headers() const { return headers_; }
+
+            // case-insensitive lookup of the first header with this name (empty if absent).
+            util::slice header(const util::slice& name) const
+            {
+                for(auto& h : headers_) if(name.equals_no_case(h.first)) return h.second;
+                return util::slice();
+            }
+
+            // Content-Disposition: form-data; name="..."; filename="..."
+            const std::string& name() const { return name_; }
+            const std::string& filename() const { return filename_; }
+
+            // a file upload (its filename may still be empty: no file was chosen)
+            bool has_filename() const { return has_filename_; }
+
+            util::slice content_type() const
+            {
+                auto type = header("Content-Type");
+                return type.empty() ? util::slice("text/plain") : type;
+            }
+
+        private:
+            void clear_()
+            {
+                headers_.clear();
+                name_.clear();
+                filename_.clear();
+                has_filename_ = false;
+            }
+
+            // the parameters of Content-Disposition: tokens or quoted strings, separated by ';'.
+            void parse_disposition_()
+            {
+                auto value = header("Content-Disposition");
+
+                std::size_t i = value.find(';');
+                while(i != util::slice::npos && i < value.size())
+                {
+                    ++i;
+                    while(i < value.size() && (value[i] == ' ' || value[i] == '\t')) ++i;
+
+                    auto eq = value.find('=', i);
+                    if(eq == util::slice::npos) break;
+                    auto key = value.substr(i, eq - i);
+                    while(!key.empty() && (key[key.size()-1] == ' ' || key[key.size()-1] == '\t')) key = key.substr(0, key.size() - 1);
+
+                    std::string v;
+                    i = eq + 1;
+                    while(i < value.size() && (value[i] == ' ' || value[i] == '\t')) ++i;
+                    if(i < value.size() && value[i] == '"')
+                    {
+                        for(++i;i < value.size() && value[i] != '"';++i)
+                        {
+                            if(value[i] == '\\' && i + 1 < value.size()) ++i;
+                            v += value[i];
+                        }
+                        i = value.find(';', i);
+                    }
+                    else
+                    {
+                        auto end = value.find(';', i);
+                        auto token = value.substr(i, end == util::slice::npos ? util::slice::npos : end - i);
+                        while(!token.empty() && (token[token.size()-1] == ' ' || token[token.size()-1] == '\t')) token = token.substr(0, token.size() - 1);
+                        v = token.to_string();
+                        i = end;
+                    }
+
+                    if(key.equals_no_case("name")) name_ = std::move(v);
+                    else if(key.equals_no_case("filename"))
+                    {
+                        filename_ = std::move(v);
+                        has_filename_ = true;
+                    }
+                }
+            }
+
+        private:
+            std::size_t index_;
+            headers_type headers_;
+            std::string name_;
+            std::string filename_;
+            bool has_filename_;
+        };
+
+        // Incremental multipart/form-data parser (RFC 7578, RFC 2046 5.1) fed with the body as it arrives: the
+        // headers of each part are reported once complete, its data as slices of the input (valid during the
+        // call) with no copy but the few bytes that may start a delimiter at the end of an input.
+        // The delimiter ("\r\n--" boundary) is searched with Boyer-Moore-Horspool: most input bytes are skipped
+        // without being compared.
+        class multipart_parser
+        {
+            typedef std::function<void(const multipart_part&)> on_part_callback_type;
+            typedef std::function<void(const multipart_part&, const util::slice&)> on_data_callback_type;
+
+            enum class state
+            {
+                preamble,
+                delimiter,          // after a delimiter: "--" (the end), or transport padding and CRLF
+                delimiter_dash,
+                delimiter_lf,
+                headers,
+                data,
+                epilogue,
+                failed
+            };
+
+        public:
+            // RFC 2046: 1 to 70 characters
+            static const std::size_t max_boundary_size = 70;
+            static const std::size_t default_max_header_bytes = 8 * 1024;
+            static const std::size_t default_max_parts = 1000;
+
+            // boundary: as given by boundary_of()
+            multipart_parser(const util::slice& boundary)
+                : delimiter_("\r\n--")
+                , skip_()
+                , state_(state::preamble)
+                , error_()
+                , carry_("\r\n")
+                , scratch_()
+                , head_()
+                , part_()
+                , parts_(0)
+                , max_header_bytes_(default_max_header_bytes)
+                , max_parts_(default_max_parts)
+                , on_part_()
+                , on_data_()
+                , on_part_end_()
+            {
+                assert(!boundary.empty() && boundary.size() <= max_boundary_size);
+                delimiter_.append(boundary.data(), boundary.size());
+
+                // Horspool: the shift for the byte under the last position of the window
+                auto m = delimiter_.size();
+                for(auto& s : skip_) s = static_cast<unsigned char>(m);
+                for(std::size_t i=0;i<m-1;++i) skip_[static_cast<unsigned char>(delimiter_[i])] = static_cast<unsigned char>(m - 1 - i);
+            }
+
+            // no copy allowed
+            multipart_parser(const multipart_parser&) = delete;
+            void operator=(const multipart_parser&) = delete;
+
+            // Extracts the boundary parameter of a "multipart/form-data" Content-Type; false if there is none or it
+            // is not valid.
+            static bool boundary_of(const util::slice& content_type, std::string& boundary)
+            {
+                static const util::slice type("multipart/form-data");
+                if(content_type.size() < type.size() || !content_type.substr(0, type.size()).equals_no_case(type)) return false;
+
+                auto value = content_type.substr(type.size());
+                std::size_t i = 0;
+                while((i = value.find(';', i)) != util::slice::npos)
+                {
+                    ++i;
+                    while(i < value.size() && (value[i] == ' ' || value[i] == '\t')) ++i;
+
+                    static const util::slice key("boundary=");
+                    if(!value.substr(i, key.size()).equals_no_case(key)) continue;
+
+                    auto v = value.substr(i + key.size());
+                    if(!v.empty() && v[0] == '"')
+                    {
+                        auto end = v.find('"', 1);
+                        if(end == util::slice::npos) return false;
+                        v = v.substr(1, end - 1);
+                    }
+                    else
+                    {
+                        auto end = v.find(';');
+                        if(end != util::slice::npos) v = v.substr(0, end);
+                        while(!v.empty() && (v[v.size()-1] == ' ' || v[v.size()-1] == '\t')) v = v.substr(0, v.size() - 1);
+                    }
+
+                    if(v.empty() || v.size() > max_boundary_size) return false;
+                    boundary = v.to_string();
+                    return true;
+                }
+                return false;
+            }
+
+            // headers of a part (the same object is reused for every part)
+            void on_part(on_part_callback_type callback) { on_part_ = callback; }
+
+            // data of the current part, in pieces
+            void on_data(on_data_callback_type callback) { on_data_ = callback; }
+
+            void on_part_end(on_part_callback_type callback) { on_part_end_ = callback; }
+
+            // the headers of one part (emsgsize beyond)
+            void set_max_header_bytes(std::size_t bytes) { max_header_bytes_ = bytes; }
+            void set_max_parts(std::size_t parts) { max_parts_ = parts; }
+
+            // Parses the next piece of the body: eproto if it is malformed, emsgsize over a limit. The parser stays
+            // failed after an error.
+            resval feed(const util::slice& input)
+            {
+                auto p = input.data();
+                auto n = input.size();
+                std::size_t pos = 0;
+
+                while(pos < n && state_ != state::failed)
+                {
+                    switch(state_)
+                    {
+                    case state::preamble:
+                    case state::data:
+                        pos = scan_(p, n, pos);
+                        break;
+
+                    case state::delimiter:
+                        if(p[pos] == '-') state_ = state::delimiter_dash;
+                        else if(p[pos] == '\r') state_ = state::delimiter_lf;
+                        else if(p[pos] != ' ' && p[pos] != '\t') fail_(resval(error::eproto));
+                        ++pos;
+                        break;
+
+                    case state::delimiter_dash:
+                        if(p[pos++] == '-') state_ = state::epilogue;
+                        else fail_(resval(error::eproto));
+                        break;
+
+                    case state::delimiter_lf:
+                        if(p[pos++] != '\n') fail_(resval(error::eproto));
+                        else if(parts_ == max_parts_) fail_(resval(error::emsgsize));
+                        else
+                        {
+                            head_.clear();
+                            state_ = state::headers;
+                        }
+                        break;
+
+                    case state::headers:
+                        pos = headers_(p, n, pos);
+                        break;
+
+                    case state::epilogue:
+                        // ignored
+                        pos = n;
+                        break;
+
+                    case state::failed:
+                        break;
+                    }
+                }
+                return error_;
+            }
+
+            // The body is complete: eproto if the closing delimiter is missing.
+            resval finish()
+            {
+                if(state_ != state::epilogue && state_ != state::failed) fail_(resval(error::eproto));
+                return error_;
+            }
+
+            // the closing delimiter has been parsed
+            bool done() const { return state_ == state::epilogue; }
+
+            std::size_t parts() const { return parts_; }
+
+        private:
+            // Searches the delimiter from pos (and from the bytes carried over from the previous input), reports the
+            // data before it, and returns where parsing resumes.
+            std::size_t scan_(const char* p, std::size_t n, std::size_t pos)
+            {
+                auto m = delimiter_.size();
+
+                if(!carry_.empty())
+                {
+                    // a delimiter may have started at the end of the previous input
+                    scratch_.assign(carry_);
+                    scratch_.append(p + pos, std::min(n - pos, m - 1));
+
+                    auto i = search_(scratch_.data(), scratch_.size(), 0);
+                    if(i < carry_.size())
+                    {
+                        data_(carry_.data(), i);
+                        auto consumed = i + m - carry_.size();
+                        carry_.clear();
+                        delimiter_found_();
+                        return pos + consumed;
+                    }
+
+                    // still a possible start: the input was too short to tell
+                    auto j = partial_(scratch_.data(), scratch_.size());
+                    if(j < carry_.size())
+                    {
+                        data_(carry_.data(), j);
+                        carry_.assign(scratch_, j, std::string::npos);
+                        return n;
+                    }
+
+                    data_(carry_.data(), carry_.size());
+                    carry_.clear();
+                }
+
+                auto i = search_(p, n, pos);
+                if(i != std::string::npos)
+                {
+                    data_(p + pos, i - pos);
+                    delimiter_found_();
+                    return i + m;
+                }
+
+                // hold back what may start a delimiter
+                auto j = pos + partial_(p + pos, n - pos);
+                data_(p + pos, j - pos);
+                carry_.assign(p + j, n - j);
+                return n;
+            }
+
+            // Horspool search of the delimiter in [p + from, p + n)
+            std::size_t search_(const char* p, std::size_t n, std::size_t from) const
+            {
+                auto m = delimiter_.size();
+                auto last = m - 1;
+                auto d = delimiter_.data();
+
+                auto i = from;
+                while(i + m <= n)
+                {
+                    unsigned char c = static_cast<unsigned char>(p[i + last]);
+                    if(c == static_cast<unsigned char>(d[last]) && std::memcmp(p + i, d, last) == 0) return i;
+                    i += skip_[c];
+                }
+                return std::string::npos;
+            }
+
+            // start of the longest suffix of [p, p + n) that is a proper prefix of the delimiter (n if none)
+            std::size_t partial_(const char* p, std::size_t n) const
+            {
+                auto m = delimiter_.size();
+                for(auto i = n > m - 1 ? n - (m - 1) : 0;i < n;++i)
+                {
+                    if(p[i] == '\r' && std::memcmp(p + i, delimiter_.data(), n - i) == 0) return i;
+                }
+                return n;
+            }
+
+            void data_(const char* p, std::size_t n)
+            {
+                // the preamble is ignored
+                if(n && state_ == state::data && on_data_) on_data_(part_, util::slice(p, n));
+            }
+
+            void delimiter_found_()
+            {
+                if(state_ == state::data && on_part_end_) on_part_end_(part_);
+                state_ = state::delimiter;
+            }
+
+            // gathers the headers of a part up to the empty line, and returns where parsing resumes.
+            std::size_t headers_(const char* p, std::size_t n, std::size_t pos)
+            {
+                auto old = head_.size();
+                head_.append(p + pos, std::min(n - pos, max_header_bytes_ + 4 - std::min(old, max_header_bytes_ + 4)));
+
+                // no headers at all, or the first empty line
+                std::size_t end = std::string::npos;
+                if(head_.size() >= 2 && head_[0] == '\r' && head_[1] == '\n') end = 2;
+                else
+                {
+                    auto i = head_.find("\r\n\r\n", old > 3 ? old - 3 : 0);
+                    if(i != std::string::npos) end = i + 4;
+                }
+
+                if(end == std::string::npos)
+                {
+                    if(head_.size() > max_header_bytes_) fail_(resval(error::emsgsize));
+                    return n;
+                }
+
+                auto consumed = end - old;
+                head_.resize(end);
+                if(!parse_headers_()) return n;
+
+                part_.index_ = parts_++;
+                state_ = state::data;
+                if(on_part_) on_part_(part_);
+                return pos + consumed;
+            }
+
+            bool parse_headers_()
+            {
+                part_.clear_();
+
+                util::slice block(head_);
+                std::size_t i = 0;
+                while(i + 2 < block.size())
+                {
+                    auto eol = block.find('\r', i);
+                    if(eol == util::slice::npos || eol + 1 >= block.size() || block[eol+1] != '\n')
+                    {
+                        fail_(resval(error::eproto));
+                        return false;
+                    }
+                    auto line = block.substr(i, eol - i);
+                    i = eol + 2;
+
+                    // obsolete line folding continues the previous value
+                    if(!line.empty() && (line[0] == ' ' || line[0] == '\t') && !part_.headers_.empty())
+                    {
+                        part_.headers_.back().second += ' ';
+                        part_.headers_.back().second += trim_(line).to_string();
+                        continue;
+                    }
+
+                    auto colon = line.find(':');
+                    if(colon == util::slice::npos || colon == 0)
+                    {
+                        fail_(resval(error::eproto));
+                        return false;
+                    }
+                    part_.headers_.push_back(std::make_pair(line.substr(0, colon).to_string(), trim_(line.substr(colon + 1)).to_string()));
+                }
+
+                part_.parse_disposition_();
+                return true;
+            }
+
+            static util::slice trim_(util::slice s)
+            {
+                while(!s.empty() && (s[0] == ' ' || s[0] == '\t')) s = s.substr(1);
+                while(!s.empty() && (s[s.size()-1] == ' ' || s[s.size()-1] == '\t')) s = s.substr(0, s.size() - 1);
+                return s;
+            }
+
+            void fail_(resval rv)
+            {
+                state_ = state::failed;
+                error_ = rv;
+            }
+
+        private:
+            std::string delimiter_;     // "\r\n--" boundary
+            unsigned char skip_[256];
+            state state_;
+            resval error_;
+            std::string carry_;         // the end of the previous input, if it may start a delimiter
+            std::string scratch_;
+            std::string head_;          // headers of the part being parsed
+            multipart_part part_;
+            std::size_t parts_;
+            std::size_t max_header_bytes_;
+            std::size_t max_parts_;
+            on_part_callback_type on_part_;
+            on_data_callback_type on_data_;
+            on_part_callback_type on_part_end_;
+        };
+
+        // Receives a multipart/form-data request body on behalf of a handler: small fields are kept in memory, file
+        // uploads (and fields over max_field_size) are spooled to temporary files. Memory stays bounded however large
+        // the upload: data goes to the disk in pooled buffers, and the session stops reading while more than
+        // max_buffered bytes wait to be written.
+        // The upload deletes itself after on_complete; temporary files still at their path then are removed: rename
+        // one from the callback to keep it.
+        class multipart_upload
+        {
+        public:
+            struct options
+            {
+                std::size_t max_field_size;     // in memory up to this size (per field)
+                std::size_t max_parts;
+                std::size_t max_header_bytes;   // per part
+                std::size_t max_buffered;       // waiting to be written
+
+                options()
+                    : max_field_size(64 * 1024)
+                    , max_parts(multipart_parser::default_max_parts)
+                    , max_header_bytes(multipart_parser::default_max_header_bytes)
+                    , max_buffered(1024 * 1024)
+                {}
+            };
+
+            struct field
+            {
+                std::string name;
+                std::string filename;
+                std::string content_type;
+                std::string value;      // in memory (path is empty)
+                std::string path;       // spooled to this temporary file
+                uint64_t size;
+
+                field()
+                    : name()
+                    , filename()
+                    , content_type()
+                    , value()
+                    , path()
+                    , size(0)
+                {}
+
+                bool spooled() const { return !path.empty(); }
+            };
+
+            typedef std::function<void(multipart_upload*, resval)> on_complete_callback_type;
+
+        private:
+            // a temporary file being written
+            struct spool
+            {
+                int fd;
+                uint64_t offset;        // of the next write
+                std::size_t writes;     // in flight
+                bool ended;
+                buffer* buf;            // filling up
+                std::size_t fill;
+            };
+
+            struct write_req
+            {
+                uv_fs_t req;
+                multipart_upload* self;
+                spool* file;
+                buffer* buf;
+                std::size_t size;
+                std::size_t done;
+                uint64_t offset;
+            };
+
+        public:
+            // Reads the body of request r (call it from on_request): einval if it is not multipart/form-data. Temporary
+            // files are created in dir. on_complete is invoked once the body is parsed and written, or on the first
+            // error: answer the request from there.
+            static resval receive(http_session* session, const http_parse_result* r, const std::string& dir, on_complete_callback_type on_complete, const options& opts=options())
+            {
+                assert(session && r);
+
+                std::string boundary;
+                if(!multipart_parser::boundary_of(r->header(http_header_id::content_type), boundary)) return resval(error::einval);
+
+                auto upload = new multipart_upload(session, boundary, dir, on_complete, opts);
+                assert(upload);
+                session->read_body([upload](const util::slice& data, resval rv) { upload->on_body_(data, rv); });
+                return resval();
+            }
+
+            // no copy allowed
+            multipart_upload(const multipart_upload&) = delete;
+            void operator=(const multipart_upload&) = delete;
+
+            const std::vector<field>& fields() const { return fields_; }
+
+            // the first field with this name (nullptr if none)
+            const field* find(const util::slice& name) const
+            {
+                for(auto& f : fields_) if(name == f.name) return &f;
+                return nullptr;
+            }
+
+            http_session* session() const { return session_; }
+
+        private:
+            multipart_upload(http_session* session, const std::string& boundary, const std::string& dir, on_complete_callback_type on_complete, const options& opts)
+                : session_(session)
+                , parser_(boundary)
+                , dir_(dir)
+                , on_complete_(on_complete)
+                , options_(opts)
+                , fields_()
+                , spools_()
+                , current_(nullptr)
+                , error_()
+                , buffered_(0)
+                , writes_(0)
+                , body_done_(false)
+                , completed_(false)
+                , paused_(false)
+            {
+                session_->retain();
+
+                parser_.set_max_parts(options_.max_parts);
+                parser_.set_max_header_bytes(options_.max_header_bytes);
+                parser_.on_part([this](const multipart_part& p) { on_part_(p); });
+                parser_.on_data([this](const multipart_part&, const util::slice& data) { on_data_(data); });
+                parser_.on_part_end([this](const multipart_part&) { on_part_end_(); });
+            }
+
+            ~multipart_upload()
+            {
+                for(auto s : spools_)
+                {
+                    if(s->fd != -1) ::close(s->fd);
+                    if(s->buf) s->buf->release();
+                    delete s;
+                }
+                session_->release();
+            }
+
+            void on_body_(const util::slice& data, resval rv)
+            {
+                if(!data.empty())
+                {
+                    if(!error_) return;
+
+                    auto r = parser_.feed(data);
+                    if(!r) fail_(r);
+                    else if(buffered_ > options_.max_buffered && !paused_)
+                    {
+                        paused_ = true;
+                        session_->pause_body();
+                    }
+                }
+                else
+                {
+                    // end of the body (eof), or the request failed
+                    body_done_ = true;
+                    if(error_)
+                    {
+                        if(rv.code() != error::eof) fail_(rv);
+                        else
+                        {
+                            auto r = parser_.finish();
+                            if(!r) fail_(r);
+                        }
+                    }
+                }
+                check_done_();
+            }
+
+            void on_part_(const multipart_part& p)
+            {
+                if(!error_) return;
+
+                fields_.push_back(field());
+                auto& f = fields_.back();
+                f.name = p.name();
+                f.filename = p.filename();
+                f.content_type = p.content_type().to_string();
+
+                if(p.has_filename()) open_spool_(f);
+            }
+
+            void on_data_(const util::slice& data)
+            {
+                if(!error_) return;
+
+                auto& f = fields_.back();
+                f.size += data.size();
+
+                if(!current_ && f.value.size() + data.size() > options_.max_field_size)
+                {
+                    // too large for memory: what was kept goes to the file first.
+                    if(!open_spool_(f)) return;
+                    append_(f.value);
+                    std::string().swap(f.value);
+                }
+
+                if(current_) append_(data);
+                else f.value.append(data.data(), data.size());
+            }
+
+            void on_part_end_()
+            {
+                if(!error_ || !current_) return;
+
+                auto s = current_;
+                current_ = nullptr;
+
+                flush_(s);
+                s->ended = true;
+                if(s->writes == 0) close_(s);
+            }
+
+            bool open_spool_(field& f)
+            {
+                std::string path = dir_ + "/x10-upload-XXXXXX";
+
+                int fd = ::mkostemp(&path[0], O_CLOEXEC);
+                if(fd == -1)
+                {
+                    fail_(get_sys_error(errno));
+                    return false;
+                }
+                f.path = path;
+
+                current_ = new spool();
+                assert(current_);
+                current_->fd = fd;
+                spools_.push_back(current_);
+                return true;
+            }
+
+            // copies data into pooled buffers, written out as they fill up.
+            void append_(const util::slice& data)
+            {
+                auto s = current_;
+                std::size_t pos = 0;
+                while(pos < data.size())
+                {
+                    if(!s->buf)
+                    {
+                        s->buf = buffer_pool::get().acquire();
+                        s->fill = 0;
+                    }
+
+                    auto n = std::min(data.size() - pos, s->buf->capacity() - s->fill);
+                    std::memcpy(s->buf->data() + s->fill, data.data() + pos, n);
+                    s->fill += n;
+                    pos += n;
+
+                    if(s->fill == s->buf->capacity()) flush_(s);
+                }
+            }
+
+            void flush_(spool* s)
+            {
+                if(!s->buf) return;
+                if(s->fill == 0)
+                {
+                    s->buf->release();
+                    s->buf = nullptr;
+                    return;
+                }
+
+                auto w = new write_req();
+                assert(w);
+                w->self = this;
+                w->file = s;
+                w->buf = s->buf;
+                w->size = s->fill;
+                w->done = 0;
+                w->offset = s->offset;
+
+                s->buf = nullptr;
+                s->offset += w->size;
+                ++s->writes;
+                ++writes_;
+                buffered_ += w->size;
+
+                write_(w);
+            }
+
+            void write_(write_req* w)
+            {
+                w->req.data = w;
+                int r = uv_fs_write(uv_default_loop(), &w->req, w->file->fd, w->buf->data() + w->done, w->size - w->done, static_cast<int64_t>(w->offset + w->done), [](uv_fs_t* req) {
+                    auto w = reinterpret_cast<write_req*>(req->data);
+                    assert(w);
+
+                    auto result = req->result;
+                    auto rv = result < 0 ? get_last_error() : resval();
+                    uv_fs_req_cleanup(req);
+
+                    if(rv && result > 0)
+                    {
+                        // a short write: the rest goes again
+                        w->done += static_cast<std::size_t>(result);
+                        if(w->done < w->size)
+                        {
+                            w->self->write_(w);
+                            return;
+                        }
+                    }
+                    else if(rv)
+                    {
+                        rv = resval(error::enobufs);     // nothing written: the disk is full
+                    }
+                    w->self->after_write_(w, rv);
+                });
+                if(r) after_write_(w, get_last_error());
+            }
+
+            void after_write_(write_req* w, resval rv)
+            {
+                auto s = w->file;
+                --s->writes;
+                --writes_;
+                buffered_ -= w->size;
+                w->buf->release();
+                delete w;
+
+                if(!rv) fail_(rv);
+                if(s->ended && s->writes == 0) close_(s);
+
+                if(paused_ && buffered_ <= options_.max_buffered / 2)
+                {
+                    paused_ = false;
+                    session_->resume_body();
+                }
+                check_done_();
+            }
+
+            void close_(spool* s)
+            {
+                if(s->fd == -1) return;
+                if(::close(s->fd) != 0 && error_) fail_(get_sys_error(errno));
+                s->fd = -1;
+            }
+
+            void fail_(resval rv)
+            {
+                if(error_) error_ = rv;
+
+                // the rest of the body is discarded
+                if(paused_)
+                {
+                    paused_ = false;
+                    session_->resume_body();
+                }
+            }
+
+            // Completes once the body is parsed and every write is done (or, after an error, as soon as the writes
+            // are done); the upload itself goes once the session will not call it any more.
+            void check_done_()
+            {
+                if(writes_ > 0) return;
+
+                if(!completed_ && (body_done_ || !error_))
+                {
+                    completed_ = true;
+                    for(auto s : spools_) close_(s);
+
+                    if(on_complete_) on_complete_(this, error_);
+
+                    for(auto& f : fields_)
+                    {
+                        if(f.spooled()) ::unlink(f.path.c_str());
+                    }
+                }
+
+                // a closed session does not read any more
+                if(completed_ && (body_done_ || session_->is_closed())) delete this;
+            }
+
+        private:
+            http_session* session_;
+            multipart_parser parser_;
+            std::string dir_;
+            on_complete_callback_type on_complete_;
+            options options_;
+            std::vector<field> fields_;
+            std::vector<spool*> spools_;
+            spool* current_;            // the file of the part being parsed
+            resval error_;
+            std::size_t buffered_;      // in writes not done yet
+            std::size_t writes_;
+            bool body_done_;
+            bool completed_;
+            bool paused_;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef __DETAIL_SERVER_H__
+#define __DETAIL_SERVER_H__
+
+#include "base.h"
+#include "stream.h"
+#include "timer.h"
+#include "utility.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        struct drain_progress
+        {
+            std::size_t remaining;      // connections still open
+            std::size_t busy;           // ... of which are serving a request
+            std::size_t closed;         // connections closed since the drain started
+            int64_t elapsed;            // milliseconds since the drain started
+            bool finished;              // no connection left (or deadline reached)
+            bool timed_out;             // deadline reached: the remaining connections were closed forcibly
+        };
+
+        // Owns a listening stream and tracks every stream accepted through it, so that a restart can
+        // stop accepting, half-close idle keep-alive connections and wait (up to a deadline) for busy ones.
+        // The application tells which connections are serving a request via set_busy().
+        class server : public stream_tracker
+        {
+            typedef std::function<void(stream*, resval)> on_connection_callback_type;
+            typedef std::function<void(const drain_progress&)> on_drain_callback_type;
+            typedef util::intrusive_list<stream, &stream::tracker_link_> list_type;
+
+        public:
+            server(stream* listener)
+                : listener_(listener)
+                , connections_()
+                , busy_count_(0)
+                , on_connection_()
+                , on_drain_()
+                , draining_(false)
+                , drain_start_(0)
+                , drain_closed_(0)
+                , drain_timed_out_(false)
+                , drain_timer_(nullptr)
+            {
+                assert(listener_);
+            }
+
+            virtual ~server()
+            {
+                stop_accepting();
+                stop_drain_timer_();
+
+                // connections outlive the server; just forget about them.
+                connections_.for_each([this](stream* s) {
+                    connections_.remove(s);
+                    s->tracker_ = nullptr;
+                    s->busy_ = false;
+                });
+            }
+
+            // no copy allowed
+            server(const server&) = delete;
+            void operator=(const server&) = delete;
+
+            void on_connection(on_connection_callback_type callback)
+            {
+                on_connection_ = callback;
+            }
+
+            resval listen(int backlog)
+            {
+                if(!listener_) return resval(error::ebadf);
+
+                listener_->on_connection([this](stream* s, resval rv) {
+                    if(s) track_(s);
+                    if(on_connection_) on_connection_(s, rv);
+                });
+                return listener_->listen(backlog);
+            }
+
+            // closes the listening handle; accepted connections stay open.
+            void stop_accepting()
+            {
+                if(!listener_) return;
+
+                listener_->on_connection(nullptr);
+                listener_->close();
+                listener_ = nullptr;
+            }
+
+            // marks a connection as serving a request (busy) or waiting for the next one (idle).
+            // During a drain, a connection that turns idle is half-closed right away (closed if the peer already
+            // closed its end).
+            void set_busy(stream* s, bool busy)
+            {
+                if(s->tracker_ != this || s->busy_ == busy) return;
+
+                s->busy_ = busy;
+                if(busy) ++busy_count_;
+                else --busy_count_;
+
+                if(draining_)
+                {
+                    if(!busy) half_close_(s);
+                    report_();
+                }
+            }
+
+            // During a drain, an idle connection closes once the peer answers the FIN with its own (a busy one
+            // does when it turns idle).
+            virtual void read_eof(stream* s)
+            {
+                if(s->tracker_ != this || !draining_ || s->busy_) return;
+                s->close();
+            }
+
+            // Stops accepting, half-closes idle connections and waits for the busy ones to finish.
+            // When 'deadline' (milliseconds, 0 = none) expires the remaining connections are closed.
+            // The callback is invoked on every change and once more with finished=true.
+            void drain(int64_t deadline, on_drain_callback_type callback)
+            {
+                assert(!draining_);
+
+                stop_accepting();
+
+                draining_ = true;
+                drain_start_ = timer::now();
+                drain_closed_ = 0;
+                drain_timed_out_ = false;
+                on_drain_ = callback;
+
+                connections_.for_each([this](stream* s) {
+                    if(!s->busy_) half_close_(s);
+                });
+
+                if(deadline > 0 && !connections_.empty())
+                {
+                    drain_timer_ = new timer;
+                    assert(drain_timer_);
+
+                    drain_timer_->on_timeout([this](timer*) { force_close_(); });
+                    drain_timer_->start(deadline);
+                }
+
+                report_();
+            }
+
+            std::size_t connections() const { return connections_.size(); }
+            std::size_t busy_connections() const { return busy_count_; }
+            bool is_draining() const { return draining_; }
+
+            virtual void untrack(stream* s)
+            {
+                if(s->tracker_ != this) return;
+
+                if(s->busy_) --busy_count_;
+                s->busy_ = false;
+                s->tracker_ = nullptr;
+                connections_.remove(s);
+
+                if(draining_)
+                {
+                    ++drain_closed_;
+                    report_();
+                }
+            }
+
+        private:
+            void track_(stream* s)
+            {
+                assert(!s->tracker_);
+                s->tracker_ = this;
+                connections_.push_back(s);
+            }
+
+            // FIN after pending writes; the stream closes once the peer answers with EOF (see read_eof()), which
+            // requires the application to keep reading: a drain without a deadline waits for that.
+            void half_close_(stream* s)
+            {
+                if(s->read_eof_)
+                {
+                    s->close();
+                    return;
+                }
+
+                auto req = new uv_shutdown_t;
+                assert(req);
+
+                if(uv_shutdown(req, s->uv_stream(), [](uv_shutdown_t* req, int) { delete req; }))
+                {
+                    // already shut down or not writable any more
+                    delete req;
+                }
+            }
+
+            void force_close_()
+            {
+                stop_drain_timer_();
+
+                // the last close reports the final progress (see untrack()).
+                drain_timed_out_ = true;
+                connections_.for_each([](stream* s) { s->close(); });
+            }
+
+            void report_()
+            {
+                if(!draining_) return;
+                if(connections_.empty())
+                {
+                    finish_();
+                    return;
+                }
+
+                if(on_drain_) on_drain_(progress_(false, false));
+            }
+
+            void finish_()
+            {
+                stop_drain_timer_();
+                draining_ = false;
+
+                auto callback = on_drain_;
+                on_drain_ = nullptr;
+                if(callback) callback(progress_(true, drain_timed_out_));
+            }
+
+            drain_progress progress_(bool finished, bool timed_out) const
+            {
+                drain_progress p;
+                p.remaining = connections_.size();
+                p.busy = busy_count_;
+                p.closed = drain_closed_;
+                p.elapsed = timer::now() - drain_start_;
+                p.finished = finished;
+                p.timed_out = timed_out;
+                return p;
+            }
+
+            void stop_drain_timer_()
+            {
+                if(!drain_timer_) return;
+
+                drain_timer_->stop();
+                drain_timer_->close();
+                drain_timer_ = nullptr;
+            }
+
+        private:
+            stream* listener_;
+            list_type connections_;
+            std::size_t busy_count_;
+            on_connection_callback_type on_connection_;
+            on_drain_callback_type on_drain_;
+            bool draining_;
+            int64_t drain_start_;
+            std::size_t drain_closed_;
+            bool drain_timed_out_;
+            timer* drain_timer_;
+        };
+    }
+}
+
+#endif
@@ -3,15 +3,32 @@
 
 #include "base.h"
 #include "handle.h"
+#include "buffer.h"
+#include "utility.h"
 
 namespace x10
 {
     namespace detail
     {
         class tcp;
+        class stream;
+        class server;
+
+        // Keeps track of live streams (see server); notified when a tracked stream is closed.
+        class stream_tracker
+        {
+        public:
+            virtual ~stream_tracker() {}
+            virtual void untrack(stream* s) = 0;
+
+            // the peer closed its end (or the read failed), after the on_read callback saw it
+            virtual void read_eof(stream*) {}
+        };
 
         class stream : public handle
         {
+            friend class server;
+
             typedef std::function<void(const char*, std::size_t, std::size_t, stream*, resval)> on_read_callback_type;
             typedef std::function<void(resval)> on_complete_callback_type;
             typedef std::function<void(stream*, resval)> on_connection_callback_type;
@@ -23,6 +40,11 @@ namespace x10
                 , on_read_()
                 , on_complete_()
                 , on_connection_()
+                , tracker_(nullptr)
+                , tracker_link_()
+                , busy_(false)
+                , read_eof_(false)
+                , read_buffer_(nullptr)
             {
                 assert(stream_);
             }
@@ -87,6 +109,17 @@ namespace x10
             }
 
             virtual resval write(const char* data, int offset, int length, stream* send_stream=nullptr)
+            {
+                uv_buf_t buf;
+                buf.base = const_cast<char*>(&data[offset]);
+                buf.len = static_cast<size_t>(length);
+
+                return write(&buf, 1, send_stream);
+            }
+
+            // Vectored write: all buffers go out with one system call (when the socket is writable).
+            // The data must stay alive until the on_complete callback; the uv_buf_t array need not.
+            virtual resval write(const uv_buf_t* bufs, int count, stream* send_stream=nullptr)
             {
                 bool res = false;
                 bool ipc_pipe = stream_->type == UV_NAMED_PIPE && reinterpret_cast<uv_pipe_t*>(stream_)->ipc;
@@ -94,13 +127,9 @@ namespace x10
                 auto req = new uv_write_t;
                 assert(req);
 
-                uv_buf_t buf;
-                buf.base = const_cast<char*>(&data[offset]);
-                buf.len = static_cast<size_t>(length);
-
                 if(ipc_pipe)
                 {
-                    res = uv_write2(req, stream_, &buf, 1, send_stream?send_stream->uv_stream():nullptr, [](uv_write_t* req, int status) {
+                    res = uv_write2(req, stream_, const_cast<uv_buf_t*>(bufs), count, send_stream?send_stream->uv_stream():nullptr, [](uv_write_t* req, int status) {
                         auto self = reinterpret_cast<stream*>(req->handle->data);
                         assert(self);
                         if(self->on_complete_) self->on_complete_(status?get_last_error():resval());
@@ -109,7 +138,7 @@ namespace x10
                 }
                 else
                 {
-                    res = uv_write(req, stream_, &buf, 1, [](uv_write_t* req, int status) {
+                    res = uv_write(req, stream_, const_cast<uv_buf_t*>(bufs), count, [](uv_write_t* req, int status) {
                         auto self = reinterpret_cast<stream*>(req->handle->data);
                         assert(self);
                         if(self->on_complete_) self->on_complete_(status?get_last_error():resval());
@@ -156,6 +185,16 @@ namespace x10
                 });
             }
 
+            virtual void close()
+            {
+                if(tracker_) tracker_->untrack(this);
+                handle::close();
+            }
+
+            // Pooled buffer holding the data passed to the on_read callback currently running (nullptr outside of it).
+            // The stream releases it after the callback: retain() it to keep the data alive for longer.
+            buffer* read_buffer() const { return read_buffer_; }
+
             bool is_readable() const { return uv_is_readable(stream_) != 0; }
             bool is_writable() const { return uv_is_writable(stream_) != 0; }
 
@@ -165,23 +204,29 @@ namespace x10
         private:
             virtual stream* accept_new_() { return nullptr; }
 
-            static uv_buf_t on_alloc(uv_handle_t* h, size_t suggested_size)
+            static uv_buf_t on_alloc(uv_handle_t* h, size_t)
             {
                 auto self = reinterpret_cast<stream*>(h->data);
                 assert(self->stream_ == reinterpret_cast<uv_stream_t*>(h));
 
-                // TODO: Better memory management needed here.
-                // Something like 'slab' in the original node.js implementation.
+                // reads go into pooled buffers that consumers can retain instead of copying the data out.
+                auto b = buffer_pool::get().acquire();
+                assert(b);
 
-                return uv_buf_t { new char[suggested_size], suggested_size };
+                return uv_buf_t { b->data(), b->capacity() };
             };
 
             void after_read_(uv_stream_t* handle, ssize_t nread, uv_buf_t buf, uv_handle_type pending)
             {
+                read_buffer_ = buf.base ? buffer::from_data(buf.base) : nullptr;
+
                 if(nread < 0)
                 {
                     // error or EOF: invoke "onread" callback
                     if(on_read_) on_read_(nullptr, 0, 0, nullptr, get_last_error());
+
+                    read_eof_ = true;
+                    if(tracker_) tracker_->read_eof(this);
                 }
                 else
                 {
@@ -208,7 +253,11 @@ namespace x10
                     }
                 }
 
-                if(buf.base) delete buf.base;
+                if(read_buffer_)
+                {
+                    read_buffer_->release();
+                    read_buffer_ = nullptr;
+                }
             }
 
         protected:
@@ -218,6 +267,11 @@ namespace x10
 
         private:
             uv_stream_t* stream_;
+            stream_tracker* tracker_;
+            util::list_hook<stream> tracker_link_;
+            bool busy_;
+            bool read_eof_;
+            buffer* read_buffer_;
         };
     }
 }
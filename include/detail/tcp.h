@@ -2,35 +2,88 @@
 #define __DETAIL_TCP_H__
 
 #include "base.h"
+#include <random>
 #include "stream.h"
+#include "timer.h"
 
 namespace x10
 {
     namespace detail
     {
+        // Socket tuning for a tcp handle. Zero (or false) leaves the kernel default untouched.
+        // Options are applied as soon as the socket exists: buffer sizes and TCP_NOTSENT_LOWAT on bind/connect,
+        // TCP_FASTOPEN and TCP_DEFER_ACCEPT right before listen(), TCP_FASTOPEN_CONNECT right before connect(),
+        // and TCP_QUICKACK on every connected socket (including accepted ones).
+        struct tcp_options
+        {
+            tcp_options()
+                : send_buffer_size(0)
+                , recv_buffer_size(0)
+                , fast_open_queue(0)
+                , fast_open_connect(false)
+                , defer_accept(0)
+                , notsent_lowat(0)
+                , quick_ack(false)
+            {}
+
+            int send_buffer_size;       // SO_SNDBUF (bytes)
+            int recv_buffer_size;       // SO_RCVBUF (bytes)
+            int fast_open_queue;        // TCP_FASTOPEN: max. pending fast open requests (server)
+            bool fast_open_connect;     // TCP_FASTOPEN_CONNECT: carry the first write in the SYN (client)
+            int defer_accept;           // TCP_DEFER_ACCEPT: seconds to wait for the first data before accepting
+            int notsent_lowat;          // TCP_NOTSENT_LOWAT: max. unsent bytes buffered by the kernel
+            bool quick_ack;             // TCP_QUICKACK: acknowledge immediately instead of delaying ACKs
+        };
+
+        // Transport-level state of a connection as reported by the kernel (TCP_INFO).
+        struct tcp_transport_info
+        {
+            uint8_t state;              // TCP_ESTABLISHED, TCP_CLOSE_WAIT, ...
+            uint32_t rtt;               // smoothed round-trip time (microseconds)
+            uint32_t rtt_var;           // round-trip time variance (microseconds)
+            uint32_t rto;               // retransmission timeout (microseconds)
+            uint32_t snd_cwnd;          // congestion window (segments)
+            uint32_t snd_ssthresh;      // slow-start threshold (segments)
+            uint32_t snd_mss;           // sender MSS (bytes)
+            uint32_t unacked;           // segments in flight
+            uint32_t lost;              // segments considered lost
+            uint32_t retransmits;       // retransmitted segments not yet acknowledged
+            uint32_t total_retrans;     // retransmitted segments over the connection lifetime
+        };
+
         class tcp : public stream
         {
         public:
             tcp()
                 : stream(reinterpret_cast<uv_stream_t*>(&tcp_))
                 , tcp_()
+                , options_()
+                , connected_(false)
+                , peer_()
+                , connect_timer_(nullptr)
+                , connect_timed_out_(false)
+                , live_link_()
             {
                 int r = uv_tcp_init(uv_default_loop(), &tcp_);
                 assert(r == 0);
 
                 tcp_.data = this;
+                live_().push_back(this);
             }
 
         private:
             virtual ~tcp()
-            {}
+            {
+                live_().remove(this);
+            }
 
         public:
             // tcp hides handle::ref() and handle::unref()
             virtual void ref() {}
             virtual void unref() {}
 
-            virtual std::shared_ptr<net_addr> get_sock_name()
+            // address of the local end; valid only after bind(), listen() or connect().
+            virtual endpoint get_sock_name()
             {
                 struct sockaddr_storage addr;
                 int addrlen = static_cast<int>(sizeof(addr));
@@ -38,44 +91,18 @@ namespace x10
                 if(uv_tcp_getsockname(&tcp_, reinterpret_cast<struct sockaddr*>(&addr), &addrlen) == 0)
                 {
                     assert(addr.ss_family == AF_INET || addr.ss_family == AF_INET6);
-
-                    auto na = std::shared_ptr<net_addr>(new net_addr);
-                    na->is_ipv4 = (addr.ss_family == AF_INET);
-                    if(na->is_ipv4)
-                    {
-                        if(from_ip4_addr(reinterpret_cast<struct sockaddr_in*>(&addr), na->ip, na->port)) return na;
-                    }
-                    else
-                    {
-                        if(from_ip6_addr(reinterpret_cast<struct sockaddr_in6*>(&addr), na->ip, na->port)) return na;
-                    }
+                    return endpoint(reinterpret_cast<struct sockaddr*>(&addr), static_cast<std::size_t>(addrlen));
                 }
 
-                return nullptr;
+                return endpoint();
             }
 
-            virtual std::shared_ptr<net_addr> get_peer_name()
+            // address of the remote end. It is captured once when the connection is accepted or established,
+            // so repeated calls (e.g. per-request access logging) cost no syscall.
+            virtual const endpoint& get_peer_name()
             {
-                struct sockaddr_storage addr;
-                int addrlen = static_cast<int>(sizeof(addr));
-
-                if(uv_tcp_getsockname(&tcp_, reinterpret_cast<struct sockaddr*>(&addr), &addrlen) == 0)
-                {
-                    assert(addr.ss_family == AF_INET || addr.ss_family == AF_INET6);
-
-                    auto na = std::shared_ptr<net_addr>(new net_addr);
-                    na->is_ipv4 = (addr.ss_family == AF_INET);
-                    if(na->is_ipv4)
-                    {
-                        if(from_ip4_addr(reinterpret_cast<struct sockaddr_in*>(&addr), na->ip, na->port)) return na;
-                    }
-                    else
-                    {
-                        if(from_ip6_addr(reinterpret_cast<struct sockaddr_in6*>(&addr), na->ip, na->port)) return na;
-                    }
-                }
-
-                return nullptr;
+                if(!peer_.is_valid()) cache_peer_name_();
+                return peer_;
             }
 
             virtual resval set_no_delay(bool enable)
@@ -88,67 +115,157 @@ namespace x10
                 return run_(uv_tcp_keepalive, &tcp_, enable?1:0, delay);
             }
 
+            // Stores the options and applies the ones the current socket state allows;
+            // the rest are applied on bind(), listen() or connect().
+            virtual resval set_options(const tcp_options& options)
+            {
+                options_ = options;
+                if(socket() == -1) return resval();
+
+                resval rv = apply_socket_options_();
+                if(rv && connected_) rv = apply_connected_options_();
+                return rv;
+            }
+
+            const tcp_options& options() const { return options_; }
+
+            // TCP_QUICKACK is not permanent on Linux: the kernel may fall back to delayed ACKs
+            // after it was set, so callers can re-arm it (e.g. after each read).
+            virtual resval set_quick_ack(bool enable)
+            {
+#ifdef TCP_QUICKACK
+                if(socket() == -1) return resval(error::ebadf);
+                return set_sock_opt(socket(), IPPROTO_TCP, TCP_QUICKACK, enable?1:0);
+#else
+                return enable?resval(error::enotsup):resval();
+#endif
+            }
+
+            virtual resval transport_info(tcp_transport_info& info)
+            {
+#if defined(TCP_INFO) && defined(__linux__)
+                if(socket() == -1) return resval(error::ebadf);
+
+                struct tcp_info ti;
+                resval rv = get_sock_opt(socket(), IPPROTO_TCP, TCP_INFO, ti);
+                if(!rv) return rv;
+
+                info.state = ti.tcpi_state;
+                info.rtt = ti.tcpi_rtt;
+                info.rtt_var = ti.tcpi_rttvar;
+                info.rto = ti.tcpi_rto;
+                info.snd_cwnd = ti.tcpi_snd_cwnd;
+                info.snd_ssthresh = ti.tcpi_snd_ssthresh;
+                info.snd_mss = ti.tcpi_snd_mss;
+                info.unacked = ti.tcpi_unacked;
+                info.lost = ti.tcpi_lost;
+                info.retransmits = ti.tcpi_retrans;
+                info.total_retrans = ti.tcpi_total_retrans;
+                return resval();
+#else
+                return resval(error::enotsup);
+#endif
+            }
+
+            bool is_connected() const { return connected_; }
+
+            // Calls f(tcp*) for every tcp object alive in the process (x10 runs on the default loop), unlike
+            // uv_walk(), which also visits handles x10 does not own.
+            template<typename F>
+            static void for_each(F f)
+            {
+                live_().for_each(f);
+            }
+
+            uv_os_sock_t socket() const
+            {
+#ifdef _WIN32
+                return tcp_.socket;
+#else
+                return tcp_.io_watcher.fd;
+#endif
+            }
+
             virtual resval bind(const std::string& ip, int port)
             {
-                return run_(uv_tcp_bind, &tcp_, to_ip4_addr(ip, port));
+                resval rv = run_(uv_tcp_bind, &tcp_, to_ip4_addr(ip, port));
+                if(!rv) return rv;
+                return apply_socket_options_();
             }
 
             virtual resval bind6(const std::string& ip, int port)
             {
-                return run_(uv_tcp_bind6, &tcp_, to_ip6_addr(ip, port));
+                resval rv = run_(uv_tcp_bind6, &tcp_, to_ip6_addr(ip, port));
+                if(!rv) return rv;
+                return apply_socket_options_();
             }
 
-            virtual resval connect(const std::string& ip, int port)
+            virtual resval listen(int backlog)
             {
-                auto ver = get_ip_version(ip);
-                if(ver == 4) return connect4(ip, port);
-                else if(ver == 6) return connect6(ip, port);
-                else
+                // without bind() libuv would create the socket inside listen(), too late for the options:
+                // create it here (IPv4, as libuv does) and let listen() bind it to an ephemeral port.
+                if(socket() == -1)
                 {
-                    // TODO: uh-oh...
-                    assert(false);
-                    return resval();
+                    resval rv = open_socket_(AF_INET);
+                    if(rv) rv = apply_socket_options_();
+                    if(!rv) return rv;
                 }
+
+                resval rv = apply_listen_options_();
+                if(!rv) return rv;
+                return stream::listen(backlog);
+            }
+
+            // timeout (milliseconds) bounds the whole handshake: when it expires the handle is closed
+            // and the completion callback receives error::etimedout. 0 waits for the kernel's own timeout.
+            virtual resval connect(const std::string& ip, int port, int64_t timeout=0)
+            {
+                auto ver = get_ip_version(ip);
+                if(ver == 4) return connect4(ip, port, timeout);
+                else if(ver == 6) return connect6(ip, port, timeout);
+                else return resval(error::einval);
             }
 
-            virtual resval connect4(const std::string& ip, int port)
+            virtual resval connect4(const std::string& ip, int port, int64_t timeout=0)
             {
                 struct sockaddr_in addr = to_ip4_addr(ip, port);
 
+                resval rv = prepare_connect_(AF_INET);
+                if(!rv) return rv;
+
                 auto req = new uv_connect_t;
                 assert(req);
 
-                if(uv_tcp_connect(req, &tcp_, addr, [](uv_connect_t* req, int status){
-                    auto self = reinterpret_cast<tcp*>(req->handle->data);
-                    assert(self);
-                    if(self->on_complete_) self->on_complete_(status?get_last_error():resval());
-                    delete req;
-                }))
+                if(uv_tcp_connect(req, &tcp_, addr, after_connect_))
                 {
                     delete req;
                     return get_last_error();
                 }
-                return resval();
+                return start_connect_timer_(timeout);
             }
 
-            virtual resval connect6(const std::string& ip, int port)
+            virtual resval connect6(const std::string& ip, int port, int64_t timeout=0)
             {
                 struct sockaddr_in6 addr = to_ip6_addr(ip, port);
 
+                resval rv = prepare_connect_(AF_INET6);
+                if(!rv) return rv;
+
                 auto req = new uv_connect_t;
                 assert(req);
 
-                if(uv_tcp_connect6(req, &tcp_, addr, [](uv_connect_t* req, int status){
-                    auto self = reinterpret_cast<tcp*>(req->handle->data);
-                    assert(self);
-                    if(self->on_complete_) self->on_complete_(status?get_last_error():resval());
-                    delete req;
-                }))
+                if(uv_tcp_connect6(req, &tcp_, addr, after_connect_))
                 {
                     delete req;
                     return get_last_error();
                 }
-                return resval();
+                return start_connect_timer_(timeout);
+            }
+
+            virtual void close()
+            {
+                stop_connect_timer_();
+                stream::close();
             }
 
         private:
@@ -160,12 +277,336 @@ namespace x10
                 int r = uv_accept(reinterpret_cast<uv_stream_t*>(&tcp_), reinterpret_cast<uv_stream_t*>(&x->tcp_));
                 assert(r == 0);
 
+                // buffer sizes and TCP_NOTSENT_LOWAT are inherited from the listening socket; TCP_QUICKACK is not.
+                x->options_ = options_;
+                x->connected_ = true;
+                x->cache_peer_name_();
+                x->apply_connected_options_();
+
                 return x;
             }
 
+            static void after_connect_(uv_connect_t* req, int status)
+            {
+                auto self = reinterpret_cast<tcp*>(req->handle->data);
+                assert(self);
+
+                // also reached from uv_close() when the deadline expired: libuv cancels the pending request.
+                self->stop_connect_timer_();
+
+                resval rv;
+                if(status) rv = self->connect_timed_out_ ? resval(error::etimedout) : get_last_error();
+                else
+                {
+                    self->connected_ = true;
+                    self->cache_peer_name_();
+                    self->apply_connected_options_();
+                }
+
+                if(self->on_complete_) self->on_complete_(rv);
+                delete req;
+            }
+
+            resval start_connect_timer_(int64_t timeout)
+            {
+                if(timeout <= 0) return resval();
+
+                assert(!connect_timer_);
+                connect_timer_ = new timer;
+                assert(connect_timer_);
+
+                connect_timer_->on_timeout([this](timer*) {
+                    // closing the handle is the only way to abort a pending uv_connect_t.
+                    connect_timed_out_ = true;
+                    close();
+                });
+                return connect_timer_->start(timeout);
+            }
+
+            void stop_connect_timer_()
+            {
+                if(!connect_timer_) return;
+
+                connect_timer_->stop();
+                connect_timer_->close();
+                connect_timer_ = nullptr;
+            }
+
+            void cache_peer_name_()
+            {
+                struct sockaddr_storage addr;
+                int addrlen = static_cast<int>(sizeof(addr));
+
+                if(uv_tcp_getpeername(&tcp_, reinterpret_cast<struct sockaddr*>(&addr), &addrlen) == 0)
+                {
+                    peer_.assign(reinterpret_cast<struct sockaddr*>(&addr), static_cast<std::size_t>(addrlen));
+                }
+                else
+                {
+                    peer_.clear();
+                }
+            }
+
+            // creates the socket up front (instead of inside uv_tcp_connect) so that options can be set before connect().
+            resval prepare_connect_(int domain)
+            {
+                if(socket() == -1)
+                {
+                    resval rv = open_socket_(domain);
+                    if(!rv) return rv;
+                }
+
+                resval rv = apply_socket_options_();
+                if(!rv) return rv;
+
+#ifdef TCP_FASTOPEN_CONNECT
+                if(options_.fast_open_connect) return set_sock_opt(socket(), IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+#else
+                if(options_.fast_open_connect) return resval(error::enotsup);
+#endif
+                return resval();
+            }
+
+            resval open_socket_(int domain)
+            {
+#ifdef SOCK_NONBLOCK
+                int fd = ::socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if(fd == -1) return get_sys_error(errno);
+#else
+                int fd = ::socket(domain, SOCK_STREAM, 0);
+                if(fd == -1) return get_sys_error(errno);
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+                if(uv_tcp_open(&tcp_, fd))
+                {
+                    ::close(fd);
+                    return get_last_error();
+                }
+                return resval();
+            }
+
+            resval apply_socket_options_()
+            {
+                resval rv;
+                if(options_.send_buffer_size > 0) rv = set_sock_opt(socket(), SOL_SOCKET, SO_SNDBUF, options_.send_buffer_size);
+                if(rv && options_.recv_buffer_size > 0) rv = set_sock_opt(socket(), SOL_SOCKET, SO_RCVBUF, options_.recv_buffer_size);
+#ifdef TCP_NOTSENT_LOWAT
+                if(rv && options_.notsent_lowat > 0) rv = set_sock_opt(socket(), IPPROTO_TCP, TCP_NOTSENT_LOWAT, options_.notsent_lowat);
+#else
+                if(rv && options_.notsent_lowat > 0) rv = resval(error::enotsup);
+#endif
+                return rv;
+            }
+
+            resval apply_listen_options_()
+            {
+                resval rv;
+#ifdef TCP_FASTOPEN
+                if(options_.fast_open_queue > 0) rv = set_sock_opt(socket(), IPPROTO_TCP, TCP_FASTOPEN, options_.fast_open_queue);
+#else
+                if(options_.fast_open_queue > 0) rv = resval(error::enotsup);
+#endif
+#ifdef TCP_DEFER_ACCEPT
+                if(rv && options_.defer_accept > 0) rv = set_sock_opt(socket(), IPPROTO_TCP, TCP_DEFER_ACCEPT, options_.defer_accept);
+#else
+                if(rv && options_.defer_accept > 0) rv = resval(error::enotsup);
+#endif
+                return rv;
+            }
+
+            resval apply_connected_options_()
+            {
+                if(options_.quick_ack) return set_quick_ack(true);
+                return resval();
+            }
+
         private:
             uv_tcp_t tcp_;
+            tcp_options options_;
+            bool connected_;
+            endpoint peer_;
+            timer* connect_timer_;
+            bool connect_timed_out_;
+            util::list_hook<tcp> live_link_;
+
+            static util::intrusive_list<tcp, &tcp::live_link_>& live_()
+            {
+                static util::intrusive_list<tcp, &tcp::live_link_> live;
+                return live;
+            }
+        };
+
+        // Exponential backoff between connect attempts. The n-th retry waits
+        // min(initial_backoff * multiplier^(n-1), max_backoff) milliseconds, randomly shortened
+        // by up to 'jitter' (0..1) of that value so that clients don't retry in lockstep.
+        struct retry_policy
+        {
+            retry_policy(int max_attempts=3, int64_t initial_backoff=50, int64_t max_backoff=5000, double multiplier=2.0, double jitter=0.5)
+                : max_attempts(max_attempts)
+                , initial_backoff(initial_backoff)
+                , max_backoff(max_backoff)
+                , multiplier(multiplier)
+                , jitter(jitter)
+            {}
+
+            // delay (milliseconds) before retry number 'retry' (1-based).
+            int64_t backoff(int retry) const
+            {
+                double delay = static_cast<double>(initial_backoff);
+                for(int i=1;i<retry && delay<max_backoff;++i) delay *= multiplier;
+                if(delay > max_backoff) delay = static_cast<double>(max_backoff);
+
+                static std::minstd_rand rng(static_cast<std::minstd_rand::result_type>(uv_hrtime()));
+                double r = static_cast<double>(rng() - rng.min()) / (rng.max() - rng.min());
+                return static_cast<int64_t>(delay * (1.0 - jitter * r));
+            }
+
+            int max_attempts;
+            int64_t initial_backoff;
+            int64_t max_backoff;
+            double multiplier;
+            double jitter;
+        };
+
+        typedef std::function<void(tcp*, resval)> tcp_connect_callback_type;
+
+        class tcp_connect_context
+        {
+        public:
+            tcp_connect_context(const std::vector<std::pair<std::string, int>>& targets, const retry_policy& policy,
+                int64_t attempt_timeout, const tcp_options& options, tcp_connect_callback_type callback)
+                : targets_(targets)
+                , policy_(policy)
+                , attempt_timeout_(attempt_timeout)
+                , options_(options)
+                , callback_(callback)
+                , attempts_(0)
+                , next_target_(0)
+                , backoff_timer_(nullptr)
+            {
+                assert(!targets_.empty());
+            }
+
+            ~tcp_connect_context()
+            {
+                if(backoff_timer_) backoff_timer_->close();
+            }
+
+            void start()
+            {
+                start_attempt_();
+            }
+
+        private:
+            // one attempt per target in turn: a failed target fails over to the next one at once,
+            // the backoff delay applies only after every target has failed in the current round.
+            resval attempt_()
+            {
+                auto& target = targets_[next_target_];
+                next_target_ = (next_target_ + 1) % targets_.size();
+                ++attempts_;
+
+                auto conn = new tcp;
+                assert(conn);
+
+                resval rv = conn->set_options(options_);
+                if(rv)
+                {
+                    conn->on_complete([this, conn](resval rv) {
+                        // detach from the handle first: this resets the closure that is running right now.
+                        auto self = this;
+                        auto c = conn;
+                        c->on_complete(nullptr);
+
+                        if(rv)
+                        {
+                            self->callback_(c, rv);
+                            delete self;
+                        }
+                        else
+                        {
+                            // a timed out handle has already been closed by tcp itself.
+                            if(rv.code() != error::etimedout) c->close();
+                            self->retry_(rv);
+                        }
+                    });
+                    rv = conn->connect(target.first, target.second, attempt_timeout_);
+                }
+
+                if(!rv)
+                {
+                    conn->on_complete(nullptr);
+                    conn->close();
+                }
+                return rv;
+            }
+
+            void retry_(resval last_error)
+            {
+                if(attempts_ >= policy_.max_attempts)
+                {
+                    callback_(nullptr, last_error);
+                    delete this;
+                    return;
+                }
+
+                if(next_target_ != 0)
+                {
+                    // fail over to the next target right away
+                    start_attempt_();
+                    return;
+                }
+
+                if(!backoff_timer_)
+                {
+                    backoff_timer_ = new timer;
+                    assert(backoff_timer_);
+                }
+
+                int round = static_cast<int>(attempts_ / targets_.size());
+                backoff_timer_->on_timeout([this](timer*) { start_attempt_(); });
+                resval rv = backoff_timer_->start(policy_.backoff(round));
+                if(!rv)
+                {
+                    callback_(nullptr, rv);
+                    delete this;
+                }
+            }
+
+            void start_attempt_()
+            {
+                // a synchronous failure (e.g. EMFILE) counts as a failed attempt too.
+                resval rv = attempt_();
+                if(!rv) retry_(rv);
+            }
+
+        private:
+            std::vector<std::pair<std::string, int>> targets_;
+            retry_policy policy_;
+            int64_t attempt_timeout_;
+            tcp_options options_;
+            tcp_connect_callback_type callback_;
+            int attempts_;
+            std::size_t next_target_;
+            timer* backoff_timer_;
         };
+
+        // Connects to the first reachable target (ip, port) with a deadline per attempt and retries
+        // according to the policy. The callback receives the connected handle, or nullptr and the last error;
+        // attempts that fail synchronously (e.g. EMFILE), the first one included, are retried like the others,
+        // so the callback may be invoked before this returns.
+        inline resval connect_with_retry(const std::vector<std::pair<std::string, int>>& targets, const retry_policy& policy,
+            int64_t attempt_timeout, tcp_connect_callback_type callback, const tcp_options& options=tcp_options())
+        {
+            if(targets.empty() || policy.max_attempts < 1) return resval(error::einval);
+
+            auto ctx = new tcp_connect_context(targets, policy, attempt_timeout, options, callback);
+            assert(ctx);
+
+            ctx->start();
+            return resval();
+        }
     }
 }
 
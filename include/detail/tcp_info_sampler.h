@@ -0,0 +1,130 @@
+#ifndef __DETAIL_TCP_INFO_SAMPLER_H__
+#define __DETAIL_TCP_INFO_SAMPLER_H__
+
+#include "base.h"
+#include "tcp.h"
+#include "timer.h"
+#include "histogram.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        // Periodically reads TCP_INFO of every connected tcp object and aggregates the values
+        // into histograms, to tell network-bound latency (RTT, retransmits, small cwnd) from application-bound latency.
+        class tcp_info_sampler
+        {
+            typedef std::function<void(const tcp_info_sampler*)> on_sample_callback_type;
+
+        public:
+            tcp_info_sampler()
+                : timer_(nullptr)
+                , on_sample_()
+                , samples_(0)
+                , connections_(0)
+                , rtt_()
+                , rtt_var_()
+                , snd_cwnd_()
+                , retransmits_()
+                , total_retrans_()
+            {}
+
+            ~tcp_info_sampler()
+            {
+                stop();
+            }
+
+            // no copy allowed
+            tcp_info_sampler(const tcp_info_sampler&) = delete;
+            void operator=(const tcp_info_sampler&) = delete;
+
+            // invoked after every sampling round.
+            void on_sample(on_sample_callback_type callback)
+            {
+                on_sample_ = callback;
+            }
+
+            resval start(int64_t interval_ms)
+            {
+                if(!timer_)
+                {
+                    timer_ = new timer;
+                    assert(timer_);
+
+                    timer_->on_timeout([this](timer*) { sample(); });
+                }
+                return timer_->start(interval_ms, interval_ms);
+            }
+
+            void stop()
+            {
+                if(!timer_) return;
+
+                timer_->stop();
+                timer_->close();
+                timer_ = nullptr;
+            }
+
+            // takes one sample of all live connections right away.
+            void sample()
+            {
+                connections_ = 0;
+                tcp::for_each([this](tcp* conn) {
+                    // closed (awaiting deletion) or not connected
+                    if(!conn->uv_handle() || !conn->is_connected()) return;
+
+                    tcp_transport_info info;
+                    if(conn->transport_info(info)) record(info);
+                });
+
+                ++samples_;
+                if(on_sample_) on_sample_(this);
+            }
+
+            void record(const tcp_transport_info& info)
+            {
+                ++connections_;
+                rtt_.record(info.rtt);
+                rtt_var_.record(info.rtt_var);
+                snd_cwnd_.record(info.snd_cwnd);
+                retransmits_.record(info.retransmits);
+                total_retrans_.record(info.total_retrans);
+            }
+
+            void reset()
+            {
+                samples_ = 0;
+                connections_ = 0;
+                rtt_.reset();
+                rtt_var_.reset();
+                snd_cwnd_.reset();
+                retransmits_.reset();
+                total_retrans_.reset();
+            }
+
+            uint64_t samples() const { return samples_; }
+
+            // number of connections seen by the last sampling round.
+            std::size_t connections() const { return connections_; }
+
+            const histogram& rtt() const { return rtt_; }
+            const histogram& rtt_var() const { return rtt_var_; }
+            const histogram& snd_cwnd() const { return snd_cwnd_; }
+            const histogram& retransmits() const { return retransmits_; }
+            const histogram& total_retrans() const { return total_retrans_; }
+
+        private:
+            timer* timer_;
+            on_sample_callback_type on_sample_;
+            uint64_t samples_;
+            std::size_t connections_;
+            histogram rtt_;
+            histogram rtt_var_;
+            histogram snd_cwnd_;
+            histogram retransmits_;
+            histogram total_retrans_;
+        };
+    }
+}
+
+#endif
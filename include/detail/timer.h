@@ -0,0 +1,73 @@
+#ifndef __DETAIL_TIMER_H__
+#define __DETAIL_TIMER_H__
+
+#include "base.h"
+#include "handle.h"
+
+namespace x10
+{
+    namespace detail
+    {
+        class timer : public handle
+        {
+            typedef std::function<void(timer*)> on_timeout_callback_type;
+
+        public:
+            timer()
+                : handle(reinterpret_cast<uv_handle_t*>(&timer_))
+                , timer_()
+                , on_timeout_()
+            {
+                int r = uv_timer_init(uv_default_loop(), &timer_);
+                assert(r == 0);
+
+                timer_.data = this;
+            }
+
+        private:
+            virtual ~timer()
+            {}
+
+        public:
+            void on_timeout(on_timeout_callback_type callback)
+            {
+                on_timeout_ = callback;
+            }
+
+            // timeout and repeat are in milliseconds; repeat=0 makes it a one-shot timer.
+            virtual resval start(int64_t timeout, int64_t repeat=0)
+            {
+                return run_(uv_timer_start, &timer_, [](uv_timer_t* handle, int) {
+                    auto self = reinterpret_cast<timer*>(handle->data);
+                    assert(self);
+                    if(self->on_timeout_) self->on_timeout_(self);
+                }, timeout, repeat);
+            }
+
+            virtual resval stop()
+            {
+                return run_(uv_timer_stop, &timer_);
+            }
+
+            // restarts a repeating timer using its repeat value as the timeout.
+            virtual resval again()
+            {
+                return run_(uv_timer_again, &timer_);
+            }
+
+            void set_repeat(int64_t repeat) { uv_timer_set_repeat(&timer_, repeat); }
+            int64_t repeat() { return uv_timer_get_repeat(&timer_); }
+
+            bool is_active() const { return uv_is_active(reinterpret_cast<const uv_handle_t*>(&timer_)) != 0; }
+
+            // cached loop time in milliseconds (updated once per loop iteration).
+            static int64_t now() { return uv_now(uv_default_loop()); }
+
+        private:
+            uv_timer_t timer_;
+            on_timeout_callback_type on_timeout_;
+        };
+    }
+}
+
+#endif
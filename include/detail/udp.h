@@ -2,14 +2,632 @@
 #define __DETAIL_UDP_H__
 
 #include "base.h"
-#include "stream.h"
+#include <deque>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#endif
+#include "handle.h"
 
 namespace x10
 {
     namespace detail
     {
-        class udp : public stream
+        // A received datagram. data points into the handle's receive pool and is valid only during the callback.
+        struct udp_message
         {
+            const char* data;
+            std::size_t length;
+            endpoint peer;
+            bool truncated;             // datagram was larger than max_datagram_size
+            std::size_t segment_size;   // non-zero: GRO coalesced datagrams of this size (the last may be shorter)
+
+            std::size_t segment_count() const
+            {
+                if(segment_size == 0 || length == 0) return 1;
+                return (length + segment_size - 1) / segment_size;
+            }
+        };
+
+        // UDP socket driven by a uv_poll_t watcher instead of uv_udp_t, so that one readiness event can move
+        // a whole batch of datagrams with recvmmsg()/sendmmsg() (Linux; other platforms loop over recvfrom()/sendto()).
+        // Datagrams are received into a pool of batch_size * max_datagram_size bytes allocated once in recv_start().
+        // On Linux, UDP_SEGMENT (GSO) and UDP_GRO offload are used when the kernel supports them.
+        class udp : public handle
+        {
+            typedef std::function<void(const udp_message*, std::size_t, resval)> on_recv_callback_type;
+            typedef std::function<void(resval)> on_error_callback_type;
+
+            // caps the datagrams handled per readiness event so that one busy socket can't starve the loop.
+            static const std::size_t max_batches_per_event = 32;
+            static const std::size_t max_send_batch = 64;
+
+            // kernel limits for one GSO send (UDP_MAX_SEGMENTS, IP datagram size).
+            static const std::size_t max_gso_segments = 64;
+            static const std::size_t max_gso_bytes = 65000;
+
+            // a GRO receive may hand over up to 64KB at once.
+            static const std::size_t gro_datagram_size = 65536;
+
+        public:
+            udp(int family=AF_INET)
+                : handle(reinterpret_cast<uv_handle_t*>(&poll_))
+                , poll_()
+                , fd_(-1)
+                , open_error_()
+                , events_(0)
+                , gso_(-1)
+                , gro_(false)
+                , on_recv_()
+                , on_error_()
+                , batch_size_(0)
+                , max_datagram_size_(0)
+                , pool_()
+                , messages_()
+                , send_queue_()
+            {
+                assert(family == AF_INET || family == AF_INET6);
+
+                // a failure (e.g. EMFILE) is kept in open_error(), which every operation returns; the handle
+                // still has to be closed.
+#ifdef SOCK_NONBLOCK
+                fd_ = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if(fd_ == -1) open_error_ = get_sys_error(errno);
+#else
+                fd_ = ::socket(family, SOCK_DGRAM, 0);
+                if(fd_ == -1) open_error_ = get_sys_error(errno);
+                else
+                {
+                    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+                    fcntl(fd_, F_SETFD, FD_CLOEXEC);
+                }
+#endif
+
+                int r = uv_poll_init_socket(uv_default_loop(), &poll_, fd_);
+                assert(r == 0);
+
+                poll_.data = this;
+            }
+
+        private:
+            virtual ~udp()
+            {}
+
+        public:
+            // invoked with each batch of received datagrams.
+            void on_recv(on_recv_callback_type callback)
+            {
+                on_recv_ = callback;
+            }
+
+            // invoked when a queued datagram could not be sent or the watcher failed.
+            void on_error(on_error_callback_type callback)
+            {
+                on_error_ = callback;
+            }
+
+            virtual void close()
+            {
+                if(!uv_handle()) return;
+
+                // uv_close() stops the watcher synchronously, so the descriptor can go right after.
+                int fd = fd_;
+                fd_ = -1;
+                handle::close();
+                if(fd != -1) ::close(fd);
+            }
+
+            // the error socket() failed with in the constructor (success otherwise)
+            resval open_error() const { return open_error_; }
+
+            virtual resval bind(const std::string& ip, int port, bool reuse_address=false)
+            {
+                endpoint ep = to_endpoint(ip, port);
+                if(!ep.is_valid()) return resval(error::einval);
+                return bind(ep, reuse_address);
+            }
+
+            virtual resval bind(const endpoint& ep, bool reuse_address=false)
+            {
+                if(fd_ == -1) return closed_error_();
+                if(reuse_address)
+                {
+                    resval rv = set_sock_opt(fd_, SOL_SOCKET, SO_REUSEADDR, 1);
+                    if(!rv) return rv;
+#ifdef SO_REUSEPORT
+                    rv = set_sock_opt(fd_, SOL_SOCKET, SO_REUSEPORT, 1);
+                    if(!rv) return rv;
+#endif
+                }
+
+                if(::bind(fd_, ep.addr(), static_cast<socklen_t>(ep.length()))) return get_sys_error(errno);
+                return resval();
+            }
+
+            endpoint get_sock_name() const
+            {
+                struct sockaddr_storage addr;
+                socklen_t addrlen = static_cast<socklen_t>(sizeof(addr));
+
+                if(getsockname(fd_, reinterpret_cast<struct sockaddr*>(&addr), &addrlen) == 0)
+                {
+                    return endpoint(reinterpret_cast<struct sockaddr*>(&addr), static_cast<std::size_t>(addrlen));
+                }
+                return endpoint();
+            }
+
+            resval set_broadcast(bool enable) { return fd_ == -1 ? closed_error_() : set_sock_opt(fd_, SOL_SOCKET, SO_BROADCAST, enable?1:0); }
+            resval set_ttl(int ttl) { return fd_ == -1 ? closed_error_() : set_sock_opt(fd_, IPPROTO_IP, IP_TTL, ttl); }
+            resval set_send_buffer_size(int size) { return fd_ == -1 ? closed_error_() : set_sock_opt(fd_, SOL_SOCKET, SO_SNDBUF, size); }
+            resval set_recv_buffer_size(int size) { return fd_ == -1 ? closed_error_() : set_sock_opt(fd_, SOL_SOCKET, SO_RCVBUF, size); }
+
+            // batch_size datagrams are read per syscall; larger datagrams are truncated to max_datagram_size.
+            virtual resval recv_start(std::size_t batch_size=32, std::size_t max_datagram_size=2048)
+            {
+                if(fd_ == -1) return closed_error_();
+                if(batch_size == 0 || max_datagram_size == 0) return resval(error::einval);
+                if(gro_) max_datagram_size = std::max(max_datagram_size, std::size_t(gro_datagram_size));
+
+                if(batch_size != batch_size_ || max_datagram_size != max_datagram_size_)
+                {
+                    batch_size_ = batch_size;
+                    max_datagram_size_ = max_datagram_size;
+                    init_pool_();
+                }
+
+                events_ |= UV_READABLE;
+                return update_poll_();
+            }
+
+            virtual resval recv_stop()
+            {
+                events_ &= ~UV_READABLE;
+                return update_poll_();
+            }
+
+            // Sends right away when the socket is writable. Otherwise the datagram is copied into the send queue
+            // and flushed in batches once the socket becomes writable again.
+            virtual resval send(const char* data, std::size_t length, const endpoint& to)
+            {
+                if(fd_ == -1) return closed_error_();
+
+                if(send_queue_.empty())
+                {
+                    ssize_t r;
+                    do r = ::sendto(fd_, data, length, 0, to.addr(), static_cast<socklen_t>(to.length()));
+                    while(r == -1 && errno == EINTR);
+
+                    if(r >= 0) return resval();
+                    if(errno != EAGAIN && errno != ENOBUFS) return get_sys_error(errno);
+                }
+
+                return enqueue_(data, length, to);
+            }
+
+            // Sends a batch of datagrams with a single sendmmsg() where available; what doesn't fit
+            // into the socket buffer is queued.
+            virtual resval send(const udp_message* messages, std::size_t count)
+            {
+                if(fd_ == -1) return closed_error_();
+
+                std::size_t sent = 0;
+                if(send_queue_.empty())
+                {
+                    resval rv = send_now_(messages, count, sent);
+                    if(!rv && rv.code() != error::eagain && rv.code() != error::enobufs) return rv;
+                }
+
+                for(std::size_t i=sent;i<count;++i)
+                {
+                    resval rv = enqueue_(messages[i].data, messages[i].length, messages[i].peer);
+                    if(!rv) return rv;
+                }
+                return resval();
+            }
+
+            // Sends one buffer as length/segment_size datagrams (the last may be shorter). With UDP_SEGMENT
+            // the kernel (or NIC) does the split and the whole buffer costs one syscall per 64 segments;
+            // without it the datagrams are sent as a sendmmsg() batch instead.
+            virtual resval send(const char* data, std::size_t length, std::size_t segment_size, const endpoint& to)
+            {
+                if(fd_ == -1) return closed_error_();
+                if(segment_size == 0) return resval(error::einval);
+                if(length <= segment_size) return send(data, length, to);
+
+                std::size_t offset = 0;
+                if(send_queue_.empty() && is_gso_supported())
+                {
+                    std::size_t chunk_max = std::min(std::size_t(max_gso_segments), std::size_t(max_gso_bytes) / segment_size) * segment_size;
+                    while(offset < length && chunk_max > 0)
+                    {
+                        std::size_t chunk = std::min(length - offset, chunk_max);
+                        resval rv = send_gso_(data + offset, chunk, segment_size, to);
+                        if(!rv)
+                        {
+                            if(rv.code() == error::eagain || rv.code() == error::enobufs) break;
+                            if(gso_ != 0) return rv;
+
+                            // the kernel turned GSO down (e.g. no checksum offload on the route): fall back.
+                            break;
+                        }
+                        offset += chunk;
+                    }
+                }
+
+                udp_message batch[max_send_batch];
+                while(offset < length)
+                {
+                    std::size_t n = 0;
+                    for(;n<max_send_batch && offset<length;++n)
+                    {
+                        batch[n].data = data + offset;
+                        batch[n].length = std::min(segment_size, length - offset);
+                        batch[n].peer = to;
+                        batch[n].truncated = false;
+                        batch[n].segment_size = 0;
+                        offset += batch[n].length;
+                    }
+
+                    resval rv = send(batch, n);
+                    if(!rv) return rv;
+                }
+                return resval();
+            }
+
+            bool is_gso_supported()
+            {
+#if defined(__linux__) && defined(UDP_SEGMENT)
+                if(gso_ == -1)
+                {
+                    int value = 0;
+                    gso_ = get_sock_opt(fd_, SOL_UDP, UDP_SEGMENT, value) ? 1 : 0;
+                }
+                return gso_ == 1;
+#else
+                return false;
+#endif
+            }
+
+            // Asks the kernel to coalesce consecutive datagrams of a flow into one receive (UDP_GRO); they are
+            // delivered as one udp_message with segment_size set. Returns whether GRO is active: without kernel
+            // support datagrams simply keep arriving one by one. Takes effect with the next recv_start().
+            bool set_gro(bool enable)
+            {
+#if defined(__linux__) && defined(UDP_GRO)
+                if(set_sock_opt(fd_, SOL_UDP, UDP_GRO, enable?1:0)) gro_ = enable;
+                else gro_ = false;
+#else
+                gro_ = false;
+#endif
+                return gro_;
+            }
+
+            bool gro_enabled() const { return gro_; }
+
+            std::size_t send_queue_size() const { return send_queue_.size(); }
+
+            uv_os_sock_t socket() const { return fd_; }
+
+        private:
+            struct queued_datagram
+            {
+                std::vector<char> data;
+                endpoint peer;
+            };
+
+            struct recv_pool
+            {
+                std::vector<char> data;
+                std::vector<struct iovec> iov;
+                std::vector<struct sockaddr_storage> addrs;
+#ifdef __linux__
+                std::vector<struct mmsghdr> hdrs;
+                std::vector<char> control;
+#endif
+            };
+
+            void init_pool_()
+            {
+                pool_.data.assign(batch_size_ * max_datagram_size_, 0);
+                pool_.iov.resize(batch_size_);
+                pool_.addrs.resize(batch_size_);
+                messages_.resize(batch_size_);
+
+                for(std::size_t i=0;i<batch_size_;++i)
+                {
+                    pool_.iov[i].iov_base = &pool_.data[i * max_datagram_size_];
+                    pool_.iov[i].iov_len = max_datagram_size_;
+                }
+
+#ifdef __linux__
+                pool_.hdrs.assign(batch_size_, mmsghdr());
+                for(std::size_t i=0;i<batch_size_;++i)
+                {
+                    auto& h = pool_.hdrs[i].msg_hdr;
+                    h.msg_iov = &pool_.iov[i];
+                    h.msg_iovlen = 1;
+                    h.msg_name = &pool_.addrs[i];
+                }
+
+                pool_.control.assign(batch_size_ * control_size_(), 0);
+                for(std::size_t i=0;i<batch_size_;++i) pool_.hdrs[i].msg_hdr.msg_control = &pool_.control[i * control_size_()];
+#endif
+            }
+
+            resval update_poll_()
+            {
+                if(fd_ == -1) return closed_error_();
+
+                if(events_ == 0) return run_(uv_poll_stop, &poll_);
+
+                return run_(uv_poll_start, &poll_, events_, [](uv_poll_t* handle, int status, int events) {
+                    auto self = reinterpret_cast<udp*>(handle->data);
+                    assert(self);
+
+                    if(status)
+                    {
+                        if(self->on_error_) self->on_error_(get_last_error());
+                        return;
+                    }
+
+                    if(events & UV_READABLE) self->do_recv_();
+                    if((events & UV_WRITABLE) && self->fd_ != -1) self->flush_();
+                });
+            }
+
+            // reads one batch; returns the number of datagrams, 0 if none is pending, -1 on error.
+            int recv_batch_()
+            {
+#ifdef __linux__
+                for(std::size_t i=0;i<batch_size_;++i)
+                {
+                    pool_.hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+                    pool_.hdrs[i].msg_hdr.msg_controllen = gro_ ? control_size_() : 0;
+                    pool_.hdrs[i].msg_hdr.msg_flags = 0;
+                    pool_.hdrs[i].msg_len = 0;
+                }
+
+                int n;
+                do n = ::recvmmsg(fd_, &pool_.hdrs[0], static_cast<unsigned int>(batch_size_), MSG_DONTWAIT, nullptr);
+                while(n == -1 && errno == EINTR);
+
+                if(n == -1) return (errno == EAGAIN) ? 0 : -1;
+
+                for(int i=0;i<n;++i)
+                {
+                    auto& h = pool_.hdrs[i];
+                    auto& m = messages_[i];
+                    m.data = reinterpret_cast<const char*>(pool_.iov[i].iov_base);
+                    m.length = h.msg_len;
+                    m.truncated = (h.msg_hdr.msg_flags & MSG_TRUNC) != 0;
+                    m.peer.assign(reinterpret_cast<struct sockaddr*>(&pool_.addrs[i]), h.msg_hdr.msg_namelen);
+                    m.segment_size = gro_ ? gro_segment_size_(h.msg_hdr) : 0;
+                }
+                return n;
+#else
+                int n = 0;
+                for(;static_cast<std::size_t>(n)<batch_size_;++n)
+                {
+                    socklen_t addrlen = sizeof(struct sockaddr_storage);
+                    ssize_t r;
+                    do r = ::recvfrom(fd_, pool_.iov[n].iov_base, max_datagram_size_, MSG_DONTWAIT,
+                        reinterpret_cast<struct sockaddr*>(&pool_.addrs[n]), &addrlen);
+                    while(r == -1 && errno == EINTR);
+
+                    if(r == -1)
+                    {
+                        if(errno == EAGAIN) break;
+                        return n ? n : -1;
+                    }
+
+                    auto& m = messages_[n];
+                    m.data = reinterpret_cast<const char*>(pool_.iov[n].iov_base);
+                    m.length = static_cast<std::size_t>(r);
+                    m.truncated = false;
+                    m.segment_size = 0;
+                    m.peer.assign(reinterpret_cast<struct sockaddr*>(&pool_.addrs[n]), addrlen);
+                }
+                return n;
+#endif
+            }
+
+            void do_recv_()
+            {
+                for(std::size_t round=0;round<max_batches_per_event;++round)
+                {
+                    // the callback may have stopped receiving or closed the handle.
+                    if(fd_ == -1 || !(events_ & UV_READABLE)) return;
+
+                    int n = recv_batch_();
+                    if(n < 0)
+                    {
+                        if(on_recv_) on_recv_(nullptr, 0, get_sys_error(errno));
+                        return;
+                    }
+                    if(n == 0) return;
+
+                    if(on_recv_) on_recv_(&messages_[0], static_cast<std::size_t>(n), resval());
+
+                    // a short batch means the socket buffer is drained.
+                    if(static_cast<std::size_t>(n) < batch_size_) return;
+                }
+            }
+
+            resval send_now_(const udp_message* messages, std::size_t count, std::size_t& sent)
+            {
+                sent = 0;
+#ifdef __linux__
+                struct mmsghdr hdrs[max_send_batch];
+                struct iovec iov[max_send_batch];
+
+                while(sent < count)
+                {
+                    std::size_t n = std::min(count - sent, std::size_t(max_send_batch));
+                    for(std::size_t i=0;i<n;++i)
+                    {
+                        const udp_message& m = messages[sent + i];
+                        iov[i].iov_base = const_cast<char*>(m.data);
+                        iov[i].iov_len = m.length;
+
+                        hdrs[i] = mmsghdr();
+                        hdrs[i].msg_hdr.msg_iov = &iov[i];
+                        hdrs[i].msg_hdr.msg_iovlen = 1;
+                        hdrs[i].msg_hdr.msg_name = const_cast<struct sockaddr*>(m.peer.addr());
+                        hdrs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(m.peer.length());
+                    }
+
+                    int r;
+                    do r = ::sendmmsg(fd_, hdrs, static_cast<unsigned int>(n), MSG_DONTWAIT);
+                    while(r == -1 && errno == EINTR);
+
+                    if(r == -1) return get_sys_error(errno);
+                    sent += static_cast<std::size_t>(r);
+                    if(static_cast<std::size_t>(r) < n) return resval(error::eagain);
+                }
+#else
+                for(;sent<count;++sent)
+                {
+                    const udp_message& m = messages[sent];
+                    ssize_t r;
+                    do r = ::sendto(fd_, m.data, m.length, 0, m.peer.addr(), static_cast<socklen_t>(m.peer.length()));
+                    while(r == -1 && errno == EINTR);
+
+                    if(r == -1) return get_sys_error(errno);
+                }
+#endif
+                return resval();
+            }
+
+#ifdef __linux__
+            static std::size_t control_size_() { return CMSG_SPACE(sizeof(int)); }
+
+            static std::size_t gro_segment_size_(const struct msghdr& h)
+            {
+#ifdef UDP_GRO
+                for(auto c=CMSG_FIRSTHDR(&h);c;c=CMSG_NXTHDR(const_cast<struct msghdr*>(&h), c))
+                {
+                    if(c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO)
+                    {
+                        int size;
+                        std::memcpy(&size, CMSG_DATA(c), sizeof(size));
+                        return static_cast<std::size_t>(size);
+                    }
+                }
+#endif
+                return 0;
+            }
+#endif
+
+            resval send_gso_(const char* data, std::size_t length, std::size_t segment_size, const endpoint& to)
+            {
+#if defined(__linux__) && defined(UDP_SEGMENT)
+                char control[CMSG_SPACE(sizeof(uint16_t))];
+                std::memset(control, 0, sizeof(control));
+
+                struct iovec iov;
+                iov.iov_base = const_cast<char*>(data);
+                iov.iov_len = length;
+
+                struct msghdr h = msghdr();
+                h.msg_name = const_cast<struct sockaddr*>(to.addr());
+                h.msg_namelen = static_cast<socklen_t>(to.length());
+                h.msg_iov = &iov;
+                h.msg_iovlen = 1;
+                h.msg_control = control;
+                h.msg_controllen = sizeof(control);
+
+                auto c = CMSG_FIRSTHDR(&h);
+                c->cmsg_level = SOL_UDP;
+                c->cmsg_type = UDP_SEGMENT;
+                c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t size = static_cast<uint16_t>(segment_size);
+                std::memcpy(CMSG_DATA(c), &size, sizeof(size));
+
+                ssize_t r;
+                do r = ::sendmsg(fd_, &h, MSG_DONTWAIT);
+                while(r == -1 && errno == EINTR);
+
+                if(r >= 0) return resval();
+
+                // EIO: the device can't do segmentation offload; ENOPROTOOPT/EOPNOTSUPP: no UDP_SEGMENT at all.
+                // Anything else (EINVAL for a segment size the route can't take...) is the caller's to handle.
+                if(errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP) gso_ = 0;
+                return get_sys_error(errno);
+#else
+                gso_ = 0;
+                return resval(error::enotsup);
+#endif
+            }
+
+            // closed, or never opened: see open_error()
+            resval closed_error_() const
+            {
+                return open_error_ ? resval(error::ebadf) : open_error_;
+            }
+
+            resval enqueue_(const char* data, std::size_t length, const endpoint& to)
+            {
+                send_queue_.push_back(queued_datagram());
+                send_queue_.back().data.assign(data, data + length);
+                send_queue_.back().peer = to;
+
+                if(events_ & UV_WRITABLE) return resval();
+                events_ |= UV_WRITABLE;
+                return update_poll_();
+            }
+
+            void flush_()
+            {
+                udp_message batch[max_send_batch];
+
+                while(!send_queue_.empty())
+                {
+                    std::size_t n = std::min(send_queue_.size(), std::size_t(max_send_batch));
+                    for(std::size_t i=0;i<n;++i)
+                    {
+                        batch[i].data = send_queue_[i].data.data();
+                        batch[i].length = send_queue_[i].data.size();
+                        batch[i].peer = send_queue_[i].peer;
+                        batch[i].truncated = false;
+                        batch[i].segment_size = 0;
+                    }
+
+                    std::size_t sent = 0;
+                    resval rv = send_now_(batch, n, sent);
+                    send_queue_.erase(send_queue_.begin(), send_queue_.begin() + sent);
+
+                    if(!rv)
+                    {
+                        if(rv.code() == error::eagain || rv.code() == error::enobufs) return;
+
+                        // the datagram at the head can't be sent at all: drop it and report.
+                        send_queue_.pop_front();
+                        if(on_error_) on_error_(rv);
+                        if(fd_ == -1) return;
+                    }
+                }
+
+                events_ &= ~UV_WRITABLE;
+                update_poll_();
+            }
+
+        private:
+            uv_poll_t poll_;
+            uv_os_sock_t fd_;
+            resval open_error_;
+            int events_;
+            int gso_;                   // -1: not probed yet, 0: unsupported, 1: supported
+            bool gro_;
+            on_recv_callback_type on_recv_;
+            on_error_callback_type on_error_;
+            std::size_t batch_size_;
+            std::size_t max_datagram_size_;
+            recv_pool pool_;
+            std::vector<udp_message> messages_;
+            std::deque<queued_datagram> send_queue_;
         };
     }
 }
+
+#endif
@@ -2,6 +2,7 @@
 #define __DETAIL_UTILITY_H__
 
 #include "base.h"
+#include <cstring>
 #include <tuple>
 #include <stdexcept>
 
@@ -98,6 +99,180 @@ namespace x10
         struct tuple_index_r<std::tuple<>, C, I>
         {};
 
+        /**
+         *  Link fields embedded in an element of intrusive_list<>.
+         */
+        template<typename T>
+        struct list_hook
+        {
+            list_hook() : prev(nullptr), next(nullptr), linked(false) {}
+
+            T* prev;
+            T* next;
+            bool linked;
+        };
+
+        /**
+         *  Doubly-linked list threaded through a list_hook<T> member of its elements:
+         *  insertion and removal never allocate, and an element unlinks itself in O(1).
+         */
+        template<typename T, list_hook<T> T::*hook>
+        class intrusive_list
+        {
+        public:
+            intrusive_list()
+                : head_(nullptr)
+                , tail_(nullptr)
+                , size_(0)
+            {}
+
+            // no copy allowed
+            intrusive_list(const intrusive_list&) = delete;
+            void operator=(const intrusive_list&) = delete;
+
+            void push_back(T* x)
+            {
+                auto& h = x->*hook;
+                assert(!h.linked);
+
+                h.prev = tail_;
+                h.next = nullptr;
+                h.linked = true;
+                if(tail_) (tail_->*hook).next = x;
+                else head_ = x;
+                tail_ = x;
+                ++size_;
+            }
+
+            void remove(T* x)
+            {
+                auto& h = x->*hook;
+                if(!h.linked) return;
+
+                if(h.prev) (h.prev->*hook).next = h.next;
+                else head_ = h.next;
+                if(h.next) (h.next->*hook).prev = h.prev;
+                else tail_ = h.prev;
+
+                h.prev = h.next = nullptr;
+                h.linked = false;
+                --size_;
+            }
+
+            // f may remove the element it is called with.
+            template<typename F>
+            void for_each(F f)
+            {
+                for(T* x=head_;x;)
+                {
+                    T* next = (x->*hook).next;
+                    f(x);
+                    x = next;
+                }
+            }
+
+            T* front() const { return head_; }
+            T* back() const { return tail_; }
+            bool empty() const { return size_ == 0; }
+            std::size_t size() const { return size_; }
+
+            static bool is_linked(const T* x) { return (x->*hook).linked; }
+            static T* next(const T* x) { return (x->*hook).next; }
+
+        private:
+            T* head_;
+            T* tail_;
+            std::size_t size_;
+        };
+
+        /**
+         *  Non-owning view of a character range. The referenced memory must outlive the slice.
+         */
+        class slice
+        {
+        public:
+            static const std::size_t npos = static_cast<std::size_t>(-1);
+
+            slice()
+                : data_(nullptr)
+                , size_(0)
+            {}
+
+            slice(const char* data, std::size_t size)
+                : data_(data)
+                , size_(size)
+            {}
+
+            slice(const char* str)
+                : data_(str)
+                , size_(str ? std::strlen(str) : 0)
+            {}
+
+            slice(const std::string& str)
+                : data_(str.data())
+                , size_(str.size())
+            {}
+
+            const char* data() const { return data_; }
+            std::size_t size() const { return size_; }
+            bool empty() const { return size_ == 0; }
+
+            const char* begin() const { return data_; }
+            const char* end() const { return data_ + size_; }
+            char operator[](std::size_t i) const { return data_[i]; }
+
+            slice substr(std::size_t pos, std::size_t len=npos) const
+            {
+                if(pos > size_) pos = size_;
+                if(len > size_ - pos) len = size_ - pos;
+                return slice(data_ + pos, len);
+            }
+
+            std::size_t find(char c, std::size_t pos=0) const
+            {
+                if(pos >= size_) return npos;
+                auto p = static_cast<const char*>(std::memchr(data_ + pos, c, size_ - pos));
+                return p ? static_cast<std::size_t>(p - data_) : npos;
+            }
+
+            std::size_t rfind(char c) const
+            {
+                for(std::size_t i=size_;i>0;--i) if(data_[i-1] == c) return i-1;
+                return npos;
+            }
+
+            bool equals(const slice& other) const
+            {
+                return size_ == other.size_ && (size_ == 0 || std::memcmp(data_, other.data_, size_) == 0);
+            }
+
+            // ASCII case-insensitive comparison; no allocation (unlike text::compare_no_case()).
+            bool equals_no_case(const slice& other) const
+            {
+                if(size_ != other.size_) return false;
+                for(std::size_t i=0;i<size_;++i)
+                {
+                    unsigned char a = static_cast<unsigned char>(data_[i]);
+                    unsigned char b = static_cast<unsigned char>(other.data_[i]);
+                    if(a == b) continue;
+
+                    // ASCII letters only differ by 0x20
+                    a |= 0x20;
+                    if(a != (b | 0x20) || a < 'a' || a > 'z') return false;
+                }
+                return true;
+            }
+
+            std::string to_string() const { return std::string(data_, size_); }
+
+        private:
+            const char* data_;
+            std::size_t size_;
+        };
+
+        inline bool operator==(const slice& a, const slice& b) { return a.equals(b); }
+        inline bool operator!=(const slice& a, const slice& b) { return !a.equals(b); }
+
         namespace text
         {
             void lower(std::string& str)
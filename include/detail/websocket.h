@@ -0,0 +1,740 @@
+#ifndef __DETAIL_WEBSOCKET_H__
+#define __DETAIL_WEBSOCKET_H__
+
+#include "base.h"
+#include <deque>
+#include "buffer.h"
+#include "http_session.h"
+#include "timer.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace x10
+{
+    namespace detail
+    {
+        enum class websocket_opcode
+        {
+            continuation = 0x0,
+            text = 0x1,
+            binary = 0x2,
+            close = 0x8,
+            ping = 0x9,
+            pong = 0xa
+        };
+
+        // RFC 6455 framing: payload unmasking, frame heads, and the opening handshake key.
+        namespace websocket_codec
+        {
+            // 2 bytes, 8 of extended length, 4 of masking key
+            static const std::size_t max_header_size = 14;
+
+            // XORs n bytes of payload with the masking key, 32 (AVX2) or 16 (SSE2) bytes per step, then 8 bytes
+            // at a time. phase: position of data[0] in the payload, for a payload split across reads.
+            inline void unmask(char* data, std::size_t n, const unsigned char* key, std::size_t phase)
+            {
+                // the key rotated to start at data[0]: every step below is a multiple of 4 bytes.
+                unsigned char k[4] = { key[phase & 3], key[(phase + 1) & 3], key[(phase + 2) & 3], key[(phase + 3) & 3] };
+                uint32_t k32;
+                std::memcpy(&k32, k, 4);
+
+                char* p = data;
+                char* end = data + n;
+#if defined(__AVX2__)
+                const __m256i m = _mm256_set1_epi32(static_cast<int>(k32));
+                for(;end - p >= 32;p += 32)
+                {
+                    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm256_xor_si256(v, m));
+                }
+#elif defined(__SSE2__) || defined(_M_X64)
+                const __m128i m = _mm_set1_epi32(static_cast<int>(k32));
+                for(;end - p >= 16;p += 16)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm_xor_si128(v, m));
+                }
+#endif
+                const uint64_t k64 = (static_cast<uint64_t>(k32) << 32) | k32;
+                for(;end - p >= 8;p += 8)
+                {
+                    uint64_t v;
+                    std::memcpy(&v, p, 8);
+                    v ^= k64;
+                    std::memcpy(p, &v, 8);
+                }
+                for(std::size_t i=0;p < end;++p, ++i) *p ^= static_cast<char>(k[i & 3]);
+            }
+
+            // Writes the head of an unmasked (server) frame and returns its length (at most 10 bytes).
+            inline std::size_t encode_header(char* out, websocket_opcode opcode, uint64_t length, bool fin=true)
+            {
+                auto p = reinterpret_cast<unsigned char*>(out);
+                p[0] = static_cast<unsigned char>((fin ? 0x80 : 0) | static_cast<int>(opcode));
+
+                if(length < 126)
+                {
+                    p[1] = static_cast<unsigned char>(length);
+                    return 2;
+                }
+                if(length <= 0xffff)
+                {
+                    p[1] = 126;
+                    p[2] = static_cast<unsigned char>(length >> 8);
+                    p[3] = static_cast<unsigned char>(length);
+                    return 4;
+                }
+
+                p[1] = 127;
+                for(int i=0;i<8;++i) p[2 + i] = static_cast<unsigned char>(length >> (56 - 8 * i));
+                return 10;
+            }
+
+            // SHA-1 of data (for the handshake only).
+            inline void sha1(const util::slice& data, unsigned char digest[20])
+            {
+                uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+                auto rol = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+
+                auto block = [&](const unsigned char* b) {
+                    uint32_t w[80];
+                    for(int i=0;i<16;++i) w[i] = (uint32_t(b[4*i]) << 24) | (uint32_t(b[4*i+1]) << 16) | (uint32_t(b[4*i+2]) << 8) | b[4*i+3];
+                    for(int i=16;i<80;++i) w[i] = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+                    uint32_t a = h[0], b_ = h[1], c = h[2], d = h[3], e = h[4];
+                    for(int i=0;i<80;++i)
+                    {
+                        uint32_t f, k;
+                        if(i < 20) { f = (b_ & c) | (~b_ & d); k = 0x5a827999; }
+                        else if(i < 40) { f = b_ ^ c ^ d; k = 0x6ed9eba1; }
+                        else if(i < 60) { f = (b_ & c) | (b_ & d) | (c & d); k = 0x8f1bbcdc; }
+                        else { f = b_ ^ c ^ d; k = 0xca62c1d6; }
+
+                        uint32_t t = rol(a, 5) + f + e + k + w[i];
+                        e = d;
+                        d = c;
+                        c = rol(b_, 30);
+                        b_ = a;
+                        a = t;
+                    }
+                    h[0] += a; h[1] += b_; h[2] += c; h[3] += d; h[4] += e;
+                };
+
+                auto p = reinterpret_cast<const unsigned char*>(data.data());
+                std::size_t n = data.size();
+                for(;n >= 64;p += 64, n -= 64) block(p);
+
+                // padding: 0x80, zeros, then the length in bits (big endian)
+                unsigned char tail[128] = {};
+                std::memcpy(tail, p, n);
+                tail[n] = 0x80;
+                std::size_t tail_size = n < 56 ? 64 : 128;
+                uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+                for(int i=0;i<8;++i) tail[tail_size - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+
+                block(tail);
+                if(tail_size == 128) block(tail + 64);
+
+                for(int i=0;i<5;++i)
+                {
+                    digest[4*i] = static_cast<unsigned char>(h[i] >> 24);
+                    digest[4*i+1] = static_cast<unsigned char>(h[i] >> 16);
+                    digest[4*i+2] = static_cast<unsigned char>(h[i] >> 8);
+                    digest[4*i+3] = static_cast<unsigned char>(h[i]);
+                }
+            }
+
+            inline std::string base64(const unsigned char* data, std::size_t n)
+            {
+                static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+                std::string out;
+                out.reserve((n + 2) / 3 * 4);
+                for(std::size_t i=0;i<n;i += 3)
+                {
+                    uint32_t v = uint32_t(data[i]) << 16;
+                    if(i + 1 < n) v |= uint32_t(data[i+1]) << 8;
+                    if(i + 2 < n) v |= data[i+2];
+
+                    out += alphabet[(v >> 18) & 0x3f];
+                    out += alphabet[(v >> 12) & 0x3f];
+                    out += i + 1 < n ? alphabet[(v >> 6) & 0x3f] : '=';
+                    out += i + 2 < n ? alphabet[v & 0x3f] : '=';
+                }
+                return out;
+            }
+
+            // Sec-WebSocket-Accept for a Sec-WebSocket-Key: base64(SHA-1(key + GUID)).
+            inline std::string accept_key(const util::slice& key)
+            {
+                static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+                std::string s;
+                s.reserve(key.size() + sizeof(guid) - 1);
+                s.append(key.data(), key.size());
+                s.append(guid, sizeof(guid) - 1);
+
+                unsigned char digest[20];
+                sha1(s, digest);
+                return base64(digest, sizeof(digest));
+            }
+        }
+
+        // A frame encoded once (head and payload in one pooled buffer) to be sent to any number of connections:
+        // each websocket::send() of it retains the buffer instead of copying or encoding the payload again.
+        class websocket_frame
+        {
+        public:
+            websocket_frame(websocket_opcode opcode, const util::slice& payload, bool fin=true)
+                : buffer_(nullptr)
+                , size_(0)
+            {
+                buffer_ = buffer_pool::get().acquire(payload.size() + websocket_codec::max_header_size);
+                assert(buffer_);
+
+                size_ = websocket_codec::encode_header(buffer_->data(), opcode, payload.size(), fin);
+                if(!payload.empty()) std::memcpy(buffer_->data() + size_, payload.data(), payload.size());
+                size_ += payload.size();
+            }
+
+            websocket_frame(websocket_frame&& c)
+                : buffer_(c.buffer_)
+                , size_(c.size_)
+            {
+                c.buffer_ = nullptr;
+                c.size_ = 0;
+            }
+
+            ~websocket_frame()
+            {
+                if(buffer_) buffer_->release();
+            }
+
+            // no copy allowed
+            websocket_frame(const websocket_frame&) = delete;
+            void operator=(const websocket_frame&) = delete;
+
+            buffer* data_buffer() const { return buffer_; }
+            util::slice data() const { return buffer_ ? util::slice(buffer_->data(), size_) : util::slice(); }
+
+        private:
+            buffer* buffer_;
+            std::size_t size_;
+        };
+
+        // Server side of a WebSocket connection, taken over from an http_session by accept(). It owns the
+        // connection and deletes itself after closing it (see on_close()).
+        //
+        // Payloads are unmasked in place in the read buffer: a message that arrives unfragmented within one read
+        // is passed to on_message without any copy, others are reassembled first (up to max_message_size).
+        // Pings are answered automatically, and a close frame from the peer is echoed before the connection
+        // closes. Text payloads are not checked for UTF-8.
+        class websocket
+        {
+            typedef std::function<void(websocket*)> on_open_callback_type;
+            typedef std::function<void(websocket*, websocket_opcode, const util::slice&)> on_message_callback_type;
+            typedef std::function<void(websocket*, int, resval)> on_close_callback_type;
+
+        public:
+            static const std::size_t default_max_message_size = 16 * 1024 * 1024;
+
+            // a close handshake we started gives up on the peer's answer after this
+            static const int64_t close_timeout = 5000;
+
+            // status codes of close frames
+            static const int normal_closure = 1000;
+            static const int going_away = 1001;
+            static const int protocol_error = 1002;
+            static const int abnormal_closure = 1006;
+            static const int message_too_big = 1009;
+
+            // Answers request 'id' of the session with 101 Switching Protocols if it is a valid opening handshake
+            // (version 13), and returns false after answering 400 (or 426, for another version) otherwise. Once
+            // the response is written, the connection becomes a websocket and on_open receives it: set its
+            // callbacks there.
+            static bool accept(http_session* session, std::size_t id, const http_parse_result* r, on_open_callback_type on_open)
+            {
+                auto key = r->header(http_header_id::sec_websocket_key);
+                auto version = r->header(http_header_id::sec_websocket_version);
+
+                if(!r->upgrade() || r->method() != "GET" || key.size() != 24
+                    || !http_header_has_token(r->header(http_header_id::upgrade), "websocket")
+                    || !http_header_has_token(r->header(http_header_id::connection), "upgrade"))
+                {
+                    session->respond(id, http_response(400));
+                    return false;
+                }
+
+                if(version != "13")
+                {
+                    http_response res(426);
+                    res.add_header("Sec-WebSocket-Version", "13");
+                    session->respond(id, std::move(res));
+                    return false;
+                }
+
+                http_response res(101);
+                res.add_header("Upgrade", "websocket");
+                res.add_header("Connection", "Upgrade");
+                res.add_header("Sec-WebSocket-Accept", websocket_codec::accept_key(key));
+
+                resval rv = session->upgrade(id, std::move(res), [on_open](stream* conn) {
+                    auto ws = new websocket(conn);
+                    assert(ws);
+
+                    ws->start_();
+                    if(on_open) on_open(ws);
+                });
+                return !!rv;
+            }
+
+            // Text and binary messages (control frames are handled here). The payload is valid during the
+            // callback only.
+            void on_message(on_message_callback_type callback)
+            {
+                on_message_ = callback;
+            }
+
+            // Invoked once when the connection ends: the status code of the close frame received (or sent, after
+            // a protocol error), or abnormal_closure if the connection was lost; rv holds the error, if any. The
+            // websocket is deleted once the connection is closed.
+            void on_close(on_close_callback_type callback)
+            {
+                on_close_ = callback;
+            }
+
+            void set_max_message_size(std::size_t size) { max_message_size_ = size; }
+
+            // Sends a message in one frame. The payload is copied.
+            resval send(websocket_opcode opcode, const util::slice& payload)
+            {
+                if(close_sent_) return resval(error::epipe);
+
+                websocket_frame frame(opcode, payload);
+                return write_(frame.data_buffer(), frame.data().size());
+            }
+
+            // Sends a frame encoded beforehand, e.g. the same message to many connections.
+            resval send(const websocket_frame& frame)
+            {
+                if(close_sent_) return resval(error::epipe);
+                if(!frame.data_buffer()) return resval(error::einval);
+
+                return write_(frame.data_buffer(), frame.data().size());
+            }
+
+            // Starts the close handshake: no message can be sent afterwards, and the connection closes once the
+            // peer has answered (or after close_timeout).
+            void close(int code=normal_closure, const util::slice& reason=util::slice())
+            {
+                if(close_sent_ || finishing_ || closed_reported_) return;
+
+                // a failed write may have deleted the websocket already
+                if(!send_close_(code, reason)) return;
+
+                timer_ = new timer;
+                assert(timer_);
+
+                timer_->on_timeout([this](timer*) {
+                    report_close_(abnormal_closure, resval(error::etimedout));
+                    finish_();
+                });
+                timer_->start(close_timeout);
+            }
+
+            // bytes waiting in the connection's write queue: a slow reader makes it grow.
+            std::size_t buffered_amount() const { return conn_->write_queue_size(); }
+
+            stream* connection() const { return conn_; }
+
+        private:
+            websocket(stream* conn)
+                : conn_(conn)
+                , on_message_()
+                , on_close_()
+                , max_message_size_(default_max_message_size)
+                , header_size_(0)
+                , in_payload_(false)
+                , delivered_(false)
+                , fin_(false)
+                , opcode_(websocket_opcode::continuation)
+                , remaining_(0)
+                , position_(0)
+                , message_()
+                , message_opcode_(websocket_opcode::continuation)
+                , control_size_(0)
+                , writes_()
+                , timer_(nullptr)
+                , close_sent_(false)
+                , close_received_(false)
+                , closed_reported_(false)
+                , draining_(false)
+                , dispatching_(false)
+                , finishing_(false)
+            {
+                assert(conn_);
+            }
+
+            ~websocket()
+            {
+                for(auto b : writes_) b->release();
+            }
+
+            // no copy allowed
+            websocket(const websocket&) = delete;
+            void operator=(const websocket&) = delete;
+
+            void start_()
+            {
+                conn_->on_read([this](const char* data, std::size_t offset, std::size_t length, stream*, resval rv) {
+                    after_read_(data, offset, length, rv);
+                });
+                conn_->on_complete([this](resval rv) { after_write_(rv); });
+
+                resval rv = conn_->read_start();
+                if(!rv)
+                {
+                    report_close_(abnormal_closure, rv);
+                    finish_();
+                }
+            }
+
+            void after_read_(const char* data, std::size_t offset, std::size_t length, resval rv)
+            {
+                if(!rv)
+                {
+                    report_close_(abnormal_closure, rv);
+                    finish_();
+                    return;
+                }
+
+                // the read buffer is ours during the callback: payloads are unmasked in place.
+                auto p = const_cast<char*>(data) + offset;
+                auto end = p + length;
+
+                dispatching_ = true;
+                while(p < end && !finishing_ && !draining_)
+                {
+                    if(!in_payload_)
+                    {
+                        if(!read_header_(p, end)) break;
+                        continue;
+                    }
+
+                    auto n = static_cast<std::size_t>(std::min<uint64_t>(remaining_, end - p));
+                    websocket_codec::unmask(p, n, key_, position_);
+                    payload_(p, n);
+
+                    p += n;
+                    remaining_ -= n;
+                    position_ += n;
+                    if(remaining_ == 0) end_frame_();
+                }
+                dispatching_ = false;
+
+                if(finishing_) finish_();
+            }
+
+            // collects the frame head (it may span reads) and starts the frame; false if more input is needed.
+            bool read_header_(char*& p, char* end)
+            {
+                auto collect = [&](std::size_t need) {
+                    while(header_size_ < need && p < end) header_[header_size_++] = static_cast<unsigned char>(*p++);
+                    return header_size_ >= need;
+                };
+
+                if(!collect(2)) return false;
+
+                auto len = header_[1] & 0x7f;
+                if(!collect(2 + (len == 126 ? 2 : len == 127 ? 8 : 0) + ((header_[1] & 0x80) ? 4 : 0))) return false;
+                header_size_ = 0;
+
+                fin_ = (header_[0] & 0x80) != 0;
+                opcode_ = static_cast<websocket_opcode>(header_[0] & 0x0f);
+
+                uint64_t length = header_[1] & 0x7f;
+                std::size_t k = 2;
+                if(length == 126)
+                {
+                    length = (uint64_t(header_[2]) << 8) | header_[3];
+                    k = 4;
+                }
+                else if(length == 127)
+                {
+                    length = 0;
+                    for(int i=0;i<8;++i) length = (length << 8) | header_[2 + i];
+                    k = 10;
+                }
+                std::memcpy(key_, header_ + k, 4);
+
+                bool control = (header_[0] & 0x08) != 0;
+
+                // no extension negotiated: RSV bits must be 0; client frames must be masked
+                if((header_[0] & 0x70) || !(header_[1] & 0x80)) return fail_(protocol_error);
+
+                switch(opcode_)
+                {
+                case websocket_opcode::continuation:
+                    if(message_opcode_ == websocket_opcode::continuation) return fail_(protocol_error);
+                    break;
+                case websocket_opcode::text:
+                case websocket_opcode::binary:
+                    if(message_opcode_ != websocket_opcode::continuation) return fail_(protocol_error);
+                    break;
+                case websocket_opcode::close:
+                case websocket_opcode::ping:
+                case websocket_opcode::pong:
+                    if(!fin_ || length > sizeof(control_)) return fail_(protocol_error);
+                    break;
+                default:
+                    return fail_(protocol_error);
+                }
+
+                if(!control)
+                {
+                    auto total = (opcode_ == websocket_opcode::continuation ? message_.size() : 0) + length;
+                    if(length > max_message_size_ || total > max_message_size_) return fail_(message_too_big);
+                }
+
+                in_payload_ = true;
+                delivered_ = false;
+                remaining_ = length;
+                position_ = 0;
+                control_size_ = 0;
+
+                if(remaining_ == 0) end_frame_();
+                return true;
+            }
+
+            void payload_(char* p, std::size_t n)
+            {
+                if(n == 0) return;
+
+                if(static_cast<int>(opcode_) & 0x08)
+                {
+                    std::memcpy(control_ + control_size_, p, n);
+                    control_size_ += n;
+                    return;
+                }
+
+                // a whole unfragmented message in this read: no copy
+                if(fin_ && opcode_ != websocket_opcode::continuation && position_ == 0 && n == remaining_)
+                {
+                    delivered_ = true;
+                    if(on_message_) on_message_(this, opcode_, util::slice(p, n));
+                    return;
+                }
+
+                if(message_.empty()) message_.reserve(static_cast<std::size_t>(position_ + remaining_));
+                message_.append(p, n);
+            }
+
+            void end_frame_()
+            {
+                in_payload_ = false;
+
+                switch(opcode_)
+                {
+                case websocket_opcode::ping:
+                    if(!close_sent_)
+                    {
+                        websocket_frame pong(websocket_opcode::pong, util::slice(control_, control_size_));
+                        write_(pong.data_buffer(), pong.data().size());
+                    }
+                    return;
+
+                case websocket_opcode::pong:
+                    return;
+
+                case websocket_opcode::close:
+                    close_frame_();
+                    return;
+
+                default:
+                    break;
+                }
+
+                // the first frame of a fragmented message
+                if(!fin_)
+                {
+                    if(opcode_ != websocket_opcode::continuation) message_opcode_ = opcode_;
+                    return;
+                }
+
+                if(delivered_) return;
+
+                auto opcode = opcode_ == websocket_opcode::continuation ? message_opcode_ : opcode_;
+                message_opcode_ = websocket_opcode::continuation;
+
+                std::string message;
+                message.swap(message_);
+                if(on_message_) on_message_(this, opcode, message);
+            }
+
+            void close_frame_()
+            {
+                close_received_ = true;
+
+                int code = normal_closure;
+                if(control_size_ == 1) code = protocol_error;
+                else if(control_size_ >= 2)
+                {
+                    code = (static_cast<unsigned char>(control_[0]) << 8) | static_cast<unsigned char>(control_[1]);
+                    if(code < 1000 || code == 1004 || code == 1005 || code == 1006 || (code > 1014 && code < 3000) || code >= 5000) code = protocol_error;
+                }
+
+                if(!close_sent_)
+                {
+                    // echo the status code
+                    send_close_(code == protocol_error ? protocol_error : (control_size_ ? code : normal_closure), util::slice());
+                }
+
+                if(code == protocol_error) report_close_(code, resval(error::eproto));
+                else report_close_(code, resval());
+
+                draining_ = true;
+                conn_->read_stop();
+                finish_if_drained_();
+            }
+
+            // protocol violation: tells the peer why and closes the connection once that is written.
+            bool fail_(int code)
+            {
+                in_payload_ = false;
+                if(!close_sent_) send_close_(code, util::slice());
+
+                report_close_(code, code == message_too_big ? resval(error::emsgsize) : resval(error::eproto));
+
+                draining_ = true;
+                conn_->read_stop();
+                finish_if_drained_();
+                return false;
+            }
+
+            // Returns the result of the write: on failure the websocket is finished, and deleted unless inside the
+            // read loop, so the caller must not touch it any more.
+            resval send_close_(int code, const util::slice& reason)
+            {
+                char payload[sizeof(control_)];
+                payload[0] = static_cast<char>(code >> 8);
+                payload[1] = static_cast<char>(code);
+
+                auto n = std::min(reason.size(), sizeof(payload) - 2);
+                if(n) std::memcpy(payload + 2, reason.data(), n);
+
+                websocket_frame frame(websocket_opcode::close, util::slice(payload, n + 2));
+                close_sent_ = true;
+                return write_(frame.data_buffer(), frame.data().size());
+            }
+
+            resval write_(buffer* b, std::size_t size)
+            {
+                uv_buf_t buf { b->data(), size };
+
+                resval rv = conn_->write(&buf, 1);
+                if(!rv)
+                {
+                    report_close_(abnormal_closure, rv);
+                    finish_();
+                    return rv;
+                }
+
+                // the data must stay alive until the write completes
+                b->retain();
+                writes_.push_back(b);
+                return resval();
+            }
+
+            // stream writes complete in the order they were issued.
+            void after_write_(resval rv)
+            {
+                assert(!writes_.empty());
+                writes_.front()->release();
+                writes_.pop_front();
+
+                if(!rv)
+                {
+                    report_close_(abnormal_closure, rv);
+                    finish_();
+                    return;
+                }
+
+                finish_if_drained_();
+            }
+
+            void finish_if_drained_()
+            {
+                if(draining_ && writes_.empty()) finish_();
+            }
+
+            void report_close_(int code, resval rv)
+            {
+                if(closed_reported_) return;
+                closed_reported_ = true;
+
+                if(on_close_) on_close_(this, code, rv);
+            }
+
+            // closes the connection and deletes the websocket (after the read loop, if inside it).
+            void finish_()
+            {
+                finishing_ = true;
+                if(dispatching_) return;
+
+                if(timer_)
+                {
+                    timer_->stop();
+                    timer_->close();
+                    timer_ = nullptr;
+                }
+
+                conn_->on_read(nullptr);
+                conn_->on_complete(nullptr);
+                conn_->close();
+                delete this;
+            }
+
+        private:
+            stream* conn_;
+            on_message_callback_type on_message_;
+            on_close_callback_type on_close_;
+            std::size_t max_message_size_;
+
+            // frame being read
+            unsigned char header_[websocket_codec::max_header_size];
+            std::size_t header_size_;
+            bool in_payload_;
+            bool delivered_;            // passed to on_message straight from the read buffer
+            bool fin_;
+            websocket_opcode opcode_;
+            unsigned char key_[4];
+            uint64_t remaining_;        // payload bytes still to come
+            uint64_t position_;         // payload bytes already read
+
+            // fragmented message being reassembled (opcode continuation if none)
+            std::string message_;
+            websocket_opcode message_opcode_;
+
+            // payload of a control frame
+            char control_[125];
+            std::size_t control_size_;
+
+            std::deque<buffer*> writes_;
+            timer* timer_;              // close handshake timeout
+
+            bool close_sent_;
+            bool close_received_;
+            bool closed_reported_;
+            bool draining_;             // closing once the writes complete
+            bool dispatching_;
+            bool finishing_;
+        };
+    }
+}
+
+#endif
@@ -1,6 +1,10 @@
 #ifndef __NET_H__
 #define __NET_H__
 
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
 #include "common.h"
 #include "error.h"
 
@@ -8,11 +12,99 @@ namespace x10
 {
     namespace detail
     {
-        struct net_addr
+        // Socket address held by value in a sockaddr_storage: copying it never allocates.
+        // The textual form is produced only on request, into a caller-provided buffer.
+        class endpoint
         {
-            bool is_ipv4;
-            std::string ip;
-            int port;
+        public:
+            // "[ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255]:65535" + '\0'
+            static const std::size_t max_string_length = INET6_ADDRSTRLEN + 8;
+
+            endpoint()
+                : addr_()
+                , length_(0)
+            {}
+
+            endpoint(const struct sockaddr* addr, std::size_t length)
+                : addr_()
+                , length_(0)
+            {
+                assign(addr, length);
+            }
+
+            void assign(const struct sockaddr* addr, std::size_t length)
+            {
+                assert(addr && length <= sizeof(addr_));
+                std::memcpy(&addr_, addr, length);
+                length_ = length;
+            }
+
+            void clear() { length_ = 0; }
+
+            bool is_valid() const { return length_ > 0 && (is_ipv4() || is_ipv6()); }
+            bool is_ipv4() const { return addr_.ss_family == AF_INET; }
+            bool is_ipv6() const { return addr_.ss_family == AF_INET6; }
+
+            int port() const
+            {
+                if(is_ipv4()) return static_cast<int>(ntohs(reinterpret_cast<const struct sockaddr_in*>(&addr_)->sin_port));
+                if(is_ipv6()) return static_cast<int>(ntohs(reinterpret_cast<const struct sockaddr_in6*>(&addr_)->sin6_port));
+                return 0;
+            }
+
+            // writes the IP address (without port) and returns its length, or 0 if it didn't fit.
+            std::size_t format_ip(char* buf, std::size_t size) const
+            {
+                assert(buf);
+                int r = -1;
+                if(is_ipv4()) r = uv_ip4_name(const_cast<struct sockaddr_in*>(reinterpret_cast<const struct sockaddr_in*>(&addr_)), buf, size);
+                else if(is_ipv6()) r = uv_ip6_name(const_cast<struct sockaddr_in6*>(reinterpret_cast<const struct sockaddr_in6*>(&addr_)), buf, size);
+
+                if(r != 0)
+                {
+                    if(size) buf[0] = '\0';
+                    return 0;
+                }
+                return std::strlen(buf);
+            }
+
+            // writes "ip:port" ("[ip]:port" for IPv6) and returns its length, or 0 if it didn't fit.
+            std::size_t format(char* buf, std::size_t size) const
+            {
+                assert(buf);
+                if(size < 2) return 0;
+
+                std::size_t n = 0;
+                if(is_ipv6()) buf[n++] = '[';
+
+                std::size_t ip_len = format_ip(buf+n, size-n);
+                if(ip_len == 0) return 0;
+                n += ip_len;
+
+                if(is_ipv6())
+                {
+                    if(n+1 >= size) return 0;
+                    buf[n++] = ']';
+                }
+
+                int r = snprintf(buf+n, size-n, ":%d", port());
+                if(r < 0 || static_cast<std::size_t>(r) >= size-n) return 0;
+                return n + static_cast<std::size_t>(r);
+            }
+
+            // convenience for non-critical paths; allocates.
+            std::string to_string() const
+            {
+                char buf[max_string_length];
+                return std::string(buf, format(buf, sizeof(buf)));
+            }
+
+            const struct sockaddr* addr() const { return reinterpret_cast<const struct sockaddr*>(&addr_); }
+            std::size_t length() const { return length_; }
+
+        private:
+            struct sockaddr_storage addr_;
+            std::size_t length_;
         };
         
         // TODO: merge all global inline functions into a set of classes.
@@ -32,24 +124,74 @@ namespace x10
         inline sockaddr_in to_ip4_addr(const std::string& ip, int port) { return uv_ip4_addr(ip.c_str(), port); }
         inline sockaddr_in6 to_ip6_addr(const std::string& ip, int port) { return uv_ip6_addr(ip.c_str(), port); }
         
-        inline uv_err_t from_ip4_addr(sockaddr_in* src, std::string& ip, int& port)
+        // returns an invalid endpoint if ip is neither an IPv4 nor an IPv6 address.
+        inline endpoint to_endpoint(const std::string& ip, int port)
         {
-            char dest[16];
-            if(uv_ip4_name(src, dest, 16)) get_last_error();
-            
-            ip = dest;
-            port = static_cast<int>(ntohs(src->sin_port));
-            return no_error;
+            auto ver = get_ip_version(ip);
+            if(ver == 4)
+            {
+                auto addr = to_ip4_addr(ip, port);
+                return endpoint(reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+            }
+            else if(ver == 6)
+            {
+                auto addr = to_ip6_addr(ip, port);
+                return endpoint(reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+            }
+            return endpoint();
         }
         
-        inline uv_err_t from_ip6_addr(sockaddr_in6* src, std::string& ip, int& port)
+        // translates errno of a raw system call (setsockopt, socket, open, ...) into resval.
+        inline resval get_sys_error(int err)
         {
-            char dest[46];
-            if(uv_ip6_name(src, dest, 46)) get_last_error();
-            
-            ip = dest;
-            port = static_cast<int>(ntohs(src->sin6_port));
-            return no_error;
+            switch(err)
+            {
+                case 0: return resval();
+                case EACCES: return resval(error::eacces);
+                case EADDRINUSE: return resval(error::eaddrinuse);
+                case EADDRNOTAVAIL: return resval(error::eaddrnotavail);
+                case EAFNOSUPPORT: return resval(error::eafnosupport);
+                case EAGAIN: return resval(error::eagain);
+                case EBADF: return resval(error::ebadf);
+                case ECONNREFUSED: return resval(error::econnrefused);
+                case ECONNRESET: return resval(error::econnreset);
+                case EHOSTUNREACH: return resval(error::ehostunreach);
+                case EINTR: return resval(error::eintr);
+                case EINVAL: return resval(error::einval);
+                case EIO: return resval(error::eio);
+                case EISDIR: return resval(error::eisdir);
+                case ELOOP: return resval(error::eloop);
+                case EMFILE: return resval(error::emfile);
+                case EMSGSIZE: return resval(error::emsgsize);
+                case ENAMETOOLONG: return resval(error::enametoolong);
+                case ENETUNREACH: return resval(error::enetunreach);
+                case ENFILE: return resval(error::enfile);
+                case ENOBUFS: return resval(error::enobufs);
+                case ENOENT: return resval(error::enoent);
+                case ENOMEM: return resval(error::enomem);
+                case ENOPROTOOPT: return resval(error::enotsup);
+                case ENOTDIR: return resval(error::enotdir);
+                case ENOTSOCK: return resval(error::enotsock);
+                case ENOTSUP: return resval(error::enotsup);
+                case EPERM: return resval(error::eperm);
+                case EPIPE: return resval(error::epipe);
+                default: return resval(error::unknown);
+            }
+        }
+
+        template<typename T>
+        inline resval set_sock_opt(uv_os_sock_t sock, int level, int name, const T& value)
+        {
+            if(setsockopt(sock, level, name, reinterpret_cast<const char*>(&value), sizeof(value)) == 0) return resval();
+            return get_sys_error(errno);
+        }
+
+        template<typename T>
+        inline resval get_sock_opt(uv_os_sock_t sock, int level, int name, T& value)
+        {
+            socklen_t len = static_cast<socklen_t>(sizeof(value));
+            if(getsockopt(sock, level, name, reinterpret_cast<char*>(&value), &len) == 0) return resval();
+            return get_sys_error(errno);
         }
     }
 }